@@ -655,11 +655,10 @@ void rino_mru_remove (void *item, void *data)
  */
 int build_s3_object_path(kvsns_ino_t object, char *obj_dir, char *obj_fname)
 {
-	char k[KLEN];
 	char v[VLEN];
 	kvsns_ino_t ino = object;
 	kvsns_ino_t root_ino = 0LL;
-	struct stat stat;
+	kvsns_inode_t inode;
 
 	/* get root inode number */
 	RC_WRAP(kvsal_get_char, "KVSNS_PARENT_INODE", v);
@@ -671,23 +670,17 @@ int build_s3_object_path(kvsns_ino_t object, char *obj_dir, char *obj_fname)
 
 	while (ino != root_ino) {
 
-		/* current inode name */
-		snprintf(k, KLEN, "%llu.name", ino);
-		RC_WRAP(kvsal_get_char, k, v);
-
-		snprintf(k, KLEN, "%llu.stat", ino);
-		RC_WRAP(kvsal_get_stat, k, &stat);
-		if (stat.st_mode & S_IFDIR) {
+		/* current inode's name, type and parent in a single fetch */
+		RC_WRAP(kvsns_get_inode, &ino, &inode);
+		if (S_ISDIR(inode.stat.st_mode)) {
 			prepend(obj_dir, "/");
-			prepend(obj_dir, v);
+			prepend(obj_dir, inode.name);
 		} else {
-			strcpy(obj_fname, v);
+			strcpy(obj_fname, inode.name);
 		}
 
 		/* get parent inode */
-		snprintf(k, KLEN, "%llu.parentdir", ino);
-		RC_WRAP(kvsal_get_char, k, v);
-		sscanf(v, "%llu|", &ino);
+		ino = inode.parents[0];
 	};
 
 	return 0;
@@ -62,14 +62,98 @@ typedef struct kvsal_item {
 	char str[KLEN];
 } kvsal_item_t;
 
+/* Keys about an inode start with its number, either in decimal followed by
+ * a '.', or encoded as the byte KVSAL_INO_KEY + n followed by the n 7 bit
+ * groups of the number, most significant first, each with its high bit set.
+ * An encoded number sorts like the number itself and holds neither zero nor
+ * any character with a meaning in a pattern or a hash tag. The KVSAL keeps
+ * all the keys of an inode together, on the same server */
+#define KVSAL_INO_KEY 0x80
+#define KVSAL_INO_GROUPS 10
+#define KVSAL_INO_KEYLEN (1 + KVSAL_INO_GROUPS)
+
+/* len bytes at p, which may be any bytes, zeros included, and are not
+ * zero-terminated */
+typedef struct kvsal_slice {
+	char *p;
+	size_t len;
+} kvsal_slice_t;
+
+/* A listing is streamed from the KVS as it is read. content holds the items
+ * fetched but not yet consumed, the first one being at position offset in
+ * the listing. They are slices of the listing's own copy of the keys, kept
+ * in seen. Reading backward restarts the listing from its beginning.
+ * With keys spread over several servers, they are listed one server after
+ * the other, from shard to last_shard */
 typedef struct kvsal_list {
 	char pattern[KLEN];
-	kvsal_item_t *content;
+	kvsal_slice_t *content;
 	size_t size;
+	int offset;
+	unsigned long long cursor;
+	int shard;
+	int last_shard;
+	bool done;
+	bool fields;
+	bool replica;
+	void *seen;
 } kvsal_list_t;
 
+/* Batch operations: a set of independent operations sent to the KVS
+ * in a single round trip. Each operation has its own result.
+ * SETRANGE overwrites vlen bytes at off in the value of k, leaving the rest
+ * as it is, as Redis does: a value too short, or missing, is zero-filled up
+ * to off, and vlen is then set to the value's new size. It is not allowed
+ * on fields nor within a transaction */
+enum kvsal_op_type {
+	KVSAL_OP_GET = 1,
+	KVSAL_OP_SET = 2,
+	KVSAL_OP_DEL = 3,
+	KVSAL_OP_EXISTS = 4,
+	KVSAL_OP_SETRANGE = 5
+};
+
+typedef struct kvsal_op {
+	enum kvsal_op_type type;
+	char *k;	/* Zero-terminated, of any length unlike KLEN's keys */
+	char *field;	/* If not NULL, the op is about this field of map k */
+	char *v;	/* SET: value to be set, GET: buffer for the value */
+	size_t vlen;	/* SET: value's size, GET: [INOUT] buffer/read size */
+	size_t off;	/* SETRANGE: where v goes in the value */
+	int rc;		/* [OUT] 0 or a negative "-errno" for this op */
+} kvsal_op_t;
+
 int kvsal_init(struct collection_item *cfg_items);
 int kvsal_fini(void);
+
+/* Per-thread scratch memory, for the arrays and buffers a call needs only
+ * until it returns. kvsal_arena_alloc returns aligned memory, or NULL if it
+ * ran out of it; kvsal_arena_release frees all that was allocated by the
+ * thread since kvsal_arena_mark returned mark. Marks nest, as calls do */
+size_t kvsal_arena_mark(void);
+void *kvsal_arena_alloc(size_t size);
+void kvsal_arena_release(size_t mark);
+
+/* Connection pool counters, since the KVSAL was initialized */
+typedef struct kvsal_pool_stats {
+	unsigned int size;		/* connections in the pool */
+	unsigned int idle;		/* connections held by no thread */
+	unsigned long long acquired;	/* connections handed to threads */
+	unsigned long long waits;	/* a thread had to wait for one */
+	unsigned long long timeouts;	/* ... and gave up */
+	unsigned long long connects;
+	unsigned long long connect_failures;
+	unsigned long long check_failures; /* idle ones found broken */
+} kvsal_pool_stats_t;
+
+int kvsal_get_pool_stats(kvsal_pool_stats_t *stats);
+
+/* With on set, the calling thread's reads are sent to the servers' replicas,
+ * if any, which may lag behind them: a read may not see a change that was
+ * just made. Writes, and reads within a transaction, still go to the
+ * servers. A listing keeps on reading from where it started. Returns the
+ * previous setting, to be restored by the caller */
+bool kvsal_read_replica(bool on);
 int kvsal_begin_transaction(void);
 int kvsal_end_transaction(void);
 int kvsal_discard_transaction(void);
@@ -83,12 +167,107 @@ int kvsal_get_stat(char *k, struct stat *buf);
 int kvsal_get_list_size(char *pattern);
 int kvsal_del(char *k);
 int kvsal_incr_counter(char *k, unsigned long long *v);
+int kvsal_incr_counter_by(char *k, unsigned long long incr,
+			  unsigned long long *v);
+
+/* Adds incr, which may be negative, to counter k (0 if missing). Within a
+ * transaction, the addition is done along with it */
+int kvsal_add_counter(char *k, long long incr);
+
+/* Plain keys and values as slices, of any size. kvsal_get_slice reads the
+ * value in the v->len bytes at v->p and sets v->len to its size: if it does
+ * not fit, it returns -ENOBUFS and v->len is the size needed */
+int kvsal_set_slice(kvsal_slice_t *k, kvsal_slice_t *v);
+int kvsal_get_slice(kvsal_slice_t *k, kvsal_slice_t *v);
+int kvsal_del_slice(kvsal_slice_t *k);
+
+/* A map is a key holding a set of fields, each with its own value */
+int kvsal_set_field(char *k, char *field, char *v);
+int kvsal_get_field(char *k, char *field, char *v);
+int kvsal_del_field(char *k, char *field);
+int kvsal_get_fields_count(char *k);
 
 int kvsal_get_list_pattern(char *pattern, int start, int *end,
 			   kvsal_item_t *items);
 int kvsal_get_list(kvsal_list_t *list, int start, int *end, kvsal_item_t *items);
+
+/* Same as kvsal_get_list, without any copy nor limit on the keys' length:
+ * the slices point into the listing, until it is read again or disposed */
+int kvsal_get_list_slices(kvsal_list_t *list, int start, int *end,
+			  kvsal_slice_t *items);
 int kvsal_fetch_list(char *pattern, kvsal_list_t *list);
+int kvsal_fetch_field_list(char *k, kvsal_list_t *list);
 int kvsal_dispose_list(kvsal_list_t *list);
 int kvsal_init_list(kvsal_list_t *list);
 
+/* A GET op returns -ENOENT if the key does not exist and -ENOBUFS if the
+ * value does not fit in the buffer. The value is zero-terminated if there is
+ * room left for it. Inside a transaction, only SET and DEL ops are allowed,
+ * they are queued with the transaction.
+ * kvsal_mget and kvsal_mset expect only GET (resp. SET) ops on keys.
+ * These calls return 0 if every op was sent, results are in ops[i].rc */
+int kvsal_batch(kvsal_op_t *ops, int nb_ops);
+int kvsal_mget(kvsal_op_t *ops, int nb_ops);
+int kvsal_mset(kvsal_op_t *ops, int nb_ops);
+
+/* Server side scripts, each run atomically by the KVS. body is the script's
+ * source, id is set once the script is loaded. kvsal_run_script loads the
+ * script if needed, then gives it its keys, of any length as the ops' ones
+ * are, and its binary args. A script returns an integer, set in *ret. Both
+ * calls return -ENOTSUP if the KVS does not run scripts, kvsal_run_script
+ * returns -EXDEV if the keys are not all on the same server */
+#define KVSAL_SCRIPT_IDLEN 64
+
+typedef struct kvsal_script {
+	const char *body;
+	char id[KVSAL_SCRIPT_IDLEN];
+} kvsal_script_t;
+
+int kvsal_load_script(kvsal_script_t *script);
+int kvsal_run_script(kvsal_script_t *script, int nb_keys, char **keys,
+		     int nb_args, char **args, size_t *argslen,
+		     long long *ret);
+
+/* Same as kvsal_run_script, for a script which also reads keys it finds as
+ * it runs, which it was not given: it returns -EXDEV unless the KVS is a
+ * single server. Such a script returns an array, the integer set in *ret
+ * followed by at most *nb_values strings. They are copied in the values[i].len
+ * bytes at values[i].p, values[i].len being set to their size and *nb_values
+ * to their number. Returns -ENOBUFS if they do not fit */
+int kvsal_run_walk_script(kvsal_script_t *script, int nb_keys, char **keys,
+			  int nb_args, char **args, size_t *argslen,
+			  long long *ret, kvsal_slice_t *values,
+			  int *nb_values);
+
+/* Change notifications: once kvsal_watch succeeded, cb is called from a
+ * dedicated thread (one per server) with the name of every key matching one
+ * of the patterns each time a client modifies or deletes it. Only one watch
+ * may be active. Returns -ENOTSUP if the KVS does not send such notifications,
+ * -ENAMETOOLONG if a pattern is longer than a key */
+typedef void (*kvsal_watch_cb_t)(char *k, void *arg);
+int kvsal_watch(char **patterns, int nb_patterns, kvsal_watch_cb_t cb,
+		void *arg);
+
+/* Asynchronous ops: kvsal_async_op sends the op and returns at once. cb is
+ * then called with the op, once its result is in op->rc, from the KVSAL's
+ * event loop thread: it must not block, but it may submit other ops. The op
+ * and its buffers must remain valid until then. Ops on the same server
+ * complete in the order they were submitted, they may not be part of a
+ * transaction. A connection loss completes pending ops with -ENOTCONN, an
+ * op on a REDIS Cluster slot being moved completes with -EAGAIN */
+typedef void (*kvsal_async_cb_t)(kvsal_op_t *op, void *arg);
+int kvsal_async_op(kvsal_op_t *op, kvsal_async_cb_t cb, void *arg);
+
+/* A group tracks a set of asynchronous ops, kvsal_async_group_wait returns
+ * once they all completed. The group can be used again after that */
+typedef struct kvsal_async_group {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int pending;
+} kvsal_async_group_t;
+
+int kvsal_async_group_init(kvsal_async_group_t *group);
+int kvsal_async_group_op(kvsal_async_group_t *group, kvsal_op_t *op);
+int kvsal_async_group_wait(kvsal_async_group_t *group);
+
 #endif
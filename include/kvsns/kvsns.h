@@ -200,14 +200,37 @@ typedef struct kvsns_cred__ {
 
 typedef struct kvsns_fsstat_ {
 	unsigned long nb_inodes;
+	unsigned long long nb_bytes;	/* size of the files, as last closed */
 } kvsns_fsstat_t;
 
+/* How directory entries are stored in the KVS, see doc/kvsns_design.txt.
+ * This is set by "dentry_layout" in section [kvsns] of the config file */
+enum kvsns_dentry_layout {
+	KVSNS_DENTRY_KEYS = 0,	/* "keys": one key per entry (default) */
+	KVSNS_DENTRY_HASH = 1	/* "hash": one map per directory */
+};
+
+/* How inode numbers are written in keys and dentries, see
+ * doc/kvsns_design.txt. This is set by "key_encoding" in section [kvsns] */
+enum kvsns_key_encoding {
+	KVSNS_KEYS_TEXT = 0,	/* "text": "<inum>.<suffix>" (default) */
+	KVSNS_KEYS_BINARY = 1	/* "binary": encoded inum, then a tag */
+};
+
 typedef struct kvsns_dentry_ {
-	char name[NAME_MAX];
+	char name[NAME_MAX + 1];
 	kvsns_ino_t inode;
 	struct stat stats;
 } kvsns_dentry_t;
 
+/* One of the files created by kvsns_create_many */
+typedef struct kvsns_create_item_ {
+	char *name;
+	mode_t mode;
+	kvsns_ino_t ino;	/* [OUT] the new file's inode */
+	int rc;			/* [OUT] 0 or a negative "-errno" for this file */
+} kvsns_create_item_t;
+
 typedef struct kvsns_open_owner_ {
 	int pid;
 	int tid;
@@ -219,6 +242,27 @@ typedef struct kvsns_file_open_ {
 	int flags;
 } kvsns_file_open_t;
 
+/* An inode's metadata, stored in the KVS as a single packed record.
+ * See doc/kvsns_design.txt for the record format */
+
+/* The size, blocks, atime and mtime of a regular file are those of its
+ * data in the extstore: it was not written since its last fd was closed,
+ * or since it was truncated */
+#define KVSNS_INODE_DATA_ATTRS 0x01
+
+/* The size of a directory is its number of entries, which are counted in
+ * a key of their own */
+#define KVSNS_INODE_ENTRIES 0x02
+
+typedef struct kvsns_inode_ {
+	struct stat stat;
+	unsigned int flags;
+	int nb_parents;
+	kvsns_ino_t parents[KVSAL_ARRAY_SIZE];
+	char name[NAME_MAX + 1];
+	char link[VLEN];
+} kvsns_inode_t;
+
 typedef struct kvsns_dir {
 	kvsns_ino_t ino;
 	kvsal_list_t list;
@@ -231,7 +275,7 @@ enum kvsns_type {
 };
 
 typedef struct kvsns_xattr__ {
-	char name[NAME_MAX];
+	char name[NAME_MAX + 1];
 } kvsns_xattr_t;
 
 /**
@@ -298,6 +342,29 @@ int kvsns_access(kvsns_cred_t *cred, kvsns_ino_t *ino, int flags);
 int kvsns_creat(kvsns_cred_t *cred, kvsns_ino_t *parent, char *name,
 		mode_t mode, kvsns_ino_t *newino);
 
+/**
+ * Creates many files in the same directory, as kvsns_creat would for each
+ * of them, in a few round trips: their inode numbers are reserved at once,
+ * then a server side script per batch creates those whose name does not
+ * exist, along with the directory's times. Without scripts, their names are
+ * checked in batches and every dentry and inode written in a single
+ * transaction: as with "scripts = false", a name created by another client
+ * in the meantime is then replaced.
+ *
+ * @param cred - pointer to user's credentials
+ * @param parent - pointer to parent directory's inode.
+ * @param items - the files' names and modes, each gets its inode and result
+ * @param nb_items - number of items
+ *
+ * @return 0 if the call went through, each item's rc then tells if its file
+ * was created (-EEXIST if the name exists or is given twice, -ENAMETOOLONG
+ * if it is longer than its key holds), a negative
+ * "-errno" value in case of failure, only the items whose rc is 0 being
+ * created then
+ */
+int kvsns_create_many(kvsns_cred_t *cred, kvsns_ino_t *parent,
+		      kvsns_create_item_t *items, int nb_items);
+
 /**
  * Creates a directory.
  *
@@ -430,6 +497,17 @@ int kvsns_lookupp(kvsns_cred_t *cred, kvsns_ino_t *where, kvsns_ino_t *parent);
  */
 int kvsns_get_root(kvsns_ino_t *ino);
 
+/**
+ * Gets the whole metadata record of an inode, without any access check.
+ * This is meant for the object stores which need to walk the namespace.
+ *
+ * @param ino - pointer to the inode
+ * @param inode - [OUT] the inode's metadata
+ *
+ * @return 0 if successful, a negative "-errno" value in case of failure
+ */
+int kvsns_get_inode(kvsns_ino_t *ino, kvsns_inode_t *inode);
+
 /**
  * Gets attributes for a known inode.
  *
@@ -469,7 +547,8 @@ int kvsns_setattr(kvsns_cred_t *cred, kvsns_ino_t *ino, struct stat *setstat,
 		 int statflags);
 
 /**
- * Gets dynamic stats for the whole namespace
+ * Gets dynamic stats for the whole namespace, from counters kept up to date
+ * by the namespace's operations
  *
  * @param stat - FS stats for the namespace
  *
@@ -498,6 +577,9 @@ int kvsns_opendir(kvsns_cred_t *cred, kvsns_ino_t *dir, kvsns_dir_t *ddir);
  * @param size - [INOUT] as input, allocated size of dirent arry, as output
  * read size.
  *
+ * The attributes of a page are fetched all at once. Those of a file still
+ * open for writing elsewhere may lag behind its data until it is closed.
+ *
  * @return 0 if successful, a negative "-errno" value in case of failure
  */
 int kvsns_readdir(kvsns_cred_t *cred, kvsns_dir_t *dir, off_t offset,
@@ -679,6 +761,76 @@ int kvsns_remove_all_xattr(kvsns_cred_t *cred, kvsns_ino_t *ino);
  */
 int kvsns_mr_proper(void);
 
+/**
+ * Converts every directory of the namespace to the given dentry layout.
+ * This is to be done when no other client is using the namespace, they
+ * should then be restarted with the new layout in their config file.
+ *
+ * @param layout - the layout the dentries are to be stored with
+ *
+ * @return 0 if successful, a negative "-errno" value in case of failure
+ */
+int kvsns_migrate_dentries(enum kvsns_dentry_layout layout);
+
+/**
+ * Converts every inode stored with the former layout (<inum>.stat,
+ * <inum>.parentdir, <inum>.link and <inum>.name keys) to a <inum>.inode
+ * record. This is to be done when no other client is using the namespace.
+ *
+ * @param (node) - void function.
+ *
+ * @return 0 if successful, a negative "-errno" value in case of failure
+ */
+int kvsns_migrate_inodes(void);
+
+/**
+ * Counts the entries of every directory whose inode does not hold their
+ * number yet, as well as the inodes and the bytes of the namespace. This is
+ * to be done when no other client is using the namespace.
+ *
+ * @param (node) - void function.
+ *
+ * @return 0 if successful, a negative "-errno" value in case of failure
+ */
+int kvsns_migrate_counters(void);
+
+
+/**
+ *  High level API: removes an entry and, if it is a directory, everything
+ *  below it. The directories are walked by "tree_workers" threads (section
+ *  [kvsns]), the entries of each page of a directory being removed in a
+ *  single transaction, then the directories themselves, the deepest first,
+ *  those with the same parent together. The files' data is deleted by the
+ *  workers as they go. On failure, what was removed already stays so.
+ *
+ * @param cred - pointer to user's credentials
+ * @param parent - pointer to parent directory's inode.
+ * @param name - name of the entry to be removed.
+ *
+ * @return 0 if successful, a negative "-errno" value in case of failure
+ * (-ENOTEMPTY if an entry was created below it meanwhile)
+ */
+int kvsns_rmtree(kvsns_cred_t *cred, kvsns_ino_t *parent, char *name);
+
+/**
+ *  High level API: copies an entry and, if it is a directory, everything
+ *  below it, as the caller's. The directories are walked by "tree_workers"
+ *  threads, the files of each page of a directory being created with
+ *  kvsns_create_many, their data then copied by the workers. Modes and
+ *  symbolic links are copied, xattrs are not, and hard links to the same
+ *  file become distinct files.
+ *
+ * @param cred - pointer to user's credentials
+ * @param sparent - pointer to the source's parent directory
+ * @param sname - name of the entry to be copied
+ * @param dparent - pointer to the directory where the copy goes
+ * @param dname - name of the copy, which must not exist
+ *
+ * @return 0 if successful, a negative "-errno" value in case of failure
+ * (-EINVAL if dparent is the source directory or below it)
+ */
+int kvsns_cptree(kvsns_cred_t *cred, kvsns_ino_t *sparent, char *sname,
+		 kvsns_ino_t *dparent, char *dname);
 
 /**
  *  High level API: copy a file from the KVSNS to a POSIX fd
@@ -707,11 +859,15 @@ int kvsns_cp_to(kvsns_cred_t *cred, int fd_source,
 		kvsns_file_open_t *kfd, int iolen);
 
 /**
- *  High level API: do a "lookup by path" operation
+ *  High level API: do a "lookup by path" operation. With server side
+ *  scripts and a single REDIS server, the whole path is resolved in one
+ *  round trip.
  *
  * @param cred - pointer to user's credentials
- * @param parent - root of the lookup operation
- * @param path - path inside the kvsns, starting at inode parent
+ * @param parent - [INOUT] root of the lookup operation, then directory of
+ *	  the inode found, or the one where the path's next name does not exist
+ * @param path - [INOUT] path inside the kvsns, starting at inode parent,
+ *	  replaced by the name that does not exist if -ENOENT is returned
  * @param ino - found inode if lookup is successful
  *
  * @return 0 if successful, a negative "-errno" value in case of failure
@@ -0,0 +1,1192 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) CEA, 2016
+ * Author: Philippe Deniel  philippe.deniel@cea.fr
+ *
+ * contributeur : Philippe DENIEL   philippe.deniel@cea.fr
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+
+/* kvsal_embedded.c
+ * KVSAL: KVS abstraction layer over a store embedded in the process
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <ini_config.h>
+#include <kvsns/kvsal.h>
+#include "kvstore.h"
+
+#define RC_WRAP(__function, ...) ({\
+	int __rc = __function(__VA_ARGS__);\
+	if (__rc != 0)	\
+		return __rc; })
+
+/* A map is kept as one record per field, whose key is the map's key and
+ * the field's name separated by a NUL, so that the fields of a map are
+ * contiguous in the store and no plain key is mistaken for one of them */
+#define KVSAL_FIELD_SEP '\0'
+#define KVSAL_FIELD_KLEN (2 * KLEN)
+
+/* The records of a scratch set only live during the call building it, they
+ * are taken from the thread's arena, from mark on */
+struct kvsal_recs {
+	kvstore_rec_t *recs;
+	int nb;
+	int size;
+	bool scratch;
+	size_t mark;
+};
+
+static struct kvstore *stores[] = {
+	&kvstore_wal,
+	&kvstore_mem,
+	&kvstore_btree,
+	NULL
+};
+
+static struct kvstore *store = NULL;
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The writes of a transaction are buffered by the thread, then handed to
+ * the store as a whole when the transaction ends */
+static __thread bool in_transaction = false;
+static __thread struct kvsal_recs trans;
+
+/* The counters of a transaction are added once its writes are applied. The
+ * stores' counters are unsigned, a negative value wraps around as it would
+ * as a long long */
+#define KVSAL_TRANS_COUNTERS 8
+
+struct kvsal_counter {
+	char k[KLEN];
+	long long incr;
+};
+
+static __thread struct kvsal_counter trans_counters[KVSAL_TRANS_COUNTERS];
+static __thread int nb_trans_counters;
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void kvstore_crc_init(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+		crc_table[i] = c;
+	}
+}
+
+uint32_t kvstore_crc(const char *buf, size_t len)
+{
+	uint32_t c = 0xffffffffU;
+	size_t i;
+
+	pthread_once(&crc_once, kvstore_crc_init);
+	for (i = 0; i < len; i++)
+		c = crc_table[(c ^ (uint8_t)buf[i]) & 0xff] ^ (c >> 8);
+
+	return c ^ 0xffffffffU;
+}
+
+/* Records are copied, key and value in a single buffer */
+static int kvsal_recs_add(struct kvsal_recs *r, const char *k, size_t klen,
+			  const char *v, size_t vlen)
+{
+	kvstore_rec_t *recs;
+	char *buf;
+
+	if (r->nb == r->size) {
+		recs = realloc(r->recs, (r->size ? 2 * r->size : 16) *
+				       sizeof(kvstore_rec_t));
+		if (recs == NULL)
+			return -ENOMEM;
+		r->recs = recs;
+		r->size = r->size ? 2 * r->size : 16;
+	}
+
+	if (r->scratch) {
+		if (r->nb == 0)
+			r->mark = kvsal_arena_mark();
+		buf = kvsal_arena_alloc(klen + (v ? vlen : 0) + 1);
+	} else
+		buf = malloc(klen + (v ? vlen : 0) + 1);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	memcpy(buf, k, klen);
+	r->recs[r->nb].k = buf;
+	r->recs[r->nb].klen = klen;
+	r->recs[r->nb].v = NULL;
+	r->recs[r->nb].vlen = 0;
+	if (v) {
+		memcpy(buf + klen, v, vlen);
+		r->recs[r->nb].v = buf + klen;
+		r->recs[r->nb].vlen = vlen;
+	}
+	r->nb += 1;
+
+	return 0;
+}
+
+static void kvsal_recs_free(struct kvsal_recs *r)
+{
+	int i;
+
+	if (r->scratch) {
+		if (r->nb > 0)
+			kvsal_arena_release(r->mark);
+	} else
+		for (i = 0; i < r->nb ; i++)
+			free((char *)r->recs[i].k);
+	free(r->recs);
+
+	r->recs = NULL;
+	r->nb = 0;
+	r->size = 0;
+}
+
+static size_t kvsal_field_key(char *k, char *field, char *buf)
+{
+	size_t klen = strnlen(k, KLEN);
+	size_t flen = strnlen(field, KLEN);
+
+	memcpy(buf, k, klen);
+	buf[klen] = KVSAL_FIELD_SEP;
+	memcpy(buf + klen + 1, field, flen);
+
+	return klen + 1 + flen;
+}
+
+/* A NULL v deletes the record */
+static int kvsal_write(const char *k, size_t klen, const char *v,
+		       size_t vlen)
+{
+	kvstore_rec_t rec;
+
+	if (in_transaction)
+		return kvsal_recs_add(&trans, k, klen, v, vlen);
+
+	rec.k = k;
+	rec.klen = klen;
+	rec.v = v;
+	rec.vlen = vlen;
+
+	return store->apply(&rec, 1);
+}
+
+struct kvsal_scan_arg {
+	struct kvsal_recs *recs;
+	int count;
+	int rc;
+};
+
+static int kvsal_scan_del(const char *k, size_t klen, void *arg)
+{
+	struct kvsal_scan_arg *sa = arg;
+
+	sa->rc = kvsal_recs_add(sa->recs, k, klen, NULL, 0);
+	return sa->rc;
+}
+
+static int kvsal_scan_count(const char *k, size_t klen, void *arg)
+{
+	struct kvsal_scan_arg *sa = arg;
+
+	sa->count += 1;
+	return 0;
+}
+
+/* Stops at the first record */
+static int kvsal_scan_any(const char *k, size_t klen, void *arg)
+{
+	struct kvsal_scan_arg *sa = arg;
+
+	sa->count += 1;
+	return 1;
+}
+
+/* The prefix of the fields of map k, klen bytes long, in the arena */
+static char *kvsal_fields_prefix(const char *k, size_t klen)
+{
+	char *prefix;
+
+	prefix = kvsal_arena_alloc(klen + 1);
+	if (prefix == NULL)
+		return NULL;
+
+	memcpy(prefix, k, klen);
+	prefix[klen] = KVSAL_FIELD_SEP;
+
+	return prefix;
+}
+
+/* Deletes a key, along with all the fields if it is a map */
+static int kvsal_del_key(char *k, size_t klen)
+{
+	struct kvsal_recs dels = { NULL, 0, 0, true, 0 };
+	struct kvsal_scan_arg sa = { NULL, 0, 0 };
+	size_t mark = kvsal_arena_mark();
+	char *prefix;
+	size_t plen = klen + 1;
+	int nb;
+	int rc;
+	int i;
+
+	prefix = kvsal_fields_prefix(k, klen);
+	if (prefix == NULL)
+		return -ENOMEM;
+
+	sa.recs = in_transaction ? &trans : &dels;
+	nb = sa.recs->nb;
+
+	rc = kvsal_recs_add(sa.recs, k, klen, NULL, 0);
+	if (rc == 0)
+		rc = store->scan(prefix, plen, kvsal_scan_del, &sa);
+	if (rc == 0)
+		rc = sa.rc;
+
+	/* Fields set earlier in the same transaction go as well */
+	for (i = 0; i < nb && rc == 0; i++)
+		if (trans.recs[i].v != NULL && trans.recs[i].klen > plen &&
+		    !memcmp(trans.recs[i].k, prefix, plen))
+			rc = kvsal_recs_add(&trans, trans.recs[i].k,
+					    trans.recs[i].klen, NULL, 0);
+
+	if (!in_transaction) {
+		if (rc == 0)
+			rc = store->apply(dels.recs, dels.nb);
+		kvsal_recs_free(&dels);
+	}
+	kvsal_arena_release(mark);
+
+	return rc;
+}
+
+static int kvsal_key_exists(char *k, size_t klen)
+{
+	struct kvsal_scan_arg sa = { NULL, 0, 0 };
+	size_t mark;
+	char *prefix;
+	size_t vlen = 0;
+	char v;
+	int rc;
+
+	rc = store->get(k, klen, &v, &vlen);
+	if (rc == 0 || rc == -ENOBUFS)
+		return 0;
+	if (rc != -ENOENT)
+		return rc;
+
+	/* May be a map */
+	mark = kvsal_arena_mark();
+	prefix = kvsal_fields_prefix(k, klen);
+	if (prefix == NULL)
+		rc = -ENOMEM;
+	else
+		rc = store->scan(prefix, klen + 1, kvsal_scan_any, &sa);
+	kvsal_arena_release(mark);
+	if (rc != 0)
+		return rc;
+
+	return (sa.count > 0) ? 0 : -ENOENT;
+}
+
+int kvsal_init(struct collection_item *cfg_items)
+{
+	struct collection_item *item = NULL;
+	const char *name = "wal";
+	int rc;
+	int i;
+
+	if (cfg_items == NULL)
+		return -EINVAL;
+
+	pthread_mutex_lock(&store_lock);
+	if (store != NULL) {
+		pthread_mutex_unlock(&store_lock);
+		return 0;
+	}
+
+	rc = get_config_item("kvsal_embedded", "store", cfg_items, &item);
+	if (rc != 0) {
+		pthread_mutex_unlock(&store_lock);
+		return -rc;
+	}
+	if (item != NULL)
+		name = get_const_string_config_value(item, NULL);
+
+	for (i = 0; stores[i] != NULL ; i++)
+		if (!strcmp(stores[i]->name, name))
+			break;
+
+	if (stores[i] == NULL) {
+		fprintf(stderr, "Unknown embedded store %s\n", name);
+		pthread_mutex_unlock(&store_lock);
+		return -EINVAL;
+	}
+
+	rc = stores[i]->open(cfg_items);
+	if (rc != 0) {
+		fprintf(stderr, "Can't open embedded store %s: %d\n",
+			name, rc);
+		stores[i]->close();
+	} else
+		store = stores[i];
+	pthread_mutex_unlock(&store_lock);
+
+	return rc;
+}
+
+int kvsal_fini(void)
+{
+	int rc = 0;
+
+	pthread_mutex_lock(&store_lock);
+	if (store != NULL)
+		rc = store->close();
+	store = NULL;
+	pthread_mutex_unlock(&store_lock);
+
+	return rc;
+}
+
+/* There are no connections to pool */
+int kvsal_get_pool_stats(kvsal_pool_stats_t *stats)
+{
+	if (!stats)
+		return -EINVAL;
+
+	memset(stats, 0, sizeof(kvsal_pool_stats_t));
+	return 0;
+}
+
+/* Nor any replica, reads are always up to date */
+bool kvsal_read_replica(bool on)
+{
+	return false;
+}
+
+int kvsal_begin_transaction(void)
+{
+	if (in_transaction)
+		return -EINVAL;
+
+	in_transaction = true;
+	trans.nb = 0;
+	nb_trans_counters = 0;
+
+	return 0;
+}
+
+int kvsal_end_transaction(void)
+{
+	unsigned long long v;
+	int rc;
+	int i;
+
+	if (!in_transaction)
+		return -EINVAL;
+
+	rc = store->apply(trans.recs, trans.nb);
+	for (i = 0; i < nb_trans_counters && rc == 0; i++)
+		rc = store->incr(trans_counters[i].k,
+				 strnlen(trans_counters[i].k, KLEN),
+				 trans_counters[i].incr, &v);
+
+	kvsal_recs_free(&trans);
+	in_transaction = false;
+
+	return rc;
+}
+
+int kvsal_discard_transaction(void)
+{
+	if (!in_transaction)
+		return -EINVAL;
+
+	kvsal_recs_free(&trans);
+	nb_trans_counters = 0;
+	in_transaction = false;
+
+	return 0;
+}
+
+int kvsal_exists(char *k)
+{
+	if (!k)
+		return -EINVAL;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	return kvsal_key_exists(k, strnlen(k, KLEN));
+}
+
+int kvsal_set_char(char *k, char *v)
+{
+	if (!k || !v)
+		return -EINVAL;
+
+	return kvsal_write(k, strnlen(k, KLEN), v, strlen(v));
+}
+
+int kvsal_get_char(char *k, char *v)
+{
+	size_t vlen = VLEN - 1;
+	int rc;
+
+	if (!k || !v)
+		return -EINVAL;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	rc = store->get(k, strnlen(k, KLEN), v, &vlen);
+	if (rc == -ENOBUFS)
+		return -1;
+	if (rc != 0)
+		return rc;
+
+	if (vlen == 0)
+		return -ENOENT;
+
+	v[vlen] = '\0';
+	return 0;
+}
+
+int kvsal_set_stat(char *k, struct stat *buf)
+{
+	if (!k || !buf)
+		return -EINVAL;
+
+	return kvsal_write(k, strnlen(k, KLEN), (char *)buf,
+			   sizeof(struct stat));
+}
+
+int kvsal_get_stat(char *k, struct stat *buf)
+{
+	size_t vlen = sizeof(struct stat);
+	int rc;
+
+	if (!k || !buf)
+		return -EINVAL;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	rc = store->get(k, strnlen(k, KLEN), (char *)buf, &vlen);
+	if (rc != 0 || vlen != sizeof(struct stat))
+		return -1;
+
+	return 0;
+}
+
+int kvsal_set_binary(char *k, char *buf, size_t size)
+{
+	if (!k || !buf)
+		return -EINVAL;
+
+	return kvsal_write(k, strnlen(k, KLEN), buf, size);
+}
+
+int kvsal_get_binary(char *k, char *buf, size_t *size)
+{
+	int rc;
+
+	if (!k || !buf || !size)
+		return -EINVAL;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	rc = store->get(k, strnlen(k, KLEN), buf, size);
+	if (rc == -ENOBUFS)
+		return -1;
+
+	return rc;
+}
+
+int kvsal_set_slice(kvsal_slice_t *k, kvsal_slice_t *v)
+{
+	if (!k || !k->p || !v || (!v->p && v->len > 0))
+		return -EINVAL;
+
+	/* A NULL value would be a deletion */
+	return kvsal_write(k->p, k->len, v->p ? v->p : "", v->len);
+}
+
+int kvsal_get_slice(kvsal_slice_t *k, kvsal_slice_t *v)
+{
+	if (!k || !k->p || !v || (!v->p && v->len > 0))
+		return -EINVAL;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	return store->get(k->p, k->len, v->p, &v->len);
+}
+
+int kvsal_del_slice(kvsal_slice_t *k)
+{
+	if (!k || !k->p)
+		return -EINVAL;
+
+	return kvsal_write(k->p, k->len, NULL, 0);
+}
+
+int kvsal_incr_counter(char *k, unsigned long long *v)
+{
+	if (!k || !v)
+		return -EINVAL;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	return store->incr(k, strnlen(k, KLEN), 1, v);
+}
+
+/* Adds incr to counter k, *v is the counter's new value */
+int kvsal_incr_counter_by(char *k, unsigned long long incr,
+			  unsigned long long *v)
+{
+	if (!k || !v || incr == 0)
+		return -EINVAL;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	return store->incr(k, strnlen(k, KLEN), incr, v);
+}
+
+int kvsal_add_counter(char *k, long long incr)
+{
+	unsigned long long v;
+	int i;
+
+	if (!k)
+		return -EINVAL;
+
+	if (!in_transaction)
+		return store->incr(k, strnlen(k, KLEN), incr, &v);
+
+	for (i = 0; i < nb_trans_counters ; i++)
+		if (!strncmp(trans_counters[i].k, k, KLEN)) {
+			trans_counters[i].incr += incr;
+			return 0;
+		}
+
+	if (nb_trans_counters == KVSAL_TRANS_COUNTERS)
+		return -ENOBUFS;
+
+	strncpy(trans_counters[i].k, k, KLEN - 1);
+	trans_counters[i].k[KLEN - 1] = '\0';
+	trans_counters[i].incr = incr;
+	nb_trans_counters += 1;
+
+	return 0;
+}
+
+int kvsal_del(char *k)
+{
+	if (!k)
+		return -EINVAL;
+
+	return kvsal_del_key(k, strnlen(k, KLEN));
+}
+
+int kvsal_set_field(char *k, char *field, char *v)
+{
+	char fk[KVSAL_FIELD_KLEN];
+	size_t fklen;
+
+	if (!k || !field || !v)
+		return -EINVAL;
+
+	fklen = kvsal_field_key(k, field, fk);
+	return kvsal_write(fk, fklen, v, strlen(v));
+}
+
+int kvsal_get_field(char *k, char *field, char *v)
+{
+	char fk[KVSAL_FIELD_KLEN];
+	size_t fklen;
+	size_t vlen = VLEN - 1;
+	int rc;
+
+	if (!k || !field || !v)
+		return -EINVAL;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	fklen = kvsal_field_key(k, field, fk);
+	rc = store->get(fk, fklen, v, &vlen);
+	if (rc == -ENOBUFS)
+		return -1;
+	if (rc != 0)
+		return rc;
+
+	v[vlen] = '\0';
+	return 0;
+}
+
+int kvsal_del_field(char *k, char *field)
+{
+	char fk[KVSAL_FIELD_KLEN];
+	size_t fklen;
+
+	if (!k || !field)
+		return -EINVAL;
+
+	fklen = kvsal_field_key(k, field, fk);
+	return kvsal_write(fk, fklen, NULL, 0);
+}
+
+int kvsal_get_fields_count(char *k)
+{
+	struct kvsal_scan_arg sa = { NULL, 0, 0 };
+	char prefix[KLEN + 1];
+	size_t plen;
+
+	if (!k)
+		return -EINVAL;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	plen = strnlen(k, KLEN);
+	memcpy(prefix, k, plen);
+	prefix[plen++] = KVSAL_FIELD_SEP;
+	RC_WRAP(store->scan, prefix, plen, kvsal_scan_count, &sa);
+
+	return sa.count;
+}
+
+/* A listing is read from the store as a whole the first time items are
+ * asked for, in key order. The keys are copied in chunks, chained from
+ * list->seen, which stay put as the listing grows */
+#define KVSAL_LIST_CHUNK 65536
+
+struct kvsal_list_chunk {
+	struct kvsal_list_chunk *next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+struct kvsal_list_arg {
+	kvsal_list_t *list;
+	size_t skip;		/* size of the prefix of fields */
+	bool any;		/* pattern is its literal prefix, then "*" */
+	char last[KLEN];	/* map whose fields were just seen */
+	int rc;
+};
+
+static int kvsal_list_add(struct kvsal_list_arg *la, const char *k,
+			  size_t klen)
+{
+	kvsal_list_t *list = la->list;
+	struct kvsal_list_chunk *chunk = list->seen;
+	kvsal_slice_t *content;
+	size_t size;
+
+	if (chunk == NULL || chunk->size - chunk->used < klen) {
+		size = MAX(KVSAL_LIST_CHUNK, klen);
+		chunk = malloc(sizeof(struct kvsal_list_chunk) + size);
+		if (chunk == NULL) {
+			la->rc = -ENOMEM;
+			return la->rc;
+		}
+		chunk->next = list->seen;
+		chunk->used = 0;
+		chunk->size = size;
+		list->seen = chunk;
+	}
+
+	if ((list->size & 255) == 0) {
+		content = realloc(list->content,
+				  (list->size + 256) * sizeof(kvsal_slice_t));
+		if (content == NULL) {
+			la->rc = -ENOMEM;
+			return la->rc;
+		}
+		list->content = content;
+	}
+
+	list->content[list->size].p = chunk->data + chunk->used;
+	list->content[list->size].len = klen;
+	memcpy(chunk->data + chunk->used, k, klen);
+	chunk->used += klen;
+	list->size += 1;
+
+	return 0;
+}
+
+static int kvsal_scan_list(const char *k, size_t klen, void *arg)
+{
+	struct kvsal_list_arg *la = arg;
+	char key[KLEN];
+	const char *sep;
+
+	if (la->list->fields)
+		return kvsal_list_add(la, k + la->skip, klen - la->skip);
+
+	/* A map shows up once, as its key */
+	sep = memchr(k, KVSAL_FIELD_SEP, klen);
+	if (sep != NULL) {
+		klen = sep - k;
+		if (klen < KLEN && !strncmp(la->last, k, klen) &&
+		    la->last[klen] == '\0')
+			return 0;
+	}
+
+	/* Longer keys are matched on their beginning */
+	memcpy(key, k, MIN(klen, KLEN - 1));
+	key[MIN(klen, KLEN - 1)] = '\0';
+	strcpy(la->last, key);
+
+	if (!la->any && fnmatch(la->list->pattern, key, 0) != 0)
+		return 0;
+
+	return kvsal_list_add(la, k, klen);
+}
+
+static int kvsal_load_list(kvsal_list_t *list)
+{
+	struct kvsal_list_arg la;
+	char prefix[KLEN + 1];
+	size_t plen;
+
+	memset(&la, 0, sizeof(la));
+	la.list = list;
+
+	/* Only keys starting with the pattern's literal prefix may match */
+	plen = strnlen(list->pattern, KLEN);
+	memcpy(prefix, list->pattern, plen);
+	if (list->fields) {
+		prefix[plen++] = KVSAL_FIELD_SEP;
+		la.skip = plen;
+	} else {
+		plen = strcspn(list->pattern, "*?[\\");
+		la.any = !strcmp(list->pattern + plen, "*");
+	}
+
+	RC_WRAP(store->scan, prefix, plen, kvsal_scan_list, &la);
+	list->done = true;
+
+	return la.rc;
+}
+
+int kvsal_get_list_pattern(char *pattern, int start, int *size,
+			   kvsal_item_t *items)
+{
+	kvsal_list_t list;
+	int rc;
+
+	if (!pattern || !size || !items)
+		return -EINVAL;
+
+	RC_WRAP(kvsal_init_list, &list);
+	RC_WRAP(kvsal_fetch_list, pattern, &list);
+
+	rc = kvsal_get_list(&list, start, size, items);
+
+	kvsal_dispose_list(&list);
+	return rc;
+}
+
+int kvsal_get_list_size(char *pattern)
+{
+	kvsal_list_t list;
+	int rc;
+
+	if (!pattern)
+		return -EINVAL;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	RC_WRAP(kvsal_init_list, &list);
+	RC_WRAP(kvsal_fetch_list, pattern, &list);
+
+	rc = kvsal_load_list(&list);
+	if (rc == 0)
+		rc = list.size;
+
+	kvsal_dispose_list(&list);
+	return rc;
+}
+
+int kvsal_init_list(kvsal_list_t *list)
+{
+	if (!list)
+		return -EINVAL;
+
+	memset(list, 0, sizeof(kvsal_list_t));
+
+	return 0;
+}
+
+int kvsal_fetch_list(char *pattern, kvsal_list_t *list)
+{
+	if (!pattern || !list)
+		return -EINVAL;
+
+	/* Nothing is read here, but when the list is */
+	memset(list, 0, sizeof(kvsal_list_t));
+	strncpy(list->pattern, pattern, KLEN);
+	list->pattern[KLEN - 1] = '\0';
+
+	return 0;
+}
+
+int kvsal_fetch_field_list(char *k, kvsal_list_t *list)
+{
+	RC_WRAP(kvsal_fetch_list, k, list);
+
+	/* The list is made of the fields of map k */
+	list->fields = true;
+
+	return 0;
+}
+
+int kvsal_dispose_list(kvsal_list_t *list)
+{
+	struct kvsal_list_chunk *chunk;
+
+	if (!list)
+		return -EINVAL;
+
+	if (list->content)
+		free(list->content);
+
+	while (list->seen != NULL) {
+		chunk = list->seen;
+		list->seen = chunk->next;
+		free(chunk);
+	}
+
+	list->content = NULL;
+	list->size = 0;
+	list->done = false;
+
+	return 0;
+}
+
+int kvsal_get_list_slices(kvsal_list_t *list, int start, int *end,
+			  kvsal_slice_t *items)
+{
+	int nb;
+
+	if (!list || !end || !items || start < 0 || *end < 0)
+		return -EINVAL;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	if (!list->done)
+		RC_WRAP(kvsal_load_list, list);
+
+	nb = (int)list->size - start;
+	if (nb < 0)
+		nb = 0;
+	if (nb > *end)
+		nb = *end;
+
+	if (nb > 0)
+		memcpy(items, &list->content[start],
+		       nb * sizeof(kvsal_slice_t));
+	*end = nb;
+
+	return 0;
+}
+
+int kvsal_get_list(kvsal_list_t *list, int start, int *end,
+		    kvsal_item_t *items)
+{
+	size_t len;
+	int i;
+
+	if (!list || !end || !items || start < 0 || *end < 0)
+		return -EINVAL;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	if (!list->done)
+		RC_WRAP(kvsal_load_list, list);
+
+	for (i = 0; i < *end && start + i < (int)list->size ; i++) {
+		len = MIN(list->content[start + i].len, KLEN - 1);
+		memcpy(items[i].str, list->content[start + i].p, len);
+		items[i].str[len] = '\0';
+		items[i].offset = start + i;
+	}
+	*end = i;
+
+	return 0;
+}
+
+static void kvsal_run_op(kvsal_op_t *op)
+{
+	char fk[KVSAL_FIELD_KLEN];
+	char *k = op->k;
+	size_t klen = strlen(op->k);	/* ops' keys may be of any length */
+	size_t vlen;
+
+	if (op->field) {
+		klen = kvsal_field_key(op->k, op->field, fk);
+		k = fk;
+	}
+
+	switch (op->type) {
+	case KVSAL_OP_GET:
+		vlen = op->vlen;
+		op->rc = store->get(k, klen, op->v, &vlen);
+		if (op->rc != 0)
+			break;
+		if (vlen < op->vlen)
+			op->v[vlen] = '\0';
+		op->vlen = vlen;
+		break;
+
+	case KVSAL_OP_SET:
+		op->rc = kvsal_write(k, klen, op->v, op->vlen);
+		break;
+
+	case KVSAL_OP_SETRANGE:
+		if (op->field)
+			op->rc = -EINVAL;
+		else
+			op->rc = store->setrange(k, klen, op->off, op->v,
+						 &op->vlen);
+		break;
+
+	case KVSAL_OP_DEL:
+		if (op->field)
+			op->rc = kvsal_write(k, klen, NULL, 0);
+		else
+			op->rc = kvsal_del_key(k, klen);
+		break;
+
+	case KVSAL_OP_EXISTS:
+		if (op->field) {
+			vlen = 0;
+			op->rc = store->get(k, klen, fk, &vlen);
+			if (op->rc == -ENOBUFS)
+				op->rc = 0;
+		} else
+			op->rc = kvsal_key_exists(k, klen);
+		break;
+
+	default:
+		op->rc = -EINVAL;
+		break;
+	}
+}
+
+int kvsal_batch(kvsal_op_t *ops, int nb_ops)
+{
+	int i;
+
+	if (!ops || nb_ops < 0)
+		return -EINVAL;
+
+	for (i = 0; i < nb_ops ; i++) {
+		/* Reads make no sense within a transaction, as with a
+		 * remote KVS their result would only be known at its end */
+		if (in_transaction && ops[i].type != KVSAL_OP_SET &&
+		    ops[i].type != KVSAL_OP_DEL) {
+			ops[i].rc = -EINVAL;
+			continue;
+		}
+
+		kvsal_run_op(&ops[i]);
+	}
+
+	return 0;
+}
+
+int kvsal_mget(kvsal_op_t *ops, int nb_ops)
+{
+	int i;
+
+	if (!ops || nb_ops < 0)
+		return -EINVAL;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	for (i = 0; i < nb_ops ; i++)
+		if (ops[i].type != KVSAL_OP_GET || ops[i].field)
+			return -EINVAL;
+
+	return kvsal_batch(ops, nb_ops);
+}
+
+/* The keys are all set at once */
+int kvsal_mset(kvsal_op_t *ops, int nb_ops)
+{
+	struct kvsal_recs sets = { NULL, 0, 0, true, 0 };
+	struct kvsal_recs *r;
+	int rc = 0;
+	int i;
+
+	if (!ops || nb_ops < 0)
+		return -EINVAL;
+
+	for (i = 0; i < nb_ops ; i++)
+		if (ops[i].type != KVSAL_OP_SET || ops[i].field)
+			return -EINVAL;
+
+	r = in_transaction ? &trans : &sets;
+	for (i = 0; i < nb_ops && rc == 0; i++)
+		rc = kvsal_recs_add(r, ops[i].k, strlen(ops[i].k),
+				    ops[i].v, ops[i].vlen);
+
+	if (!in_transaction) {
+		if (rc == 0)
+			rc = store->apply(sets.recs, sets.nb);
+		kvsal_recs_free(&sets);
+	}
+
+	for (i = 0; i < nb_ops ; i++)
+		ops[i].rc = rc;
+
+	return rc;
+}
+
+/* Every call is already run by the store in one go */
+int kvsal_load_script(kvsal_script_t *script)
+{
+	return -ENOTSUP;
+}
+
+int kvsal_run_script(kvsal_script_t *script, int nb_keys, char **keys,
+		     int nb_args, char **args, size_t *argslen,
+		     long long *ret)
+{
+	return -ENOTSUP;
+}
+
+int kvsal_run_walk_script(kvsal_script_t *script, int nb_keys, char **keys,
+			  int nb_args, char **args, size_t *argslen,
+			  long long *ret, kvsal_slice_t *values,
+			  int *nb_values)
+{
+	return -ENOTSUP;
+}
+
+/* The store is private to this process, which is told of its own changes
+ * by its own calls: there is nothing to notify of */
+int kvsal_watch(char **patterns, int nb_patterns, kvsal_watch_cb_t cb,
+		void *arg)
+{
+	if (!patterns || !cb || nb_patterns <= 0 ||
+	    nb_patterns > KVSAL_ARRAY_SIZE)
+		return -EINVAL;
+
+	return 0;
+}
+
+/* Ops are completed by the store at once, cb is called before returning */
+int kvsal_async_op(kvsal_op_t *op, kvsal_async_cb_t cb, void *arg)
+{
+	if (!op || !op->k || !cb || in_transaction)
+		return -EINVAL;
+
+	kvsal_run_op(op);
+	cb(op, arg);
+
+	return 0;
+}
+
+int kvsal_async_group_init(kvsal_async_group_t *group)
+{
+	if (!group)
+		return -EINVAL;
+
+	pthread_mutex_init(&group->lock, NULL);
+	pthread_cond_init(&group->cond, NULL);
+	group->pending = 0;
+
+	return 0;
+}
+
+static void kvsal_async_group_done(kvsal_op_t *op, void *arg)
+{
+	kvsal_async_group_t *group = arg;
+
+	pthread_mutex_lock(&group->lock);
+	group->pending -= 1;
+	if (group->pending == 0)
+		pthread_cond_broadcast(&group->cond);
+	pthread_mutex_unlock(&group->lock);
+}
+
+int kvsal_async_group_op(kvsal_async_group_t *group, kvsal_op_t *op)
+{
+	int rc;
+
+	if (!group)
+		return -EINVAL;
+
+	pthread_mutex_lock(&group->lock);
+	group->pending += 1;
+	pthread_mutex_unlock(&group->lock);
+
+	rc = kvsal_async_op(op, kvsal_async_group_done, group);
+	if (rc != 0) {
+		pthread_mutex_lock(&group->lock);
+		group->pending -= 1;
+		pthread_mutex_unlock(&group->lock);
+	}
+
+	return rc;
+}
+
+int kvsal_async_group_wait(kvsal_async_group_t *group)
+{
+	if (!group)
+		return -EINVAL;
+
+	pthread_mutex_lock(&group->lock);
+	while (group->pending > 0)
+		pthread_cond_wait(&group->cond, &group->lock);
+	pthread_mutex_unlock(&group->lock);
+
+	return 0;
+}
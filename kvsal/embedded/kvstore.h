@@ -0,0 +1,84 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) CEA, 2016
+ * Author: Philippe Deniel  philippe.deniel@cea.fr
+ *
+ * contributeur : Philippe DENIEL   philippe.deniel@cea.fr
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+
+/* kvstore.h
+ * KVSAL: local key value stores used by the embedded KVSAL
+ */
+
+#ifndef _KVSTORE_H
+#define _KVSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ini_config.h>
+
+/* Keys and values are binary strings. A record with a NULL value is a
+ * deletion */
+typedef struct kvstore_rec {
+	const char *k;
+	size_t klen;
+	const char *v;
+	size_t vlen;
+} kvstore_rec_t;
+
+/* Called for each key of a scan, in key order. The store is locked, the
+ * callback must not call it. A non-zero return stops the scan */
+typedef int (*kvstore_scan_cb_t)(const char *k, size_t klen, void *arg);
+
+/* Every call may be made by several threads at once.
+ * - get copies at most *vlen bytes of the value in v, *vlen is set to the
+ *   value's size. Returns -ENOENT, or -ENOBUFS if v is too small
+ * - apply makes the records, in order, as a whole: they are all visible or
+ *   none is, and they are all durable when it returns
+ * - incr adds by to the decimal counter k (0 if missing), sets *v to its
+ *   new value
+ * - setrange writes *vlen bytes at off in the value of k, zero-filled up to
+ *   off if shorter or missing, and sets *vlen to the value's new size
+ * - scan walks the keys starting with prefix */
+struct kvstore {
+	const char *name;
+	int (*open)(struct collection_item *cfg_items);
+	int (*close)(void);
+	int (*get)(const char *k, size_t klen, char *v, size_t *vlen);
+	int (*apply)(kvstore_rec_t *recs, int nb_recs);
+	int (*incr)(const char *k, size_t klen, unsigned long long by,
+		    unsigned long long *v);
+	int (*setrange)(const char *k, size_t klen, size_t off, const char *v,
+			size_t *vlen);
+	int (*scan)(const char *prefix, size_t plen, kvstore_scan_cb_t cb,
+		    void *arg);
+};
+
+/* CRC-32 (IEEE 802.3) of buf, to check what the stores read back */
+uint32_t kvstore_crc(const char *buf, size_t len);
+
+extern struct kvstore kvstore_wal;
+extern struct kvstore kvstore_mem;
+extern struct kvstore kvstore_btree;
+
+#endif
@@ -0,0 +1,1392 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) CEA, 2016
+ * Author: Philippe Deniel  philippe.deniel@cea.fr
+ *
+ * contributeur : Philippe DENIEL   philippe.deniel@cea.fr
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+
+/* kvstore_btree.c
+ * KVSAL: copy-on-write B+tree in a memory mapped file, for the embedded KVSAL
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <ini_config.h>
+#include "kvstore.h"
+
+#define RC_WRAP(__function, ...) ({\
+	int __rc = __function(__VA_ARGS__);\
+	if (__rc != 0)        \
+		return __rc; })
+
+/* The tree lives in a file of fixed size pages, mapped in memory: opening
+ * it reads nothing but its two meta pages, gets walk the mapping and scans
+ * hand out keys that point right into it.
+ *
+ * Pages are never modified once written. A change copies the pages on its
+ * path from the root into new pages, appended to the file. Once they are
+ * synced, the alternate meta page is overwritten to point to the new root,
+ * and synced as well. After a crash, the meta page with the highest
+ * transaction id and a valid checksum is used: a transaction is there as a
+ * whole or not at all. As nothing is overwritten, readers walk the tree
+ * while the writer builds the next one; the lock they share only guards
+ * the mapping, which the writer moves when the file outgrows it.
+ *
+ * Pages left behind are not reused. Once the file holds more than twice
+ * the live pages, the live tree is copied to a new file, packed, which
+ * then replaces the old one.
+ *
+ * Values larger than BT_MAX_INLINE are stored in runs of overflow pages.
+ * Leaves left empty are removed, others are not merged: packing does it */
+
+#define BT_FILE "kvsal.btree"
+#define BT_MAGIC 0x4b564254U	/* "KVBT" */
+#define BT_VERSION 1
+#define BT_PAGE 4096
+#define BT_MAX_KEY 600
+#define BT_MAX_INLINE 512
+#define BT_MAP_MIN (64 << 20)
+#define BT_COMPACT_PAGES 1024	/* don't pack for less garbage than this */
+#define BT_PATHLEN (MAXPATHLEN - 32)
+
+#define BT_LEAF 1
+#define BT_BRANCH 2
+#define BT_OVERFLOW 4
+
+struct bt_page {
+	uint64_t pgno;
+	uint32_t npages;	/* overflow pages in this run */
+	uint16_t flags;
+	uint16_t nkeys;
+	uint16_t lower;		/* end of the slots */
+	uint16_t upper;		/* start of the nodes */
+	uint16_t slots[];	/* offset of each node, in key order */
+};
+
+#define BT_HDR offsetof(struct bt_page, slots)
+#define BT_ROOM (BT_PAGE - BT_HDR)
+
+/* Leaf node:   u16 klen, u8 big, u32 vlen, key, value (or u64 overflow pgno)
+ * Branch node: u16 klen, u64 child, key
+ * The first node of a branch page covers any key lower than the second */
+#define BT_LEAF_HDR 7
+#define BT_BRANCH_HDR 10
+#define BT_NODE_MAX (BT_LEAF_HDR + BT_MAX_KEY + BT_MAX_INLINE)
+
+struct bt_meta {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t page_size;
+	uint32_t crc;
+	uint64_t txnid;
+	uint64_t root;		/* 0 for an empty tree */
+	uint64_t npages;	/* pages in the file */
+	uint64_t live;		/* pages in use */
+};
+
+struct bt_node {
+	const char *p;
+	size_t len;
+};
+
+/* Pages of the transaction being built, from page base on */
+struct bt_txn {
+	uint64_t root;
+	uint64_t base;
+	uint64_t next;
+	char **pages;
+	size_t size;
+	uint64_t alloc;		/* pages added */
+	uint64_t dropped;	/* ... then given up */
+	uint64_t freed;		/* pages of the tree no longer used */
+};
+
+struct bt_result {
+	uint64_t pgno;		/* the subtree's new page, 0 if now empty */
+	uint64_t right;		/* the page split off it, if any */
+	char key[BT_MAX_KEY];	/* ... and its first key */
+	size_t klen;
+	bool changed;
+};
+
+static struct bt_store {
+	pthread_rwlock_t lock;	/* guards the mapping */
+	pthread_mutex_t wlock;	/* serializes writers */
+	char path[BT_PATHLEN];
+	int fd;
+	char *map;
+	size_t map_size;
+	struct bt_meta meta;	/* the last one written */
+	uint64_t root;		/* what readers walk */
+	bool sync;
+} bt = {
+	.lock = PTHREAD_RWLOCK_INITIALIZER,
+	.wlock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+};
+
+static uint16_t bt_get16(const char *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t bt_get32(const char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t bt_get64(const char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static int bt_keycmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+	int rc;
+
+	rc = memcmp(a, b, MIN(alen, blen));
+	if (rc != 0)
+		return rc;
+
+	return (alen > blen) - (alen < blen);
+}
+
+static const char *bt_node(const char *page, int i)
+{
+	return page + ((const struct bt_page *)page)->slots[i];
+}
+
+static const char *bt_node_key(const char *page, const char *node)
+{
+	if (((const struct bt_page *)page)->flags & BT_LEAF)
+		return node + BT_LEAF_HDR;
+	return node + BT_BRANCH_HDR;
+}
+
+static size_t bt_node_len(const char *page, const char *node)
+{
+	size_t klen = bt_get16(node);
+
+	if (((const struct bt_page *)page)->flags & BT_BRANCH)
+		return BT_BRANCH_HDR + klen;
+	if (node[2])
+		return BT_LEAF_HDR + klen + sizeof(uint64_t);
+	return BT_LEAF_HDR + klen + bt_get32(node + 3);
+}
+
+static uint64_t bt_node_child(const char *node)
+{
+	return bt_get64(node + 2);
+}
+
+static uint32_t bt_ovf_pages(size_t vlen)
+{
+	return (BT_HDR + vlen + BT_PAGE - 1) / BT_PAGE;
+}
+
+/* Returns the first node whose key is not lower than k */
+static int bt_search(const char *page, const char *k, size_t klen,
+		     bool *exact)
+{
+	const struct bt_page *hdr = (const struct bt_page *)page;
+	const char *node;
+	int lo = 0;
+	int hi = hdr->nkeys;
+	int mid;
+	int rc;
+
+	*exact = false;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		node = bt_node(page, mid);
+		rc = bt_keycmp(bt_node_key(page, node), bt_get16(node), k, klen);
+		if (rc == 0) {
+			*exact = true;
+			return mid;
+		}
+		if (rc < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* The child of a branch page where k belongs */
+static int bt_branch_index(const char *page, const char *k, size_t klen)
+{
+	bool exact;
+	int i;
+
+	i = bt_search(page, k, klen, &exact);
+	if (!exact && i > 0)
+		i -= 1;
+
+	return i;
+}
+
+/* Pages written by the transaction are still in its buffers */
+static const char *bt_page_get(struct bt_txn *txn, uint64_t pgno)
+{
+	if (txn != NULL && pgno >= txn->base)
+		return txn->pages[pgno - txn->base];
+
+	return bt.map + pgno * BT_PAGE;
+}
+
+static char *bt_alloc(struct bt_txn *txn, uint32_t npages, uint64_t *pgno)
+{
+	char **pages;
+	size_t size;
+	char *buf;
+
+	if (txn->next + npages - txn->base > txn->size) {
+		size = MAX(2 * txn->size, txn->next + npages - txn->base);
+		pages = realloc(txn->pages, size * sizeof(char *));
+		if (pages == NULL)
+			return NULL;
+		memset(pages + txn->size, 0,
+		       (size - txn->size) * sizeof(char *));
+		txn->pages = pages;
+		txn->size = size;
+	}
+
+	buf = calloc(npages, BT_PAGE);
+	if (buf == NULL)
+		return NULL;
+
+	*pgno = txn->next;
+	((struct bt_page *)buf)->pgno = *pgno;
+	((struct bt_page *)buf)->npages = npages;
+	txn->pages[*pgno - txn->base] = buf;
+	txn->next += npages;
+	txn->alloc += npages;
+
+	return buf;
+}
+
+static void bt_drop(struct bt_txn *txn, uint64_t pgno, uint32_t npages)
+{
+	if (pgno >= txn->base) {
+		free(txn->pages[pgno - txn->base]);
+		txn->pages[pgno - txn->base] = NULL;
+		txn->dropped += npages;
+	} else
+		txn->freed += npages;
+}
+
+/* The page's own buffer if the transaction already copied it */
+static char *bt_dirty(struct bt_txn *txn, uint64_t pgno, uint64_t *newpg)
+{
+	if (pgno >= txn->base) {
+		*newpg = pgno;
+		return txn->pages[pgno - txn->base];
+	}
+
+	txn->freed += 1;
+	return bt_alloc(txn, 1, newpg);
+}
+
+static void bt_fill(char *page, uint16_t flags, struct bt_node *nodes,
+		    int nb)
+{
+	struct bt_page *hdr = (struct bt_page *)page;
+	int i;
+
+	hdr->flags = flags;
+	hdr->nkeys = nb;
+	hdr->lower = BT_HDR + nb * sizeof(uint16_t);
+	hdr->upper = BT_PAGE;
+	for (i = 0; i < nb; i++) {
+		hdr->upper -= nodes[i].len;
+		memcpy(page + hdr->upper, nodes[i].p, nodes[i].len);
+		hdr->slots[i] = hdr->upper;
+	}
+}
+
+/* Lays nodes out in one page, or two if they don't fit. Returns the index
+ * of the first node of the second page, 0 if there is none */
+static int bt_pack(struct bt_node *nodes, int nb, uint16_t flags,
+		   char *left, char *right)
+{
+	size_t total = 0;
+	size_t sum = 0;
+	size_t best = 0;
+	size_t gap;
+	int cut = 0;
+	int i;
+
+	for (i = 0; i < nb; i++)
+		total += nodes[i].len + sizeof(uint16_t);
+
+	if (total <= BT_ROOM) {
+		bt_fill(left, flags, nodes, nb);
+		return 0;
+	}
+
+	/* Both halves fit, as even as can be */
+	for (i = 1; i < nb; i++) {
+		sum += nodes[i - 1].len + sizeof(uint16_t);
+		if (sum > BT_ROOM || total - sum > BT_ROOM)
+			continue;
+		gap = (2 * sum > total) ? 2 * sum - total : total - 2 * sum;
+		if (cut == 0 || gap < best) {
+			cut = i;
+			best = gap;
+		}
+	}
+
+	bt_fill(left, flags, nodes, cut);
+	bt_fill(right, flags, nodes + cut, nb - cut);
+	return cut;
+}
+
+/* Writes nodes in place of page pgno, or of its copy */
+static int bt_rewrite(struct bt_txn *txn, uint64_t pgno, uint16_t flags,
+		      struct bt_node *nodes, int nb, struct bt_result *res)
+{
+	char left[BT_PAGE];
+	char right[BT_PAGE];
+	const char *node;
+	char *page;
+	int cut;
+
+	memset(res, 0, offsetof(struct bt_result, key));
+	res->changed = true;
+
+	if (nb == 0) {
+		bt_drop(txn, pgno, 1);
+		return 0;
+	}
+
+	cut = bt_pack(nodes, nb, flags, left, right);
+
+	page = bt_dirty(txn, pgno, &res->pgno);
+	if (page == NULL)
+		return -ENOMEM;
+	memcpy(page + sizeof(uint64_t), left + sizeof(uint64_t),
+	       BT_PAGE - sizeof(uint64_t));
+	((struct bt_page *)page)->npages = 1;
+
+	if (cut == 0)
+		return 0;
+
+	page = bt_alloc(txn, 1, &res->right);
+	if (page == NULL)
+		return -ENOMEM;
+	memcpy(page + sizeof(uint64_t), right + sizeof(uint64_t),
+	       BT_PAGE - sizeof(uint64_t));
+	((struct bt_page *)page)->npages = 1;
+
+	node = bt_node(right, 0);
+	res->klen = bt_get16(node);
+	memcpy(res->key, bt_node_key(right, node), res->klen);
+
+	return 0;
+}
+
+/* Gathers the nodes of a page, with room for two more */
+static struct bt_node *bt_nodes(const char *page, int *nb)
+{
+	const struct bt_page *hdr = (const struct bt_page *)page;
+	struct bt_node *nodes;
+	int i;
+
+	nodes = malloc((hdr->nkeys + 2) * sizeof(struct bt_node));
+	if (nodes == NULL)
+		return NULL;
+
+	for (i = 0; i < hdr->nkeys; i++) {
+		nodes[i].p = bt_node(page, i);
+		nodes[i].len = bt_node_len(page, nodes[i].p);
+	}
+	*nb = hdr->nkeys;
+
+	return nodes;
+}
+
+static void bt_nodes_insert(struct bt_node *nodes, int *nb, int i,
+			    const char *p, size_t len)
+{
+	memmove(&nodes[i + 1], &nodes[i], (*nb - i) * sizeof(struct bt_node));
+	nodes[i].p = p;
+	nodes[i].len = len;
+	*nb += 1;
+}
+
+static void bt_nodes_remove(struct bt_node *nodes, int *nb, int i)
+{
+	memmove(&nodes[i], &nodes[i + 1],
+		(*nb - i - 1) * sizeof(struct bt_node));
+	*nb -= 1;
+}
+
+static size_t bt_branch_node(char *buf, const char *k, size_t klen,
+			     uint64_t child)
+{
+	uint16_t len = klen;
+
+	memcpy(buf, &len, sizeof(len));
+	memcpy(buf + 2, &child, sizeof(child));
+	memcpy(buf + BT_BRANCH_HDR, k, klen);
+
+	return BT_BRANCH_HDR + klen;
+}
+
+/* Large values go to overflow pages of their own */
+static int bt_leaf_node(struct bt_txn *txn, char *buf, const char *k,
+			size_t klen, const char *v, size_t vlen, size_t *len)
+{
+	uint16_t kl = klen;
+	uint32_t vl = vlen;
+	uint64_t pgno;
+	char *run;
+
+	memcpy(buf, &kl, sizeof(kl));
+	memcpy(buf + 3, &vl, sizeof(vl));
+	memcpy(buf + BT_LEAF_HDR, k, klen);
+
+	if (vlen <= BT_MAX_INLINE) {
+		buf[2] = 0;
+		memcpy(buf + BT_LEAF_HDR + klen, v, vlen);
+		*len = BT_LEAF_HDR + klen + vlen;
+		return 0;
+	}
+
+	run = bt_alloc(txn, bt_ovf_pages(vlen), &pgno);
+	if (run == NULL)
+		return -ENOMEM;
+	((struct bt_page *)run)->flags = BT_OVERFLOW;
+	memcpy(run + BT_HDR, v, vlen);
+
+	buf[2] = 1;
+	memcpy(buf + BT_LEAF_HDR + klen, &pgno, sizeof(pgno));
+	*len = BT_LEAF_HDR + klen + sizeof(pgno);
+	return 0;
+}
+
+static void bt_drop_value(struct bt_txn *txn, const char *node)
+{
+	size_t klen = bt_get16(node);
+
+	if (node[2])
+		bt_drop(txn, bt_get64(node + BT_LEAF_HDR + klen),
+			bt_ovf_pages(bt_get32(node + 3)));
+}
+
+/* Sets k to v in the subtree at pgno, or deletes k if v is NULL */
+static int bt_modify(struct bt_txn *txn, uint64_t pgno, const char *k,
+		     size_t klen, const char *v, size_t vlen,
+		     struct bt_result *res)
+{
+	const char *page = bt_page_get(txn, pgno);
+	const struct bt_page *hdr = (const struct bt_page *)page;
+	struct bt_result *sub = NULL;
+	struct bt_node *nodes;
+	char buf[BT_NODE_MAX];
+	char rbuf[BT_BRANCH_HDR + BT_MAX_KEY];
+	const char *node;
+	size_t len;
+	bool exact;
+	uint64_t child;
+	int nb;
+	int i;
+	int rc;
+
+	memset(res, 0, offsetof(struct bt_result, key));
+	res->pgno = pgno;
+
+	if (hdr->flags & BT_LEAF) {
+		i = bt_search(page, k, klen, &exact);
+		if (v == NULL && !exact)
+			return 0;
+
+		nodes = bt_nodes(page, &nb);
+		if (nodes == NULL)
+			return -ENOMEM;
+
+		if (exact) {
+			bt_drop_value(txn, nodes[i].p);
+			bt_nodes_remove(nodes, &nb, i);
+		}
+
+		if (v != NULL) {
+			rc = bt_leaf_node(txn, buf, k, klen, v, vlen, &len);
+			if (rc != 0) {
+				free(nodes);
+				return rc;
+			}
+			bt_nodes_insert(nodes, &nb, i, buf, len);
+		}
+
+		rc = bt_rewrite(txn, pgno, BT_LEAF, nodes, nb, res);
+		free(nodes);
+		return rc;
+	}
+
+	i = bt_branch_index(page, k, klen);
+	node = bt_node(page, i);
+	child = bt_node_child(node);
+
+	sub = malloc(sizeof(struct bt_result));
+	if (sub == NULL)
+		return -ENOMEM;
+
+	rc = bt_modify(txn, child, k, klen, v, vlen, sub);
+	if (rc != 0 || !sub->changed ||
+	    (sub->pgno == child && sub->right == 0)) {
+		res->changed = sub->changed;
+		free(sub);
+		return rc;
+	}
+
+	/* The child was copied, split or removed: so is this page */
+	nodes = bt_nodes(page, &nb);
+	if (nodes == NULL) {
+		free(sub);
+		return -ENOMEM;
+	}
+
+	if (sub->pgno == 0)
+		bt_nodes_remove(nodes, &nb, i);
+	else if (sub->pgno != child) {
+		len = bt_branch_node(buf, bt_node_key(page, node),
+				     bt_get16(node), sub->pgno);
+		nodes[i].p = buf;
+		nodes[i].len = len;
+	}
+
+	if (sub->right != 0) {
+		len = bt_branch_node(rbuf, sub->key, sub->klen, sub->right);
+		bt_nodes_insert(nodes, &nb, i + 1, rbuf, len);
+	}
+
+	rc = bt_rewrite(txn, pgno, BT_BRANCH, nodes, nb, res);
+	free(nodes);
+	free(sub);
+	return rc;
+}
+
+static int bt_txn_modify(struct bt_txn *txn, const char *k, size_t klen,
+			 const char *v, size_t vlen)
+{
+	struct bt_result *res;
+	struct bt_node nodes[2];
+	char lbuf[BT_BRANCH_HDR];
+	char rbuf[BT_BRANCH_HDR + BT_MAX_KEY];
+	const char *page;
+	char *root;
+	uint64_t pgno;
+	int rc;
+
+	if (klen > BT_MAX_KEY)
+		return -EINVAL;
+
+	if (txn->root == 0) {
+		if (v == NULL)
+			return 0;
+
+		/* The first key makes a leaf of its own */
+		root = bt_alloc(txn, 1, &txn->root);
+		if (root == NULL)
+			return -ENOMEM;
+		rc = bt_leaf_node(txn, rbuf, k, klen, v, vlen, &nodes[0].len);
+		if (rc != 0)
+			return rc;
+		nodes[0].p = rbuf;
+		bt_fill(root, BT_LEAF, nodes, 1);
+		return 0;
+	}
+
+	res = malloc(sizeof(struct bt_result));
+	if (res == NULL)
+		return -ENOMEM;
+
+	rc = bt_modify(txn, txn->root, k, klen, v, vlen, res);
+	if (rc != 0 || !res->changed) {
+		free(res);
+		return rc;
+	}
+	txn->root = res->pgno;
+
+	/* The root split: a new one gets both halves */
+	if (res->right != 0) {
+		nodes[0].p = lbuf;
+		nodes[0].len = bt_branch_node(lbuf, NULL, 0, res->pgno);
+		nodes[1].p = rbuf;
+		nodes[1].len = bt_branch_node(rbuf, res->key, res->klen,
+					      res->right);
+		root = bt_alloc(txn, 1, &txn->root);
+		if (root == NULL) {
+			free(res);
+			return -ENOMEM;
+		}
+		bt_fill(root, BT_BRANCH, nodes, 2);
+	}
+	free(res);
+
+	/* A root with a single child is useless */
+	while (txn->root != 0) {
+		page = bt_page_get(txn, txn->root);
+		if (!(((const struct bt_page *)page)->flags & BT_BRANCH) ||
+		    ((const struct bt_page *)page)->nkeys > 1)
+			break;
+		pgno = bt_node_child(bt_node(page, 0));
+		bt_drop(txn, txn->root, 1);
+		txn->root = pgno;
+	}
+
+	return 0;
+}
+
+static const char *bt_lookup(struct bt_txn *txn, uint64_t root,
+			     const char *k, size_t klen)
+{
+	const char *page;
+	bool exact;
+	int i;
+
+	if (root == 0 || klen > BT_MAX_KEY)
+		return NULL;
+
+	page = bt_page_get(txn, root);
+	while (((const struct bt_page *)page)->flags & BT_BRANCH) {
+		i = bt_branch_index(page, k, klen);
+		page = bt_page_get(txn, bt_node_child(bt_node(page, i)));
+	}
+
+	i = bt_search(page, k, klen, &exact);
+	return exact ? bt_node(page, i) : NULL;
+}
+
+static const char *bt_value(struct bt_txn *txn, const char *node,
+			    size_t *vlen)
+{
+	size_t klen = bt_get16(node);
+
+	*vlen = bt_get32(node + 3);
+	if (!node[2])
+		return node + BT_LEAF_HDR + klen;
+
+	return bt_page_get(txn, bt_get64(node + BT_LEAF_HDR + klen)) + BT_HDR;
+}
+
+static void bt_meta_crc(struct bt_meta *meta)
+{
+	meta->crc = 0;
+	meta->crc = kvstore_crc((char *)meta, sizeof(struct bt_meta));
+}
+
+static int bt_pwrite(int fd, const char *buf, size_t len, off_t off)
+{
+	ssize_t rc;
+
+	while (len > 0) {
+		rc = pwrite(fd, buf, len, off);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += rc;
+		len -= rc;
+		off += rc;
+	}
+
+	return 0;
+}
+
+static int bt_write_meta(int fd, struct bt_meta *meta)
+{
+	bt_meta_crc(meta);
+	return bt_pwrite(fd, (char *)meta, sizeof(struct bt_meta),
+			 (meta->txnid & 1) * BT_PAGE);
+}
+
+/* Called with wlock held: the writer is the only one to move the map */
+static int bt_map(size_t size)
+{
+	size_t map_size = MAX(bt.map_size, BT_MAP_MIN);
+	char *map;
+
+	while (map_size < size)
+		map_size *= 2;
+
+	if (bt.map != NULL && map_size == bt.map_size)
+		return 0;
+
+	pthread_rwlock_wrlock(&bt.lock);
+	if (bt.map == NULL)
+		map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, bt.fd, 0);
+	else
+		map = mremap(bt.map, bt.map_size, map_size, MREMAP_MAYMOVE);
+	if (map != MAP_FAILED) {
+		bt.map = map;
+		bt.map_size = map_size;
+	}
+	pthread_rwlock_unlock(&bt.lock);
+
+	return (map == MAP_FAILED) ? -errno : 0;
+}
+
+static void bt_txn_free(struct bt_txn *txn)
+{
+	size_t i;
+
+	for (i = 0; i < txn->next - txn->base; i++)
+		free(txn->pages[i]);
+	free(txn->pages);
+}
+
+static int bt_commit(struct bt_txn *txn)
+{
+	struct bt_meta meta;
+	uint64_t i;
+	uint32_t npages;
+
+	for (i = 0; i < txn->next - txn->base; i++) {
+		if (txn->pages[i] == NULL)
+			continue;
+		npages = ((struct bt_page *)txn->pages[i])->npages;
+		RC_WRAP(bt_pwrite, bt.fd, txn->pages[i], npages * BT_PAGE,
+			(txn->base + i) * BT_PAGE);
+	}
+
+	if (bt.sync && fdatasync(bt.fd) != 0)
+		return -errno;
+
+	meta = bt.meta;
+	meta.txnid += 1;
+	meta.root = txn->root;
+	meta.npages = txn->next;
+	meta.live += txn->alloc - txn->dropped - txn->freed;
+	RC_WRAP(bt_write_meta, bt.fd, &meta);
+	if (bt.sync && fdatasync(bt.fd) != 0)
+		return -errno;
+	bt.meta = meta;
+
+	RC_WRAP(bt_map, meta.npages * BT_PAGE);
+
+	/* The new tree is complete in the file before readers see it */
+	__atomic_store_n(&bt.root, meta.root, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/* Packing: the live tree is rewritten level by level, leaves first */
+struct bt_level {
+	int fd;
+	uint64_t next;
+	uint16_t flags;
+	char page[BT_PAGE];
+	char data[BT_PAGE];
+	struct bt_node nodes[BT_PAGE / BT_LEAF_HDR];
+	size_t used;
+	int nb;
+	char **keys;		/* first key of each page written */
+	uint16_t *klens;
+	uint64_t *pgnos;
+	size_t nb_pages;
+	size_t size;
+};
+
+static int bt_level_flush(struct bt_level *lvl)
+{
+	const char *node;
+	size_t klen;
+
+	if (lvl->nb == 0)
+		return 0;
+
+	if (lvl->nb_pages == lvl->size) {
+		lvl->size = lvl->size ? 2 * lvl->size : 64;
+		lvl->keys = realloc(lvl->keys, lvl->size * sizeof(char *));
+		lvl->klens = realloc(lvl->klens, lvl->size * sizeof(uint16_t));
+		lvl->pgnos = realloc(lvl->pgnos, lvl->size * sizeof(uint64_t));
+		if (!lvl->keys || !lvl->klens || !lvl->pgnos)
+			return -ENOMEM;
+	}
+
+	memset(lvl->page, 0, BT_PAGE);
+	bt_fill(lvl->page, lvl->flags, lvl->nodes, lvl->nb);
+	((struct bt_page *)lvl->page)->pgno = lvl->next;
+	((struct bt_page *)lvl->page)->npages = 1;
+
+	node = lvl->nodes[0].p;
+	klen = bt_get16(node);
+	lvl->keys[lvl->nb_pages] = malloc(klen ? klen : 1);
+	if (lvl->keys[lvl->nb_pages] == NULL)
+		return -ENOMEM;
+	memcpy(lvl->keys[lvl->nb_pages],
+	       node + ((lvl->flags & BT_LEAF) ? BT_LEAF_HDR : BT_BRANCH_HDR),
+	       klen);
+	lvl->klens[lvl->nb_pages] = klen;
+	lvl->pgnos[lvl->nb_pages] = lvl->next;
+	lvl->nb_pages += 1;
+
+	RC_WRAP(bt_pwrite, lvl->fd, lvl->page, BT_PAGE, lvl->next * BT_PAGE);
+	lvl->next += 1;
+	lvl->used = 0;
+	lvl->nb = 0;
+
+	return 0;
+}
+
+static int bt_level_add(struct bt_level *lvl, const char *node, size_t len)
+{
+	if (lvl->used + lvl->nb * sizeof(uint16_t) + len +
+	    sizeof(uint16_t) > BT_ROOM)
+		RC_WRAP(bt_level_flush, lvl);
+
+	memcpy(lvl->data + lvl->used, node, len);
+	lvl->nodes[lvl->nb].p = lvl->data + lvl->used;
+	lvl->nodes[lvl->nb].len = len;
+	lvl->used += len;
+	lvl->nb += 1;
+
+	return 0;
+}
+
+static void bt_level_free(struct bt_level *lvl)
+{
+	size_t i;
+
+	for (i = 0; i < lvl->nb_pages; i++)
+		free(lvl->keys[i]);
+	free(lvl->keys);
+	free(lvl->klens);
+	free(lvl->pgnos);
+	lvl->keys = NULL;
+	lvl->klens = NULL;
+	lvl->pgnos = NULL;
+	lvl->nb_pages = 0;
+	lvl->size = 0;
+}
+
+static int bt_pack_leaves(struct bt_level *lvl, uint64_t pgno)
+{
+	const char *page = bt_page_get(NULL, pgno);
+	const struct bt_page *hdr = (const struct bt_page *)page;
+	char buf[BT_NODE_MAX];
+	const char *node;
+	const char *run;
+	uint64_t ovf;
+	size_t klen;
+	size_t len;
+	uint32_t npages;
+	int i;
+
+	for (i = 0; i < hdr->nkeys; i++) {
+		node = bt_node(page, i);
+		if (hdr->flags & BT_BRANCH) {
+			RC_WRAP(bt_pack_leaves, lvl, bt_node_child(node));
+			continue;
+		}
+
+		len = bt_node_len(page, node);
+		memcpy(buf, node, len);
+
+		/* Overflow runs are copied right away, before the leaf */
+		if (node[2]) {
+			klen = bt_get16(node);
+			run = bt_page_get(NULL,
+					  bt_get64(node + BT_LEAF_HDR + klen));
+			npages = ((const struct bt_page *)run)->npages;
+			ovf = lvl->next;
+			RC_WRAP(bt_pwrite, lvl->fd, run, npages * BT_PAGE,
+				ovf * BT_PAGE);
+			RC_WRAP(bt_pwrite, lvl->fd, (char *)&ovf, sizeof(ovf),
+				ovf * BT_PAGE);
+			lvl->next += npages;
+			memcpy(buf + BT_LEAF_HDR + klen, &ovf, sizeof(ovf));
+		}
+
+		RC_WRAP(bt_level_add, lvl, buf, len);
+	}
+
+	return 0;
+}
+
+/* Called with wlock held. Readers go on with the old file meanwhile */
+static int bt_compact(void)
+{
+	struct bt_level *lvl;
+	struct bt_meta meta;
+	char tmp[MAXPATHLEN];
+	char path[MAXPATHLEN];
+	char buf[BT_BRANCH_HDR + BT_MAX_KEY];
+	char *old_map;
+	char *map;
+	size_t old_size;
+	size_t map_size;
+	size_t i;
+	int old_fd;
+	int dirfd;
+	int fd;
+	int rc;
+
+	snprintf(tmp, MAXPATHLEN, "%s/%s.tmp", bt.path, BT_FILE);
+	snprintf(path, MAXPATHLEN, "%s/%s", bt.path, BT_FILE);
+
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return -errno;
+
+	lvl = calloc(1, sizeof(struct bt_level));
+	if (lvl == NULL) {
+		close(fd);
+		unlink(tmp);
+		return -ENOMEM;
+	}
+	lvl->fd = fd;
+	lvl->next = 2;
+	lvl->flags = BT_LEAF;
+
+	memset(&meta, 0, sizeof(meta));
+	meta.magic = BT_MAGIC;
+	meta.version = BT_VERSION;
+	meta.page_size = BT_PAGE;
+	meta.txnid = bt.meta.txnid + 1;
+
+	rc = 0;
+	if (bt.meta.root != 0)
+		rc = bt_pack_leaves(lvl, bt.meta.root);
+	if (rc == 0)
+		rc = bt_level_flush(lvl);
+
+	/* Then each level of branches, up to a single page */
+	while (rc == 0 && lvl->nb_pages > 1) {
+		char **keys = lvl->keys;
+		uint16_t *klens = lvl->klens;
+		uint64_t *pgnos = lvl->pgnos;
+		size_t nb = lvl->nb_pages;
+
+		lvl->keys = NULL;
+		lvl->klens = NULL;
+		lvl->pgnos = NULL;
+		lvl->nb_pages = 0;
+		lvl->size = 0;
+		lvl->flags = BT_BRANCH;
+
+		for (i = 0; i < nb && rc == 0; i++)
+			rc = bt_level_add(lvl, buf,
+					  bt_branch_node(buf, keys[i],
+							 klens[i], pgnos[i]));
+		if (rc == 0)
+			rc = bt_level_flush(lvl);
+
+		for (i = 0; i < nb; i++)
+			free(keys[i]);
+		free(keys);
+		free(klens);
+		free(pgnos);
+	}
+
+	if (rc == 0) {
+		meta.root = lvl->nb_pages ? lvl->pgnos[0] : 0;
+		meta.npages = lvl->next;
+		meta.live = lvl->next;
+		rc = bt_write_meta(fd, &meta);
+	}
+	bt_level_free(lvl);
+	free(lvl);
+
+	/* The new file is mapped before it replaces the old one, so that
+	 * nothing fails once it did */
+	map_size = BT_MAP_MIN;
+	while (map_size < meta.npages * BT_PAGE)
+		map_size *= 2;
+	map = MAP_FAILED;
+	if (rc == 0 && fsync(fd) != 0)
+		rc = -errno;
+	if (rc == 0) {
+		map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED)
+			rc = -errno;
+	}
+	if (rc == 0 && rename(tmp, path) != 0)
+		rc = -errno;
+	if (rc != 0) {
+		if (map != MAP_FAILED)
+			munmap(map, map_size);
+		close(fd);
+		unlink(tmp);
+		return rc;
+	}
+
+	dirfd = open(bt.path, O_RDONLY | O_DIRECTORY);
+	if (dirfd >= 0) {
+		fsync(dirfd);
+		close(dirfd);
+	}
+
+	pthread_rwlock_wrlock(&bt.lock);
+	old_map = bt.map;
+	old_size = bt.map_size;
+	old_fd = bt.fd;
+	bt.fd = fd;
+	bt.map = map;
+	bt.map_size = map_size;
+	bt.meta = meta;
+	bt.root = meta.root;
+	pthread_rwlock_unlock(&bt.lock);
+
+	munmap(old_map, old_size);
+	close(old_fd);
+
+	return 0;
+}
+
+static int bt_apply_locked(kvstore_rec_t *recs, int nb_recs)
+{
+	struct bt_txn txn;
+	int rc = 0;
+	int i;
+
+	memset(&txn, 0, sizeof(txn));
+	txn.root = bt.meta.root;
+	txn.base = bt.meta.npages;
+	txn.next = txn.base;
+
+	for (i = 0; i < nb_recs && rc == 0; i++)
+		rc = bt_txn_modify(&txn, recs[i].k, recs[i].klen,
+				   recs[i].v, recs[i].vlen);
+
+	if (rc == 0)
+		rc = bt_commit(&txn);
+	bt_txn_free(&txn);
+	if (rc != 0)
+		return rc;
+
+	if (bt.meta.npages > 2 * bt.meta.live + BT_COMPACT_PAGES) {
+		rc = bt_compact();
+		if (rc != 0)
+			fprintf(stderr, "kvstore_btree: packing failed: %d\n",
+				rc);
+	}
+
+	return 0;
+}
+
+static int bt_open(struct collection_item *cfg_items)
+{
+	struct collection_item *item = NULL;
+	struct bt_meta metas[2];
+	char path[MAXPATHLEN];
+	struct stat st;
+	int rc;
+	int i;
+
+	bt.sync = true;
+
+	rc = get_config_item("kvsal_embedded", "path", cfg_items, &item);
+	if (rc != 0)
+		return -rc;
+	if (item == NULL) {
+		fprintf(stderr,
+			"kvstore_btree: [kvsal_embedded] path missing\n");
+		return -EINVAL;
+	}
+	strncpy(bt.path, get_const_string_config_value(item, NULL),
+		BT_PATHLEN - 1);
+
+	item = NULL;
+	rc = get_config_item("kvsal_embedded", "sync", cfg_items, &item);
+	if (rc != 0)
+		return -rc;
+	if (item != NULL)
+		bt.sync = get_bool_config_value(item, true, NULL);
+
+	if (mkdir(bt.path, 0700) != 0 && errno != EEXIST)
+		return -errno;
+
+	snprintf(path, MAXPATHLEN, "%s/%s", bt.path, BT_FILE);
+	bt.fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (bt.fd < 0)
+		return -errno;
+	if (fstat(bt.fd, &st) != 0)
+		return -errno;
+
+	if (st.st_size == 0) {
+		memset(&bt.meta, 0, sizeof(bt.meta));
+		bt.meta.magic = BT_MAGIC;
+		bt.meta.version = BT_VERSION;
+		bt.meta.page_size = BT_PAGE;
+		bt.meta.txnid = 0;
+		bt.meta.npages = 2;
+		bt.meta.live = 2;
+		RC_WRAP(bt_write_meta, bt.fd, &bt.meta);
+		if (ftruncate(bt.fd, 2 * BT_PAGE) != 0 || fsync(bt.fd) != 0)
+			return -errno;
+	} else {
+		/* The last meta page that was completely written wins */
+		memset(&bt.meta, 0, sizeof(bt.meta));
+		for (i = 0; i < 2; i++) {
+			if (pread(bt.fd, &metas[i], sizeof(struct bt_meta),
+				  i * BT_PAGE) != sizeof(struct bt_meta))
+				continue;
+			if (metas[i].magic != BT_MAGIC ||
+			    metas[i].version != BT_VERSION ||
+			    metas[i].page_size != BT_PAGE)
+				continue;
+			rc = metas[i].crc;
+			bt_meta_crc(&metas[i]);
+			if (metas[i].crc != (uint32_t)rc)
+				continue;
+			if (bt.meta.magic == 0 ||
+			    metas[i].txnid > bt.meta.txnid)
+				bt.meta = metas[i];
+		}
+
+		if (bt.meta.magic == 0) {
+			fprintf(stderr, "kvstore_btree: %s is corrupted\n",
+				path);
+			return -EIO;
+		}
+
+		/* Drop what a crashed transaction left behind */
+		if (st.st_size > bt.meta.npages * BT_PAGE &&
+		    ftruncate(bt.fd, bt.meta.npages * BT_PAGE) != 0)
+			return -errno;
+	}
+
+	bt.root = bt.meta.root;
+	return bt_map(bt.meta.npages * BT_PAGE);
+}
+
+static int bt_close(void)
+{
+	if (bt.map != NULL)
+		munmap(bt.map, bt.map_size);
+	if (bt.fd >= 0)
+		close(bt.fd);
+
+	bt.map = NULL;
+	bt.map_size = 0;
+	bt.fd = -1;
+
+	return 0;
+}
+
+static int bt_get(const char *k, size_t klen, char *v, size_t *vlen)
+{
+	const char *node;
+	const char *val;
+	size_t len;
+	int rc = 0;
+
+	pthread_rwlock_rdlock(&bt.lock);
+	node = bt_lookup(NULL, __atomic_load_n(&bt.root, __ATOMIC_ACQUIRE),
+			 k, klen);
+	if (node == NULL)
+		rc = -ENOENT;
+	else {
+		val = bt_value(NULL, node, &len);
+		if (len > *vlen)
+			rc = -ENOBUFS;
+		else
+			memcpy(v, val, len);
+		*vlen = len;
+	}
+	pthread_rwlock_unlock(&bt.lock);
+
+	return rc;
+}
+
+static int bt_apply(kvstore_rec_t *recs, int nb_recs)
+{
+	int rc;
+
+	if (nb_recs == 0)
+		return 0;
+
+	pthread_mutex_lock(&bt.wlock);
+	rc = bt_apply_locked(recs, nb_recs);
+	pthread_mutex_unlock(&bt.wlock);
+
+	return rc;
+}
+
+static int bt_incr(const char *k, size_t klen, unsigned long long by,
+		   unsigned long long *v)
+{
+	kvstore_rec_t rec;
+	const char *node;
+	const char *val;
+	unsigned long long cur = 0;
+	char buf[32];
+	size_t len;
+	int rc;
+
+	/* Writers are held off: the value read stays current */
+	pthread_mutex_lock(&bt.wlock);
+	node = bt_lookup(NULL, bt.meta.root, k, klen);
+	if (node != NULL) {
+		val = bt_value(NULL, node, &len);
+		if (len >= sizeof(buf)) {
+			pthread_mutex_unlock(&bt.wlock);
+			return -EINVAL;
+		}
+		memcpy(buf, val, len);
+		buf[len] = '\0';
+		cur = strtoull(buf, NULL, 10);
+	}
+
+	cur += by;
+	rec.k = k;
+	rec.klen = klen;
+	rec.v = buf;
+	rec.vlen = snprintf(buf, sizeof(buf), "%llu", cur);
+
+	rc = bt_apply_locked(&rec, 1);
+	pthread_mutex_unlock(&bt.wlock);
+
+	if (rc == 0)
+		*v = cur;
+	return rc;
+}
+
+static int bt_setrange(const char *k, size_t klen, size_t off,
+		       const char *v, size_t *vlen)
+{
+	kvstore_rec_t rec;
+	const char *node;
+	const char *val = NULL;
+	size_t len = 0;
+	char *buf;
+	int rc;
+
+	/* Writers are held off: the value patched stays current */
+	pthread_mutex_lock(&bt.wlock);
+	node = bt_lookup(NULL, bt.meta.root, k, klen);
+	if (node != NULL)
+		val = bt_value(NULL, node, &len);
+
+	rec.vlen = off + *vlen;
+	if (len > rec.vlen)
+		rec.vlen = len;
+
+	buf = calloc(1, rec.vlen);
+	if (buf == NULL) {
+		pthread_mutex_unlock(&bt.wlock);
+		return -ENOMEM;
+	}
+	if (val != NULL)
+		memcpy(buf, val, len);
+	memcpy(buf + off, v, *vlen);
+
+	rec.k = k;
+	rec.klen = klen;
+	rec.v = buf;
+
+	rc = bt_apply_locked(&rec, 1);
+	pthread_mutex_unlock(&bt.wlock);
+
+	free(buf);
+	if (rc == 0)
+		*vlen = rec.vlen;
+	return rc;
+}
+
+/* Returns 1 once past the keys starting with prefix, or if cb said so */
+static int bt_scan_page(uint64_t pgno, const char *prefix, size_t plen,
+			kvstore_scan_cb_t cb, void *arg)
+{
+	const char *page = bt_page_get(NULL, pgno);
+	const struct bt_page *hdr = (const struct bt_page *)page;
+	const char *node;
+	const char *k;
+	size_t klen;
+	bool exact;
+	int i;
+
+	if (hdr->flags & BT_BRANCH) {
+		for (i = bt_branch_index(page, prefix, plen); i < hdr->nkeys;
+		     i++)
+			if (bt_scan_page(bt_node_child(bt_node(page, i)),
+					 prefix, plen, cb, arg))
+				return 1;
+		return 0;
+	}
+
+	for (i = bt_search(page, prefix, plen, &exact); i < hdr->nkeys; i++) {
+		node = bt_node(page, i);
+		k = bt_node_key(page, node);
+		klen = bt_get16(node);
+		if (klen < plen || memcmp(k, prefix, plen) != 0)
+			return 1;
+		if (cb(k, klen, arg) != 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int bt_scan(const char *prefix, size_t plen, kvstore_scan_cb_t cb,
+		   void *arg)
+{
+	uint64_t root;
+
+	pthread_rwlock_rdlock(&bt.lock);
+	root = __atomic_load_n(&bt.root, __ATOMIC_ACQUIRE);
+	if (root != 0)
+		bt_scan_page(root, prefix, plen, cb, arg);
+	pthread_rwlock_unlock(&bt.lock);
+
+	return 0;
+}
+
+struct kvstore kvstore_btree = {
+	.name = "btree",
+	.open = bt_open,
+	.close = bt_close,
+	.get = bt_get,
+	.apply = bt_apply,
+	.incr = bt_incr,
+	.setrange = bt_setrange,
+	.scan = bt_scan,
+};
@@ -0,0 +1,527 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) CEA, 2016
+ * Author: Philippe Deniel  philippe.deniel@cea.fr
+ *
+ * contributeur : Philippe DENIEL   philippe.deniel@cea.fr
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+
+/* kvstore_mem.c
+ * KVSAL: volatile in-memory store, for tests and benchmarks
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <ini_config.h>
+#include "kvstore.h"
+
+/* Records are found by key in a hash table, and listed in key order by a
+ * skip list threaded through the same entries. The table's buckets are
+ * guarded by a fixed set of striped locks: threads working on different
+ * keys seldom wait for each other. The skip list has a lock of its own,
+ * only taken to add or remove a key, and to scan.
+ *
+ * apply locks the stripes of all its records (in order, so that appliers
+ * don't deadlock) before changing any of them: readers see all or none of
+ * the changes. Locks are always taken stripes first, then the index */
+
+#define MEM_STRIPES 1024
+#define MEM_BUCKETS (256 * 1024)
+#define MEM_MAXLEVEL 24
+
+struct mem_entry {
+	char *k;
+	size_t klen;
+	char *v;
+	size_t vlen;
+	uint64_t hash;
+	struct mem_entry *chain;
+	int level;
+	struct mem_entry *next[];
+};
+
+static struct mem_store {
+	pthread_rwlock_t stripes[MEM_STRIPES];
+	pthread_rwlock_t index;
+	struct mem_entry **buckets;
+	size_t nb_buckets;
+	struct mem_entry *head;
+	int level;
+	unsigned int seed;
+} mem;
+
+static uint64_t mem_hash(const char *k, size_t klen)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;	/* FNV-1a */
+	size_t i;
+
+	for (i = 0; i < klen; i++) {
+		h ^= (uint8_t)k[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+static int mem_stripe(uint64_t hash)
+{
+	return (hash & (mem.nb_buckets - 1)) & (MEM_STRIPES - 1);
+}
+
+static int mem_keycmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+	int rc;
+
+	rc = memcmp(a, b, MIN(alen, blen));
+	if (rc != 0)
+		return rc;
+
+	return (alen > blen) - (alen < blen);
+}
+
+/* Called with the key's stripe locked */
+static struct mem_entry *mem_lookup(const char *k, size_t klen,
+				    uint64_t hash)
+{
+	struct mem_entry *e;
+
+	for (e = mem.buckets[hash & (mem.nb_buckets - 1)]; e; e = e->chain)
+		if (e->hash == hash && e->klen == klen &&
+		    !memcmp(e->k, k, klen))
+			return e;
+
+	return NULL;
+}
+
+/* Sets update[i] to the last entry before k at level i, returns the first
+ * entry whose key is not lower than k */
+static struct mem_entry *mem_find(const char *k, size_t klen,
+				  struct mem_entry **update)
+{
+	struct mem_entry *x = mem.head;
+	int i;
+
+	for (i = mem.level - 1; i >= 0; i--) {
+		while (x->next[i] != NULL &&
+		       mem_keycmp(x->next[i]->k, x->next[i]->klen,
+				  k, klen) < 0)
+			x = x->next[i];
+		if (update)
+			update[i] = x;
+	}
+
+	return x->next[0];
+}
+
+static struct mem_entry *mem_new_entry(const char *k, size_t klen)
+{
+	struct mem_entry *e;
+	int level = 1;
+
+	while (level < MEM_MAXLEVEL && (random() & 3) == 0)
+		level++;
+
+	e = calloc(1, sizeof(struct mem_entry) +
+		      level * sizeof(struct mem_entry *));
+	if (e == NULL)
+		return NULL;
+
+	e->k = malloc(klen ? klen : 1);
+	if (e->k == NULL) {
+		free(e);
+		return NULL;
+	}
+	memcpy(e->k, k, klen);
+	e->klen = klen;
+	e->hash = mem_hash(k, klen);
+	e->level = level;
+
+	return e;
+}
+
+static void mem_free_entry(struct mem_entry *e)
+{
+	free(e->k);
+	free(e->v);
+	free(e);
+}
+
+/* Called with the entry's stripe and the index write locked */
+static void mem_insert(struct mem_entry *e)
+{
+	struct mem_entry *update[MEM_MAXLEVEL];
+	struct mem_entry **bucket;
+	int i;
+
+	bucket = &mem.buckets[e->hash & (mem.nb_buckets - 1)];
+	e->chain = *bucket;
+	*bucket = e;
+
+	mem_find(e->k, e->klen, update);
+	for (i = mem.level; i < e->level; i++)
+		update[i] = mem.head;
+	if (e->level > mem.level)
+		mem.level = e->level;
+
+	for (i = 0; i < e->level; i++) {
+		e->next[i] = update[i]->next[i];
+		update[i]->next[i] = e;
+	}
+}
+
+/* Called with the entry's stripe and the index write locked */
+static void mem_remove(struct mem_entry *e)
+{
+	struct mem_entry *update[MEM_MAXLEVEL];
+	struct mem_entry **p;
+	int i;
+
+	for (p = &mem.buckets[e->hash & (mem.nb_buckets - 1)]; *p != e;
+	     p = &(*p)->chain)
+		;
+	*p = e->chain;
+
+	mem_find(e->k, e->klen, update);
+	for (i = 0; i < e->level; i++)
+		update[i]->next[i] = e->next[i];
+
+	while (mem.level > 1 && mem.head->next[mem.level - 1] == NULL)
+		mem.level--;
+
+	mem_free_entry(e);
+}
+
+static int mem_open(struct collection_item *cfg_items)
+{
+	struct collection_item *item = NULL;
+	size_t nb = MEM_BUCKETS;
+	int rc;
+	int i;
+
+	rc = get_config_item("kvsal_embedded", "buckets", cfg_items, &item);
+	if (rc != 0)
+		return -rc;
+	if (item != NULL)
+		nb = get_int_config_value(item, 0, MEM_BUCKETS, NULL);
+
+	/* A power of 2, with each stripe having its own buckets */
+	mem.nb_buckets = MEM_STRIPES;
+	while (mem.nb_buckets < nb)
+		mem.nb_buckets <<= 1;
+
+	mem.buckets = calloc(mem.nb_buckets, sizeof(struct mem_entry *));
+	if (mem.buckets == NULL)
+		return -ENOMEM;
+
+	mem.head = calloc(1, sizeof(struct mem_entry) +
+			     MEM_MAXLEVEL * sizeof(struct mem_entry *));
+	if (mem.head == NULL)
+		return -ENOMEM;
+	mem.level = 1;
+
+	for (i = 0; i < MEM_STRIPES; i++)
+		pthread_rwlock_init(&mem.stripes[i], NULL);
+	pthread_rwlock_init(&mem.index, NULL);
+
+	return 0;
+}
+
+static int mem_close(void)
+{
+	struct mem_entry *x;
+	struct mem_entry *next;
+
+	if (mem.head != NULL) {
+		for (x = mem.head->next[0]; x != NULL; x = next) {
+			next = x->next[0];
+			mem_free_entry(x);
+		}
+		free(mem.head);
+	}
+	free(mem.buckets);
+
+	mem.head = NULL;
+	mem.buckets = NULL;
+
+	return 0;
+}
+
+static int mem_get(const char *k, size_t klen, char *v, size_t *vlen)
+{
+	struct mem_entry *e;
+	uint64_t hash = mem_hash(k, klen);
+	int stripe = mem_stripe(hash);
+	int rc = 0;
+
+	pthread_rwlock_rdlock(&mem.stripes[stripe]);
+	e = mem_lookup(k, klen, hash);
+	if (e == NULL)
+		rc = -ENOENT;
+	else {
+		if (e->vlen > *vlen)
+			rc = -ENOBUFS;
+		else
+			memcpy(v, e->v, e->vlen);
+		*vlen = e->vlen;
+	}
+	pthread_rwlock_unlock(&mem.stripes[stripe]);
+
+	return rc;
+}
+
+static int mem_intcmp(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* Everything that may fail is allocated before any record is changed, so
+ * that an apply is never left half done */
+struct mem_prep {
+	uint64_t hash;
+	char *v;		/* copy of the value */
+	struct mem_entry *e;	/* in case the key is new */
+};
+
+static int mem_apply(kvstore_rec_t *recs, int nb_recs)
+{
+	struct mem_prep *prep;
+	struct mem_entry *e;
+	int *stripes;
+	int nb_stripes = 0;
+	bool structural = false;
+	int rc = 0;
+	int i;
+
+	if (nb_recs == 0)
+		return 0;
+
+	prep = calloc(nb_recs, sizeof(struct mem_prep));
+	stripes = malloc(nb_recs * sizeof(int));
+	if (prep == NULL || stripes == NULL) {
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nb_recs; i++) {
+		prep[i].hash = mem_hash(recs[i].k, recs[i].klen);
+		stripes[i] = mem_stripe(prep[i].hash);
+		if (recs[i].v == NULL)
+			continue;
+
+		prep[i].v = malloc(recs[i].vlen ? recs[i].vlen : 1);
+		prep[i].e = mem_new_entry(recs[i].k, recs[i].klen);
+		if (prep[i].v == NULL || prep[i].e == NULL) {
+			rc = -ENOMEM;
+			goto out;
+		}
+		memcpy(prep[i].v, recs[i].v, recs[i].vlen);
+	}
+
+	qsort(stripes, nb_recs, sizeof(int), mem_intcmp);
+	for (i = 0; i < nb_recs; i++)
+		if (i == 0 || stripes[i] != stripes[nb_stripes - 1])
+			stripes[nb_stripes++] = stripes[i];
+
+	for (i = 0; i < nb_stripes; i++)
+		pthread_rwlock_wrlock(&mem.stripes[stripes[i]]);
+
+	/* The index is only needed if a key comes or goes */
+	for (i = 0; i < nb_recs && !structural; i++)
+		if (recs[i].v == NULL ||
+		    mem_lookup(recs[i].k, recs[i].klen, prep[i].hash) == NULL)
+			structural = true;
+	if (structural)
+		pthread_rwlock_wrlock(&mem.index);
+
+	for (i = 0; i < nb_recs; i++) {
+		e = mem_lookup(recs[i].k, recs[i].klen, prep[i].hash);
+		if (recs[i].v == NULL) {
+			if (e != NULL)
+				mem_remove(e);
+			continue;
+		}
+
+		if (e == NULL) {
+			e = prep[i].e;
+			prep[i].e = NULL;
+			mem_insert(e);
+		}
+		free(e->v);
+		e->v = prep[i].v;
+		e->vlen = recs[i].vlen;
+		prep[i].v = NULL;
+	}
+
+	if (structural)
+		pthread_rwlock_unlock(&mem.index);
+	for (i = nb_stripes - 1; i >= 0; i--)
+		pthread_rwlock_unlock(&mem.stripes[stripes[i]]);
+
+out:
+	if (prep != NULL)
+		for (i = 0; i < nb_recs; i++) {
+			free(prep[i].v);
+			if (prep[i].e)
+				mem_free_entry(prep[i].e);
+		}
+	free(prep);
+	free(stripes);
+
+	return rc;
+}
+
+static int mem_incr(const char *k, size_t klen, unsigned long long by,
+		    unsigned long long *v)
+{
+	struct mem_entry *e;
+	uint64_t hash = mem_hash(k, klen);
+	int stripe = mem_stripe(hash);
+	unsigned long long val = 0;
+	char buf[32];
+	char *nv;
+	int len;
+	int rc = 0;
+
+	pthread_rwlock_wrlock(&mem.stripes[stripe]);
+	e = mem_lookup(k, klen, hash);
+	if (e != NULL) {
+		if (e->vlen >= sizeof(buf)) {
+			rc = -EINVAL;
+			goto out;
+		}
+		memcpy(buf, e->v, e->vlen);
+		buf[e->vlen] = '\0';
+		val = strtoull(buf, NULL, 10);
+	}
+
+	val += by;
+	len = snprintf(buf, sizeof(buf), "%llu", val);
+	nv = malloc(len);
+	if (nv == NULL) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	memcpy(nv, buf, len);
+
+	if (e == NULL) {
+		e = mem_new_entry(k, klen);
+		if (e == NULL) {
+			free(nv);
+			rc = -ENOMEM;
+			goto out;
+		}
+		pthread_rwlock_wrlock(&mem.index);
+		mem_insert(e);
+		pthread_rwlock_unlock(&mem.index);
+	}
+	free(e->v);
+	e->v = nv;
+	e->vlen = len;
+	*v = val;
+
+out:
+	pthread_rwlock_unlock(&mem.stripes[stripe]);
+	return rc;
+}
+
+static int mem_setrange(const char *k, size_t klen, size_t off,
+			const char *v, size_t *vlen)
+{
+	struct mem_entry *e;
+	uint64_t hash = mem_hash(k, klen);
+	int stripe = mem_stripe(hash);
+	size_t len = off + *vlen;
+	char *nv;
+	int rc = 0;
+
+	pthread_rwlock_wrlock(&mem.stripes[stripe]);
+	e = mem_lookup(k, klen, hash);
+	if (e != NULL && e->vlen > len)
+		len = e->vlen;
+
+	nv = calloc(1, len);
+	if (nv == NULL) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	if (e != NULL)
+		memcpy(nv, e->v, e->vlen);
+	memcpy(nv + off, v, *vlen);
+
+	if (e == NULL) {
+		e = mem_new_entry(k, klen);
+		if (e == NULL) {
+			free(nv);
+			rc = -ENOMEM;
+			goto out;
+		}
+		pthread_rwlock_wrlock(&mem.index);
+		mem_insert(e);
+		pthread_rwlock_unlock(&mem.index);
+	}
+	free(e->v);
+	e->v = nv;
+	e->vlen = len;
+	*vlen = len;
+
+out:
+	pthread_rwlock_unlock(&mem.stripes[stripe]);
+	return rc;
+}
+
+static int mem_scan(const char *prefix, size_t plen, kvstore_scan_cb_t cb,
+		    void *arg)
+{
+	struct mem_entry *x;
+
+	pthread_rwlock_rdlock(&mem.index);
+	for (x = mem_find(prefix, plen, NULL); x != NULL; x = x->next[0]) {
+		if (x->klen < plen || memcmp(x->k, prefix, plen) != 0)
+			break;
+		if (cb(x->k, x->klen, arg) != 0)
+			break;
+	}
+	pthread_rwlock_unlock(&mem.index);
+
+	return 0;
+}
+
+struct kvstore kvstore_mem = {
+	.name = "memory",
+	.open = mem_open,
+	.close = mem_close,
+	.get = mem_get,
+	.apply = mem_apply,
+	.incr = mem_incr,
+	.setrange = mem_setrange,
+	.scan = mem_scan,
+};
@@ -0,0 +1,728 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) CEA, 2016
+ * Author: Philippe Deniel  philippe.deniel@cea.fr
+ *
+ * contributeur : Philippe DENIEL   philippe.deniel@cea.fr
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+
+/* kvstore_wal.c
+ * KVSAL: in-memory ordered store made durable by a write-ahead log
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <ini_config.h>
+#include "kvstore.h"
+
+/* Records are kept in memory in a skip list, sorted by key. Each call to
+ * apply is appended to the log as one frame, synced, then made visible. A
+ * frame is only replayed if complete, which makes a transaction atomic
+ * across a crash. Once the log grows past checkpoint_mb, the whole content
+ * is written to a snapshot and the log starts over.
+ *
+ * A frame is { magic, payload size, crc32 of payload } then a payload made
+ * of { op, key size, value size, key, value } items. Integers are in host
+ * order, the files are not meant to move to another architecture */
+
+#define WAL_MAGIC 0x4b56574cU	/* "KVWL" */
+#define WAL_OP_SET 1
+#define WAL_OP_DEL 2
+#define WAL_FILE "kvsal.wal"
+#define WAL_SNAPSHOT "kvsal.snap"
+#define WAL_CHECKPOINT_MB 64
+#define WAL_MAXLEVEL 24
+#define WAL_PATHLEN (MAXPATHLEN - 32)	/* leaves room for file names */
+
+struct wal_frame {
+	uint32_t magic;
+	uint32_t size;
+	uint32_t crc;
+};
+
+struct wal_item {
+	uint8_t op;
+	uint32_t klen;
+	uint32_t vlen;
+} __attribute__((packed));
+
+struct wal_node {
+	char *k;
+	size_t klen;
+	char *v;
+	size_t vlen;
+	int level;
+	struct wal_node *next[];
+};
+
+static struct wal_store {
+	pthread_rwlock_t lock;	/* readers vs the writer of the skip list */
+	pthread_mutex_t wlock;	/* serializes writers, held while logging */
+	struct wal_node *head;
+	int level;
+	unsigned int seed;
+	char path[WAL_PATHLEN];
+	int fd;
+	off_t size;
+	off_t checkpoint;
+	bool sync;
+} wal = {
+	.lock = PTHREAD_RWLOCK_INITIALIZER,
+	.wlock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+};
+
+static int wal_keycmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+	int rc;
+
+	rc = memcmp(a, b, MIN(alen, blen));
+	if (rc != 0)
+		return rc;
+
+	return (alen > blen) - (alen < blen);
+}
+
+/* Sets update[i] to the last node before k at level i, returns the first
+ * node whose key is not lower than k */
+static struct wal_node *wal_find(const char *k, size_t klen,
+				 struct wal_node **update)
+{
+	struct wal_node *x = wal.head;
+	int i;
+
+	for (i = wal.level - 1; i >= 0; i--) {
+		while (x->next[i] != NULL &&
+		       wal_keycmp(x->next[i]->k, x->next[i]->klen,
+				  k, klen) < 0)
+			x = x->next[i];
+		if (update)
+			update[i] = x;
+	}
+
+	return x->next[0];
+}
+
+static struct wal_node *wal_new_node(int level)
+{
+	return calloc(1, sizeof(struct wal_node) +
+			 level * sizeof(struct wal_node *));
+}
+
+/* Called with the skip list write locked */
+static int wal_mem_set(const char *k, size_t klen, const char *v,
+		       size_t vlen)
+{
+	struct wal_node *update[WAL_MAXLEVEL];
+	struct wal_node *x;
+	char *nv;
+	int level;
+	int i;
+
+	nv = malloc(vlen ? vlen : 1);
+	if (nv == NULL)
+		return -ENOMEM;
+	memcpy(nv, v, vlen);
+
+	x = wal_find(k, klen, update);
+	if (x != NULL && wal_keycmp(x->k, x->klen, k, klen) == 0) {
+		free(x->v);
+		x->v = nv;
+		x->vlen = vlen;
+		return 0;
+	}
+
+	level = 1;
+	while (level < WAL_MAXLEVEL && (rand_r(&wal.seed) & 3) == 0)
+		level++;
+
+	x = wal_new_node(level);
+	if (x == NULL) {
+		free(nv);
+		return -ENOMEM;
+	}
+
+	x->k = malloc(klen ? klen : 1);
+	if (x->k == NULL) {
+		free(nv);
+		free(x);
+		return -ENOMEM;
+	}
+	memcpy(x->k, k, klen);
+	x->klen = klen;
+	x->v = nv;
+	x->vlen = vlen;
+	x->level = level;
+
+	for (i = wal.level; i < level; i++)
+		update[i] = wal.head;
+	if (level > wal.level)
+		wal.level = level;
+
+	for (i = 0; i < level; i++) {
+		x->next[i] = update[i]->next[i];
+		update[i]->next[i] = x;
+	}
+
+	return 0;
+}
+
+/* Called with the skip list write locked */
+static void wal_mem_del(const char *k, size_t klen)
+{
+	struct wal_node *update[WAL_MAXLEVEL];
+	struct wal_node *x;
+	int i;
+
+	x = wal_find(k, klen, update);
+	if (x == NULL || wal_keycmp(x->k, x->klen, k, klen) != 0)
+		return;
+
+	for (i = 0; i < x->level; i++)
+		update[i]->next[i] = x->next[i];
+
+	while (wal.level > 1 && wal.head->next[wal.level - 1] == NULL)
+		wal.level--;
+
+	free(x->k);
+	free(x->v);
+	free(x);
+}
+
+static int wal_mem_apply(kvstore_rec_t *recs, int nb_recs)
+{
+	int rc = 0;
+	int i;
+
+	pthread_rwlock_wrlock(&wal.lock);
+	for (i = 0; i < nb_recs && rc == 0; i++) {
+		if (recs[i].v != NULL)
+			rc = wal_mem_set(recs[i].k, recs[i].klen,
+					 recs[i].v, recs[i].vlen);
+		else
+			wal_mem_del(recs[i].k, recs[i].klen);
+	}
+	pthread_rwlock_unlock(&wal.lock);
+
+	return rc;
+}
+
+static int wal_write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t rc;
+
+	while (len > 0) {
+		rc = write(fd, buf, len);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += rc;
+		len -= rc;
+	}
+
+	return 0;
+}
+
+/* Builds a frame holding recs, to be freed by the caller */
+static char *wal_encode(kvstore_rec_t *recs, int nb_recs, size_t *len)
+{
+	struct wal_frame *frame;
+	struct wal_item item;
+	char *buf;
+	char *p;
+	size_t size = 0;
+	int i;
+
+	for (i = 0; i < nb_recs; i++)
+		size += sizeof(struct wal_item) + recs[i].klen +
+			(recs[i].v ? recs[i].vlen : 0);
+
+	buf = malloc(sizeof(struct wal_frame) + size);
+	if (buf == NULL)
+		return NULL;
+
+	p = buf + sizeof(struct wal_frame);
+	for (i = 0; i < nb_recs; i++) {
+		item.op = recs[i].v ? WAL_OP_SET : WAL_OP_DEL;
+		item.klen = recs[i].klen;
+		item.vlen = recs[i].v ? recs[i].vlen : 0;
+		memcpy(p, &item, sizeof(struct wal_item));
+		p += sizeof(struct wal_item);
+		memcpy(p, recs[i].k, item.klen);
+		p += item.klen;
+		memcpy(p, recs[i].v, item.vlen);
+		p += item.vlen;
+	}
+
+	frame = (struct wal_frame *)buf;
+	frame->magic = WAL_MAGIC;
+	frame->size = size;
+	frame->crc = kvstore_crc(buf + sizeof(struct wal_frame), size);
+
+	*len = sizeof(struct wal_frame) + size;
+	return buf;
+}
+
+/* Replays the items of a frame's payload */
+static int wal_replay(const char *p, size_t size)
+{
+	struct wal_item item;
+	const char *end = p + size;
+	int rc;
+
+	while (p < end) {
+		if (end - p < sizeof(struct wal_item))
+			return -EIO;
+		memcpy(&item, p, sizeof(struct wal_item));
+		p += sizeof(struct wal_item);
+		if (end - p < (size_t)item.klen + item.vlen)
+			return -EIO;
+
+		if (item.op == WAL_OP_SET) {
+			rc = wal_mem_set(p, item.klen, p + item.klen,
+					 item.vlen);
+			if (rc != 0)
+				return rc;
+		} else
+			wal_mem_del(p, item.klen);
+		p += item.klen + item.vlen;
+	}
+
+	return 0;
+}
+
+/* Replays every valid frame of a file. *valid is set to the size of the
+ * frames that could be read, anything after it is a torn write */
+static int wal_load(const char *path, off_t *valid)
+{
+	struct wal_frame frame;
+	struct stat st;
+	char *buf = NULL;
+	off_t off = 0;
+	int fd;
+	int rc = 0;
+
+	*valid = 0;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return (errno == ENOENT) ? 0 : -errno;
+
+	if (fstat(fd, &st) != 0) {
+		rc = -errno;
+		goto out;
+	}
+
+	while (off + (off_t)sizeof(frame) <= st.st_size) {
+		if (pread(fd, &frame, sizeof(frame), off) != sizeof(frame))
+			break;
+		if (frame.magic != WAL_MAGIC ||
+		    off + (off_t)sizeof(frame) + frame.size > st.st_size)
+			break;
+
+		buf = realloc(buf, frame.size ? frame.size : 1);
+		if (buf == NULL) {
+			rc = -ENOMEM;
+			goto out;
+		}
+		if (pread(fd, buf, frame.size, off + sizeof(frame)) !=
+		    frame.size)
+			break;
+		if (kvstore_crc(buf, frame.size) != frame.crc)
+			break;
+
+		rc = wal_replay(buf, frame.size);
+		if (rc != 0)
+			goto out;
+		off += sizeof(frame) + frame.size;
+	}
+	*valid = off;
+
+out:
+	free(buf);
+	close(fd);
+	return rc;
+}
+
+static int wal_sync_dir(void)
+{
+	int fd;
+	int rc = 0;
+
+	fd = open(wal.path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return -errno;
+	if (fsync(fd) != 0)
+		rc = -errno;
+	close(fd);
+
+	return rc;
+}
+
+/* Called with wlock held: no writer may change the skip list meanwhile */
+static int wal_checkpoint(void)
+{
+	char tmp[MAXPATHLEN];
+	char path[MAXPATHLEN];
+	struct wal_node *x;
+	kvstore_rec_t rec;
+	char *buf;
+	size_t len;
+	int fd;
+	int rc = 0;
+
+	snprintf(tmp, MAXPATHLEN, "%s/%s.tmp", wal.path, WAL_SNAPSHOT);
+	snprintf(path, MAXPATHLEN, "%s/%s", wal.path, WAL_SNAPSHOT);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return -errno;
+
+	for (x = wal.head->next[0]; x != NULL && rc == 0; x = x->next[0]) {
+		rec.k = x->k;
+		rec.klen = x->klen;
+		rec.v = x->v;
+		rec.vlen = x->vlen;
+		buf = wal_encode(&rec, 1, &len);
+		if (buf == NULL) {
+			rc = -ENOMEM;
+			break;
+		}
+		rc = wal_write_all(fd, buf, len);
+		free(buf);
+	}
+
+	if (rc == 0 && fsync(fd) != 0)
+		rc = -errno;
+	close(fd);
+
+	if (rc == 0 && rename(tmp, path) != 0)
+		rc = -errno;
+	if (rc == 0)
+		rc = wal_sync_dir();
+	if (rc != 0) {
+		unlink(tmp);
+		return rc;
+	}
+
+	/* Replaying the log over the snapshot would be harmless, should
+	 * this fail */
+	if (ftruncate(wal.fd, 0) != 0 || fsync(wal.fd) != 0)
+		return -errno;
+	wal.size = 0;
+
+	return 0;
+}
+
+static int wal_log(kvstore_rec_t *recs, int nb_recs)
+{
+	char *buf;
+	size_t len;
+	int rc;
+
+	buf = wal_encode(recs, nb_recs, &len);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	rc = wal_write_all(wal.fd, buf, len);
+	free(buf);
+	if (rc != 0) {
+		/* Don't leave a partial frame before the next ones */
+		if (ftruncate(wal.fd, wal.size) != 0)
+			return -EIO;
+		return rc;
+	}
+	wal.size += len;
+
+	if (wal.sync && fdatasync(wal.fd) != 0)
+		return -errno;
+
+	return 0;
+}
+
+/* Called with wlock held */
+static int wal_commit(kvstore_rec_t *recs, int nb_recs)
+{
+	int rc;
+
+	rc = wal_log(recs, nb_recs);
+	if (rc != 0)
+		return rc;
+
+	rc = wal_mem_apply(recs, nb_recs);
+	if (rc != 0)
+		return rc;
+
+	if (wal.checkpoint > 0 && wal.size >= wal.checkpoint) {
+		rc = wal_checkpoint();
+		if (rc != 0)
+			fprintf(stderr, "kvstore_wal: checkpoint failed: %d\n",
+				rc);
+	}
+
+	return 0;
+}
+
+static int wal_open(struct collection_item *cfg_items)
+{
+	struct collection_item *item = NULL;
+	char path[MAXPATHLEN];
+	off_t valid;
+	int rc;
+
+	wal.sync = true;
+	wal.checkpoint = (off_t)WAL_CHECKPOINT_MB << 20;
+
+	rc = get_config_item("kvsal_embedded", "path", cfg_items, &item);
+	if (rc != 0)
+		return -rc;
+	if (item == NULL) {
+		fprintf(stderr, "kvstore_wal: [kvsal_embedded] path missing\n");
+		return -EINVAL;
+	}
+	strncpy(wal.path, get_const_string_config_value(item, NULL),
+		WAL_PATHLEN - 1);
+
+	item = NULL;
+	rc = get_config_item("kvsal_embedded", "sync", cfg_items, &item);
+	if (rc != 0)
+		return -rc;
+	if (item != NULL)
+		wal.sync = get_bool_config_value(item, true, NULL);
+
+	item = NULL;
+	rc = get_config_item("kvsal_embedded", "checkpoint_mb", cfg_items,
+			     &item);
+	if (rc != 0)
+		return -rc;
+	if (item != NULL)
+		wal.checkpoint = (off_t)get_int_config_value(item, 0,
+							     WAL_CHECKPOINT_MB,
+							     NULL) << 20;
+
+	if (mkdir(wal.path, 0700) != 0 && errno != EEXIST)
+		return -errno;
+
+	wal.seed = getpid();
+	wal.level = 1;
+	wal.head = wal_new_node(WAL_MAXLEVEL);
+	if (wal.head == NULL)
+		return -ENOMEM;
+
+	snprintf(path, MAXPATHLEN, "%s/%s", wal.path, WAL_SNAPSHOT);
+	rc = wal_load(path, &valid);
+	if (rc != 0)
+		return rc;
+
+	snprintf(path, MAXPATHLEN, "%s/%s", wal.path, WAL_FILE);
+	rc = wal_load(path, &valid);
+	if (rc != 0)
+		return rc;
+
+	wal.fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+	if (wal.fd < 0)
+		return -errno;
+
+	/* Drop a frame torn by a crash, later frames are appended */
+	if (ftruncate(wal.fd, valid) != 0)
+		return -errno;
+	wal.size = valid;
+
+	return 0;
+}
+
+static int wal_close(void)
+{
+	struct wal_node *x;
+	struct wal_node *next;
+
+	if (wal.fd >= 0)
+		close(wal.fd);
+	wal.fd = -1;
+
+	if (wal.head == NULL)
+		return 0;
+
+	for (x = wal.head->next[0]; x != NULL; x = next) {
+		next = x->next[0];
+		free(x->k);
+		free(x->v);
+		free(x);
+	}
+	free(wal.head);
+	wal.head = NULL;
+
+	return 0;
+}
+
+static int wal_get(const char *k, size_t klen, char *v, size_t *vlen)
+{
+	struct wal_node *x;
+	int rc = 0;
+
+	pthread_rwlock_rdlock(&wal.lock);
+	x = wal_find(k, klen, NULL);
+	if (x == NULL || wal_keycmp(x->k, x->klen, k, klen) != 0)
+		rc = -ENOENT;
+	else {
+		if (x->vlen > *vlen)
+			rc = -ENOBUFS;
+		else
+			memcpy(v, x->v, x->vlen);
+		*vlen = x->vlen;
+	}
+	pthread_rwlock_unlock(&wal.lock);
+
+	return rc;
+}
+
+static int wal_apply(kvstore_rec_t *recs, int nb_recs)
+{
+	int rc;
+
+	if (nb_recs == 0)
+		return 0;
+
+	pthread_mutex_lock(&wal.wlock);
+	rc = wal_commit(recs, nb_recs);
+	pthread_mutex_unlock(&wal.wlock);
+
+	return rc;
+}
+
+static int wal_incr(const char *k, size_t klen, unsigned long long by,
+		    unsigned long long *v)
+{
+	struct wal_node *x;
+	kvstore_rec_t rec;
+	char buf[32];
+	unsigned long long val = 0;
+	int rc;
+
+	/* Writers are held off: the value read stays current */
+	pthread_mutex_lock(&wal.wlock);
+	x = wal_find(k, klen, NULL);
+	if (x != NULL && wal_keycmp(x->k, x->klen, k, klen) == 0) {
+		if (x->vlen >= sizeof(buf)) {
+			pthread_mutex_unlock(&wal.wlock);
+			return -EINVAL;
+		}
+		memcpy(buf, x->v, x->vlen);
+		buf[x->vlen] = '\0';
+		val = strtoull(buf, NULL, 10);
+	}
+
+	val += by;
+	rec.k = k;
+	rec.klen = klen;
+	rec.v = buf;
+	rec.vlen = snprintf(buf, sizeof(buf), "%llu", val);
+
+	rc = wal_commit(&rec, 1);
+	pthread_mutex_unlock(&wal.wlock);
+
+	if (rc == 0)
+		*v = val;
+	return rc;
+}
+
+static int wal_setrange(const char *k, size_t klen, size_t off,
+			const char *v, size_t *vlen)
+{
+	struct wal_node *x;
+	kvstore_rec_t rec;
+	char *buf;
+	int rc;
+
+	/* Writers are held off: the value patched stays current */
+	pthread_mutex_lock(&wal.wlock);
+	x = wal_find(k, klen, NULL);
+	if (x != NULL && wal_keycmp(x->k, x->klen, k, klen) != 0)
+		x = NULL;
+
+	rec.vlen = off + *vlen;
+	if (x != NULL && x->vlen > rec.vlen)
+		rec.vlen = x->vlen;
+
+	buf = calloc(1, rec.vlen);
+	if (buf == NULL) {
+		pthread_mutex_unlock(&wal.wlock);
+		return -ENOMEM;
+	}
+	if (x != NULL)
+		memcpy(buf, x->v, x->vlen);
+	memcpy(buf + off, v, *vlen);
+
+	rec.k = k;
+	rec.klen = klen;
+	rec.v = buf;
+
+	rc = wal_commit(&rec, 1);
+	pthread_mutex_unlock(&wal.wlock);
+
+	free(buf);
+	if (rc == 0)
+		*vlen = rec.vlen;
+	return rc;
+}
+
+static int wal_scan(const char *prefix, size_t plen, kvstore_scan_cb_t cb,
+		    void *arg)
+{
+	struct wal_node *x;
+
+	pthread_rwlock_rdlock(&wal.lock);
+	for (x = wal_find(prefix, plen, NULL); x != NULL; x = x->next[0]) {
+		if (x->klen < plen || memcmp(x->k, prefix, plen) != 0)
+			break;
+		if (cb(x->k, x->klen, arg) != 0)
+			break;
+	}
+	pthread_rwlock_unlock(&wal.lock);
+
+	return 0;
+}
+
+struct kvstore kvstore_wal = {
+	.name = "wal",
+	.open = wal_open,
+	.close = wal_close,
+	.get = wal_get,
+	.apply = wal_apply,
+	.incr = wal_incr,
+	.setrange = wal_setrange,
+	.scan = wal_scan,
+};
@@ -0,0 +1,151 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) CEA, 2016
+ * Author: Philippe Deniel  philippe.deniel@cea.fr
+ *
+ * contributeur : Philippe DENIEL   philippe.deniel@cea.fr
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+/* kvsal_arena.c
+ * KVS Abstraction Layer: per-thread scratch memory, common to the KVSALs
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <kvsns/kvsal.h>
+
+#define KVSAL_ARENA_CHUNK 65536
+#define KVSAL_ARENA_ALIGN 16
+
+/* The arena is a stack of chunks. A mark is an offset in the arena, base
+ * being the offset of the chunk's first byte */
+struct kvsal_arena_chunk {
+	struct kvsal_arena_chunk *prev;
+	size_t base;
+	size_t size;
+	size_t used;
+};
+
+#define KVSAL_ARENA_HDR \
+	((sizeof(struct kvsal_arena_chunk) + KVSAL_ARENA_ALIGN - 1) & \
+	 ~(size_t)(KVSAL_ARENA_ALIGN - 1))
+
+/* spare is the largest chunk released lately, kept for the next one
+ * needed, so that a thread soon stops allocating anything */
+struct kvsal_arena {
+	struct kvsal_arena_chunk *top;
+	struct kvsal_arena_chunk *spare;
+	bool registered;
+};
+
+static __thread struct kvsal_arena arena;
+
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+/* Frees a thread's chunks as it exits */
+static void kvsal_arena_destroy(void *arg)
+{
+	struct kvsal_arena *a = arg;
+	struct kvsal_arena_chunk *c;
+
+	while ((c = a->top) != NULL) {
+		a->top = c->prev;
+		free(c);
+	}
+
+	free(a->spare);
+	a->spare = NULL;
+	a->registered = false;
+}
+
+static void kvsal_arena_key_init(void)
+{
+	pthread_key_create(&arena_key, kvsal_arena_destroy);
+}
+
+static void kvsal_arena_pop(void)
+{
+	struct kvsal_arena_chunk *c = arena.top;
+
+	arena.top = c->prev;
+	if (arena.spare == NULL || arena.spare->size < c->size) {
+		free(arena.spare);
+		arena.spare = c;
+	} else
+		free(c);
+}
+
+size_t kvsal_arena_mark(void)
+{
+	return arena.top ? arena.top->base + arena.top->used : 0;
+}
+
+void *kvsal_arena_alloc(size_t size)
+{
+	struct kvsal_arena_chunk *c = arena.top;
+	size_t base = kvsal_arena_mark();
+	void *p;
+
+	size = (size + KVSAL_ARENA_ALIGN - 1) & ~(size_t)(KVSAL_ARENA_ALIGN - 1);
+	if (c == NULL || c->size - c->used < size) {
+		/* An empty chunk too small is replaced */
+		if (c != NULL && c->used == 0)
+			kvsal_arena_pop();
+
+		if (arena.spare != NULL && arena.spare->size >= size) {
+			c = arena.spare;
+			arena.spare = NULL;
+		} else {
+			c = malloc(KVSAL_ARENA_HDR +
+				   MAX(size, KVSAL_ARENA_CHUNK));
+			if (c == NULL)
+				return NULL;
+			c->size = MAX(size, KVSAL_ARENA_CHUNK);
+		}
+
+		if (!arena.registered) {
+			pthread_once(&arena_once, kvsal_arena_key_init);
+			pthread_setspecific(arena_key, &arena);
+			arena.registered = true;
+		}
+
+		c->prev = arena.top;
+		c->base = base;
+		c->used = 0;
+		arena.top = c;
+	}
+
+	p = (char *)c + KVSAL_ARENA_HDR + c->used;
+	c->used += size;
+
+	return p;
+}
+
+void kvsal_arena_release(size_t mark)
+{
+	while (arena.top != NULL && arena.top->base > mark)
+		kvsal_arena_pop();
+
+	if (arena.top != NULL && mark - arena.top->base < arena.top->used)
+		arena.top->used = mark - arena.top->base;
+}
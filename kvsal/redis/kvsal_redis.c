@@ -29,13 +29,21 @@
  * KVS Abstraction Layer: interface for REDIS
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <search.h>
 #include <hiredis/hiredis.h>
+#include <hiredis/async.h>
 #include <pthread.h>
 #include <time.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <ini_config.h>
 #include <kvsns/kvsal.h>
 
@@ -44,28 +52,398 @@
         if (__rc != 0)        \
                 return __rc; })
 
-/* The REDIS context exists in the TLS, for MT-Safety */
+/* Keys are spread over one or more servers, the shards, see kvsal_shard_of.
+ * With a Redis Cluster, the shards are the cluster's masters. Connections
+ * come from a pool per shard, shared by all threads. A thread holds one for
+ * the duration of a call (see KVSAL_CONNECT). rediscontext is the one the
+ * thread holds for the shard it is talking to. A shard may have a replica,
+ * kept at KVSAL_REPLICA(shard) with a pool of its own, which serves the
+ * reads of threads that asked for it (see kvsal_read_replica) */
 __thread redisContext *rediscontext = NULL;
 
+#define KVSAL_MAX_SHARDS 64
+#define KVSAL_MAX_NODES (2 * KVSAL_MAX_SHARDS)
+#define KVSAL_REPLICA(__shard) ((__shard) + KVSAL_MAX_SHARDS)
+#define KVSAL_POOL_SIZE 16
+#define KVSAL_POOL_WAIT_MS 5000
+#define KVSAL_POOL_CHECK_S 30
+#define KVSAL_BACKOFF_MIN_MS 10
+#define KVSAL_BACKOFF_MAX_MS 5000
+#define KVSAL_CLUSTER_SLOTS 16384
+#define KVSAL_MAX_REDIRECTS 5
+
+/* Number of slots SCAN looks at in one call. This is only a hint, a call
+ * may return more or less keys than this */
+#define KVSAL_SCAN_COUNT 1000
+
+/* Room for a key once given a hash tag, see kvsal_wire_key */
+#define KVSAL_WIRE_KLEN (KLEN + 2)
+
+/* The channels of a key's notifications, on any database */
+#define KVSAL_CHANNEL_PREFIX "__keyspace@*__:"
+#define KVSAL_CHANNEL_LEN (sizeof(KVSAL_CHANNEL_PREFIX) - 1 + KVSAL_WIRE_KLEN)
+
+/* Room for a SETRANGE offset, in decimal */
+#define KVSAL_OFF_LEN 24
+
+struct kvsal_conn {
+	redisContext *ctx;	/* NULL until (re)connected */
+	time_t last_used;
+	struct kvsal_conn *next;
+};
+
+/* The async fields are guarded by loop.lock, the watch ones are only used
+ * by kvsal_watch and kvsal_fini, the others by pool.lock */
+struct kvsal_shard {
+	char *hostname;		/* NULL for a replica that is not set */
+	int port;
+	bool replica;
+	struct kvsal_conn *idle;
+	int size;		/* connections open to it */
+	unsigned long long next_connect_ms;
+	int backoff_ms;
+	redisAsyncContext *ac;	/* NULL until (re)connected */
+	bool reading;		/* set by hiredis through the ev hooks */
+	bool writing;
+	redisContext *watchcontext;
+	pthread_t watcher;
+};
+
+static struct kvsal_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool ready;
+	struct kvsal_shard shards[KVSAL_MAX_NODES];
+	int nb_shards;		/* replicas not included */
+	bool cluster;
+	unsigned char slots[KVSAL_CLUSTER_SLOTS]; /* cluster: slot's shard */
+	int max_size;		/* per shard */
+	int wait_ms;
+	int check_s;
+	unsigned long long txn_seq;
+	kvsal_pool_stats_t stats;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* The connection a thread holds to each shard, and how many calls use it */
+static __thread struct kvsal_held {
+	struct kvsal_conn *conn;
+	int users;
+} held[KVSAL_MAX_NODES];
+
+/* The shard rediscontext belongs to, -1 if none */
+static __thread int cur_shard = -1;
+
+struct kvsal_hold {
+	int rc;
+	int shard;
+	int prev_shard;
+};
+
+/* Commands issued within a transaction are formatted and kept aside until
+ * it ends, in parts: one per shard, or in cluster mode one per slot, as a
+ * MULTI may not touch keys of several slots there. MULTI, the commands and
+ * EXEC are then sent at once, so that a transaction of a single part costs
+ * a single round trip. Those of several parts are committed in two phases,
+ * the first part being the coordinator (see kvsal_commit_parts) */
+#define KVSAL_MAX_PARTS 64
+
+struct kvsal_trans {
+	int shard;
+	int slot;		/* -1 out of cluster mode */
+	char tag[KLEN];		/* cluster mode: hashes to the slot */
+	char *buf;
+	size_t len;
+	size_t size;
+	int nb_cmds;
+};
+
+/* Set by kvsal_read_replica, ignored within a transaction */
+static __thread bool read_replica = false;
+
+static __thread bool in_transaction = false;
+static __thread struct kvsal_trans trans[KVSAL_MAX_PARTS];
+static __thread int nb_parts;
+
+/* Two-phase commits: for each part but the coordinator, the commands are
+ * kept in the intents map, under "<coordinator's shard>.<transaction id>",
+ * before the coordinator commits its own part along with the decision,
+ * "kvsal.commit.<field>". In cluster mode, the intents map and the field
+ * are given the hash tag of the part, resp. of the coordinator, so that
+ * they live in the same slot. Intents left behind by a client that died
+ * are completed or dropped, depending on the decision, by the next client
+ * to start. Decisions expire: this must happen within a day */
+#define KVSAL_TXN_INTENTS "kvsal.txn"
+#define KVSAL_TXN_DECISION "kvsal.commit."
+#define KVSAL_TXN_COMMITTED "committed"
+#define KVSAL_TXN_ABORTED "aborted"
+#define KVSAL_TXN_EXPIRE_S 86400
+#define KVSAL_TXN_RECOVER_S 60	/* younger intents may still be in use */
+
 static struct collection_item *conf = NULL;
 
-int kvsal_init(struct collection_item *cfg_items)
+/* Keyspace notifications are read from connections of their own, one per
+ * shard, which only subscribe, each by a dedicated thread */
+static bool watching = false;
+static kvsal_watch_cb_t watch_cb;
+static void *watch_arg;
+static volatile bool watch_stop = false;
+
+/* Asynchronous ops are sent on connections of their own, one per shard,
+ * whose sockets are polled by an event loop thread. hiredis' async context
+ * is not thread safe: every call to it is made with loop.lock held. That
+ * lock is recursive so that completion callbacks, called from the loop, may
+ * submit new ops. Submitters wake the loop up through a pipe, for it to poll
+ * for writing */
+static struct kvsal_loop {
+	pthread_mutex_t lock;
+	pthread_t thread;
+	bool running;
+	bool stop;
+	int wake[2];
+} loop = {
+	.lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP,
+	.wake = { -1, -1 },
+};
+
+struct kvsal_async_req {
+	kvsal_op_t *op;
+	kvsal_async_cb_t cb;
+	void *arg;
+};
+
+static int kvsal_add_shard(char *hostname, int port)
+{
+	struct kvsal_shard *shard;
+
+	if (pool.nb_shards == KVSAL_MAX_SHARDS) {
+		fprintf(stderr, "kvsal: more than %d servers\n",
+			KVSAL_MAX_SHARDS);
+		return -EINVAL;
+	}
+
+	shard = &pool.shards[pool.nb_shards];
+	memset(shard, 0, sizeof(struct kvsal_shard));
+	shard->hostname = hostname;
+	shard->port = port;
+	memset(&pool.shards[KVSAL_REPLICA(pool.nb_shards)], 0,
+	       sizeof(struct kvsal_shard));
+	/* Shards may be added while others are in use, see kvsal_redirect */
+	__atomic_store_n(&pool.nb_shards, pool.nb_shards + 1,
+			 __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static void kvsal_set_replica(int s, char *hostname, int port)
+{
+	struct kvsal_shard *replica = &pool.shards[KVSAL_REPLICA(s)];
+
+	memset(replica, 0, sizeof(struct kvsal_shard));
+	replica->hostname = hostname;
+	replica->port = port;
+	replica->replica = true;
+}
+
+/* The shard for a cluster node, added if it is not known yet. Returns its
+ * index or a negative "-errno" */
+static int kvsal_cluster_node(const char *hostname, int port)
+{
+	static pthread_mutex_t nodes_lock = PTHREAD_MUTEX_INITIALIZER;
+	char *name;
+	int rc;
+	int s;
+
+	pthread_mutex_lock(&nodes_lock);
+	for (s = 0; s < pool.nb_shards ; s++)
+		if (pool.shards[s].port == port &&
+		    !strcmp(pool.shards[s].hostname, hostname)) {
+			pthread_mutex_unlock(&nodes_lock);
+			return s;
+		}
+
+	name = strdup(hostname);
+	if (name == NULL) {
+		pthread_mutex_unlock(&nodes_lock);
+		return -ENOMEM;
+	}
+
+	rc = kvsal_add_shard(name, port);
+	if (rc != 0)
+		free(name);
+	else
+		rc = pool.nb_shards - 1;
+	pthread_mutex_unlock(&nodes_lock);
+
+	return rc;
+}
+
+/* The servers listed only lead to the cluster: one of them tells about the
+ * masters and the slots each serves. The masters then replace them as the
+ * shards */
+static int kvsal_cluster_slots(void)
 {
-	redisReply *reply;
-	char *hostname = NULL;
-	char hostname_default[] = "127.0.0.1";
 	struct timeval timeout = { 1, 500000 }; /* 1.5 seconds */
-	int port = 6379; /* REDIS default */
+	redisReply *reply = NULL;
+	redisReply *range;
+	redisContext *ctx;
+	char *hostname;
+	long long slot;
+	int shard;
+	int s;
+	size_t i;
+
+	for (s = 0; reply == NULL && s < pool.nb_shards ; s++) {
+		ctx = redisConnectWithTimeout(pool.shards[s].hostname,
+					      pool.shards[s].port, timeout);
+		if (ctx != NULL && !ctx->err)
+			reply = redisCommand(ctx, "CLUSTER SLOTS");
+		if (ctx != NULL)
+			redisFree(ctx);
+
+		if (reply != NULL && reply->type != REDIS_REPLY_ARRAY) {
+			freeReplyObject(reply);
+			reply = NULL;
+		}
+	}
+
+	if (reply == NULL) {
+		fprintf(stderr, "kvsal: can't get the cluster's slots\n");
+		return -ENOTCONN;
+	}
+
+	pool.nb_shards = 0;
+	memset(pool.slots, 0, sizeof(pool.slots));
+
+	/* [start, end, [master's host, port, ...], replicas...] per range */
+	for (i = 0; i < reply->elements ; i++) {
+		range = reply->element[i];
+		if (range->type != REDIS_REPLY_ARRAY || range->elements < 3 ||
+		    range->element[2]->type != REDIS_REPLY_ARRAY ||
+		    range->element[2]->elements < 2 ||
+		    range->element[2]->element[0]->type != REDIS_REPLY_STRING)
+			continue;
+
+		shard = kvsal_cluster_node(range->element[2]->element[0]->str,
+				range->element[2]->element[1]->integer);
+		if (shard < 0) {
+			freeReplyObject(reply);
+			return shard;
+		}
+
+		/* The first replica listed serves the reads sent to one */
+		if (range->elements > 3 &&
+		    pool.shards[KVSAL_REPLICA(shard)].hostname == NULL &&
+		    range->element[3]->type == REDIS_REPLY_ARRAY &&
+		    range->element[3]->elements >= 2 &&
+		    range->element[3]->element[0]->type == REDIS_REPLY_STRING) {
+			hostname = strdup(range->element[3]->element[0]->str);
+			if (hostname == NULL) {
+				freeReplyObject(reply);
+				return -ENOMEM;
+			}
+			kvsal_set_replica(shard, hostname,
+				range->element[3]->element[1]->integer);
+		}
+
+		for (slot = range->element[0]->integer;
+		     slot <= range->element[1]->integer &&
+		     slot < KVSAL_CLUSTER_SLOTS ; slot++)
+			pool.slots[slot] = shard;
+	}
+	freeReplyObject(reply);
+
+	return (pool.nb_shards > 0) ? 0 : -ENOTCONN;
+}
+
+/* Splits "host[:port]" in place */
+static int kvsal_server_port(char *server)
+{
+	char *colon = strrchr(server, ':');
+
+	if (colon == NULL)
+		return 6379; /* REDIS default */
+
+	*colon = '\0';
+	return atoi(colon + 1);
+}
+
+/* "replicas" gives a replica for each of the shards, in the same order and
+ * in the same form as "servers". A cluster tells about its own */
+static int kvsal_replica_config(struct collection_item *cfg_items)
+{
 	struct collection_item *item = NULL;
+	char *replicas;
+	char *server;
+	char *save;
+	int s = 0;
 
-	if (cfg_items == NULL)
-		return -EINVAL;
+	RC_WRAP(get_config_item, "kvsal_redis", "replicas", cfg_items, &item);
+	if (item == NULL)
+		return 0;
 
-	if (conf == NULL)
-		conf = cfg_items;
+	replicas = get_string_config_value(item, NULL);
+	if (replicas == NULL)
+		return -ENOMEM;
+
+	for (server = strtok_r(replicas, ", \t", &save); server;
+	     server = strtok_r(NULL, ", \t", &save)) {
+		if (s == pool.nb_shards) {
+			fprintf(stderr, "kvsal: more replicas than servers\n");
+			return -EINVAL;
+		}
+
+		kvsal_set_replica(s, server, kvsal_server_port(server));
+		s += 1;
+	}
+
+	return 0;
+}
 
-	/* Get config from ini file */
+/* "servers" lists the shards as host[:port], separated by commas. Every
+ * client must list them in the same order. Without it, "server" and "port"
+ * give the only one. With "cluster", they are only the way into the
+ * cluster */
+static int kvsal_server_config(struct collection_item *cfg_items)
+{
+	static char hostname_default[] = "127.0.0.1";
+	struct collection_item *item = NULL;
+	char *servers;
+	char *server;
+	char *save;
+	char *hostname;
+	int port = 6379; /* REDIS default */
+
+	pool.nb_shards = 0;
+
+	RC_WRAP(get_config_item, "kvsal_redis", "cluster", cfg_items, &item);
+	if (item != NULL)
+		pool.cluster = get_bool_config_value(item, false, NULL);
 	item = NULL;
+
+	RC_WRAP(get_config_item, "kvsal_redis", "servers", cfg_items, &item);
+	if (item != NULL) {
+		servers = get_string_config_value(item, NULL);
+		if (servers == NULL)
+			return -ENOMEM;
+
+		for (server = strtok_r(servers, ", \t", &save); server;
+		     server = strtok_r(NULL, ", \t", &save)) {
+			port = kvsal_server_port(server);
+			RC_WRAP(kvsal_add_shard, server, port);
+		}
+
+		if (pool.nb_shards == 0)
+			return -EINVAL;
+
+		if (pool.cluster)
+			return kvsal_cluster_slots();
+
+		return kvsal_replica_config(cfg_items);
+	}
+
 	RC_WRAP(get_config_item, "kvsal_redis", "server", cfg_items, &item);
 	if (item == NULL)
 		hostname = hostname_default;
@@ -77,429 +455,3492 @@ int kvsal_init(struct collection_item *cfg_items)
 	if (item != NULL)
 		port = (int)get_int_config_value(item, 0, 0, NULL);
 
-	/* Start REDIS */
-	rediscontext = redisConnectWithTimeout(hostname, port, timeout);
-	if (rediscontext == NULL || rediscontext->err) {
-		if (rediscontext) {
-			fprintf(stderr,
-				"Redis connection error: %s\n", rediscontext->errstr);
-			redisFree(rediscontext);
-		} else {
-			fprintf(stderr,
-				"Redis connection error: can't get context\n");
+	RC_WRAP(kvsal_add_shard, hostname, port);
+
+	if (pool.cluster)
+		return kvsal_cluster_slots();
+
+	return kvsal_replica_config(cfg_items);
+}
+
+/* In cluster mode, a MOVED or ASK error tells the command is to be sent to
+ * another shard, which is returned, otherwise -1. MOVED means the slot now
+ * belongs to that shard, ASK that it is being migrated to it: the command
+ * is then sent there once, preceded by ASKING */
+static int kvsal_redirect(redisReply *reply, bool *ask)
+{
+	char hostname[KLEN];
+	char *addr;
+	char *colon;
+	long slot;
+	int shard;
+
+	if (!pool.cluster || reply == NULL ||
+	    reply->type != REDIS_REPLY_ERROR)
+		return -1;
+
+	if (!strncmp(reply->str, "MOVED ", strlen("MOVED ")))
+		*ask = false;
+	else if (!strncmp(reply->str, "ASK ", strlen("ASK ")))
+		*ask = true;
+	else
+		return -1;
+
+	/* "MOVED <slot> <host>:<port>" */
+	slot = strtol(strchr(reply->str, ' ') + 1, &addr, 10);
+	colon = strrchr(addr, ':');
+	if (slot < 0 || slot >= KVSAL_CLUSTER_SLOTS || *addr != ' ' ||
+	    colon == NULL || colon - addr - 1 >= KLEN)
+		return -1;
+
+	snprintf(hostname, KLEN, "%.*s", (int)(colon - addr - 1), addr + 1);
+	shard = kvsal_cluster_node(hostname, atoi(colon + 1));
+	if (shard < 0)
+		return -1;
+
+	if (!*ask)
+		__atomic_store_n(&pool.slots[slot], shard, __ATOMIC_RELAXED);
+
+	return shard;
+}
+
+/* Length of the encoded inode number the klen bytes at k start with, 0 if
+ * they don't */
+static size_t kvsal_encoded_ino(const char *k, size_t klen)
+{
+	const unsigned char *u = (const unsigned char *)k;
+	size_t n;
+	size_t i;
+
+	if (klen == 0 || u[0] <= KVSAL_INO_KEY ||
+	    u[0] > KVSAL_INO_KEY + KVSAL_INO_GROUPS)
+		return 0;
+
+	n = 1 + u[0] - KVSAL_INO_KEY;
+	if (n > klen)
+		return 0;
+
+	for (i = 1; i < n ; i++)
+		if (!(u[i] & 0x80))
+			return 0;
+
+	return n;
+}
+
+/* Length of the inode number the klen bytes of key k start with, 0 if it
+ * is not about an inode */
+static size_t kvsal_ino_prefix(const char *k, size_t klen)
+{
+	size_t n;
+
+	n = kvsal_encoded_ino(k, klen);
+	if (n > 0)
+		return n;
+
+	while (n < klen && k[n] >= '0' && k[n] <= '9')
+		n++;
+
+	return (n > 0 && (n == klen || k[n] == '.')) ? n : 0;
+}
+
+/* The inode number of the n bytes kvsal_ino_prefix found */
+static unsigned long long kvsal_prefix_ino(const char *k, size_t n)
+{
+	unsigned long long ino = 0;
+	size_t i;
+
+	if (kvsal_encoded_ino(k, n) == n) {
+		for (i = 1; i < n ; i++)
+			ino = (ino << 7) | (k[i] & 0x7f);
+		return ino;
+	}
+
+	for (i = 0; i < n ; i++)
+		ino = ino * 10 + (k[i] - '0');
+
+	return ino;
+}
+
+/* Length of the "{<inum>}" hash tag kvsal_wire_key put at the beginning of
+ * wk, 0 if there is none */
+static size_t kvsal_tag_len(const char *wk, size_t len)
+{
+	const char *end;
+	size_t n;
+
+	if (!pool.cluster || len < 3 || wk[0] != '{')
+		return 0;
+
+	end = memchr(wk + 1, '}', len - 1);
+	if (end == NULL)
+		return 0;
+
+	n = end - wk - 1;
+	if (kvsal_ino_prefix(wk + 1, n) != n)
+		return 0;
+
+	return n + 2;
+}
+
+static size_t kvsal_ino_len(const char *k)
+{
+	return kvsal_ino_prefix(k, strlen(k));
+}
+
+/* In cluster mode, an inode's keys are sent as "{<ino>}.<rest>". The hash
+ * tag makes all of them hash to the same slot, so that a MULTI about them is
+ * accepted. Returns k itself if it is sent as is */
+static char *kvsal_wire_key(char *k, char *buf)
+{
+	size_t n;
+
+	if (!pool.cluster)
+		return k;
+
+	n = kvsal_ino_len(k);
+	if (n == 0)
+		return k;
+
+	snprintf(buf, KVSAL_WIRE_KLEN, "{%.*s}%s", (int)n, k, k + n);
+	return buf;
+}
+
+/* kvsal_wire_key for a key that may not fit in buf, a KVSAL_WIRE_KLEN
+ * buffer: it is then given its hash tag in the arena. Returns NULL if the
+ * arena ran out */
+static char *kvsal_wire_key_any(char *k, char *buf)
+{
+	size_t len;
+	size_t n;
+
+	if (!pool.cluster)
+		return k;
+
+	len = strlen(k);
+	if (len + 3 <= KVSAL_WIRE_KLEN)
+		return kvsal_wire_key(k, buf);
+
+	n = kvsal_ino_len(k);
+	if (n == 0)
+		return k;
+
+	buf = kvsal_arena_alloc(len + 3);
+	if (buf == NULL)
+		return NULL;
+
+	buf[0] = '{';
+	memcpy(buf + 1, k, n);
+	buf[n + 1] = '}';
+	memcpy(buf + n + 2, k + n, len - n + 1);
+
+	return buf;
+}
+
+/* Reverse of kvsal_wire_key, in place, for keys notified by the servers */
+static char *kvsal_user_key(char *wk)
+{
+	size_t len = strlen(wk);
+	size_t n;
+
+	n = kvsal_tag_len(wk, len);
+	if (n == 0)
+		return wk;
+
+	memmove(wk, wk + 1, n - 2);
+	memmove(wk + n - 2, wk + n, len - n + 1);
+	return wk;
+}
+
+/* The part of key k the cluster hashes once it is sent: the hash tag, if
+ * any, otherwise the whole key */
+static size_t kvsal_hashed_part(const char *k, size_t klen,
+				const char **part)
+{
+	const char *open;
+	const char *close;
+	size_t n;
+
+	*part = k;
+	n = kvsal_ino_prefix(k, klen);
+	if (n > 0)
+		return n;
+
+	open = memchr(k, '{', klen);
+	if (open != NULL) {
+		close = memchr(open + 1, '}', klen - (open + 1 - k));
+		if (close != NULL && close > open + 1) {
+			*part = open + 1;
+			return close - open - 1;
 		}
-		exit(1);
 	}
 
-	/* PING server */
-	reply = redisCommand(rediscontext, "PING");
-	if (!reply) {
-		fprintf(stderr,
-			"Can't ping redis server\n");
-		return -1;
+	return klen;
+}
+
+/* CRC16-CCITT (XMODEM), as used by Redis Cluster */
+static unsigned int kvsal_crc16(const char *buf, size_t len)
+{
+	unsigned int crc = 0;
+	size_t i;
+	int b;
+
+	for (i = 0; i < len ; i++) {
+		crc ^= (unsigned char)buf[i] << 8;
+		for (b = 0; b < 8 ; b++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
 	}
 
-	freeReplyObject(reply);
+	return crc & 0xffff;
+}
+
+static int kvsal_key_slot(const char *k, size_t klen)
+{
+	const char *part;
+	size_t len;
+
+	len = kvsal_hashed_part(k, klen, &part);
+	return kvsal_crc16(part, len) % KVSAL_CLUSTER_SLOTS;
+}
+
+static int kvsal_slot_of(const char *k)
+{
+	return kvsal_key_slot(k, strlen(k));
+}
+
+/* Keys are routed by the inode number they start with, so that an inode's
+ * keys and its dentries are on the same shard. Other keys are on shard 0.
+ * In cluster mode, keys go where the cluster serves their slot */
+static int kvsal_key_shard(const char *k, size_t klen)
+{
+	unsigned long long ino;
+	size_t n;
+
+	if (pool.cluster)
+		return __atomic_load_n(&pool.slots[kvsal_key_slot(k, klen)],
+				       __ATOMIC_RELAXED);
+
+	n = kvsal_ino_prefix(k, klen);
+	if (pool.nb_shards <= 1 || n == 0)
+		return 0;
+
+	ino = kvsal_prefix_ino(k, n);
+
+	/* Inodes are numbered in sequence, mix them before spreading them */
+	ino ^= ino >> 33;
+	ino *= 0xff51afd7ed558ccdULL;
+	ino ^= ino >> 33;
+
+	return ino % pool.nb_shards;
+}
+
+static int kvsal_shard_of(const char *k)
+{
+	return kvsal_key_shard(k, strlen(k));
+}
+
+/* The shard holding every key matching pattern, -1 if they may be on any */
+static int kvsal_pattern_shard(const char *pattern)
+{
+	if (pool.cluster)
+		return (kvsal_ino_len(pattern) > 0 ||
+			strpbrk(pattern, "*?[\\") == NULL) ?
+			kvsal_shard_of(pattern) : -1;
+
+	if (pool.nb_shards <= 1)
+		return 0;
+
+	if (kvsal_ino_len(pattern) > 0)
+		return kvsal_shard_of(pattern);
+
+	/* Digits may be the beginning of an inode number */
+	if ((pattern[0] >= '0' && pattern[0] <= '9') ||
+	    (unsigned char)pattern[0] > KVSAL_INO_KEY ||
+	    strchr("*?[\\", pattern[0]) != NULL)
+		return -1;
 
 	return 0;
 }
 
-static int kvsal_reinit()
+static unsigned long long kvsal_now_ms(void)
 {
-	return kvsal_init(conf);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-int kvsal_fini(void)
+/* After a failure, no connection to the shard is attempted for a delay that
+ * doubles with each new failure, so that clients don't storm a server that
+ * is down */
+static bool kvsal_may_connect(struct kvsal_shard *shard,
+			      unsigned long long now)
+{
+	bool rc;
+
+	pthread_mutex_lock(&pool.lock);
+	rc = (now >= shard->next_connect_ms);
+	pthread_mutex_unlock(&pool.lock);
+
+	return rc;
+}
+
+static void kvsal_connect_done(struct kvsal_shard *shard, bool connected,
+			       unsigned long long now)
+{
+	pthread_mutex_lock(&pool.lock);
+	if (connected) {
+		pool.stats.connects += 1;
+		shard->backoff_ms = 0;
+		shard->next_connect_ms = 0;
+	} else {
+		pool.stats.connect_failures += 1;
+		shard->backoff_ms = (shard->backoff_ms == 0) ?
+			KVSAL_BACKOFF_MIN_MS :
+			MIN(2 * shard->backoff_ms, KVSAL_BACKOFF_MAX_MS);
+		shard->next_connect_ms = now + shard->backoff_ms;
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static int kvsal_connect(struct kvsal_shard *shard, struct kvsal_conn *c)
+{
+	struct timeval timeout = { 1, 500000 }; /* 1.5 seconds */
+	unsigned long long now = kvsal_now_ms();
+	redisContext *ctx;
+	redisReply *reply;
+
+	if (!kvsal_may_connect(shard, now))
+		return -ENOTCONN;
+
+	ctx = redisConnectWithTimeout(shard->hostname, shard->port, timeout);
+
+	/* A cluster's replica redirects reads to its master unless told */
+	if (ctx != NULL && !ctx->err && shard->replica && pool.cluster) {
+		reply = redisCommand(ctx, "READONLY");
+		if (reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+			redisFree(ctx);
+			ctx = NULL;
+		}
+		if (reply != NULL)
+			freeReplyObject(reply);
+	}
+
+	if (ctx == NULL || ctx->err) {
+		if (ctx)
+			redisFree(ctx);
+		kvsal_connect_done(shard, false, now);
+		return -ENOTCONN;
+	}
+	kvsal_connect_done(shard, true, now);
+
+	c->ctx = ctx;
+	c->last_used = time(NULL);
+	return 0;
+}
+
+/* A connection that stayed idle for long is checked before being used */
+static int kvsal_check_conn(struct kvsal_shard *shard, struct kvsal_conn *c)
 {
+	redisReply *reply;
+
+	if (c->ctx != NULL && pool.check_s > 0 &&
+	    time(NULL) - c->last_used >= pool.check_s) {
+		reply = redisCommand(c->ctx, "PING");
+		if (reply)
+			freeReplyObject(reply);
+		else {
+			redisFree(c->ctx);
+			c->ctx = NULL;
+
+			pthread_mutex_lock(&pool.lock);
+			pool.stats.check_failures += 1;
+			pthread_mutex_unlock(&pool.lock);
+		}
+	}
+
+	if (c->ctx == NULL)
+		return kvsal_connect(shard, c);
+
 	return 0;
 }
 
-int kvsal_begin_transaction(void)
+static void kvsal_put_conn(struct kvsal_shard *shard, struct kvsal_conn *c)
+{
+	pthread_mutex_lock(&pool.lock);
+	c->next = shard->idle;
+	shard->idle = c;
+	pool.stats.idle += 1;
+	/* Waiters may be waiting for another shard */
+	pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static void kvsal_set_context(int shard)
+{
+	cur_shard = shard;
+	if (shard >= 0 && held[shard].conn != NULL)
+		rediscontext = held[shard].conn->ctx;
+	else
+		rediscontext = NULL;
+}
+
+/* Makes rediscontext a connection to shard. rc is -EAGAIN if no connection
+ * got free in time */
+static struct kvsal_hold kvsal_acquire(int shard)
+{
+	struct kvsal_hold hold = { .rc = 0, .shard = shard,
+				   .prev_shard = cur_shard };
+	struct kvsal_shard *s = &pool.shards[shard];
+	struct kvsal_conn *c;
+	struct timespec deadline;
+	int rc;
+
+	if (held[shard].conn != NULL) {
+		held[shard].users += 1;
+		kvsal_set_context(shard);
+		return hold;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += pool.wait_ms / 1000;
+	deadline.tv_nsec += (pool.wait_ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec += 1;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	if (!pool.ready || shard % KVSAL_MAX_SHARDS >= pool.nb_shards ||
+	    s->hostname == NULL) {
+		pthread_mutex_unlock(&pool.lock);
+		hold.rc = -ENOTCONN;
+		return hold;
+	}
+
+	while (s->idle == NULL && s->size >= pool.max_size) {
+		pool.stats.waits += 1;
+		rc = pthread_cond_timedwait(&pool.cond, &pool.lock, &deadline);
+		if (rc == ETIMEDOUT && s->idle == NULL) {
+			pool.stats.timeouts += 1;
+			pthread_mutex_unlock(&pool.lock);
+			hold.rc = -EAGAIN;
+			return hold;
+		}
+	}
+
+	if (s->idle != NULL) {
+		c = s->idle;
+		s->idle = c->next;
+		pool.stats.idle -= 1;
+	} else {
+		c = calloc(1, sizeof(struct kvsal_conn));
+		if (c == NULL) {
+			pthread_mutex_unlock(&pool.lock);
+			hold.rc = -ENOMEM;
+			return hold;
+		}
+		s->size += 1;
+		pool.stats.size += 1;
+	}
+	pool.stats.acquired += 1;
+	pthread_mutex_unlock(&pool.lock);
+
+	/* Network exchanges are done out of the lock */
+	rc = kvsal_check_conn(s, c);
+	if (rc != 0) {
+		kvsal_put_conn(s, c);
+		hold.rc = rc;
+		return hold;
+	}
+
+	held[shard].conn = c;
+	held[shard].users = 1;
+	kvsal_set_context(shard);
+	return hold;
+}
+
+/* The connection held before is made current again */
+static void kvsal_release(struct kvsal_hold *hold)
+{
+	struct kvsal_conn *c = held[hold->shard].conn;
+
+	if (hold->rc != 0 || c == NULL)
+		return;
+
+	held[hold->shard].users -= 1;
+	if (held[hold->shard].users == 0) {
+		held[hold->shard].conn = NULL;
+
+		/* A broken connection is reopened by its next user */
+		if (c->ctx != NULL && c->ctx->err) {
+			redisFree(c->ctx);
+			c->ctx = NULL;
+		}
+		c->last_used = time(NULL);
+
+		kvsal_put_conn(&pool.shards[hold->shard], c);
+	}
+
+	kvsal_set_context(hold->prev_shard);
+}
+
+/* To be the first statement of any call talking to the KVS, about keys of
+ * the given shard */
+#define KVSAL_CONNECT(__shard) \
+	struct kvsal_hold __held __attribute__((cleanup(kvsal_release))) = \
+		kvsal_acquire(__shard); \
+	if (__held.rc != 0) \
+		return __held.rc
+
+/* The replica to send a read about shard's keys to, -1 for the shard */
+static int kvsal_replica_of(int shard)
+{
+	if (!read_replica || in_transaction ||
+	    pool.shards[KVSAL_REPLICA(shard)].hostname == NULL)
+		return -1;
+
+	return KVSAL_REPLICA(shard);
+}
+
+/* Holds a connection to every shard in use, taken in shard order so that
+ * two threads holding several never wait for each other. For reads, a
+ * shard's replica may be held instead: holds[s].shard tells which one */
+static int kvsal_acquire_set(bool *used, struct kvsal_hold *holds, bool read)
+{
+	int replica;
+	int s;
+
+	for (s = 0; s < pool.nb_shards ; s++)
+		holds[s].rc = -ENOENT;
+
+	for (s = 0; s < pool.nb_shards ; s++) {
+		if (!used[s])
+			continue;
+
+		/* A replica out of reach leaves the reads to the shard */
+		replica = read ? kvsal_replica_of(s) : -1;
+		if (replica >= 0) {
+			holds[s] = kvsal_acquire(replica);
+			if (holds[s].rc == 0)
+				continue;
+		}
+
+		holds[s] = kvsal_acquire(s);
+		if (holds[s].rc != 0)
+			return holds[s].rc;
+	}
+
+	return 0;
+}
+
+static void kvsal_release_set(bool *used, struct kvsal_hold *holds)
+{
+	int s;
+
+	for (s = pool.nb_shards - 1; s >= 0 ; s--)
+		if (used[s])
+			kvsal_release(&holds[s]);
+}
+
+static redisContext *kvsal_context(int shard)
+{
+	return held[shard].conn->ctx;
+}
+
+static int kvsal_send(int shard, bool asking, const char *cmd, size_t len,
+		      redisReply **reply)
+{
+	redisReply *ack;
+
+	KVSAL_CONNECT(shard);
+
+	*reply = NULL;
+	if (asking &&
+	    redisAppendCommand(rediscontext, "ASKING") != REDIS_OK)
+		return -1;
+
+	if (redisAppendFormattedCommand(rediscontext, cmd, len) != REDIS_OK)
+		return -1;
+
+	if (asking) {
+		if (redisGetReply(rediscontext, (void **)&ack) != REDIS_OK)
+			return -1;
+		freeReplyObject(ack);
+	}
+
+	if (redisGetReply(rediscontext, (void **)reply) != REDIS_OK) {
+		*reply = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Sends a formatted command to shard, or for a read to its replica, then
+ * to those the cluster redirects it to, if any */
+static int kvsal_command_formatted(redisReply **reply, int shard, bool read,
+				   const char *cmd, size_t len)
+{
+	bool ask = false;
+	int replica = read ? kvsal_replica_of(shard) : -1;
+	int i;
+
+	/* A replica out of reach leaves the read to the shard */
+	if (replica >= 0 && kvsal_send(replica, false, cmd, len, reply) == 0) {
+		i = kvsal_redirect(*reply, &ask);
+		if (i < 0)
+			return 0;
+
+		freeReplyObject(*reply);
+		shard = i;
+	}
+
+	for (i = 0; i <= KVSAL_MAX_REDIRECTS ; i++) {
+		RC_WRAP(kvsal_send, shard, ask, cmd, len, reply);
+
+		shard = kvsal_redirect(*reply, &ask);
+		if (shard < 0)
+			return 0;
+
+		freeReplyObject(*reply);
+	}
+
+	*reply = NULL;
+	return -EIO;
+}
+
+static int kvsal_vcommand(redisReply **reply, const char *k, bool read,
+			  const char *format, va_list args)
+{
+	char *cmd;
+	int len;
+	int rc;
+
+	len = redisvFormatCommand(&cmd, format, args);
+	if (len < 0)
+		return -ENOMEM;
+
+	rc = kvsal_command_formatted(reply, kvsal_shard_of(k), read, cmd, len);
+	free(cmd);
+
+	return rc;
+}
+
+/* Runs a command about key k, *reply is to be freed by the caller. The key
+ * itself is given to the command as kvsal_wire_key makes it */
+static int kvsal_command(redisReply **reply, const char *k,
+			 const char *format, ...)
+{
+	va_list args;
+	int rc;
+
+	va_start(args, format);
+	rc = kvsal_vcommand(reply, k, false, format, args);
+	va_end(args);
+
+	return rc;
+}
+
+/* Same as kvsal_command, for a command that only reads */
+static int kvsal_read_command(redisReply **reply, const char *k,
+			      const char *format, ...)
+{
+	va_list args;
+	int rc;
+
+	va_start(args, format);
+	rc = kvsal_vcommand(reply, k, true, format, args);
+	va_end(args);
+
+	return rc;
+}
+
+static int kvsal_recover(void);
+
+int kvsal_init(struct collection_item *cfg_items)
+{
+	struct collection_item *item = NULL;
+	redisReply *reply;
+	bool recover = false;
+	int s;
+
+	if (cfg_items == NULL)
+		return -EINVAL;
+
+	if (conf == NULL)
+		conf = cfg_items;
+
+	if (!pool.ready) {
+		/* Get config from ini file */
+		RC_WRAP(kvsal_server_config, cfg_items);
+
+		pool.max_size = KVSAL_POOL_SIZE;
+		RC_WRAP(get_config_item, "kvsal_redis", "pool_size", cfg_items,
+			&item);
+		if (item != NULL)
+			pool.max_size = get_int_config_value(item, 0,
+							     KVSAL_POOL_SIZE,
+							     NULL);
+		if (pool.max_size <= 0)
+			return -EINVAL;
+
+		pool.wait_ms = KVSAL_POOL_WAIT_MS;
+		item = NULL;
+		RC_WRAP(get_config_item, "kvsal_redis", "pool_wait_ms",
+			cfg_items, &item);
+		if (item != NULL)
+			pool.wait_ms = get_int_config_value(item, 0,
+							    KVSAL_POOL_WAIT_MS,
+							    NULL);
+
+		pool.check_s = KVSAL_POOL_CHECK_S;
+		item = NULL;
+		RC_WRAP(get_config_item, "kvsal_redis", "pool_check_s",
+			cfg_items, &item);
+		if (item != NULL)
+			pool.check_s = get_int_config_value(item, 0,
+							    KVSAL_POOL_CHECK_S,
+							    NULL);
+
+		pthread_mutex_lock(&pool.lock);
+		pool.ready = true;
+		pthread_mutex_unlock(&pool.lock);
+		recover = true;
+	}
+
+	/* Make sure the servers can be reached */
+	for (s = 0; s < pool.nb_shards ; s++) {
+		KVSAL_CONNECT(s);
+
+		reply = redisCommand(rediscontext, "PING");
+		if (!reply) {
+			fprintf(stderr,
+				"Can't ping redis server %s:%d\n",
+				pool.shards[s].hostname, pool.shards[s].port);
+			return -ENOTCONN;
+		}
+
+		freeReplyObject(reply);
+	}
+
+	/* The namespace is usable meanwhile, only partly updated */
+	if (recover && (pool.nb_shards > 1 || pool.cluster) &&
+	    kvsal_recover() != 0)
+		fprintf(stderr, "kvsal: can't recover transactions\n");
+
+	return 0;
+}
+
+int kvsal_get_pool_stats(kvsal_pool_stats_t *stats)
+{
+	if (!stats)
+		return -EINVAL;
+
+	pthread_mutex_lock(&pool.lock);
+	memcpy(stats, &pool.stats, sizeof(kvsal_pool_stats_t));
+	pthread_mutex_unlock(&pool.lock);
+
+	return 0;
+}
+
+bool kvsal_read_replica(bool on)
+{
+	bool prev = read_replica;
+
+	read_replica = on;
+	return prev;
+}
+
+/* Used when replies can no longer be matched with the commands that were
+ * sent. Closing the connection makes the server drop any pending MULTI or
+ * WATCH */
+static void kvsal_drop_shard(int shard)
+{
+	if (held[shard].conn->ctx != NULL)
+		redisFree(held[shard].conn->ctx);
+	held[shard].conn->ctx = NULL;
+	if (cur_shard == shard)
+		rediscontext = NULL;
+}
+
+/* Drops the connections held to every shard in use, when a pipeline failed
+ * while some of them still had commands buffered or replies to be read */
+static void kvsal_drop_set(bool *used, struct kvsal_hold *holds)
+{
+	int s;
+
+	for (s = 0; s < pool.nb_shards ; s++)
+		if (used[s] && holds[s].rc == 0)
+			kvsal_drop_shard(holds[s].shard);
+}
+
+static void kvsal_reset_transaction(void)
+{
+	int p;
+
+	for (p = 0; p < nb_parts ; p++) {
+		free(trans[p].buf);
+		trans[p].buf = NULL;
+		trans[p].len = 0;
+		trans[p].size = 0;
+		trans[p].nb_cmds = 0;
+	}
+
+	in_transaction = false;
+	nb_parts = 0;
+}
+
+/* The part of the transaction key k belongs to */
+static struct kvsal_trans *kvsal_trans_part(const char *k, size_t klen)
+{
+	struct kvsal_trans *t;
+	const char *part;
+	size_t len;
+	int shard = kvsal_key_shard(k, klen);
+	int slot = pool.cluster ? kvsal_key_slot(k, klen) : -1;
+	int p;
+
+	for (p = 0; p < nb_parts ; p++)
+		if (trans[p].shard == shard && trans[p].slot == slot)
+			return &trans[p];
+
+	if (nb_parts == KVSAL_MAX_PARTS)
+		return NULL;
+
+	t = &trans[nb_parts++];
+	t->shard = shard;
+	t->slot = slot;
+	len = kvsal_hashed_part(k, klen, &part);
+	snprintf(t->tag, KLEN, "%.*s", (int)len, part);
+
+	return t;
+}
+
+/* Queues a formatted command about key k with the transaction */
+static int kvsal_queue_formatted(const char *k, size_t klen, const char *cmd,
+				 size_t len)
+{
+	struct kvsal_trans *t = kvsal_trans_part(k, klen);
+	size_t size;
+	char *buf;
+
+	if (t == NULL)
+		return -E2BIG;
+
+	if (t->len + len > t->size) {
+		size = MAX(2 * t->size, t->len + len);
+		buf = realloc(t->buf, size);
+		if (buf == NULL)
+			return -ENOMEM;
+		t->buf = buf;
+		t->size = size;
+	}
+
+	memcpy(t->buf + t->len, cmd, len);
+	t->len += len;
+	t->nb_cmds += 1;
+
+	return 0;
+}
+
+/* Queues a command about key k with the transaction, k being given to the
+ * command as kvsal_wire_key makes it */
+static int kvsal_queue_command(char *k, const char *format, ...)
+{
+	va_list args;
+	char *cmd;
+	int len;
+	int rc;
+
+	va_start(args, format);
+	len = redisvFormatCommand(&cmd, format, args);
+	va_end(args);
+
+	if (len < 0)
+		return -ENOMEM;
+
+	rc = kvsal_queue_formatted(k, strlen(k), cmd, len);
+	free(cmd);
+
+	return rc;
+}
+
+/* Sends MULTI, the formatted commands in buf, then last if not NULL and
+ * EXEC to shard. Returns the number of replies to read */
+static int kvsal_append_multi(int shard, const char *buf, size_t len,
+			      int nb_cmds, const char *last, size_t lastlen)
+{
+	redisContext *ctx = kvsal_context(shard);
+
+	if (ctx == NULL)
+		return -1;
+
+	if (redisAppendCommand(ctx, "MULTI") != REDIS_OK ||
+	    (len > 0 &&
+	     redisAppendFormattedCommand(ctx, buf, len) != REDIS_OK) ||
+	    (last != NULL &&
+	     redisAppendFormattedCommand(ctx, last, lastlen) != REDIS_OK) ||
+	    redisAppendCommand(ctx, "EXEC") != REDIS_OK) {
+		kvsal_drop_shard(shard);
+		return -1;
+	}
+
+	return nb_cmds + (last != NULL) + 2;
+}
+
+/* Reads the replies to kvsal_append_multi. Returns 0 if EXEC ran every
+ * command, -EAGAIN if it did not run them as a watched key changed, -EIO if
+ * the connection was lost and the outcome is unknown */
+static int kvsal_read_multi(int shard, int nb_replies)
+{
+	redisReply *reply;
+	bool ask;
+	size_t j;
+	int rc = 0;
+	int i;
+
+	/* MULTI's OK, a QUEUED status per command, then EXEC's array */
+	for (i = 0; i < nb_replies ; i++) {
+		if (kvsal_context(shard) == NULL ||
+		    redisGetReply(kvsal_context(shard),
+				  (void **)&reply) != REDIS_OK) {
+			kvsal_drop_shard(shard);
+			return -EIO;
+		}
+
+		/* A redirected command makes EXEC fail. The slot map is
+		 * right for the next attempt */
+		if (i < nb_replies - 1) {
+			if (reply->type == REDIS_REPLY_ERROR) {
+				kvsal_redirect(reply, &ask);
+				rc = -1;
+			}
+			freeReplyObject(reply);
+			continue;
+		}
+
+		if (reply->type == REDIS_REPLY_NIL)
+			rc = -EAGAIN;
+		else if (reply->type != REDIS_REPLY_ARRAY)
+			rc = -1;
+		else
+			for (j = 0; j < reply->elements ; j++)
+				if (reply->element[j]->type ==
+				    REDIS_REPLY_ERROR)
+					rc = -1;
+		freeReplyObject(reply);
+		break;
+	}
+
+	return rc;
+}
+
+/* Reads a reply, returns 0 if it is not an error */
+static int kvsal_read_reply(int shard, int expected_type)
+{
+	redisReply *reply;
+	int rc = 0;
+
+	if (kvsal_context(shard) == NULL)
+		return -1;
+
+	if (redisGetReply(kvsal_context(shard), (void **)&reply) != REDIS_OK) {
+		kvsal_drop_shard(shard);
+		return -1;
+	}
+
+	if (reply->type == REDIS_REPLY_ERROR ||
+	    (expected_type != 0 && reply->type != expected_type))
+		rc = -1;
+
+	freeReplyObject(reply);
+	return rc;
+}
+
+static void kvsal_loop_stop(void);
+static void kvsal_watch_stop(void);
+
+int kvsal_fini(void)
+{
+	struct kvsal_shard *shard;
+	struct kvsal_conn *c;
+	int s;
+
+	kvsal_loop_stop();
+	kvsal_watch_stop();
+
+	/* Connections held by other threads go back to the pool as usual */
+	pthread_mutex_lock(&pool.lock);
+	for (s = 0; s < KVSAL_MAX_NODES ; s++) {
+		shard = &pool.shards[s];
+		while (shard->idle != NULL) {
+			c = shard->idle;
+			shard->idle = c->next;
+			if (c->ctx)
+				redisFree(c->ctx);
+			free(c);
+			shard->size -= 1;
+			pool.stats.idle -= 1;
+			pool.stats.size -= 1;
+		}
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	return 0;
+}
+
+int kvsal_begin_transaction(void)
+{
+	if (in_transaction)
+		return -EINVAL;
+
+	in_transaction = true;
+
+	return 0;
+}
+
+/* A transaction id unique among all clients */
+static void kvsal_txn_id(char *id, size_t len)
+{
+	static unsigned long long start_ns;
+	struct timespec ts;
+
+	if (start_ns == 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		__sync_bool_compare_and_swap(&start_ns, 0,
+			(unsigned long long)ts.tv_sec * 1000000000 +
+			ts.tv_nsec);
+	}
+
+	snprintf(id, len, "%x.%llx.%llu", getpid(), start_ns,
+		 __sync_add_and_fetch(&pool.txn_seq, 1));
+}
+
+/* The intents map of a part */
+static void kvsal_txn_intents(struct kvsal_trans *t, char *intents)
+{
+	if (pool.cluster)
+		snprintf(intents, KVSAL_WIRE_KLEN + KLEN, "%s{%s}",
+			 KVSAL_TXN_INTENTS, t->tag);
+	else
+		strcpy(intents, KVSAL_TXN_INTENTS);
+}
+
+/* The transaction spans several parts. Every part but the coordinator is
+ * kept aside, as an intent, while the coordinator watches the decision key.
+ * The coordinator then runs its commands and sets the decision at once:
+ * this is the commit point. The other parts are finally run and their
+ * intents dropped. The transaction is atomic, but readers may see a shard
+ * updated before another. Three round trips, each made with all the shards
+ * involved at once */
+static int kvsal_commit_parts(void)
+{
+	struct kvsal_hold holds[KVSAL_MAX_SHARDS];
+	bool used[KVSAL_MAX_SHARDS];
+	int nb_replies[KVSAL_MAX_PARTS];
+	struct kvsal_trans *t;
+	redisContext *ctx;
+	char id[64];
+	char field[KLEN + 66];
+	char decision[2 * KLEN];
+	char intents[KVSAL_WIRE_KLEN + KLEN];
+	char header[VLEN];
+	char *cmd = NULL;
+	int coord = trans[0].shard;
+	int len;
+	int err;
+	int rc;
+	int p;
+
+	memset(used, 0, sizeof(used));
+	for (p = 0; p < nb_parts ; p++)
+		used[trans[p].shard] = true;
+
+	kvsal_txn_id(id, sizeof(id));
+	if (pool.cluster)
+		snprintf(field, sizeof(field), "%s{%s}", id, trans[0].tag);
+	else
+		snprintf(field, sizeof(field), "%d.%s", coord, id);
+	snprintf(decision, sizeof(decision), "%s%s", KVSAL_TXN_DECISION,
+		 field);
+
+	rc = kvsal_acquire_set(used, holds, false);
+	if (rc != 0)
+		goto out;
+
+	/* Phase 1: prepare */
+	for (p = 0; p < nb_parts ; p++) {
+		t = &trans[p];
+		ctx = kvsal_context(t->shard);
+		if (ctx == NULL) {
+			rc = -1;
+			continue;
+		}
+
+		if (p == 0)
+			err = (redisAppendCommand(ctx, "WATCH %s", decision) ||
+			       redisAppendCommand(ctx, "GET %s", decision));
+		else {
+			kvsal_txn_intents(t, intents);
+			snprintf(header, VLEN, "%lld %d\n",
+				 (long long)time(NULL), t->nb_cmds);
+			err = redisAppendCommand(ctx, "HSET %s %s %s%b",
+						 intents, field, header,
+						 t->buf, t->len);
+		}
+		if (err != REDIS_OK) {
+			kvsal_drop_shard(t->shard);
+			rc = -1;
+		}
+	}
+
+	for (p = 0; p < nb_parts ; p++) {
+		t = &trans[p];
+		if (kvsal_read_reply(t->shard, 0) != 0 ||
+		    (p == 0 && kvsal_read_reply(t->shard,
+						REDIS_REPLY_NIL) != 0))
+			rc = -1;
+	}
+
+	/* Phase 2: commit */
+	if (rc == 0) {
+		len = redisFormatCommand(&cmd, "SET %s %s EX %d", decision,
+					 KVSAL_TXN_COMMITTED,
+					 KVSAL_TXN_EXPIRE_S);
+		rc = (len < 0) ? -ENOMEM :
+			kvsal_append_multi(coord, trans[0].buf, trans[0].len,
+					   trans[0].nb_cmds, cmd, len);
+		free(cmd);
+		cmd = NULL;
+		if (rc > 0)
+			rc = kvsal_read_multi(coord, rc);
+	}
+
+	if (rc != 0) {
+		/* Unless the outcome is unknown, intents are dropped at once.
+		 * Otherwise recovery will know what to do with them */
+		if (used[coord] && kvsal_context(coord) != NULL) {
+			redisAppendCommand(kvsal_context(coord), "UNWATCH");
+			kvsal_read_reply(coord, 0);
+		}
+
+		for (p = 1; rc != -EIO && p < nb_parts ; p++) {
+			t = &trans[p];
+			if (kvsal_context(t->shard) == NULL)
+				continue;
+			kvsal_txn_intents(t, intents);
+			redisAppendCommand(kvsal_context(t->shard),
+					   "HDEL %s %s", intents, field);
+			kvsal_read_reply(t->shard, 0);
+		}
+
+		rc = -1;
+		goto out;
+	}
+
+	/* Phase 3: the others follow. If one fails, recovery completes it */
+	for (p = 1; p < nb_parts ; p++) {
+		t = &trans[p];
+		nb_replies[p] = 0;
+		kvsal_txn_intents(t, intents);
+		len = redisFormatCommand(&cmd, "HDEL %s %s", intents, field);
+		if (len < 0)
+			continue;
+
+		nb_replies[p] = kvsal_append_multi(t->shard, t->buf, t->len,
+						   t->nb_cmds, cmd, len);
+		free(cmd);
+	}
+
+	for (p = 1; p < nb_parts ; p++) {
+		t = &trans[p];
+		if (nb_replies[p] > 0 &&
+		    kvsal_read_multi(t->shard, nb_replies[p]) != 0)
+			fprintf(stderr,
+				"kvsal: %s:%d left to recover transaction %s\n",
+				pool.shards[t->shard].hostname,
+				pool.shards[t->shard].port, id);
+	}
+
+out:
+	kvsal_release_set(used, holds);
+	return rc;
+}
+
+static int kvsal_commit_part(struct kvsal_trans *t)
+{
+	int rc;
+
+	KVSAL_CONNECT(t->shard);
+
+	rc = kvsal_append_multi(t->shard, t->buf, t->len, t->nb_cmds,
+				NULL, 0);
+	if (rc > 0)
+		rc = kvsal_read_multi(t->shard, rc);
+
+	return (rc != 0) ? -1 : 0;
+}
+
+int kvsal_end_transaction(void)
+{
+	int rc = 0;
+
+	if (!in_transaction)
+		return -EINVAL;
+
+	if (nb_parts > 1)
+		rc = kvsal_commit_parts();
+	else if (nb_parts == 1)
+		rc = kvsal_commit_part(&trans[0]);
+
+	kvsal_reset_transaction();
+	return rc;
+}
+
+int kvsal_discard_transaction(void)
+{
+	if (!in_transaction)
+		return -EINVAL;
+
+	/* Nothing was sent yet */
+	kvsal_reset_transaction();
+	return 0;
+}
+
+/* Completes or drops an intent of map intents, depending on its
+ * coordinator's decision. Taking the decision first makes a late
+ * coordinator fail to commit */
+static int kvsal_recover_intent(int shard, char *intents, redisReply *field,
+				redisReply *value)
+{
+	redisReply *reply;
+	char decision[2 * KLEN];
+	char *cmd;
+	char *end;
+	char *buf;
+	long long since;
+	int nb_cmds;
+	int coord;
+	int len;
+	int rc;
+
+	snprintf(decision, sizeof(decision), "%s%s", KVSAL_TXN_DECISION,
+		 field->str);
+	since = strtoll(value->str, &buf, 10);
+	nb_cmds = strtol(buf, &buf, 10);
+	if (*buf != '\n')
+		return -EINVAL;
+	buf += 1;
+
+	/* In cluster mode, the decision is where its hash tag leads */
+	if (pool.cluster)
+		coord = kvsal_shard_of(decision);
+	else {
+		coord = strtol(field->str, &end, 10);
+		if (*end != '.' || coord < 0 || coord >= pool.nb_shards ||
+		    coord == shard)
+			return -EINVAL;
+	}
+
+	if (time(NULL) - since < KVSAL_TXN_RECOVER_S)
+		return 0;
+
+	{
+		KVSAL_CONNECT(coord);
+
+		reply = redisCommand(rediscontext, "SET %s %s NX EX %d",
+				     decision, KVSAL_TXN_ABORTED,
+				     KVSAL_TXN_EXPIRE_S);
+		if (!reply)
+			return -1;
+		if (reply->type == REDIS_REPLY_NIL) {
+			freeReplyObject(reply);
+			reply = redisCommand(rediscontext, "GET %s", decision);
+			if (!reply)
+				return -1;
+		}
+		rc = (reply->type == REDIS_REPLY_STRING &&
+		      !strcmp(reply->str, KVSAL_TXN_COMMITTED));
+		freeReplyObject(reply);
+	}
+
+	KVSAL_CONNECT(shard);
+
+	len = redisFormatCommand(&cmd, "HDEL %s %s", intents, field->str);
+	if (len < 0)
+		return -ENOMEM;
+
+	if (rc)
+		rc = kvsal_append_multi(shard, buf,
+					value->len - (buf - value->str),
+					nb_cmds, cmd, len);
+	else
+		rc = kvsal_append_multi(shard, NULL, 0, 0, cmd, len);
+	free(cmd);
+
+	if (rc > 0)
+		rc = kvsal_read_multi(shard, rc);
+
+	return rc;
+}
+
+static int kvsal_recover_intents(int shard, char *intents)
+{
+	redisReply *reply;
+	size_t i;
+	int rc = 0;
+
+	{
+		KVSAL_CONNECT(shard);
+
+		reply = redisCommand(rediscontext, "HGETALL %s", intents);
+	}
+	if (!reply)
+		return -1;
+
+	for (i = 0; rc == 0 && reply->type == REDIS_REPLY_ARRAY &&
+	     i + 1 < reply->elements ; i += 2)
+		rc = kvsal_recover_intent(shard, intents, reply->element[i],
+					  reply->element[i + 1]);
+	freeReplyObject(reply);
+
+	return rc;
+}
+
+/* In cluster mode, there is an intents map per hash tag, found by SCAN */
+static int kvsal_recover_cluster(int shard)
+{
+	redisReply *reply;
+	redisReply *keys;
+	unsigned long long cursor = 0;
+	size_t i;
+	int rc = 0;
+
+	do {
+		{
+			KVSAL_CONNECT(shard);
+
+			reply = redisCommand(rediscontext,
+					     "SCAN %llu MATCH %s{* COUNT %d",
+					     cursor, KVSAL_TXN_INTENTS,
+					     KVSAL_SCAN_COUNT);
+		}
+		if (!reply)
+			return -1;
+		if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 2 ||
+		    reply->element[0]->type != REDIS_REPLY_STRING) {
+			freeReplyObject(reply);
+			return -1;
+		}
+
+		cursor = strtoull(reply->element[0]->str, NULL, 10);
+		keys = reply->element[1];
+		for (i = 0; rc == 0 && keys->type == REDIS_REPLY_ARRAY &&
+		     i < keys->elements ; i++)
+			rc = kvsal_recover_intents(shard,
+						   keys->element[i]->str);
+		freeReplyObject(reply);
+	} while (rc == 0 && cursor != 0);
+
+	return rc;
+}
+
+/* Transactions left half done by clients that died */
+static int kvsal_recover(void)
+{
+	int s;
+
+	for (s = 0; s < pool.nb_shards ; s++) {
+		if (pool.cluster)
+			RC_WRAP(kvsal_recover_cluster, s);
+		else
+			RC_WRAP(kvsal_recover_intents, s, KVSAL_TXN_INTENTS);
+	}
+
+	return 0;
+}
+
+int kvsal_exists(char *k)
+{
+	redisReply *reply;
+	char wk[KVSAL_WIRE_KLEN];
+
+	if (!k)
+		return -EINVAL;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	/* Set a key */
+	RC_WRAP(kvsal_read_command, &reply, k, "EXISTS %s",
+		kvsal_wire_key(k, wk));
+
+	if (reply->type != REDIS_REPLY_INTEGER) {
+		freeReplyObject(reply);
+		return -1;
+	}
+
+	if (reply->integer == 0) {
+		freeReplyObject(reply);
+		return -ENOENT;
+	}
+
+	freeReplyObject(reply);
+
+	return 0;
+}
+
+int kvsal_set_char(char *k, char *v)
+{
+	redisReply *reply;
+	char wk[KVSAL_WIRE_KLEN];
+
+	if (!k || !v)
+		return -EINVAL;
+
+	if (in_transaction)
+		return kvsal_queue_command(k, "SET %s %s",
+					   kvsal_wire_key(k, wk), v);
+
+	/* Set a key */
+	RC_WRAP(kvsal_command, &reply, k, "SET %s %s",
+		kvsal_wire_key(k, wk), v);
+
+	freeReplyObject(reply);
+
+	return 0;
+}
+
+int kvsal_get_char(char *k, char *v)
+{
+	redisReply *reply;
+	char wk[KVSAL_WIRE_KLEN];
+
+	if (!k || !v)
+		return -EINVAL;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	/* Try a GET and two INCR */
+	RC_WRAP(kvsal_read_command, &reply, k, "GET %s", kvsal_wire_key(k, wk));
+
+	if (reply->len == 0) {
+		freeReplyObject(reply);
+		return -ENOENT;
+	}
+
+	/* v is VLEN long */
+	if (reply->type != REDIS_REPLY_STRING || reply->len >= VLEN) {
+		freeReplyObject(reply);
+		return -1;
+	}
+
+	memcpy(v, reply->str, reply->len + 1);
+	freeReplyObject(reply);
+
+	return 0;
+}
+
+int kvsal_set_stat(char *k, struct stat *buf)
+{
+	redisReply *reply;
+	char wk[KVSAL_WIRE_KLEN];
+
+	size_t size = sizeof(struct stat);
+
+	if (!k || !buf)
+		return -EINVAL;
+
+	if (in_transaction)
+		return kvsal_queue_command(k, "SET %s %b",
+					   kvsal_wire_key(k, wk), buf, size);
+
+	/* Set a key */
+	RC_WRAP(kvsal_command, &reply, k, "SET %s %b",
+		kvsal_wire_key(k, wk), buf, size);
+
+	freeReplyObject(reply);
+
+	return 0;
+}
+
+int kvsal_get_stat(char *k, struct stat *buf)
+{
+	redisReply *reply;
+	char wk[KVSAL_WIRE_KLEN];
+
+	if (!k || !buf)
+		return -EINVAL;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	RC_WRAP(kvsal_read_command, &reply, k, "GET %s", kvsal_wire_key(k, wk));
+
+	if (reply->type != REDIS_REPLY_STRING) {
+		freeReplyObject(reply);
+		return -1;
+	}
+
+	if (reply->len != sizeof(struct stat)) {
+		freeReplyObject(reply);
+		return -1;
+	}
+
+	memcpy((char *)buf, reply->str, reply->len);
+
+	freeReplyObject(reply);
+
+	return 0;
+}
+
+int kvsal_set_binary(char *k, char *buf, size_t size)
+{
+	redisReply *reply;
+	char wk[KVSAL_WIRE_KLEN];
+
+	if (!k || !buf)
+		return -EINVAL;
+
+	if (in_transaction)
+		return kvsal_queue_command(k, "SET %s %b",
+					   kvsal_wire_key(k, wk), buf, size);
+
+	/* Set a key */
+	RC_WRAP(kvsal_command, &reply, k, "SET %s %b",
+		kvsal_wire_key(k, wk), buf, size);
+
+	freeReplyObject(reply);
+
+	return 0;
+}
+
+int kvsal_get_binary(char *k, char *buf, size_t *size)
+{
+	redisReply *reply;
+	char wk[KVSAL_WIRE_KLEN];
+
+	if (!k || !buf || !size)
+		return -EINVAL;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	RC_WRAP(kvsal_read_command, &reply, k, "GET %s", kvsal_wire_key(k, wk));
+
+	if (reply->type == REDIS_REPLY_NIL) {
+		freeReplyObject(reply);
+		return -ENOENT;
+	}
+
+	if (reply->type != REDIS_REPLY_STRING) {
+		freeReplyObject(reply);
+		return -1;
+	}
+
+	if (reply->len > *size) {
+		freeReplyObject(reply);
+		return -1;
+	}
+
+	memcpy((char *)buf, reply->str, reply->len);
+	*size = reply->len;
+
+	freeReplyObject(reply);
+
+	return 0;
+}
+
+/* Formats verb, slice k and v if not NULL as a command. An inode's key is
+ * given its hash tag as by kvsal_wire_key. Returns the command's length */
+static int kvsal_slice_format(char **cmd, const char *verb, kvsal_slice_t *k,
+			      kvsal_slice_t *v)
+{
+	const char *argv[3] = { verb, k->p, NULL };
+	size_t argvlen[3] = { strlen(verb), k->len, 0 };
+	size_t n = pool.cluster ? kvsal_ino_prefix(k->p, k->len) : 0;
+	size_t mark = kvsal_arena_mark();
+	char *wk;
+	long long len;
+
+	if (n > 0) {
+		wk = kvsal_arena_alloc(k->len + 2);
+		if (wk == NULL)
+			return -ENOMEM;
+
+		wk[0] = '{';
+		memcpy(wk + 1, k->p, n);
+		wk[n + 1] = '}';
+		memcpy(wk + n + 2, k->p + n, k->len - n);
+		argv[1] = wk;
+		argvlen[1] = k->len + 2;
+	}
+
+	if (v != NULL) {
+		argv[2] = v->p;
+		argvlen[2] = v->len;
+	}
+
+	len = redisFormatCommandArgv(cmd, (v != NULL) ? 3 : 2, argv, argvlen);
+	kvsal_arena_release(mark);
+
+	return (len < 0) ? -ENOMEM : (int)len;
+}
+
+/* Runs, or queues with the transaction, a command about slice k */
+static int kvsal_slice_command(redisReply **reply, const char *verb,
+			       kvsal_slice_t *k, kvsal_slice_t *v, bool read)
+{
+	char *cmd;
+	int len;
+	int rc;
+
+	len = kvsal_slice_format(&cmd, verb, k, v);
+	if (len < 0)
+		return len;
+
+	if (in_transaction) {
+		*reply = NULL;
+		rc = kvsal_queue_formatted(k->p, k->len, cmd, len);
+	} else
+		rc = kvsal_command_formatted(reply,
+					     kvsal_key_shard(k->p, k->len),
+					     read, cmd, len);
+	free(cmd);
+
+	return rc;
+}
+
+int kvsal_set_slice(kvsal_slice_t *k, kvsal_slice_t *v)
+{
+	redisReply *reply;
+
+	if (!k || !k->p || !v || (!v->p && v->len > 0))
+		return -EINVAL;
+
+	RC_WRAP(kvsal_slice_command, &reply, "SET", k, v, false);
+
+	if (reply != NULL)
+		freeReplyObject(reply);
+
+	return 0;
+}
+
+int kvsal_get_slice(kvsal_slice_t *k, kvsal_slice_t *v)
+{
+	redisReply *reply;
+	int rc = 0;
+
+	if (!k || !k->p || !v || (!v->p && v->len > 0))
+		return -EINVAL;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	RC_WRAP(kvsal_slice_command, &reply, "GET", k, NULL, true);
+
+	if (reply->type == REDIS_REPLY_NIL)
+		rc = -ENOENT;
+	else if (reply->type != REDIS_REPLY_STRING)
+		rc = -1;
+	else {
+		if (reply->len > v->len)
+			rc = -ENOBUFS;
+		else
+			memcpy(v->p, reply->str, reply->len);
+		v->len = reply->len;
+	}
+
+	freeReplyObject(reply);
+	return rc;
+}
+
+int kvsal_del_slice(kvsal_slice_t *k)
+{
+	redisReply *reply;
+
+	if (!k || !k->p)
+		return -EINVAL;
+
+	RC_WRAP(kvsal_slice_command, &reply, "DEL", k, NULL, false);
+
+	if (reply != NULL)
+		freeReplyObject(reply);
+
+	return 0;
+}
+
+int kvsal_incr_counter(char *k, unsigned long long *v)
+{
+	redisReply *reply;
+	char wk[KVSAL_WIRE_KLEN];
+
+	if (!k || !v)
+		return -EINVAL;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	RC_WRAP(kvsal_command, &reply, k, "INCR %s", kvsal_wire_key(k, wk));
+
+	*v = (unsigned long long)reply->integer;
+	freeReplyObject(reply);
+
+	return 0;
+}
+
+/* Adds incr to counter k, *v is the counter's new value */
+int kvsal_incr_counter_by(char *k, unsigned long long incr,
+			  unsigned long long *v)
+{
+	redisReply *reply;
+	char wk[KVSAL_WIRE_KLEN];
+
+	if (!k || !v || incr == 0)
+		return -EINVAL;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	RC_WRAP(kvsal_command, &reply, k, "INCRBY %s %llu",
+		kvsal_wire_key(k, wk), incr);
+
+	if (reply->type != REDIS_REPLY_INTEGER) {
+		freeReplyObject(reply);
+		return -1;
+	}
+
+	*v = (unsigned long long)reply->integer;
+	freeReplyObject(reply);
+
+	return 0;
+}
+
+int kvsal_add_counter(char *k, long long incr)
+{
+	redisReply *reply;
+	char wk[KVSAL_WIRE_KLEN];
+
+	if (!k)
+		return -EINVAL;
+
+	if (in_transaction)
+		return kvsal_queue_command(k, "INCRBY %s %lld",
+					   kvsal_wire_key(k, wk), incr);
+
+	RC_WRAP(kvsal_command, &reply, k, "INCRBY %s %lld",
+		kvsal_wire_key(k, wk), incr);
+
+	if (reply->type != REDIS_REPLY_INTEGER) {
+		freeReplyObject(reply);
+		return -1;
+	}
+
+	freeReplyObject(reply);
+	return 0;
+}
+
+int kvsal_del(char *k)
+{
+	redisReply *reply;
+	char wk[KVSAL_WIRE_KLEN];
+
+	if (!k)
+		return -EINVAL;
+
+	if (in_transaction)
+		return kvsal_queue_command(k, "DEL %s",
+					   kvsal_wire_key(k, wk));
+
+	/* Try a GET and two INCR */
+	RC_WRAP(kvsal_command, &reply, k, "DEL %s", kvsal_wire_key(k, wk));
+	freeReplyObject(reply);
+	return 0;
+}
+
+int kvsal_set_field(char *k, char *field, char *v)
+{
+	redisReply *reply;
+	char wk[KVSAL_WIRE_KLEN];
+
+	if (!k || !field || !v)
+		return -EINVAL;
+
+	if (in_transaction)
+		return kvsal_queue_command(k, "HSET %s %s %s",
+					   kvsal_wire_key(k, wk), field, v);
+
+	RC_WRAP(kvsal_command, &reply, k, "HSET %s %s %s",
+		kvsal_wire_key(k, wk), field, v);
+
+	freeReplyObject(reply);
+
+	return 0;
+}
+
+int kvsal_get_field(char *k, char *field, char *v)
+{
+	redisReply *reply;
+	char wk[KVSAL_WIRE_KLEN];
+
+	if (!k || !field || !v)
+		return -EINVAL;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	RC_WRAP(kvsal_read_command, &reply, k, "HGET %s %s",
+		kvsal_wire_key(k, wk), field);
+
+	if (reply->type != REDIS_REPLY_STRING) {
+		freeReplyObject(reply);
+		return -ENOENT;
+	}
+
+	/* v is VLEN long */
+	if (reply->len >= VLEN) {
+		freeReplyObject(reply);
+		return -ENOBUFS;
+	}
+
+	memcpy(v, reply->str, reply->len + 1);
+	freeReplyObject(reply);
+
+	return 0;
+}
+
+int kvsal_del_field(char *k, char *field)
+{
+	redisReply *reply;
+	char wk[KVSAL_WIRE_KLEN];
+
+	if (!k || !field)
+		return -EINVAL;
+
+	if (in_transaction)
+		return kvsal_queue_command(k, "HDEL %s %s",
+					   kvsal_wire_key(k, wk), field);
+
+	RC_WRAP(kvsal_command, &reply, k, "HDEL %s %s",
+		kvsal_wire_key(k, wk), field);
+
+	freeReplyObject(reply);
+	return 0;
+}
+
+int kvsal_get_fields_count(char *k)
+{
+	redisReply *reply;
+	char wk[KVSAL_WIRE_KLEN];
+	int rc;
+
+	if (!k)
+		return -EINVAL;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	RC_WRAP(kvsal_read_command, &reply, k, "HLEN %s", kvsal_wire_key(k, wk));
+
+	if (reply->type != REDIS_REPLY_INTEGER) {
+		freeReplyObject(reply);
+		return -1;
+	}
+	rc = reply->integer;
+
+	freeReplyObject(reply);
+	return rc;
+}
+
+static int kvsal_slicecmp(const void *a, const void *b)
+{
+	const kvsal_slice_t *sa = a;
+	const kvsal_slice_t *sb = b;
+	int rc;
+
+	rc = memcmp(sa->p, sb->p, MIN(sa->len, sb->len));
+	if (rc != 0)
+		return rc;
+
+	return (sa->len > sb->len) - (sa->len < sb->len);
+}
+
+/* A listed key, kept as a slice followed by its bytes. With untag, without
+ * the hash tag kvsal_wire_key gave it */
+static kvsal_slice_t *kvsal_list_key(const char *k, size_t len, bool untag)
+{
+	kvsal_slice_t *key;
+	size_t n = untag ? kvsal_tag_len(k, len) : 0;
+
+	key = malloc(sizeof(kvsal_slice_t) + len + 1);
+	if (key == NULL)
+		return NULL;
+
+	key->p = (char *)(key + 1);
+	if (n > 0) {
+		memcpy(key->p, k + 1, n - 2);
+		memcpy(key->p + n - 2, k + n, len - n);
+		key->len = len - 2;
+	} else {
+		memcpy(key->p, k, len);
+		key->len = len;
+	}
+	key->p[key->len] = '\0';
+
+	return key;
+}
+
+static void kvsal_reset_list(kvsal_list_t *list)
+{
+	int shard;
+
+	if (list->content)
+		free(list->content);
+	if (list->seen)
+		tdestroy(list->seen, free);
+
+	list->content = NULL;
+	list->size = 0;
+	list->offset = 0;
+	list->cursor = 0;
+	list->done = false;
+	list->seen = NULL;
+	list->replica = read_replica && !in_transaction;
+
+	/* The shards that may hold keys matching the pattern are scanned in
+	 * turn, a map's fields are all on its own */
+	shard = list->fields ? kvsal_shard_of(list->pattern) :
+			       kvsal_pattern_shard(list->pattern);
+	list->shard = (shard < 0) ? 0 : shard;
+	list->last_shard = (shard < 0) ? pool.nb_shards - 1 : shard;
+}
+
+/* Get the next batch of keys with a SCAN, or of fields with a HSCAN. A key
+ * may be returned more than once, those already seen are kept to filter out
+ * duplicates */
+static int kvsal_scan_list(kvsal_list_t *list)
+{
+	redisReply *reply;
+	redisReply *keys;
+	kvsal_slice_t *content;
+	kvsal_slice_t *key;
+	char wpattern[KVSAL_WIRE_KLEN];
+	void *node;
+	int shard = list->shard;
+	size_t i;
+
+	/* A cursor is only valid on the server that returned it: a listing
+	 * started on a replica goes on there */
+	if (list->replica && pool.shards[KVSAL_REPLICA(shard)].hostname != NULL)
+		shard = KVSAL_REPLICA(shard);
+
+	KVSAL_CONNECT(shard);
+
+	if (list->fields)
+		reply = redisCommand(rediscontext, "HSCAN %s %llu COUNT %d",
+				     kvsal_wire_key(list->pattern, wpattern),
+				     list->cursor, KVSAL_SCAN_COUNT);
+	else
+		reply = redisCommand(rediscontext,
+				     "SCAN %llu MATCH %s COUNT %d",
+				     list->cursor,
+				     kvsal_wire_key(list->pattern, wpattern),
+				     KVSAL_SCAN_COUNT);
+	if (!reply)
+		return -1;
+	if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 2 ||
+	    reply->element[0]->type != REDIS_REPLY_STRING ||
+	    reply->element[1]->type != REDIS_REPLY_ARRAY) {
+		freeReplyObject(reply);
+		return -1;
+	}
+
+	list->cursor = strtoull(reply->element[0]->str, NULL, 10);
+	if (list->cursor == 0) {
+		if (list->shard < list->last_shard)
+			list->shard += 1;
+		else
+			list->done = true;
+	}
+
+	keys = reply->element[1];
+	if (keys->elements == 0) {
+		freeReplyObject(reply);
+		return 0;
+	}
+
+	content = realloc(list->content,
+			  (list->size + keys->elements) * sizeof(kvsal_slice_t));
+	if (content == NULL) {
+		freeReplyObject(reply);
+		return -ENOMEM;
+	}
+	list->content = content;
+
+	/* HSCAN returns each field followed by its value */
+	for (i = 0; i < keys->elements; i += (list->fields) ? 2 : 1) {
+		/* A map's fields are not given hash tags */
+		key = kvsal_list_key(keys->element[i]->str,
+				     keys->element[i]->len, !list->fields);
+		if (key == NULL) {
+			freeReplyObject(reply);
+			return -ENOMEM;
+		}
+
+		node = tsearch(key, &list->seen, kvsal_slicecmp);
+		if (node == NULL) {
+			free(key);
+			freeReplyObject(reply);
+			return -ENOMEM;
+		}
+
+		/* Already listed */
+		if (*(kvsal_slice_t **)node != key) {
+			free(key);
+			continue;
+		}
+
+		content[list->size] = *key;
+		list->size += 1;
+	}
+
+	freeReplyObject(reply);
+	return 0;
+}
+
+/* Forget about the items located before start in the listing */
+static void kvsal_consume_list(kvsal_list_t *list, int start)
+{
+	size_t nb;
+
+	if (start <= list->offset)
+		return;
+
+	nb = start - list->offset;
+	if (nb > list->size)
+		nb = list->size;
+
+	memmove(list->content, &list->content[nb],
+		(list->size - nb) * sizeof(kvsal_slice_t));
+	list->size -= nb;
+	list->offset += nb;
+}
+
+int kvsal_get_list_pattern(char *pattern, int start, int *size,
+			   kvsal_item_t *items)
+{
+	kvsal_list_t list;
+	int rc;
+
+	if (!pattern || !size || !items)
+		return -EINVAL;
+
+	RC_WRAP(kvsal_init_list, &list);
+	RC_WRAP(kvsal_fetch_list, pattern, &list);
+
+	rc = kvsal_get_list(&list, start, size, items);
+
+	kvsal_dispose_list(&list);
+	return rc;
+}
+
+int kvsal_get_list_size(char *pattern)
+{
+	kvsal_list_t list;
+	int rc;
+	int size = 0;
+
+	if (!pattern)
+		return -EINVAL;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	RC_WRAP(kvsal_init_list, &list);
+	RC_WRAP(kvsal_fetch_list, pattern, &list);
+
+	/* Only count the keys, do not keep them */
+	do {
+		rc = kvsal_scan_list(&list);
+		if (rc != 0)
+			break;
+		size += list.size;
+		kvsal_consume_list(&list, list.offset + list.size);
+	} while (!list.done);
+
+	kvsal_dispose_list(&list);
+	return (rc != 0) ? rc : size;
+}
+
+int kvsal_init_list(kvsal_list_t *list)
+{
+	if (!list)
+		return -EINVAL;
+
+	memset(list, 0, sizeof(kvsal_list_t));
+
+	return 0;
+}
+
+int kvsal_fetch_list(char *pattern, kvsal_list_t *list)
+{
+	if (!pattern || !list)
+		return -EINVAL;
+
+	/* Nothing is read here, keys are scanned as the list is read */
+	memset(list, 0, sizeof(kvsal_list_t));
+	strncpy(list->pattern, pattern, KLEN);
+	list->pattern[KLEN - 1] = '\0';
+	kvsal_reset_list(list);
+
+	return 0;
+}
+
+int kvsal_fetch_field_list(char *k, kvsal_list_t *list)
+{
+	RC_WRAP(kvsal_fetch_list, k, list);
+
+	/* The list is made of the fields of map k */
+	list->fields = true;
+	kvsal_reset_list(list);
+
+	return 0;
+}
+
+int kvsal_dispose_list(kvsal_list_t *list)
+{
+	if (!list)
+		return -EINVAL;
+
+	kvsal_reset_list(list);
+	return 0;
+}
+
+int kvsal_get_list_slices(kvsal_list_t *list, int start, int *end,
+			  kvsal_slice_t *items)
+{
+	int nb;
+
+	if (!list || !end || !items || start < 0 || *end < 0)
+		return -EINVAL;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	/* Going backward, the listing has to be done again */
+	if (start < list->offset)
+		kvsal_reset_list(list);
+
+	for (;;) {
+		kvsal_consume_list(list, start);
+		if (list->done ||
+		    list->offset + (int)list->size >= start + *end)
+			break;
+		RC_WRAP(kvsal_scan_list, list);
+	}
+
+	nb = list->offset + (int)list->size - start;
+	if (nb < 0)
+		nb = 0;
+	if (nb > *end)
+		nb = *end;
+
+	if (nb > 0)
+		memcpy(items, &list->content[start - list->offset],
+		       nb * sizeof(kvsal_slice_t));
+	*end = nb;
+
+	return 0;
+}
+
+int kvsal_get_list(kvsal_list_t *list, int start, int *end,
+		    kvsal_item_t *items)
+{
+	size_t mark = kvsal_arena_mark();
+	kvsal_slice_t *slices;
+	size_t len;
+	int rc;
+	int i;
+
+	if (!items || !end || *end < 0)
+		return -EINVAL;
+
+	slices = kvsal_arena_alloc(MAX(*end, 1) * sizeof(kvsal_slice_t));
+	if (slices == NULL)
+		return -ENOMEM;
+
+	rc = kvsal_get_list_slices(list, start, end, slices);
+	if (rc != 0) {
+		kvsal_arena_release(mark);
+		return rc;
+	}
+
+	for (i = 0; i < *end ; i++) {
+		len = MIN(slices[i].len, KLEN - 1);
+		memcpy(items[i].str, slices[i].p, len);
+		items[i].str[len] = '\0';
+		items[i].offset = start + i;
+	}
+	kvsal_arena_release(mark);
+
+	return 0;
+}
+
+/* Builds the command for an op, argv and argvlen have room for 4 items, wk
+ * for the key as sent, off for SETRANGE's offset. A key longer than wk is
+ * sent from the arena. Returns the number of items, -EINVAL or -ENOMEM */
+static int kvsal_op_argv(kvsal_op_t *op, const char **argv, size_t *argvlen,
+			 char *wk, char *off)
+{
+	int argc = 0;
+
+	switch (op->type) {
+	case KVSAL_OP_GET:
+		argv[argc] = op->field ? "HGET" : "GET";
+		break;
+
+	case KVSAL_OP_SET:
+		argv[argc] = op->field ? "HSET" : "SET";
+		break;
+
+	case KVSAL_OP_DEL:
+		argv[argc] = op->field ? "HDEL" : "DEL";
+		break;
+
+	case KVSAL_OP_EXISTS:
+		argv[argc] = op->field ? "HEXISTS" : "EXISTS";
+		break;
+
+	case KVSAL_OP_SETRANGE:
+		if (op->field)
+			return -EINVAL;
+		argv[argc] = "SETRANGE";
+		break;
+
+	default:
+		return -EINVAL;
+	}
+	argvlen[argc] = strlen(argv[argc]);
+	argc += 1;
+
+	argv[argc] = kvsal_wire_key_any(op->k, wk);
+	if (argv[argc] == NULL)
+		return -ENOMEM;
+	argvlen[argc] = strlen(argv[argc]);
+	argc += 1;
+
+	if (op->field) {
+		argv[argc] = op->field;
+		argvlen[argc] = strlen(op->field);
+		argc += 1;
+	}
+
+	if (op->type == KVSAL_OP_SETRANGE) {
+		argv[argc] = off;
+		argvlen[argc] = snprintf(off, KVSAL_OFF_LEN, "%zu", op->off);
+		argc += 1;
+	}
+
+	if (op->type == KVSAL_OP_SET || op->type == KVSAL_OP_SETRANGE) {
+		argv[argc] = op->v;
+		argvlen[argc] = op->vlen;
+		argc += 1;
+	}
+
+	return argc;
+}
+
+static int kvsal_append_op(redisContext *ctx, kvsal_op_t *op)
+{
+	const char *argv[4];
+	size_t argvlen[4];
+	char wk[KVSAL_WIRE_KLEN];
+	char off[KVSAL_OFF_LEN];
+	size_t mark = kvsal_arena_mark();
+	int argc;
+	int rc;
+
+	argc = kvsal_op_argv(op, argv, argvlen, wk, off);
+	if (argc < 0)
+		rc = REDIS_ERR;
+	else
+		rc = redisAppendCommandArgv(ctx, argc, argv, argvlen);
+	kvsal_arena_release(mark);
+
+	return rc;
+}
+
+/* Queues a SET or DEL op with the transaction */
+static int kvsal_queue_op(kvsal_op_t *op)
+{
+	const char *argv[4];
+	size_t argvlen[4];
+	char wk[KVSAL_WIRE_KLEN];
+	char off[KVSAL_OFF_LEN];
+	char *cmd;
+	size_t mark = kvsal_arena_mark();
+	long long len;
+	int argc;
+	int rc;
+
+	argc = kvsal_op_argv(op, argv, argvlen, wk, off);
+	len = (argc < 0) ? argc :
+	      redisFormatCommandArgv(&cmd, argc, argv, argvlen);
+	kvsal_arena_release(mark);
+	if (argc < 0)
+		return argc;
+	if (len < 0)
+		return -ENOMEM;
+
+	rc = kvsal_queue_formatted(op->k, strlen(op->k), cmd, len);
+	free(cmd);
+
+	return rc;
+}
+
+static void kvsal_op_result(kvsal_op_t *op, redisReply *reply)
+{
+	if (reply->type == REDIS_REPLY_ERROR) {
+		op->rc = -1;
+		return;
+	}
+
+	switch (op->type) {
+	case KVSAL_OP_GET:
+		if (reply->type != REDIS_REPLY_STRING) {
+			op->rc = -ENOENT;
+			break;
+		}
+
+		if (reply->len > op->vlen) {
+			op->rc = -ENOBUFS;
+			break;
+		}
+
+		memcpy(op->v, reply->str, reply->len);
+		if (reply->len < op->vlen)
+			op->v[reply->len] = '\0';
+		op->vlen = reply->len;
+		op->rc = 0;
+		break;
+
+	case KVSAL_OP_EXISTS:
+		op->rc = (reply->integer == 0) ? -ENOENT : 0;
+		break;
+
+	case KVSAL_OP_SETRANGE:
+		op->vlen = reply->integer;
+		op->rc = 0;
+		break;
+
+	default:
+		op->rc = 0;
+		break;
+	}
+}
+
+/* Runs an op on its own, wherever the cluster redirects it */
+static int kvsal_op_command(kvsal_op_t *op)
+{
+	const char *argv[4];
+	size_t argvlen[4];
+	char wk[KVSAL_WIRE_KLEN];
+	char off[KVSAL_OFF_LEN];
+	redisReply *reply;
+	char *cmd;
+	size_t mark = kvsal_arena_mark();
+	long long len;
+	int argc;
+	int rc;
+
+	argc = kvsal_op_argv(op, argv, argvlen, wk, off);
+	len = (argc < 0) ? argc :
+	      redisFormatCommandArgv(&cmd, argc, argv, argvlen);
+	kvsal_arena_release(mark);
+	if (argc < 0)
+		return argc;
+	if (len < 0)
+		return -ENOMEM;
+
+	rc = kvsal_command_formatted(&reply, kvsal_shard_of(op->k), false, cmd,
+				     len);
+	free(cmd);
+	if (rc != 0)
+		return rc;
+
+	kvsal_op_result(op, reply);
+	freeReplyObject(reply);
+
+	return 0;
+}
+
+/* The shards the ops are about */
+static void kvsal_ops_shards(kvsal_op_t *ops, int nb_ops, bool *used)
+{
+	int i;
+
+	memset(used, 0, KVSAL_MAX_SHARDS * sizeof(bool));
+	for (i = 0; i < nb_ops ; i++)
+		used[kvsal_shard_of(ops[i].k)] = true;
+}
+
+int kvsal_batch(kvsal_op_t *ops, int nb_ops)
+{
+	struct kvsal_hold holds[KVSAL_MAX_SHARDS];
+	bool used[KVSAL_MAX_SHARDS];
+	bool failed[KVSAL_MAX_SHARDS];
+	redisReply *reply;
+	bool redirected = false;
+	bool read = true;
+	bool ask;
+	int shard;
+	int rc;
+	int s;
+	int i;
+
+	if (!ops || nb_ops < 0)
+		return -EINVAL;
+
+	for (i = 0; i < nb_ops ; i++)
+		if (!ops[i].k)
+			return -EINVAL;
+
+	if (in_transaction) {
+		/* Writes are queued with the transaction, reads make no sense
+		 * as their result would only be known at EXEC time */
+		for (i = 0; i < nb_ops ; i++) {
+			if (ops[i].type != KVSAL_OP_SET &&
+			    ops[i].type != KVSAL_OP_DEL) {
+				ops[i].rc = -EINVAL;
+				continue;
+			}
+
+			RC_WRAP(kvsal_queue_op, &ops[i]);
+			ops[i].rc = 0;
+		}
+		return 0;
+	}
+
+	/* Only reads may go to replicas */
+	for (i = 0; i < nb_ops ; i++)
+		if (ops[i].type != KVSAL_OP_GET &&
+		    ops[i].type != KVSAL_OP_EXISTS)
+			read = false;
+
+	/* Pipeline: send every command to its shard, then read every reply.
+	 * Each shard replies in order */
+	kvsal_ops_shards(ops, nb_ops, used);
+	rc = kvsal_acquire_set(used, holds, read);
+
+	if (rc != 0)
+		goto out;
+
+	for (i = 0; i < nb_ops ; i++) {
+		shard = holds[kvsal_shard_of(ops[i].k)].shard;
+		if (kvsal_append_op(kvsal_context(shard),
+				    &ops[i]) != REDIS_OK) {
+			kvsal_drop_set(used, holds);
+			rc = -1;
+			goto out;
+		}
+	}
+
+	/* Once a shard failed, the replies of the others are still read, so
+	 * that none is left for the next user of their connection */
+	memset(failed, 0, sizeof(failed));
+	for (i = 0; i < nb_ops ; i++) {
+		s = kvsal_shard_of(ops[i].k);
+		if (failed[s]) {
+			ops[i].rc = -1;
+			continue;
+		}
+
+		shard = holds[s].shard;
+		if (redisGetReply(kvsal_context(shard),
+				  (void **)&reply) != REDIS_OK) {
+			kvsal_drop_shard(shard);
+			failed[s] = true;
+			ops[i].rc = -1;
+			rc = -1;
+			continue;
+		}
+
+		/* Ops on slots that moved are run again once all the replies
+		 * are read */
+		if (kvsal_redirect(reply, &ask) >= 0) {
+			ops[i].rc = -EAGAIN;
+			redirected = true;
+		} else
+			kvsal_op_result(&ops[i], reply);
+		freeReplyObject(reply);
+	}
+
+	for (i = 0; rc == 0 && redirected && i < nb_ops ; i++)
+		if (ops[i].rc == -EAGAIN && kvsal_op_command(&ops[i]) != 0)
+			ops[i].rc = -1;
+
+out:
+	kvsal_release_set(used, holds);
+	return rc;
+}
+
+int kvsal_mget(kvsal_op_t *ops, int nb_ops)
+{
+	struct kvsal_hold holds[KVSAL_MAX_SHARDS];
+	bool used[KVSAL_MAX_SHARDS];
+	redisReply *replies[KVSAL_MAX_SHARDS];
+	size_t next[KVSAL_MAX_SHARDS];
+	const char **argv;
+	redisReply *reply;
+	size_t mark;
+	bool sent;
+	int argc;
+	int rc;
+	int s;
+	int i;
+
+	if (!ops || nb_ops < 0)
+		return -EINVAL;
+
+	if (nb_ops == 0)
+		return 0;
+
+	if (in_transaction)
+		return -EINVAL;
+
+	for (i = 0; i < nb_ops ; i++)
+		if (ops[i].type != KVSAL_OP_GET || !ops[i].k || ops[i].field)
+			return -EINVAL;
+
+	/* In cluster mode, a MGET may only be about keys of a single slot */
+	if (pool.cluster)
+		return kvsal_batch(ops, nb_ops);
+
+	mark = kvsal_arena_mark();
+	argv = kvsal_arena_alloc((nb_ops + 1) * sizeof(char *));
+	if (!argv)
+		return -ENOMEM;
+
+	/* A MGET per shard, all sent at once */
+	for (s = 0; s < pool.nb_shards ; s++) {
+		replies[s] = NULL;
+		next[s] = 0;
+	}
+
+	kvsal_ops_shards(ops, nb_ops, used);
+	rc = kvsal_acquire_set(used, holds, true);
+
+	for (s = 0; rc == 0 && s < pool.nb_shards ; s++) {
+		if (!used[s])
+			continue;
+
+		argv[0] = "MGET";
+		argc = 1;
+		for (i = 0; i < nb_ops ; i++)
+			if (kvsal_shard_of(ops[i].k) == s)
+				argv[argc++] = ops[i].k;
+
+		if (redisAppendCommandArgv(kvsal_context(holds[s].shard),
+					   argc, argv, NULL) != REDIS_OK) {
+			kvsal_drop_set(used, holds);
+			rc = -1;
+		}
+	}
+	kvsal_arena_release(mark);
+	sent = (rc == 0);
+
+	/* Every shard's reply is read, even once one is wrong */
+	for (s = 0; sent && s < pool.nb_shards ; s++) {
+		if (!used[s])
+			continue;
+
+		if (redisGetReply(kvsal_context(holds[s].shard),
+				  (void **)&replies[s]) != REDIS_OK) {
+			kvsal_drop_shard(holds[s].shard);
+			replies[s] = NULL;
+			rc = -1;
+		} else if (replies[s]->type != REDIS_REPLY_ARRAY)
+			rc = -1;
+	}
+
+	for (i = 0; rc == 0 && i < nb_ops ; i++) {
+		s = kvsal_shard_of(ops[i].k);
+		reply = replies[s];
+		if (next[s] >= reply->elements) {
+			rc = -1;
+			break;
+		}
+		kvsal_op_result(&ops[i], reply->element[next[s]++]);
+	}
+
+	for (s = 0; s < pool.nb_shards ; s++)
+		if (replies[s] != NULL)
+			freeReplyObject(replies[s]);
+
+	kvsal_release_set(used, holds);
+	return rc;
+}
+
+/* Sends, or queues with the transaction, a MSET of the ops of shard */
+static int kvsal_append_mset(int shard, kvsal_op_t *ops, int nb_ops,
+			     const char **argv, size_t *argvlen)
+{
+	char *cmd;
+	char *k = NULL;
+	long long len;
+	int argc = 1;
+	int rc;
+	int i;
+
+	argv[0] = "MSET";
+	argvlen[0] = strlen(argv[0]);
+	for (i = 0; i < nb_ops ; i++) {
+		if (kvsal_shard_of(ops[i].k) != shard)
+			continue;
+		k = ops[i].k;
+		argv[argc] = ops[i].k;
+		argvlen[argc] = strlen(ops[i].k);
+		argv[argc + 1] = ops[i].v;
+		argvlen[argc + 1] = ops[i].vlen;
+		argc += 2;
+	}
+
+	if (in_transaction) {
+		len = redisFormatCommandArgv(&cmd, argc, argv, argvlen);
+		if (len < 0)
+			return -ENOMEM;
+		rc = kvsal_queue_formatted(k, strlen(k), cmd, len);
+		free(cmd);
+		return rc;
+	}
+
+	if (redisAppendCommandArgv(kvsal_context(shard), argc, argv,
+				   argvlen) != REDIS_OK)
+		return -1;
+
+	return 0;
+}
+
+int kvsal_mset(kvsal_op_t *ops, int nb_ops)
+{
+	struct kvsal_hold holds[KVSAL_MAX_SHARDS];
+	bool used[KVSAL_MAX_SHARDS];
+	int results[KVSAL_MAX_SHARDS];
+	const char **argv;
+	size_t *argvlen;
+	size_t mark;
+	int rc = 0;
+	int s;
+	int i;
+
+	if (!ops || nb_ops < 0)
+		return -EINVAL;
+
+	if (nb_ops == 0)
+		return 0;
+
+	for (i = 0; i < nb_ops ; i++)
+		if (ops[i].type != KVSAL_OP_SET || !ops[i].k || ops[i].field)
+			return -EINVAL;
+
+	/* Same as MGET */
+	if (pool.cluster)
+		return kvsal_batch(ops, nb_ops);
+
+	mark = kvsal_arena_mark();
+	argv = kvsal_arena_alloc((2 * nb_ops + 1) * sizeof(char *));
+	argvlen = kvsal_arena_alloc((2 * nb_ops + 1) * sizeof(size_t));
+	if (!argv || !argvlen) {
+		kvsal_arena_release(mark);
+		return -ENOMEM;
+	}
+
+	/* A MSET per shard, all sent at once */
+	kvsal_ops_shards(ops, nb_ops, used);
+	if (!in_transaction)
+		rc = kvsal_acquire_set(used, holds, false);
+
+	for (s = 0; rc == 0 && s < pool.nb_shards ; s++) {
+		if (!used[s])
+			continue;
+
+		rc = kvsal_append_mset(s, ops, nb_ops, argv, argvlen);
+
+		/* The MSETs buffered for other shards must not be sent */
+		if (rc != 0 && !in_transaction)
+			kvsal_drop_set(used, holds);
+	}
+	kvsal_arena_release(mark);
+
+	for (s = 0; s < pool.nb_shards ; s++) {
+		results[s] = rc;
+		if (rc == 0 && used[s] && !in_transaction)
+			results[s] = kvsal_read_reply(s, 0);
+	}
+
+	for (i = 0; i < nb_ops ; i++) {
+		ops[i].rc = results[kvsal_shard_of(ops[i].k)];
+		if (ops[i].rc != 0)
+			rc = ops[i].rc;
+	}
+
+	if (!in_transaction)
+		kvsal_release_set(used, holds);
+	return rc;
+}
+
+/* Script ids are shared by all threads, any of them may reload a script
+ * once the server forgot about it */
+static pthread_mutex_t script_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Scripts get the same id on every server, from their body's SHA1 */
+static int kvsal_load_script_shard(kvsal_script_t *script, int shard)
 {
 	redisReply *reply;
+	int rc = 0;
 
-	if (!rediscontext)
-		if (kvsal_reinit() != 0)
-			return -1;
+	KVSAL_CONNECT(shard);
 
-	reply = redisCommand(rediscontext, "MULTI");
+	reply = redisCommand(rediscontext, "SCRIPT LOAD %s", script->body);
 	if (!reply)
 		return -1;
 
-	if (reply->type != REDIS_REPLY_STATUS) {
-		freeReplyObject(reply);
-		return -1;
-	}
-
-	if (strncmp(reply->str, "OK", reply->len)) {
-		freeReplyObject(reply);
-		return -1;
-	}
+	if (reply->type == REDIS_REPLY_STRING &&
+	    reply->len < KVSAL_SCRIPT_IDLEN) {
+		pthread_mutex_lock(&script_lock);
+		memcpy(script->id, reply->str, reply->len);
+		script->id[reply->len] = '\0';
+		pthread_mutex_unlock(&script_lock);
+	} else if (reply->type == REDIS_REPLY_ERROR)
+		rc = -ENOTSUP;
+	else
+		rc = -1;
 
 	freeReplyObject(reply);
-	return 0;
+
+	return rc;
 }
 
-int kvsal_end_transaction(void)
+int kvsal_load_script(kvsal_script_t *script)
 {
-	redisReply *reply;
-	int i;
+	int s;
 
-	if (!rediscontext)
-		if (kvsal_reinit() != 0)
-			return -1;
-
-	reply = redisCommand(rediscontext, "EXEC");
-	if (!reply)
-		return -1;
+	if (!script || !script->body)
+		return -EINVAL;
 
-	if (reply->type != REDIS_REPLY_ARRAY) {
-		freeReplyObject(reply);
-		return -1;
-	}
+	if (in_transaction)
+		return -EINVAL;
 
-	for (i = 0; i < reply->elements ; i++)
-		if (strncmp(reply->element[i]->str, "OK",
-			    reply->element[i]->len)) {
-			freeReplyObject(reply);
-			return -1;
-		}
+	for (s = 0; s < pool.nb_shards ; s++)
+		RC_WRAP(kvsal_load_script_shard, script, s);
 
-	freeReplyObject(reply);
 	return 0;
 }
 
-int kvsal_discard_transaction(void)
+/* Copies the strings following the integer of a script's array reply */
+static int kvsal_script_values(redisReply *reply, kvsal_slice_t *values,
+			       int *nb_values)
 {
-	redisReply *reply;
+	redisReply *r;
+	int i;
 
-	if (!rediscontext)
-		if (kvsal_reinit() != 0)
-			return -1;
+	if (reply->elements - 1 > *nb_values)
+		return -ENOBUFS;
 
-	reply = redisCommand(rediscontext, "DISCARD");
-	if (!reply)
-		return -1;
+	for (i = 0; i < reply->elements - 1 ; i++) {
+		r = reply->element[i + 1];
+		if (r->type != REDIS_REPLY_STRING)
+			return -EIO;
 
-	if (reply->type != REDIS_REPLY_STATUS) {
-		freeReplyObject(reply);
-		return -1;
-	}
+		if (r->len > values[i].len)
+			return -ENOBUFS;
 
-	if (strncmp(reply->str, "OK", reply->len)) {
-		freeReplyObject(reply);
-		return -1;
+		memcpy(values[i].p, r->str, r->len);
+		values[i].len = r->len;
 	}
+	*nb_values = i;
 
-	freeReplyObject(reply);
 	return 0;
 }
 
-int kvsal_exists(char *k)
+/* Returns -ENOENT if the server does not know the script, -EXDEV if the
+ * cluster tells its keys are elsewhere */
+static int kvsal_evalsha(kvsal_script_t *script, int argc, const char **argv,
+			 size_t *argvlen, long long *ret,
+			 kvsal_slice_t *values, int *nb_values)
 {
 	redisReply *reply;
+	char id[KVSAL_SCRIPT_IDLEN];
+	bool ask;
+	int rc = 0;
 
-	if (!k)
-		return -EINVAL;
+	pthread_mutex_lock(&script_lock);
+	strcpy(id, script->id);
+	pthread_mutex_unlock(&script_lock);
 
-	if (!rediscontext)
-		if (kvsal_reinit() != 0)
-			return -1;
+	if (id[0] == '\0')
+		return -ENOENT;
 
-	/* Set a key */
-	reply = redisCommand(rediscontext, "EXISTS %s", k);
-	if (!reply)
-		return -1;
+	argv[1] = id;
+	argvlen[1] = strlen(id);
 
-	if (reply->type != REDIS_REPLY_INTEGER)
+	reply = redisCommandArgv(rediscontext, argc, argv, argvlen);
+	if (!reply)
 		return -1;
 
-	if (reply->integer == 0)
-		return -ENOENT;
+	if (reply->type == REDIS_REPLY_INTEGER && values == NULL)
+		*ret = reply->integer;
+	else if (reply->type == REDIS_REPLY_ARRAY && values != NULL &&
+		 reply->elements > 0 &&
+		 reply->element[0]->type == REDIS_REPLY_INTEGER) {
+		*ret = reply->element[0]->integer;
+		rc = kvsal_script_values(reply, values, nb_values);
+	} else if (reply->type == REDIS_REPLY_ERROR &&
+		 !strncmp(reply->str, "NOSCRIPT", strlen("NOSCRIPT")))
+		rc = -ENOENT;
+	else if (reply->type == REDIS_REPLY_ERROR &&
+		 strstr(reply->str, "unknown command"))
+		rc = -ENOTSUP;
+	else if (kvsal_redirect(reply, &ask) >= 0 ||
+		 (reply->type == REDIS_REPLY_ERROR &&
+		  !strncmp(reply->str, "CROSSSLOT", strlen("CROSSSLOT"))))
+		rc = -EXDEV;
+	else
+		rc = -EIO;
 
 	freeReplyObject(reply);
 
-	return 0;
+	return rc;
 }
 
-int kvsal_set_char(char *k, char *v)
+/* argv and argvlen have room for the nb_keys + nb_args + 3 arguments of
+ * EVALSHA, wkeys for the nb_keys keys sent. To be called within an arena
+ * mark */
+static int kvsal_run_script_argv(kvsal_script_t *script, int nb_keys,
+				 char **keys, int nb_args, char **args,
+				 size_t *argslen, long long *ret,
+				 kvsal_slice_t *values, int *nb_values,
+				 const char **argv, size_t *argvlen,
+				 char (*wkeys)[KVSAL_WIRE_KLEN])
 {
-	redisReply *reply;
+	char numkeys[VLEN];
+	int shard = 0;
+	int slot = 0;
+	int argc;
+	int rc;
+	int i;
 
-	if (!k || !v)
+	/* A script runs on a single server, with all of its keys. In cluster
+	 * mode, they must even be in the same slot */
+	for (i = 0; i < nb_keys ; i++) {
+		if (i == 0) {
+			shard = kvsal_shard_of(keys[i]);
+			slot = pool.cluster ? kvsal_slot_of(keys[i]) : 0;
+		} else if (kvsal_shard_of(keys[i]) != shard ||
+			   (pool.cluster && kvsal_slot_of(keys[i]) != slot))
+			return -EXDEV;
+	}
+
+	KVSAL_CONNECT(shard);
+
+	if (in_transaction)
 		return -EINVAL;
 
-	if (!rediscontext)
-		if (kvsal_reinit() != 0)
-			return -1;
+	/* EVALSHA <id> <numkeys> <keys> <args>, id is set when sent */
+	snprintf(numkeys, VLEN, "%d", nb_keys);
+	argv[0] = "EVALSHA";
+	argvlen[0] = strlen("EVALSHA");
+	argv[2] = numkeys;
+	argvlen[2] = strlen(numkeys);
+	argc = 3;
+
+	/* Longer keys are sent from the arena */
+	for (i = 0; i < nb_keys ; i++, argc++) {
+		argv[argc] = kvsal_wire_key_any(keys[i], wkeys[i]);
+		if (argv[argc] == NULL)
+			return -ENOMEM;
+		argvlen[argc] = strlen(argv[argc]);
+	}
 
-	/* Set a key */
-	reply = redisCommand(rediscontext, "SET %s %s", k, v);
-	if (!reply)
-		return -1;
+	for (i = 0; i < nb_args ; i++, argc++) {
+		argv[argc] = args[i];
+		argvlen[argc] = argslen[i];
+	}
 
-	freeReplyObject(reply);
+	rc = kvsal_evalsha(script, argc, argv, argvlen, ret, values,
+			   nb_values);
+	if (rc != -ENOENT)
+		return rc;
 
-	return 0;
+	/* Never loaded, or the server restarted or flushed its scripts */
+	RC_WRAP(kvsal_load_script_shard, script, shard);
+
+	return kvsal_evalsha(script, argc, argv, argvlen, ret, values,
+			     nb_values);
 }
 
-int kvsal_get_char(char *k, char *v)
+static int kvsal_run_script_reply(kvsal_script_t *script, int nb_keys,
+				  char **keys, int nb_args, char **args,
+				  size_t *argslen, long long *ret,
+				  kvsal_slice_t *values, int *nb_values)
 {
-	redisReply *reply;
+	char (*wkeys)[KVSAL_WIRE_KLEN];
+	const char **argv;
+	size_t *argvlen;
+	size_t mark;
+	int rc;
 
-	if (!k || !v)
+	if (!script || !script->body || !ret || nb_keys < 0 || nb_args < 0 ||
+	    (nb_keys > 0 && !keys) || (nb_args > 0 && (!args || !argslen)))
 		return -EINVAL;
 
-	if (!rediscontext)
-		if (kvsal_reinit() != 0)
-			return -1;
+	/* A script may be given many keys and args, as a batch of creations */
+	mark = kvsal_arena_mark();
+	argv = kvsal_arena_alloc((nb_keys + nb_args + 3) * sizeof(char *));
+	argvlen = kvsal_arena_alloc((nb_keys + nb_args + 3) * sizeof(size_t));
+	wkeys = kvsal_arena_alloc(MAX(nb_keys, 1) * KVSAL_WIRE_KLEN);
+	if (!argv || !argvlen || !wkeys)
+		rc = -ENOMEM;
+	else
+		rc = kvsal_run_script_argv(script, nb_keys, keys, nb_args,
+					   args, argslen, ret, values,
+					   nb_values, argv, argvlen, wkeys);
+	kvsal_arena_release(mark);
 
-	/* Try a GET and two INCR */
-	reply = NULL;
-	reply = redisCommand(rediscontext, "GET %s", k);
-	if (!reply)
-		return -1;
+	return rc;
+}
 
-	if (reply->len == 0)
-		return -ENOENT;
+int kvsal_run_script(kvsal_script_t *script, int nb_keys, char **keys,
+		     int nb_args, char **args, size_t *argslen,
+		     long long *ret)
+{
+	return kvsal_run_script_reply(script, nb_keys, keys, nb_args, args,
+				      argslen, ret, NULL, NULL);
+}
 
-	strcpy(v, reply->str);
-	freeReplyObject(reply);
+int kvsal_run_walk_script(kvsal_script_t *script, int nb_keys, char **keys,
+			  int nb_args, char **args, size_t *argslen,
+			  long long *ret, kvsal_slice_t *values,
+			  int *nb_values)
+{
+	if (!values || !nb_values || *nb_values < 0)
+		return -EINVAL;
 
-	return 0;
+	/* The keys it finds may be anywhere else, or lack their hash tag */
+	if (pool.nb_shards > 1 || pool.cluster)
+		return -EXDEV;
+
+	return kvsal_run_script_reply(script, nb_keys, keys, nb_args, args,
+				      argslen, ret, values, nb_values);
 }
 
-int kvsal_set_stat(char *k, struct stat *buf)
+static void *kvsal_watcher(void *arg)
 {
+	struct kvsal_shard *shard = arg;
 	redisReply *reply;
+	char *k;
+
+	while (!watch_stop) {
+		if (redisGetReply(shard->watchcontext,
+				  (void **)&reply) != REDIS_OK)
+			break;
+
+		/* "pmessage" <pattern> "__keyspace@<db>__:<key>" <event> */
+		if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 4 &&
+		    reply->element[2]->type == REDIS_REPLY_STRING) {
+			k = strstr(reply->element[2]->str, "__:");
+			if (k != NULL)
+				watch_cb(kvsal_user_key(k + 3), watch_arg);
+		}
 
-	size_t size = sizeof(struct stat);
+		freeReplyObject(reply);
+	}
 
-	if (!k || !buf)
-		return -EINVAL;
+	/* Notifications are lost from now on */
+	if (!watch_stop)
+		watch_cb(NULL, watch_arg);
 
-	if (!rediscontext)
-		if (kvsal_reinit() != 0)
-			return -1;
+	return NULL;
+}
 
-	/* Set a key */
-	reply = redisCommand(rediscontext, "SET %s %b", k, buf, size);
+/* The server only notifies if "notify-keyspace-events" has K (keyspace
+ * events) along with A (all) or g$h (generic, string and hash commands).
+ * The check is skipped if CONFIG is not available to this client */
+static int kvsal_check_notify_config(redisContext *ctx)
+{
+	redisReply *reply;
+	char *flags;
+	int rc = 0;
+
+	reply = redisCommand(ctx, "CONFIG GET notify-keyspace-events");
 	if (!reply)
 		return -1;
 
-	freeReplyObject(reply);
+	if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 2 &&
+	    reply->element[1]->type == REDIS_REPLY_STRING) {
+		flags = reply->element[1]->str;
+		if (!strchr(flags, 'K') ||
+		    (!strchr(flags, 'A') &&
+		     (!strchr(flags, 'g') || !strchr(flags, '$') ||
+		      !strchr(flags, 'h'))))
+			rc = -ENOTSUP;
+	}
 
-	return 0;
+	freeReplyObject(reply);
+	return rc;
 }
 
-int kvsal_get_stat(char *k, struct stat *buf)
+/* Subscribes a connection of its own to the shard, for the patterns */
+static int kvsal_watch_shard(struct kvsal_shard *shard, int nb_patterns,
+			     const char **argv)
 {
 	redisReply *reply;
+	struct timeval timeout = { 1, 500000 }; /* 1.5 seconds */
+	struct timeval no_timeout = { 0, 0 };
+	redisContext *ctx;
+	int rc = 0;
+	int i;
 
-	if (!k || !buf)
-		return -EINVAL;
+	ctx = redisConnectWithTimeout(shard->hostname, shard->port, timeout);
+	if (ctx == NULL || ctx->err) {
+		if (ctx)
+			redisFree(ctx);
+		return -ENOTCONN;
+	}
 
-	if (!rediscontext)
-		if (kvsal_reinit() != 0)
-			return -1;
+	/* The watcher waits for notifications as long as needed */
+	redisSetTimeout(ctx, no_timeout);
 
-	reply = redisCommand(rediscontext, "GET %s", k);
-	if (!reply)
-		return -1;
+	rc = kvsal_check_notify_config(ctx);
+	if (rc != 0)
+		goto errout;
 
-	if (reply->type != REDIS_REPLY_STRING)
-		return -1;
+	/* Each pattern is acknowledged by a reply of its own */
+	reply = redisCommandArgv(ctx, nb_patterns + 1, argv, NULL);
+	for (i = 0; i < nb_patterns ; i++) {
+		if (i > 0 && redisGetReply(ctx, (void **)&reply) != REDIS_OK)
+			reply = NULL;
 
-	if (reply->len != sizeof(struct stat))
-		return -1;
+		if (!reply || reply->type != REDIS_REPLY_ARRAY)
+			rc = -ENOTSUP;
 
-	memcpy((char *)buf, reply->str, reply->len);
+		if (reply)
+			freeReplyObject(reply);
 
-	freeReplyObject(reply);
+		if (rc != 0)
+			goto errout;
+	}
+
+	shard->watchcontext = ctx;
+	if (pthread_create(&shard->watcher, NULL, kvsal_watcher,
+			   shard) != 0) {
+		shard->watchcontext = NULL;
+		rc = -EAGAIN;
+		goto errout;
+	}
 
 	return 0;
+
+errout:
+	redisFree(ctx);
+	return rc;
 }
 
-int kvsal_set_binary(char *k, char *buf, size_t size)
+static void kvsal_watch_stop(void)
 {
-	redisReply *reply;
+	struct kvsal_shard *shard;
+	int s;
+
+	if (!watching)
+		return;
+
+	/* Wake the watchers up, they are blocked reading */
+	watch_stop = true;
+	for (s = 0; s < pool.nb_shards ; s++) {
+		shard = &pool.shards[s];
+		if (shard->watchcontext == NULL)
+			continue;
+
+		shutdown(shard->watchcontext->fd, SHUT_RDWR);
+		pthread_join(shard->watcher, NULL);
+		redisFree(shard->watchcontext);
+		shard->watchcontext = NULL;
+	}
+	watch_stop = false;
+	watching = false;
+}
 
-	if (!k || !buf)
+int kvsal_watch(char **patterns, int nb_patterns, kvsal_watch_cb_t cb,
+		void *arg)
+{
+	const char *argv[KVSAL_ARRAY_SIZE + 1];
+	char channels[KVSAL_ARRAY_SIZE][KVSAL_CHANNEL_LEN];
+	char wk[KVSAL_WIRE_KLEN];
+	int len;
+	int rc = 0;
+	int s;
+	int i;
+
+	if (!patterns || !cb || nb_patterns <= 0 ||
+	    nb_patterns > KVSAL_ARRAY_SIZE || !pool.ready)
 		return -EINVAL;
 
-	if (!rediscontext)
-		if (kvsal_reinit() != 0)
-			return -1;
+	if (watching)
+		return -EBUSY;
+
+	argv[0] = "PSUBSCRIBE";
+	for (i = 0; i < nb_patterns ; i++) {
+		len = snprintf(channels[i], KVSAL_CHANNEL_LEN, "%s%s",
+			       KVSAL_CHANNEL_PREFIX,
+			       kvsal_wire_key(patterns[i], wk));
+		if (len >= KVSAL_CHANNEL_LEN)
+			return -ENAMETOOLONG;
+		argv[i + 1] = channels[i];
+	}
 
-	/* Set a key */
-	reply = redisCommand(rediscontext, "SET %s %b", k, buf, size);
-	if (!reply)
-		return -1;
+	watch_cb = cb;
+	watch_arg = arg;
+	watch_stop = false;
+	watching = true;
+
+	/* Every server notifies about its own keys */
+	for (s = 0; s < pool.nb_shards ; s++) {
+		rc = kvsal_watch_shard(&pool.shards[s], nb_patterns, argv);
+		if (rc != 0) {
+			kvsal_watch_stop();
+			return rc;
+		}
+	}
 
 	return 0;
 }
 
-int kvsal_get_binary(char *k, char *buf, size_t *size)
+static void kvsal_loop_add_read(void *data)
 {
-	redisReply *reply;
+	((struct kvsal_shard *)data)->reading = true;
+}
 
-	if (!k || !buf || !size)
-		return -EINVAL;
+static void kvsal_loop_del_read(void *data)
+{
+	((struct kvsal_shard *)data)->reading = false;
+}
 
-	if (!rediscontext)
-		if (kvsal_reinit() != 0)
-			return -1;
+static void kvsal_loop_add_write(void *data)
+{
+	((struct kvsal_shard *)data)->writing = true;
+}
 
-	reply = redisCommand(rediscontext, "GET %s", k);
-	if (!reply)
-		return -1;
+static void kvsal_loop_del_write(void *data)
+{
+	((struct kvsal_shard *)data)->writing = false;
+}
 
-	if (reply->type != REDIS_REPLY_STRING)
-		return -1;
+static void kvsal_loop_cleanup(void *data)
+{
+	((struct kvsal_shard *)data)->reading = false;
+	((struct kvsal_shard *)data)->writing = false;
+}
 
-	if (reply->len > *size)
-		return -1;
+/* hiredis frees the context once these have been called */
+static void kvsal_loop_connected(const redisAsyncContext *ac, int status)
+{
+	struct kvsal_shard *shard = ac->data;
 
-	memcpy((char *)buf, reply->str, reply->len);
-	*size = reply->len;
+	kvsal_connect_done(shard, status == REDIS_OK, kvsal_now_ms());
+	if (status != REDIS_OK)
+		shard->ac = NULL;
+}
 
-	freeReplyObject(reply);
+static void kvsal_loop_disconnected(const redisAsyncContext *ac, int status)
+{
+	struct kvsal_shard *shard = ac->data;
 
-	return 0;
+	shard->ac = NULL;
 }
 
-int kvsal_incr_counter(char *k, unsigned long long *v)
+static void kvsal_loop_wake(void)
 {
-	redisReply *reply;
+	char c = 0;
 
-	if (!k || !v)
-		return -EINVAL;
+	/* If the pipe is full, the loop has yet to wake up anyway */
+	if (write(loop.wake[1], &c, 1) < 0 && errno != EAGAIN)
+		fprintf(stderr, "kvsal: can't wake event loop up\n");
+}
 
-	if (!rediscontext)
-		if (kvsal_reinit() != 0)
-			return -1;
+static void *kvsal_loop_run(void *arg)
+{
+	struct pollfd fds[KVSAL_MAX_SHARDS + 1];
+	struct kvsal_shard *polled[KVSAL_MAX_SHARDS + 1];
+	struct kvsal_shard *shard;
+	char buf[64];
+	int nfds;
+	int s;
+	int i;
 
-	reply = redisCommand(rediscontext, "INCR %s", k);
-	if (!reply)
-		return -1;
+	fds[0].fd = loop.wake[0];
+	fds[0].events = POLLIN;
 
-	*v = (unsigned long long)reply->integer;
+	for (;;) {
+		/* Contexts are only freed by this thread, from within
+		 * hiredis' handlers, so their sockets stay valid while polled */
+		pthread_mutex_lock(&loop.lock);
+		if (loop.stop) {
+			pthread_mutex_unlock(&loop.lock);
+			break;
+		}
+		nfds = 1;
+		for (s = 0; s < pool.nb_shards ; s++) {
+			shard = &pool.shards[s];
+			if (shard->ac == NULL ||
+			    (!shard->reading && !shard->writing))
+				continue;
+
+			fds[nfds].fd = shard->ac->c.fd;
+			fds[nfds].events = (shard->reading ? POLLIN : 0) |
+					   (shard->writing ? POLLOUT : 0);
+			polled[nfds] = shard;
+			nfds += 1;
+		}
+		pthread_mutex_unlock(&loop.lock);
+
+		for (i = 0; i < nfds ; i++)
+			fds[i].revents = 0;
+		if (poll(fds, nfds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "kvsal: event loop poll failed\n");
+			break;
+		}
 
-	return 0;
+		if (fds[0].revents & POLLIN)
+			while (read(loop.wake[0], buf, sizeof(buf)) > 0)
+				;
+
+		pthread_mutex_lock(&loop.lock);
+		for (i = 1; i < nfds ; i++) {
+			shard = polled[i];
+			if (shard->ac != NULL &&
+			    (fds[i].revents & (POLLIN | POLLERR | POLLHUP)))
+				redisAsyncHandleRead(shard->ac);
+			if (shard->ac != NULL &&
+			    (fds[i].revents & (POLLOUT | POLLERR)))
+				redisAsyncHandleWrite(shard->ac);
+		}
+		pthread_mutex_unlock(&loop.lock);
+	}
+
+	return NULL;
 }
 
-int kvsal_del(char *k)
+/* Called with loop.lock held */
+static int kvsal_loop_connect(struct kvsal_shard *shard)
 {
-	redisReply *reply;
-
-	if (!k)
-		return -EINVAL;
-
-	if (!rediscontext)
-		if (kvsal_reinit() != 0)
-			return -1;
+	unsigned long long now = kvsal_now_ms();
+	redisAsyncContext *ac;
+
+	if (!kvsal_may_connect(shard, now))
+		return -ENOTCONN;
+
+	/* The connection completes within the loop, ops submitted meanwhile
+	 * are kept by hiredis until then */
+	ac = redisAsyncConnect(shard->hostname, shard->port);
+	if (ac == NULL || ac->err) {
+		if (ac)
+			redisAsyncFree(ac);
+		kvsal_connect_done(shard, false, now);
+		return -ENOTCONN;
+	}
 
-	/* Try a GET and two INCR */
-	reply = redisCommand(rediscontext, "DEL %s", k);
-	if (!reply)
-		return -1;
-	freeReplyObject(reply);
+	ac->data = shard;
+	ac->ev.data = shard;
+	ac->ev.addRead = kvsal_loop_add_read;
+	ac->ev.delRead = kvsal_loop_del_read;
+	ac->ev.addWrite = kvsal_loop_add_write;
+	ac->ev.delWrite = kvsal_loop_del_write;
+	ac->ev.cleanup = kvsal_loop_cleanup;
+	redisAsyncSetConnectCallback(ac, kvsal_loop_connected);
+	redisAsyncSetDisconnectCallback(ac, kvsal_loop_disconnected);
+
+	shard->ac = ac;
 	return 0;
 }
 
-int kvsal_get_list_pattern(char *pattern, int start, int *size,
-			   kvsal_item_t *items)
+/* Called with loop.lock held. The loop is started by the first op, the
+ * connection to a shard by the first op about its keys */
+static int kvsal_loop_start(struct kvsal_shard *shard)
 {
-	redisReply *reply;
-	int i;
+	if (!pool.ready)
+		return -ENOTCONN;
+
+	if (!loop.running) {
+		if (pipe2(loop.wake, O_NONBLOCK | O_CLOEXEC) != 0)
+			return -errno;
+
+		loop.stop = false;
+		if (pthread_create(&loop.thread, NULL, kvsal_loop_run,
+				   NULL) != 0) {
+			close(loop.wake[0]);
+			close(loop.wake[1]);
+			loop.wake[0] = loop.wake[1] = -1;
+			return -EAGAIN;
+		}
+		loop.running = true;
+	}
 
-	if (!pattern || !size || !items)
-		return -EINVAL;
+	if (shard->ac == NULL)
+		return kvsal_loop_connect(shard);
 
-	if (!rediscontext)
-		if (kvsal_reinit() != 0)
-			return -1;
+	return 0;
+}
 
-	reply = redisCommand(rediscontext, "KEYS %s", pattern);
-	if (!reply)
-		return -1;
-	if (reply->type != REDIS_REPLY_ARRAY)
-		return -1;
+/* Ops still pending complete with -ENOTCONN */
+static void kvsal_loop_stop(void)
+{
+	int s;
 
-	if (reply->elements < (start + *size))
-		*size = reply->elements - start;
+	pthread_mutex_lock(&loop.lock);
+	if (!loop.running) {
+		pthread_mutex_unlock(&loop.lock);
+		return;
+	}
+	loop.stop = true;
+	pthread_mutex_unlock(&loop.lock);
+
+	kvsal_loop_wake();
+	pthread_join(loop.thread, NULL);
 
-	for (i = start; i < start + *size ; i++) {
-		items[i-start].offset = i;
-		strncpy(items[i-start].str, reply->element[i]->str, KLEN);
+	pthread_mutex_lock(&loop.lock);
+	for (s = 0; s < pool.nb_shards ; s++) {
+		if (pool.shards[s].ac != NULL)
+			redisAsyncFree(pool.shards[s].ac);
+		pool.shards[s].ac = NULL;
 	}
+	close(loop.wake[0]);
+	close(loop.wake[1]);
+	loop.wake[0] = loop.wake[1] = -1;
+	loop.running = false;
+	pthread_mutex_unlock(&loop.lock);
+}
 
-	freeReplyObject(reply);
-	return 0;
+static void kvsal_async_reply(redisAsyncContext *ac, void *r, void *privdata)
+{
+	struct kvsal_async_req *req = privdata;
+	bool ask;
+
+	/* No reply if the connection was lost, the reply is freed by hiredis */
+	if (r == NULL)
+		req->op->rc = -ENOTCONN;
+	else if (kvsal_redirect(r, &ask) >= 0)
+		req->op->rc = -EAGAIN;
+	else
+		kvsal_op_result(req->op, r);
+
+	req->cb(req->op, req->arg);
+	free(req);
 }
 
-int kvsal_get_list_size(char *pattern)
+int kvsal_async_op(kvsal_op_t *op, kvsal_async_cb_t cb, void *arg)
 {
-	redisReply *reply;
+	struct kvsal_async_req *req;
+	struct kvsal_shard *shard;
+	const char *argv[4];
+	size_t argvlen[4];
+	char wk[KVSAL_WIRE_KLEN];
+	char off[KVSAL_OFF_LEN];
+	size_t mark;
+	int argc;
 	int rc;
 
-	if (!pattern)
+	if (!op || !op->k || !cb || in_transaction)
 		return -EINVAL;
 
-	if (!rediscontext)
-		if (kvsal_reinit() != 0)
-			return -1;
-
-	reply = redisCommand(rediscontext, "KEYS %s", pattern);
-	if (!reply)
-		return -1;
-	if (reply->type != REDIS_REPLY_ARRAY)
-		return -1;
-	rc = reply->elements;
+	req = malloc(sizeof(struct kvsal_async_req));
+	if (req == NULL)
+		return -ENOMEM;
+
+	req->op = op;
+	req->cb = cb;
+	req->arg = arg;
+
+	/* The command is formatted by the call, the key sent may go then */
+	mark = kvsal_arena_mark();
+	argc = kvsal_op_argv(op, argv, argvlen, wk, off);
+	rc = (argc < 0) ? argc : 0;
+
+	pthread_mutex_lock(&loop.lock);
+	shard = &pool.shards[kvsal_shard_of(op->k)];
+	if (rc == 0)
+		rc = kvsal_loop_start(shard);
+	if (rc == 0 &&
+	    redisAsyncCommandArgv(shard->ac, kvsal_async_reply, req, argc,
+				  argv, argvlen) != REDIS_OK)
+		rc = -ENOTCONN;
+	pthread_mutex_unlock(&loop.lock);
+	kvsal_arena_release(mark);
+
+	if (rc != 0) {
+		free(req);
+		return rc;
+	}
 
-	freeReplyObject(reply);
-	return rc;
+	kvsal_loop_wake();
+	return 0;
 }
 
-int kvsal_init_list(kvsal_list_t *list)
+int kvsal_async_group_init(kvsal_async_group_t *group)
 {
-	if (!list)
+	if (!group)
 		return -EINVAL;
 
-	list->size = 0;
-	list->content = NULL;
+	pthread_mutex_init(&group->lock, NULL);
+	pthread_cond_init(&group->cond, NULL);
+	group->pending = 0;
 
 	return 0;
 }
 
-int kvsal_fetch_list(char *pattern, kvsal_list_t *list)
+static void kvsal_async_group_done(kvsal_op_t *op, void *arg)
 {
-	if (!pattern || !list)
-		return -EINVAL;
-
-	/* REDIS manages KVS in RAM. Nothing to do */
-	strncpy(list->pattern , pattern, KLEN);
+	kvsal_async_group_t *group = arg;
 
-	return 0;
+	pthread_mutex_lock(&group->lock);
+	group->pending -= 1;
+	if (group->pending == 0)
+		pthread_cond_broadcast(&group->cond);
+	pthread_mutex_unlock(&group->lock);
 }
 
-int kvsal_dispose_list(kvsal_list_t *list)
+int kvsal_async_group_op(kvsal_async_group_t *group, kvsal_op_t *op)
 {
-	if (!list)
+	int rc;
+
+	if (!group)
 		return -EINVAL;
 
-	/* REDIS manages KVS in RAM. Nothing to do */
-	return 0;
+	pthread_mutex_lock(&group->lock);
+	group->pending += 1;
+	pthread_mutex_unlock(&group->lock);
+
+	rc = kvsal_async_op(op, kvsal_async_group_done, group);
+	if (rc != 0) {
+		pthread_mutex_lock(&group->lock);
+		group->pending -= 1;
+		pthread_mutex_unlock(&group->lock);
+	}
+
+	return rc;
 }
 
-int kvsal_get_list(kvsal_list_t *list, int start, int *end,
-		    kvsal_item_t *items)
+int kvsal_async_group_wait(kvsal_async_group_t *group)
 {
-	if (!list)
+	if (!group)
 		return -EINVAL;
-	
-	return kvsal_get_list_pattern(list->pattern, 
-				      start, 
-				      end,
-				      items);
+
+	pthread_mutex_lock(&group->lock);
+	while (group->pending > 0)
+		pthread_cond_wait(&group->cond, &group->lock);
+	pthread_mutex_unlock(&group->lock);
+
+	return 0;
 }
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <kvsns/kvsal.h>
+
+#define CONFIG "/etc/kvsns.d/kvsns.ini"
+#define NB_THREADS 8
+#define NB_OPS 100
+
+static char *prefix;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int pending = 0;
+
+struct key {
+	char k[KLEN];
+	char v[VLEN];
+	char r[VLEN];
+	kvsal_op_t op;
+};
+
+static void check_gone(kvsal_op_t *op, void *arg)
+{
+	if (op->rc != -ENOENT) {
+		fprintf(stderr, "EXISTS key=%s: rc=%d\n", op->k, op->rc);
+		exit(1);
+	}
+
+	pthread_mutex_lock(&lock);
+	pending -= 1;
+	if (pending == 0)
+		pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+/* Completion callbacks may submit other ops */
+static void deleted(kvsal_op_t *op, void *arg)
+{
+	int rc;
+
+	if (op->rc != 0) {
+		fprintf(stderr, "DEL key=%s: rc=%d\n", op->k, op->rc);
+		exit(1);
+	}
+
+	op->type = KVSAL_OP_EXISTS;
+	rc = kvsal_async_op(op, check_gone, arg);
+	if (rc != 0) {
+		fprintf(stderr, "kvsal_async_op: err=%d\n", rc);
+		exit(1);
+	}
+}
+
+static void *worker(void *arg)
+{
+	struct key *keys;
+	kvsal_async_group_t group;
+	long id = (long)arg;
+	int rc = 0;
+	int i;
+
+	keys = calloc(NB_OPS, sizeof(struct key));
+	if (keys == NULL)
+		exit(1);
+
+	kvsal_async_group_init(&group);
+
+	for (i = 0; i < NB_OPS && rc == 0; i++) {
+		snprintf(keys[i].k, KLEN, "%s.%ld.%d", prefix, id, i);
+		snprintf(keys[i].v, VLEN, "%d", i);
+		keys[i].op.type = KVSAL_OP_SET;
+		keys[i].op.k = keys[i].k;
+		keys[i].op.v = keys[i].v;
+		keys[i].op.vlen = strlen(keys[i].v);
+		rc = kvsal_async_group_op(&group, &keys[i].op);
+	}
+	kvsal_async_group_wait(&group);
+
+	for (i = 0; i < NB_OPS && rc == 0; i++) {
+		if (keys[i].op.rc != 0) {
+			fprintf(stderr, "SET key=%s: rc=%d\n", keys[i].k,
+				keys[i].op.rc);
+			exit(1);
+		}
+		keys[i].op.type = KVSAL_OP_GET;
+		keys[i].op.v = keys[i].r;
+		keys[i].op.vlen = VLEN;
+		rc = kvsal_async_group_op(&group, &keys[i].op);
+	}
+	kvsal_async_group_wait(&group);
+
+	for (i = 0; i < NB_OPS && rc == 0; i++) {
+		if (keys[i].op.rc != 0 || strcmp(keys[i].r, keys[i].v)) {
+			fprintf(stderr, "GET key=%s: rc=%d val=%s\n",
+				keys[i].k, keys[i].op.rc, keys[i].r);
+			exit(1);
+		}
+
+		pthread_mutex_lock(&lock);
+		pending += 1;
+		pthread_mutex_unlock(&lock);
+
+		keys[i].op.type = KVSAL_OP_DEL;
+		rc = kvsal_async_op(&keys[i].op, deleted, NULL);
+	}
+
+	if (rc != 0) {
+		fprintf(stderr, "kvsal_async_op: err=%d\n", rc);
+		exit(1);
+	}
+
+	pthread_mutex_lock(&lock);
+	while (pending > 0)
+		pthread_cond_wait(&cond, &lock);
+	pthread_mutex_unlock(&lock);
+
+	free(keys);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct collection_item *cfg_items = NULL;
+	struct collection_item *errors = NULL;
+	pthread_t threads[NB_THREADS];
+	int rc;
+	long i;
+
+	if (argc != 2) {
+		fprintf(stderr, "2 args\n");
+		exit(1);
+	}
+	prefix = argv[1];
+
+	rc = config_from_file("libkvsns", CONFIG, &cfg_items,
+			      INI_STOP_ON_ERROR, &errors);
+	if (rc != 0) {
+		fprintf(stderr, "config_from_file: err=%d\n", rc);
+		free_ini_config_errors(errors);
+		exit(rc);
+	}
+
+	rc = kvsal_init(cfg_items);
+	if (rc != 0) {
+		fprintf(stderr, "kvsal_init: err=%d\n", rc);
+		exit(-rc);
+	}
+
+	for (i = 0; i < NB_THREADS; i++)
+		if (pthread_create(&threads[i], NULL, worker, (void *)i)) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+
+	for (i = 0; i < NB_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	rc = kvsal_fini();
+	if (rc != 0) {
+		fprintf(stderr, "kvsal_fini: err=%d\n", rc);
+		exit(-rc);
+	}
+
+	printf("+++++++++++++++\n");
+	exit(0);
+	return 0;
+}
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <kvsns/kvsal.h>
+
+#define CONFIG "/etc/kvsns.d/kvsns.ini"
+#define NB_OPS 10
+
+int main(int argc, char *argv[])
+{
+	struct collection_item *cfg_items = NULL;
+	struct collection_item *errors = NULL;
+	kvsal_op_t ops[2*NB_OPS];
+	char keys[NB_OPS][KLEN];
+	char vals[NB_OPS][VLEN];
+	char reads[NB_OPS][VLEN];
+	int rc;
+	int i;
+
+	if (argc != 3) {
+		fprintf(stderr, "3 args\n");
+		exit(1);
+	}
+
+	rc = config_from_file("libkvsns", CONFIG, &cfg_items,
+			      INI_STOP_ON_ERROR, &errors);
+	if (rc != 0) {
+		fprintf(stderr, "config_from_file: err=%d\n", rc);
+		free_ini_config_errors(errors);
+		exit(rc);
+	}
+
+	rc = kvsal_init(cfg_items);
+	if (rc != 0) {
+		fprintf(stderr, "kvsal_init: err=%d\n", rc);
+		exit(-rc);
+	}
+
+	memset(ops, 0, sizeof(ops));
+	for (i = 0; i < NB_OPS; i++) {
+		snprintf(keys[i], KLEN, "%s%d", argv[1], i);
+		snprintf(vals[i], VLEN, "%s%d", argv[2], i);
+		ops[i].type = KVSAL_OP_SET;
+		ops[i].k = keys[i];
+		ops[i].v = vals[i];
+		ops[i].vlen = strnlen(vals[i], VLEN);
+	}
+
+	rc = kvsal_mset(ops, NB_OPS);
+	if (rc != 0) {
+		fprintf(stderr, "kvsal_mset: err=%d\n", rc);
+		exit(-rc);
+	}
+
+	for (i = 0; i < NB_OPS; i++) {
+		ops[i].type = KVSAL_OP_GET;
+		ops[i].v = reads[i];
+		ops[i].vlen = VLEN;
+	}
+
+	rc = kvsal_mget(ops, NB_OPS);
+	if (rc != 0) {
+		fprintf(stderr, "kvsal_mget: err=%d\n", rc);
+		exit(-rc);
+	}
+
+	for (i = 0; i < NB_OPS; i++) {
+		if (ops[i].rc != 0 || strcmp(reads[i], vals[i])) {
+			fprintf(stderr, "kvsal_mget: key=%s rc=%d val=%s\n",
+				keys[i], ops[i].rc, reads[i]);
+			exit(1);
+		}
+		printf("key=%s val=%s\n", keys[i], reads[i]);
+	}
+
+	/* Delete every key, then check it is gone, in a single batch */
+	for (i = 0; i < NB_OPS; i++) {
+		ops[i].type = KVSAL_OP_DEL;
+		ops[NB_OPS + i].type = KVSAL_OP_EXISTS;
+		ops[NB_OPS + i].k = keys[i];
+	}
+
+	rc = kvsal_batch(ops, 2*NB_OPS);
+	if (rc != 0) {
+		fprintf(stderr, "kvsal_batch: err=%d\n", rc);
+		exit(-rc);
+	}
+
+	for (i = 0; i < NB_OPS; i++) {
+		if (ops[i].rc != 0 || ops[NB_OPS + i].rc != -ENOENT) {
+			fprintf(stderr, "kvsal_batch: key=%s del=%d exists=%d\n",
+				keys[i], ops[i].rc, ops[NB_OPS + i].rc);
+			exit(1);
+		}
+	}
+
+	rc = kvsal_fini();
+	if (rc != 0) {
+		fprintf(stderr, "kvsal_fini: err=%d\n", rc);
+		exit(-rc);
+	}
+
+	printf("+++++++++++++++\n");
+	exit(0);
+	return 0;
+}
@@ -0,0 +1,346 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/param.h>
+#include <kvsns/kvsal.h>
+
+#define CONFIG "/etc/kvsns.d/kvsns.ini"
+#define NB_GROUP 64	/* keys written by each transaction */
+#define NB_CRASHES 5
+#define NB_SCAN 1000
+#define BIG_LEN 5000	/* in overflow pages */
+#define SMALL_LEN 16
+#define LIST_TRUNK 100
+
+static char dir[] = "/tmp/kvsal_btree_1.XXXXXX";
+static char config[MAXPATHLEN];
+
+/* CONFIG, with the embedded KVSAL using the B+tree store in dir */
+static void write_config(void)
+{
+	char line[1024];
+	FILE *in;
+	FILE *out;
+	int in_section = 0;
+	int found = 0;
+
+	snprintf(config, MAXPATHLEN, "%s.ini", dir);
+	in = fopen(CONFIG, "r");
+	out = fopen(config, "w");
+	if (in == NULL || out == NULL) {
+		fprintf(stderr, "write_config: err=%d\n", errno);
+		exit(1);
+	}
+
+	while (fgets(line, sizeof(line), in) != NULL) {
+		if (line[0] == '[')
+			in_section = !strncmp(line, "[kvsal_embedded]", 16);
+		else if (in_section)
+			continue;
+		fputs(line, out);
+		if (in_section) {
+			fprintf(out, "\tstore = btree\n\tpath = %s\n"
+				"\tsync = false\n", dir);
+			found = 1;
+		}
+	}
+	if (!found)
+		fprintf(out, "\n[kvsal_embedded]\n\tstore = btree\n"
+			"\tpath = %s\n\tsync = false\n", dir);
+
+	fclose(in);
+	fclose(out);
+}
+
+static void init(void)
+{
+	struct collection_item *cfg_items = NULL;
+	struct collection_item *errors = NULL;
+	int rc;
+
+	rc = config_from_file("libkvsns", config, &cfg_items,
+			      INI_STOP_ON_ERROR, &errors);
+	if (rc != 0) {
+		fprintf(stderr, "config_from_file: err=%d\n", rc);
+		free_ini_config_errors(errors);
+		exit(rc);
+	}
+
+	rc = kvsal_init(cfg_items);
+	if (rc != 0) {
+		fprintf(stderr, "kvsal_init: err=%d\n", rc);
+		exit(-rc);
+	}
+}
+
+static void check(int rc, const char *what)
+{
+	if (rc != 0) {
+		fprintf(stderr, "%s: err=%d\n", what, rc);
+		exit(1);
+	}
+}
+
+/* Key j of the group, as written by round r: every other one is too large
+ * to be kept in its leaf */
+static size_t group_value(int r, int j, char *v)
+{
+	size_t len = (j % 2) ? BIG_LEN : SMALL_LEN;
+	char round[9];
+
+	memset(v, 'a' + (r + j) % 26, len);
+	snprintf(round, sizeof(round), "%08d", r);
+	memcpy(v, round, 8);
+
+	return len;
+}
+
+/* Rewrites the whole group in a transaction per round, reporting each round
+ * committed on fd, until killed */
+static void writer(int fd, int r)
+{
+	char k[KLEN];
+	char v[BIG_LEN];
+	char round[VLEN];
+	size_t len;
+	int j;
+
+	init();
+	for (;;) {
+		r++;
+		check(kvsal_begin_transaction(), "kvsal_begin_transaction");
+		for (j = 0; j < NB_GROUP; j++) {
+			snprintf(k, KLEN, "bt.g.%03d", j);
+			len = group_value(r, j, v);
+			check(kvsal_set_binary(k, v, len), "kvsal_set_binary");
+		}
+		snprintf(round, VLEN, "%d", r);
+		check(kvsal_set_char("bt.round", round), "kvsal_set_char");
+		check(kvsal_end_transaction(), "kvsal_end_transaction");
+
+		if (write(fd, &r, sizeof(r)) != sizeof(r))
+			_exit(1);
+	}
+}
+
+/* After a crash, the group is the one of the last round committed, as a
+ * whole. Returns that round */
+static int check_group(int committed)
+{
+	char k[KLEN];
+	char v[BIG_LEN];
+	char r[BIG_LEN];
+	char round[VLEN];
+	size_t size;
+	int last;
+	int rc;
+	int j;
+
+	rc = kvsal_get_char("bt.round", round);
+	if (rc == -ENOENT)
+		last = 0;
+	else {
+		check(rc, "kvsal_get_char");
+		last = atoi(round);
+	}
+
+	if (last < committed) {
+		fprintf(stderr, "round %d lost, %d found\n", committed, last);
+		exit(1);
+	}
+
+	for (j = 0; j < NB_GROUP; j++) {
+		snprintf(k, KLEN, "bt.g.%03d", j);
+		size = BIG_LEN;
+		rc = kvsal_get_binary(k, r, &size);
+		if (last == 0) {
+			check(rc != -ENOENT, "group before the first round");
+			continue;
+		}
+		check(rc, "kvsal_get_binary");
+		if (size != group_value(last, j, v) || memcmp(r, v, size)) {
+			fprintf(stderr, "%s: not from round %d\n", k, last);
+			exit(1);
+		}
+	}
+
+	return last;
+}
+
+/* The writer is killed at some point of its transactions, or of the file's
+ * packing that their garbage triggers */
+static void test_crashes(void)
+{
+	int committed = 0;
+	int last = 0;
+	int fds[2];
+	pid_t pid;
+	int r;
+	int i;
+
+	for (i = 0; i < NB_CRASHES; i++) {
+		if (pipe(fds) != 0) {
+			fprintf(stderr, "pipe: err=%d\n", errno);
+			exit(1);
+		}
+
+		pid = fork();
+		if (pid < 0) {
+			fprintf(stderr, "fork: err=%d\n", errno);
+			exit(1);
+		}
+		if (pid == 0) {
+			close(fds[0]);
+			writer(fds[1], last);
+		}
+		close(fds[1]);
+
+		usleep(100000 + 50000 * i);
+		kill(pid, SIGKILL);
+		while (read(fds[0], &r, sizeof(r)) == sizeof(r))
+			committed = r;
+		close(fds[0]);
+		waitpid(pid, NULL, 0);
+
+		init();
+		last = check_group(committed);
+		check(kvsal_fini(), "kvsal_fini");
+		printf("crash %d: round %d\n", i, last);
+	}
+
+	if (last == 0) {
+		fprintf(stderr, "no round committed\n");
+		exit(1);
+	}
+}
+
+/* Lists the keys starting with prefix, in pages, without copying them.
+ * Returns their number, they must be sorted */
+static int list(char *prefix)
+{
+	kvsal_slice_t items[LIST_TRUNK];
+	kvsal_list_t list;
+	char pattern[KLEN];
+	char last[KLEN] = "";
+	char key[KLEN];
+	int offset = 0;
+	int size;
+	int i;
+
+	snprintf(pattern, KLEN, "%s*", prefix);
+	check(kvsal_init_list(&list), "kvsal_init_list");
+	check(kvsal_fetch_list(pattern, &list), "kvsal_fetch_list");
+
+	do {
+		size = LIST_TRUNK;
+		check(kvsal_get_list_slices(&list, offset, &size, items),
+		      "kvsal_get_list_slices");
+		for (i = 0; i < size ; i++) {
+			check(items[i].len >= KLEN, "kvsal_get_list_slices len");
+			memcpy(key, items[i].p, items[i].len);
+			key[items[i].len] = '\0';
+			check(strncmp(key, prefix, strlen(prefix)),
+			      "kvsal_get_list_slices prefix");
+			check(strcmp(last, key) >= 0,
+			      "kvsal_get_list_slices order");
+			strcpy(last, key);
+		}
+		offset += size;
+	} while (size == LIST_TRUNK);
+
+	check(kvsal_dispose_list(&list), "kvsal_dispose_list");
+	check(kvsal_get_list_size(pattern) != offset, "kvsal_get_list_size");
+
+	return offset;
+}
+
+/* Prefixes nested in one another, over many leaves, written by one
+ * transaction after one that was discarded */
+static void test_scans(void)
+{
+	char k[KLEN];
+	int i;
+
+	check(kvsal_begin_transaction(), "kvsal_begin_transaction");
+	for (i = 0; i < NB_SCAN; i++) {
+		snprintf(k, KLEN, "bt.s.a.%04d", i);
+		check(kvsal_set_char(k, "discarded"), "kvsal_set_char");
+	}
+	check(kvsal_discard_transaction(), "kvsal_discard_transaction");
+	check(list("bt.s.") != 0, "discarded transaction");
+
+	check(kvsal_begin_transaction(), "kvsal_begin_transaction");
+	for (i = 0; i < NB_SCAN; i++) {
+		snprintf(k, KLEN, "bt.s.a.%04d", i);
+		check(kvsal_set_char(k, k), "kvsal_set_char");
+	}
+	for (i = 0; i < 10; i++) {
+		snprintf(k, KLEN, "bt.s.ab.%d", i);
+		check(kvsal_set_char(k, k), "kvsal_set_char");
+	}
+	check(kvsal_set_char("bt.s.b", "b"), "kvsal_set_char");
+	check(kvsal_end_transaction(), "kvsal_end_transaction");
+
+	check(list("bt.s.a.") != NB_SCAN, "list bt.s.a.");
+	check(list("bt.s.a") != NB_SCAN + 10, "list bt.s.a");
+	check(list("bt.s.") != NB_SCAN + 11, "list bt.s.");
+	check(list("bt.s.c") != 0, "list bt.s.c");
+}
+
+/* Every other key goes, in a single transaction */
+static void test_deletions(void)
+{
+	char k[KLEN];
+	int i;
+
+	check(kvsal_begin_transaction(), "kvsal_begin_transaction");
+	for (i = 0; i < NB_SCAN; i += 2) {
+		snprintf(k, KLEN, "bt.s.a.%04d", i);
+		check(kvsal_del(k), "kvsal_del");
+	}
+	check(kvsal_end_transaction(), "kvsal_end_transaction");
+
+	check(list("bt.s.a.") != NB_SCAN / 2, "list after deletions");
+	check(kvsal_exists("bt.s.a.0000") != -ENOENT, "deleted key");
+	check(kvsal_exists("bt.s.a.0001"), "kept key");
+}
+
+int main(int argc, char *argv[])
+{
+	char path[MAXPATHLEN];
+
+	if (mkdtemp(dir) == NULL) {
+		fprintf(stderr, "mkdtemp: err=%d\n", errno);
+		exit(1);
+	}
+	write_config();
+
+	test_crashes();
+
+	init();
+	test_scans();
+	test_deletions();
+	check(kvsal_fini(), "kvsal_fini");
+
+	/* All of it read back from the file */
+	init();
+	check(list("bt.s.a.") != NB_SCAN / 2, "list after reopen");
+	check(list("bt.s.") != NB_SCAN / 2 + 11, "list after reopen");
+	check_group(0);
+	check(kvsal_fini(), "kvsal_fini");
+
+	snprintf(path, MAXPATHLEN, "%s/kvsal.btree", dir);
+	unlink(path);
+	rmdir(dir);
+	unlink(config);
+
+	printf("+++++++++++++++\n");
+
+	exit(0);
+	return 0;
+}
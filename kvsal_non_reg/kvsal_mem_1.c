@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <kvsns/kvsal.h>
+
+#define CONFIG "/etc/kvsns.d/kvsns.ini"
+#define TEST_CONFIG "/tmp/kvsal_mem_1.ini"
+#define NB_KEYS 100
+#define NB_THREADS 16
+#define LIST_TRUNK 10
+
+/* CONFIG, with the embedded KVSAL using the memory store: the calls of the
+ * other kvsal_non_reg programs are run here in one process, as nothing is
+ * left once it exits */
+static void write_config(void)
+{
+	char line[1024];
+	FILE *in;
+	FILE *out;
+	int in_section = 0;
+	int found = 0;
+
+	in = fopen(CONFIG, "r");
+	out = fopen(TEST_CONFIG, "w");
+	if (in == NULL || out == NULL) {
+		fprintf(stderr, "write_config: err=%d\n", errno);
+		exit(1);
+	}
+
+	while (fgets(line, sizeof(line), in) != NULL) {
+		if (line[0] == '[')
+			in_section = !strncmp(line, "[kvsal_embedded]", 16);
+		else if (in_section)
+			continue;
+		fputs(line, out);
+		if (in_section) {
+			fputs("\tstore = memory\n", out);
+			found = 1;
+		}
+	}
+	if (!found)
+		fputs("\n[kvsal_embedded]\n\tstore = memory\n", out);
+
+	fclose(in);
+	fclose(out);
+}
+
+static void init(void)
+{
+	struct collection_item *cfg_items = NULL;
+	struct collection_item *errors = NULL;
+	int rc;
+
+	rc = config_from_file("libkvsns", TEST_CONFIG, &cfg_items,
+			      INI_STOP_ON_ERROR, &errors);
+	if (rc != 0) {
+		fprintf(stderr, "config_from_file: err=%d\n", rc);
+		free_ini_config_errors(errors);
+		exit(rc);
+	}
+
+	rc = kvsal_init(cfg_items);
+	if (rc != 0) {
+		fprintf(stderr, "kvsal_init: err=%d\n", rc);
+		exit(-rc);
+	}
+}
+
+static void check(int rc, const char *what)
+{
+	if (rc != 0) {
+		fprintf(stderr, "%s: err=%d\n", what, rc);
+		exit(1);
+	}
+}
+
+/* Same as kvsal_set_1, kvsal_get_1, kvsal_exists_1 and kvsal_del_1 */
+static void test_keys(void)
+{
+	char v[VLEN];
+
+	check(kvsal_set_char("mem.k", "v1"), "kvsal_set_char");
+	check(kvsal_get_char("mem.k", v), "kvsal_get_char");
+	check(strcmp(v, "v1"), "kvsal_get_char value");
+	check(kvsal_exists("mem.k"), "kvsal_exists");
+	check(kvsal_del("mem.k"), "kvsal_del");
+	check(kvsal_exists("mem.k") != -ENOENT, "kvsal_exists after del");
+}
+
+/* Lists the keys starting with prefix, in pages, as kvsal_get_list does.
+ * Returns their number, they must be sorted */
+static int list(char *prefix)
+{
+	kvsal_item_t items[LIST_TRUNK];
+	kvsal_list_t list;
+	char pattern[KLEN];
+	char last[KLEN] = "";
+	int offset = 0;
+	int size;
+	int i;
+
+	snprintf(pattern, KLEN, "%s*", prefix);
+	check(kvsal_init_list(&list), "kvsal_init_list");
+	check(kvsal_fetch_list(pattern, &list), "kvsal_fetch_list");
+
+	do {
+		size = LIST_TRUNK;
+		check(kvsal_get_list(&list, offset, &size, items),
+		      "kvsal_get_list");
+		for (i = 0; i < size ; i++) {
+			check(strncmp(items[i].str, prefix, strlen(prefix)),
+			      "kvsal_get_list prefix");
+			check(strcmp(last, items[i].str) >= 0,
+			      "kvsal_get_list order");
+			strcpy(last, items[i].str);
+		}
+		offset += size;
+	} while (size == LIST_TRUNK);
+
+	check(kvsal_dispose_list(&list), "kvsal_dispose_list");
+	check(kvsal_get_list_size(pattern) != offset, "kvsal_get_list_size");
+
+	return offset;
+}
+
+/* Same as kvsal_set_many_transaction, kvsal_get_list and
+ * kvsal_del_many_transaction, with a transaction discarded first */
+static void test_transactions(void)
+{
+	char k[KLEN];
+	char v[VLEN];
+	int i;
+
+	check(kvsal_set_char("mem.u", "outside"), "kvsal_set_char");
+
+	check(kvsal_begin_transaction(), "kvsal_begin_transaction");
+	for (i = 0; i < NB_KEYS; i++) {
+		snprintf(k, KLEN, "mem.t.%d", i);
+		check(kvsal_set_char(k, "discarded"), "kvsal_set_char");
+	}
+	check(kvsal_discard_transaction(), "kvsal_discard_transaction");
+	check(list("mem.t.") != 0, "discarded transaction");
+
+	check(kvsal_begin_transaction(), "kvsal_begin_transaction");
+	for (i = 0; i < NB_KEYS; i++) {
+		snprintf(k, KLEN, "mem.t.%d", i);
+		check(kvsal_set_char(k, "v"), "kvsal_set_char");
+	}
+	check(kvsal_add_counter("mem.count", NB_KEYS), "kvsal_add_counter");
+	check(kvsal_end_transaction(), "kvsal_end_transaction");
+	check(list("mem.t.") != NB_KEYS, "transaction");
+	check(kvsal_get_char("mem.count", v), "kvsal_get_char");
+	check(atoi(v) != NB_KEYS, "kvsal_add_counter value");
+
+	check(kvsal_begin_transaction(), "kvsal_begin_transaction");
+	for (i = 0; i < NB_KEYS; i++) {
+		snprintf(k, KLEN, "mem.t.%d", i);
+		check(kvsal_del(k), "kvsal_del");
+	}
+	check(kvsal_end_transaction(), "kvsal_end_transaction");
+	check(list("mem.t.") != 0, "deletions");
+	check(list("mem.u") != 1, "other keys");
+}
+
+/* A map, as the "hash" dentry layout uses */
+static void test_fields(void)
+{
+	char field[KLEN];
+	char v[VLEN];
+	int i;
+
+	for (i = 0; i < NB_KEYS; i++) {
+		snprintf(field, KLEN, "f%d", i);
+		check(kvsal_set_field("mem.h", field, field),
+		      "kvsal_set_field");
+	}
+	check(kvsal_get_fields_count("mem.h") != NB_KEYS,
+	      "kvsal_get_fields_count");
+	check(kvsal_get_field("mem.h", "f7", v), "kvsal_get_field");
+	check(strcmp(v, "f7"), "kvsal_get_field value");
+	check(kvsal_del_field("mem.h", "f7"), "kvsal_del_field");
+	check(kvsal_get_field("mem.h", "f7", v) != -ENOENT,
+	      "kvsal_get_field after del");
+	check(kvsal_get_fields_count("mem.h") != NB_KEYS - 1,
+	      "kvsal_get_fields_count after del");
+}
+
+/* Same as kvsal_batch_1 */
+static void test_batch(void)
+{
+	kvsal_op_t ops[2*LIST_TRUNK];
+	char keys[LIST_TRUNK][KLEN];
+	char vals[LIST_TRUNK][VLEN];
+	char reads[LIST_TRUNK][VLEN];
+	int i;
+
+	memset(ops, 0, sizeof(ops));
+	for (i = 0; i < LIST_TRUNK; i++) {
+		snprintf(keys[i], KLEN, "mem.b.%d", i);
+		snprintf(vals[i], VLEN, "%d", i);
+		ops[i].type = KVSAL_OP_SET;
+		ops[i].k = keys[i];
+		ops[i].v = vals[i];
+		ops[i].vlen = strlen(vals[i]);
+		ops[LIST_TRUNK + i].type = KVSAL_OP_GET;
+		ops[LIST_TRUNK + i].k = keys[i];
+		ops[LIST_TRUNK + i].v = reads[i];
+		ops[LIST_TRUNK + i].vlen = VLEN;
+	}
+
+	check(kvsal_batch(ops, 2*LIST_TRUNK), "kvsal_batch");
+	for (i = 0; i < LIST_TRUNK; i++) {
+		check(ops[i].rc, "kvsal_batch SET");
+		check(ops[LIST_TRUNK + i].rc, "kvsal_batch GET");
+		check(strcmp(reads[i], vals[i]), "kvsal_batch value");
+	}
+}
+
+/* Same as kvsal_pool_1: many threads at once, each doing plain calls and
+ * transactions */
+static void *worker(void *arg)
+{
+	long id = (long)arg;
+	char k[KLEN];
+	char v[VLEN];
+	char r[VLEN];
+	int i;
+
+	for (i = 0; i < NB_KEYS; i++) {
+		snprintf(k, KLEN, "mem.p.%ld.%d", id, i);
+		snprintf(v, VLEN, "%d", i);
+
+		check(kvsal_begin_transaction(), "kvsal_begin_transaction");
+		check(kvsal_set_char(k, v), "kvsal_set_char");
+		check(kvsal_add_counter("mem.p", 1), "kvsal_add_counter");
+		check(kvsal_end_transaction(), "kvsal_end_transaction");
+		check(kvsal_get_char(k, r), "kvsal_get_char");
+		check(strcmp(r, v), "kvsal_get_char value");
+		if (i % 2)
+			check(kvsal_del(k), "kvsal_del");
+	}
+
+	return NULL;
+}
+
+static void test_threads(void)
+{
+	pthread_t threads[NB_THREADS];
+	char v[VLEN];
+	long i;
+
+	for (i = 0; i < NB_THREADS; i++)
+		if (pthread_create(&threads[i], NULL, worker, (void *)i)) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+
+	for (i = 0; i < NB_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	check(list("mem.p.") != NB_THREADS * NB_KEYS / 2, "threads' keys");
+	check(kvsal_get_char("mem.p", v), "kvsal_get_char");
+	check(atoi(v) != NB_THREADS * NB_KEYS, "threads' counter");
+}
+
+int main(int argc, char *argv[])
+{
+	write_config();
+	init();
+
+	test_keys();
+	test_transactions();
+	test_fields();
+	test_batch();
+	test_threads();
+
+	/* Nothing is kept once the store is closed */
+	check(kvsal_fini(), "kvsal_fini");
+	init();
+	check(kvsal_exists("mem.u") != -ENOENT, "kvsal_exists after reopen");
+	check(kvsal_fini(), "kvsal_fini");
+
+	printf("+++++++++++++++\n");
+
+	exit(0);
+	return 0;
+}
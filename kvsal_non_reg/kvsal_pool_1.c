@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <kvsns/kvsal.h>
+
+#define CONFIG "/etc/kvsns.d/kvsns.ini"
+#define NB_THREADS 64
+#define NB_OPS 100
+
+static char *prefix;
+
+/* Many more threads than pooled connections, each one doing plain calls
+ * and transactions */
+static void *worker(void *arg)
+{
+	long id = (long)arg;
+	char k[KLEN];
+	char v[VLEN];
+	char r[VLEN];
+	int rc;
+	int i;
+
+	for (i = 0; i < NB_OPS; i++) {
+		snprintf(k, KLEN, "%s.%ld.%d", prefix, id, i);
+		snprintf(v, VLEN, "%d", i);
+
+		rc = kvsal_begin_transaction();
+		if (rc == 0)
+			rc = kvsal_set_char(k, v);
+		if (rc == 0)
+			rc = kvsal_end_transaction();
+		if (rc == 0)
+			rc = kvsal_get_char(k, r);
+		if (rc == 0 && strcmp(r, v))
+			rc = -EIO;
+		if (rc == 0)
+			rc = kvsal_del(k);
+
+		if (rc != 0) {
+			fprintf(stderr, "key=%s: err=%d\n", k, rc);
+			exit(1);
+		}
+	}
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct collection_item *cfg_items = NULL;
+	struct collection_item *errors = NULL;
+	pthread_t threads[NB_THREADS];
+	kvsal_pool_stats_t stats;
+	int rc;
+	long i;
+
+	if (argc != 2) {
+		fprintf(stderr, "2 args\n");
+		exit(1);
+	}
+	prefix = argv[1];
+
+	rc = config_from_file("libkvsns", CONFIG, &cfg_items,
+			      INI_STOP_ON_ERROR, &errors);
+	if (rc != 0) {
+		fprintf(stderr, "config_from_file: err=%d\n", rc);
+		free_ini_config_errors(errors);
+		exit(rc);
+	}
+
+	rc = kvsal_init(cfg_items);
+	if (rc != 0) {
+		fprintf(stderr, "kvsal_init: err=%d\n", rc);
+		exit(-rc);
+	}
+
+	for (i = 0; i < NB_THREADS; i++)
+		if (pthread_create(&threads[i], NULL, worker, (void *)i)) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+
+	for (i = 0; i < NB_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	rc = kvsal_get_pool_stats(&stats);
+	if (rc != 0) {
+		fprintf(stderr, "kvsal_get_pool_stats: err=%d\n", rc);
+		exit(-rc);
+	}
+
+	printf("connections=%u idle=%u acquired=%llu waits=%llu "
+	       "timeouts=%llu connects=%llu\n",
+	       stats.size, stats.idle, stats.acquired, stats.waits,
+	       stats.timeouts, stats.connects);
+
+	/* Every connection went back to the pool */
+	if (stats.idle != stats.size) {
+		fprintf(stderr, "%u connections still held\n",
+			stats.size - stats.idle);
+		exit(1);
+	}
+
+	rc = kvsal_fini();
+	if (rc != 0) {
+		fprintf(stderr, "kvsal_fini: err=%d\n", rc);
+		exit(-rc);
+	}
+
+	printf("+++++++++++++++\n");
+	exit(0);
+	return 0;
+}
@@ -4,8 +4,12 @@
 #include <errno.h>
 #include <kvsns/kvsal.h>
 
+#define CONFIG "/etc/kvsns.d/kvsns.ini"
+
 int main(int argc, char *argv[])
 {
+	struct collection_item *cfg_items = NULL;
+	struct collection_item *errors = NULL;
 	int rc;
 	int i;
 	int howmany;
@@ -19,7 +23,15 @@ int main(int argc, char *argv[])
 
 	howmany = atoi(argv[3]);
 
-	rc = kvsal_init(NULL);
+	rc = config_from_file("libkvsns", CONFIG, &cfg_items,
+			      INI_STOP_ON_ERROR, &errors);
+	if (rc != 0) {
+		fprintf(stderr, "config_from_file: err=%d\n", rc);
+		free_ini_config_errors(errors);
+		exit(rc);
+	}
+
+	rc = kvsal_init(cfg_items);
 	if (rc != 0) {
 		fprintf(stderr, "kvsal_init: err=%d\n", rc);
 		exit(-rc);
@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/param.h>
+#include <kvsns/kvsal.h>
+
+#define CONFIG "/etc/kvsns.d/kvsns.ini"
+#define NB_KEYS 2500
+#define VALUE_LEN 1000	/* NB_KEYS of them go past a few checkpoints */
+
+static char dir[] = "/tmp/kvsal_wal_1.XXXXXX";
+static char config[MAXPATHLEN];
+
+/* CONFIG, with the embedded KVSAL using the WAL store in dir, which makes
+ * a checkpoint every MB of log */
+static void write_config(void)
+{
+	char line[1024];
+	FILE *in;
+	FILE *out;
+	int in_section = 0;
+	int found = 0;
+
+	snprintf(config, MAXPATHLEN, "%s.ini", dir);
+	in = fopen(CONFIG, "r");
+	out = fopen(config, "w");
+	if (in == NULL || out == NULL) {
+		fprintf(stderr, "write_config: err=%d\n", errno);
+		exit(1);
+	}
+
+	while (fgets(line, sizeof(line), in) != NULL) {
+		if (line[0] == '[')
+			in_section = !strncmp(line, "[kvsal_embedded]", 16);
+		else if (in_section)
+			continue;
+		fputs(line, out);
+		if (in_section) {
+			fprintf(out, "\tstore = wal\n\tpath = %s\n"
+				"\tsync = false\n\tcheckpoint_mb = 1\n", dir);
+			found = 1;
+		}
+	}
+	if (!found)
+		fprintf(out, "\n[kvsal_embedded]\n\tstore = wal\n"
+			"\tpath = %s\n\tsync = false\n\tcheckpoint_mb = 1\n",
+			dir);
+
+	fclose(in);
+	fclose(out);
+}
+
+static void init(void)
+{
+	struct collection_item *cfg_items = NULL;
+	struct collection_item *errors = NULL;
+	int rc;
+
+	rc = config_from_file("libkvsns", config, &cfg_items,
+			      INI_STOP_ON_ERROR, &errors);
+	if (rc != 0) {
+		fprintf(stderr, "config_from_file: err=%d\n", rc);
+		free_ini_config_errors(errors);
+		exit(rc);
+	}
+
+	rc = kvsal_init(cfg_items);
+	if (rc != 0) {
+		fprintf(stderr, "kvsal_init: err=%d\n", rc);
+		exit(-rc);
+	}
+}
+
+static void value(int i, char *v)
+{
+	int j;
+
+	for (j = 0; j < VALUE_LEN; j++)
+		v[j] = (i + j) & 0xff;
+}
+
+/* Writes the keys, then removes a third of them and counts the others in
+ * a transaction, likely to be left in the log after the last checkpoint */
+static void fill(void)
+{
+	char k[KLEN];
+	char v[VALUE_LEN];
+	int rc;
+	int i;
+
+	for (i = 0; i < NB_KEYS; i++) {
+		snprintf(k, KLEN, "wal.%d", i);
+		value(i, v);
+		rc = kvsal_set_binary(k, v, VALUE_LEN);
+		if (rc != 0) {
+			fprintf(stderr, "kvsal_set_binary: err=%d\n", rc);
+			exit(-rc);
+		}
+	}
+
+	rc = kvsal_begin_transaction();
+	for (i = 0; i < NB_KEYS && rc == 0; i += 3) {
+		snprintf(k, KLEN, "wal.%d", i);
+		rc = kvsal_del(k);
+	}
+	if (rc == 0)
+		rc = kvsal_add_counter("wal.count",
+				       NB_KEYS - (NB_KEYS + 2) / 3);
+	if (rc == 0)
+		rc = kvsal_end_transaction();
+	if (rc != 0) {
+		fprintf(stderr, "transaction: err=%d\n", rc);
+		exit(-rc);
+	}
+}
+
+static void check(void)
+{
+	char k[KLEN];
+	char v[VALUE_LEN];
+	char r[VALUE_LEN + 1];
+	size_t size;
+	int count = 0;
+	int rc;
+	int i;
+
+	for (i = 0; i < NB_KEYS; i++) {
+		snprintf(k, KLEN, "wal.%d", i);
+		size = sizeof(r);
+		rc = kvsal_get_binary(k, r, &size);
+		if (i % 3 == 0) {
+			if (rc != -ENOENT) {
+				fprintf(stderr, "%s: rc=%d, deleted\n", k, rc);
+				exit(1);
+			}
+			continue;
+		}
+
+		value(i, v);
+		if (rc != 0 || size != VALUE_LEN || memcmp(r, v, VALUE_LEN)) {
+			fprintf(stderr, "%s: rc=%d size=%zu, bad value\n", k,
+				rc, size);
+			exit(1);
+		}
+		count++;
+	}
+
+	rc = kvsal_get_char("wal.count", r);
+	if (rc != 0 || atoi(r) != count) {
+		fprintf(stderr, "wal.count: rc=%d, %d keys\n", rc, count);
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	char path[MAXPATHLEN];
+	uint32_t torn[2];
+	struct stat st;
+	FILE *f;
+	pid_t pid;
+	int status;
+	int rc;
+
+	if (mkdtemp(dir) == NULL) {
+		fprintf(stderr, "mkdtemp: err=%d\n", errno);
+		exit(1);
+	}
+	write_config();
+
+	/* The writer exits without closing the store, as a crash would */
+	pid = fork();
+	if (pid == 0) {
+		init();
+		fill();
+		_exit(0);
+	}
+	if (pid < 0 || waitpid(pid, &status, 0) != pid ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "writer failed\n");
+		exit(1);
+	}
+
+	snprintf(path, MAXPATHLEN, "%s/kvsal.snap", dir);
+	if (stat(path, &st) != 0) {
+		fprintf(stderr, "no checkpoint in %s: err=%d\n", dir, errno);
+		exit(1);
+	}
+
+	/* A frame header whose payload was never written, as if the crash
+	 * happened during a write */
+	snprintf(path, MAXPATHLEN, "%s/kvsal.wal", dir);
+	torn[0] = 0x4b56574cU;
+	torn[1] = 4096;
+	f = fopen(path, "a");
+	if (f == NULL || fwrite(torn, sizeof(torn), 1, f) != 1) {
+		fprintf(stderr, "%s: err=%d\n", path, errno);
+		exit(1);
+	}
+	fclose(f);
+
+	/* The snapshot and the log replayed, the torn frame dropped */
+	init();
+	check();
+
+	/* Written after the torn frame was dropped, then read back once the
+	 * store was closed cleanly */
+	rc = kvsal_set_char("wal.after", "1");
+	if (rc != 0) {
+		fprintf(stderr, "kvsal_set_char: err=%d\n", rc);
+		exit(-rc);
+	}
+
+	rc = kvsal_fini();
+	if (rc != 0) {
+		fprintf(stderr, "kvsal_fini: err=%d\n", rc);
+		exit(-rc);
+	}
+
+	init();
+	check();
+
+	rc = kvsal_exists("wal.after");
+	if (rc != 0) {
+		fprintf(stderr, "wal.after: err=%d\n", rc);
+		exit(1);
+	}
+
+	rc = kvsal_fini();
+	if (rc != 0) {
+		fprintf(stderr, "kvsal_fini: err=%d\n", rc);
+		exit(-rc);
+	}
+
+	snprintf(path, MAXPATHLEN, "%s/kvsal.snap", dir);
+	unlink(path);
+	snprintf(path, MAXPATHLEN, "%s/kvsal.wal", dir);
+	unlink(path);
+	rmdir(dir);
+	unlink(config);
+
+	printf("+++++++++++++++\n");
+
+	exit(0);
+	return 0;
+}
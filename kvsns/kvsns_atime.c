@@ -0,0 +1,492 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) CEA, 2016
+ * Author: Philippe Deniel  philippe.deniel@cea.fr
+ *
+ * contributeur : Philippe DENIEL   philippe.deniel@cea.fr
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+
+/* kvsns_atime.c
+ * KVSNS: access time updates, as set by "atime" in section [kvsns]
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <ini_config.h>
+#include <kvsns/kvsal.h>
+#include <kvsns/kvsns.h>
+#include "kvsns_internal.h"
+
+/* With "lazytime", the access times are kept in a table split into shards,
+ * each with its own lock, as the client cache is. A slot holds the last
+ * access time of an inode, not written yet. An inode taking the slot of
+ * another one has that one's time written at once, the others are written
+ * by a thread every "atime_flush_ms", in batches, or along with their inode
+ * record if it is written before */
+#define KVSNS_ATIME_SHARDS 64
+#define KVSNS_ATIME_ENTRIES 4096
+#define KVSNS_ATIME_FLUSH_MS 60000
+
+/* "relatime" only writes an access time older than the inode's last change
+ * or than a day */
+#define KVSNS_RELATIME_S (24 * 3600)
+
+struct kvsns_atime_slot {
+	bool valid;
+	kvsns_ino_t ino;
+	struct timespec atime;
+};
+
+struct kvsns_atime_shard {
+	pthread_mutex_t lock;
+	struct kvsns_atime_slot *slots;
+};
+
+enum kvsns_atime_mode kvsns_atime_mode = KVSNS_ATIME_STRICT;
+
+static struct kvsns_atime_shard atime_shards[KVSNS_ATIME_SHARDS];
+static size_t slots_per_shard;
+static uint64_t flush_ms = KVSNS_ATIME_FLUSH_MS;
+static pthread_t flusher;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+static bool flusher_started;
+static bool flusher_stop;
+
+static struct kvsns_atime_shard *kvsns_atime_shard(kvsns_ino_t *ino)
+{
+	return &atime_shards[*ino % KVSNS_ATIME_SHARDS];
+}
+
+static struct kvsns_atime_slot *kvsns_atime_slot(struct kvsns_atime_shard *s,
+						 kvsns_ino_t *ino)
+{
+	return &s->slots[(*ino / KVSNS_ATIME_SHARDS) % slots_per_shard];
+}
+
+static bool kvsns_atime_before(struct timespec *a, struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec ||
+	       (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* Writes the access times of nb slots, taken out of the table, into their
+ * inode records: they are all read, then their access times alone are
+ * overwritten, in a batch each, so that the records' other fields changed
+ * meanwhile are kept */
+static int kvsns_atime_write(struct kvsns_atime_slot *slots, int nb)
+{
+	char keys[KVSAL_ARRAY_SIZE][KLEN];
+	kvsal_op_t ops[KVSAL_ARRAY_SIZE];
+	kvsns_ino_t *set[KVSAL_ARRAY_SIZE];
+	kvsns_inode_t inode;
+	char *records;
+	char *atime;
+	size_t mark;
+	int nb_set = 0;
+	int i;
+	int rc;
+
+	mark = kvsal_arena_mark();
+	records = kvsal_arena_alloc(nb * KVSNS_INODE_MAXLEN);
+	if (records == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < nb ; i++)
+		kvsns_prepare_inode_op(&ops[i], keys[i], &slots[i].ino,
+				       &records[i*KVSNS_INODE_MAXLEN]);
+	RC_WRAP_LABEL(rc, out, kvsal_batch, ops, nb);
+
+	/* Inodes deleted meanwhile, or accessed since by another client,
+	 * are left alone */
+	for (i = 0; i < nb ; i++) {
+		rc = kvsns_inode_op_rc(&ops[i], &inode);
+		if (rc == -ENOENT)
+			continue;
+		if (rc != 0)
+			goto out;
+		if (!kvsns_atime_before(&inode.stat.st_atim, &slots[i].atime))
+			continue;
+
+		atime = &records[i*KVSNS_INODE_MAXLEN];
+		kvsns_encode_time(&slots[i].atime, atime);
+		set[nb_set] = &slots[i].ino;
+		kvsns_prepare_op(&ops[nb_set], KVSAL_OP_SETRANGE, keys[i],
+				 atime, KVSNS_TIME_LEN);
+		ops[nb_set++].off = KVSNS_INODE_ATIME;
+	}
+
+	rc = 0;
+	if (nb_set == 0)
+		goto out;
+
+	rc = kvsal_batch(ops, nb_set);
+	for (i = 0; i < nb_set ; i++)
+		kvsns_cache_del_attr(set[i]);
+	if (rc != 0)
+		goto out;
+
+	/* A record deleted since it was read is left with nothing but the
+	 * access time, that goes as well */
+	for (i = 0; i < nb_set ; i++) {
+		if (ops[i].rc != 0) {
+			rc = ops[i].rc;
+			break;
+		}
+		if (ops[i].vlen < KVSNS_INODE_HDRLEN) {
+			rc = kvsal_del(ops[i].k);
+			if (rc != 0 && rc != -ENOENT)
+				break;
+			rc = 0;
+		}
+	}
+
+out:
+	kvsal_arena_release(mark);
+	return rc;
+}
+
+/* Writes every access time kept */
+int kvsns_atime_flush(void)
+{
+	struct kvsns_atime_slot batch[KVSAL_ARRAY_SIZE];
+	struct kvsns_atime_shard *s;
+	int nb = 0;
+	size_t j;
+	int i;
+	int err;
+	int rc = 0;
+
+	if (kvsns_atime_mode != KVSNS_ATIME_LAZY)
+		return 0;
+
+	for (i = 0; i < KVSNS_ATIME_SHARDS ; i++) {
+		s = &atime_shards[i];
+		if (s->slots == NULL)
+			continue;
+
+		for (j = 0; j < slots_per_shard ; j++) {
+			pthread_mutex_lock(&s->lock);
+			if (s->slots[j].valid) {
+				batch[nb++] = s->slots[j];
+				s->slots[j].valid = false;
+			}
+			pthread_mutex_unlock(&s->lock);
+
+			if (nb < KVSAL_ARRAY_SIZE)
+				continue;
+
+			/* A failed batch is lost, as the times of a crashed
+			 * client are, the others are still written */
+			err = kvsns_atime_write(batch, nb);
+			if (err != 0)
+				rc = err;
+			nb = 0;
+		}
+	}
+
+	if (nb > 0) {
+		err = kvsns_atime_write(batch, nb);
+		if (err != 0)
+			rc = err;
+	}
+
+	return rc;
+}
+
+/* Takes the access time of ino out of the table, into slot */
+static bool kvsns_atime_take(kvsns_ino_t *ino, struct kvsns_atime_slot *slot)
+{
+	struct kvsns_atime_shard *s;
+	struct kvsns_atime_slot *cur;
+	bool found = false;
+
+	if (kvsns_atime_mode != KVSNS_ATIME_LAZY)
+		return false;
+
+	s = kvsns_atime_shard(ino);
+	cur = kvsns_atime_slot(s, ino);
+
+	pthread_mutex_lock(&s->lock);
+	if (cur->valid && cur->ino == *ino) {
+		*slot = *cur;
+		cur->valid = false;
+		found = true;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return found;
+}
+
+int kvsns_atime_flush_ino(kvsns_ino_t *ino)
+{
+	struct kvsns_atime_slot slot;
+
+	if (!kvsns_atime_take(ino, &slot))
+		return 0;
+
+	return kvsns_atime_write(&slot, 1);
+}
+
+void kvsns_atime_merge(kvsns_ino_t *ino, struct stat *stat)
+{
+	struct kvsns_atime_slot slot;
+
+	if (kvsns_atime_take(ino, &slot) &&
+	    kvsns_atime_before(&stat->st_atim, &slot.atime))
+		stat->st_atim = slot.atime;
+}
+
+void kvsns_atime_forget(kvsns_ino_t *ino)
+{
+	struct kvsns_atime_slot slot;
+
+	kvsns_atime_take(ino, &slot);
+}
+
+void kvsns_atime_amend(kvsns_ino_t *ino, struct stat *stat)
+{
+	struct kvsns_atime_shard *s;
+	struct kvsns_atime_slot *cur;
+
+	if (kvsns_atime_mode != KVSNS_ATIME_LAZY)
+		return;
+
+	s = kvsns_atime_shard(ino);
+	cur = kvsns_atime_slot(s, ino);
+
+	pthread_mutex_lock(&s->lock);
+	if (cur->valid && cur->ino == *ino &&
+	    kvsns_atime_before(&stat->st_atim, &cur->atime))
+		stat->st_atim = cur->atime;
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Keeps now as the access time of ino */
+static int kvsns_atime_defer(kvsns_ino_t *ino)
+{
+	struct kvsns_atime_shard *s;
+	struct kvsns_atime_slot *cur;
+	struct kvsns_atime_slot victim;
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_REALTIME, &now) != 0)
+		return -errno;
+
+	s = kvsns_atime_shard(ino);
+	cur = kvsns_atime_slot(s, ino);
+
+	pthread_mutex_lock(&s->lock);
+	victim = *cur;
+	cur->valid = true;
+	cur->ino = *ino;
+	cur->atime = now;
+	pthread_mutex_unlock(&s->lock);
+
+	if (victim.valid && victim.ino != *ino)
+		return kvsns_atime_write(&victim, 1);
+
+	return 0;
+}
+
+static bool kvsns_relatime_due(struct stat *stat)
+{
+	struct timespec now;
+
+	if (!kvsns_atime_before(&stat->st_mtim, &stat->st_atim) ||
+	    !kvsns_atime_before(&stat->st_ctim, &stat->st_atim))
+		return true;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return now.tv_sec - stat->st_atim.tv_sec >= KVSNS_RELATIME_S;
+}
+
+int kvsns_update_atime(kvsns_ino_t *ino, kvsns_inode_t *inode)
+{
+	kvsns_inode_t record;
+
+	if (!ino)
+		return -EINVAL;
+
+	if (kvsns_atime_mode == KVSNS_ATIME_LAZY)
+		return kvsns_atime_defer(ino);
+
+	if (inode == NULL) {
+		if (kvsns_atime_mode == KVSNS_ATIME_STRICT)
+			return kvsns_update_stat(ino, STAT_ATIME_SET);
+
+		RC_WRAP(kvsns_get_inode, ino, &record);
+		inode = &record;
+	}
+
+	if (kvsns_atime_mode == KVSNS_ATIME_RELATIME &&
+	    !kvsns_relatime_due(&inode->stat))
+		return 0;
+
+	RC_WRAP(kvsns_amend_stat, &inode->stat, STAT_ATIME_SET);
+	return kvsns_set_inode(ino, inode);
+}
+
+static void *kvsns_atime_flusher(void *arg)
+{
+	struct timespec deadline;
+	int rc;
+
+	pthread_mutex_lock(&flusher_lock);
+	while (!flusher_stop) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += flush_ms / 1000;
+		deadline.tv_nsec += (flush_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		rc = 0;
+		while (!flusher_stop && rc != ETIMEDOUT)
+			rc = pthread_cond_timedwait(&flusher_cond,
+						    &flusher_lock, &deadline);
+		if (flusher_stop)
+			break;
+
+		pthread_mutex_unlock(&flusher_lock);
+		rc = kvsns_atime_flush();
+		if (rc != 0)
+			LogWarn(KVSNS_COMPONENT_KVSNS,
+				"Can't write access times rc=%d", rc);
+		pthread_mutex_lock(&flusher_lock);
+	}
+	pthread_mutex_unlock(&flusher_lock);
+
+	return NULL;
+}
+
+int kvsns_atime_init(struct collection_item *cfg_items)
+{
+	struct collection_item *item = NULL;
+	size_t entries = KVSNS_ATIME_ENTRIES;
+	const char *mode;
+	int i;
+
+	RC_WRAP(get_config_item, "kvsns", "atime", cfg_items, &item);
+	if (item != NULL) {
+		mode = get_const_string_config_value(item, NULL);
+		if (!strcmp(mode, "strict"))
+			kvsns_atime_mode = KVSNS_ATIME_STRICT;
+		else if (!strcmp(mode, "relatime"))
+			kvsns_atime_mode = KVSNS_ATIME_RELATIME;
+		else if (!strcmp(mode, "lazytime"))
+			kvsns_atime_mode = KVSNS_ATIME_LAZY;
+		else {
+			LogCrit(KVSNS_COMPONENT_KVSNS,
+				"Unknown atime %s", mode);
+			return -EINVAL;
+		}
+	}
+
+	item = NULL;
+	RC_WRAP(get_config_item, "kvsns", "atime_flush_ms", cfg_items, &item);
+	if (item != NULL)
+		flush_ms = get_unsigned_config_value(item, 0,
+						     KVSNS_ATIME_FLUSH_MS,
+						     NULL);
+
+	item = NULL;
+	RC_WRAP(get_config_item, "kvsns", "atime_entries", cfg_items, &item);
+	if (item != NULL)
+		entries = get_unsigned_config_value(item, 0,
+						    KVSNS_ATIME_ENTRIES, NULL);
+
+	if (kvsns_atime_mode != KVSNS_ATIME_LAZY)
+		return 0;
+
+	if (flush_ms == 0) {
+		LogCrit(KVSNS_COMPONENT_KVSNS,
+			"atime_flush_ms must be at least 1");
+		kvsns_atime_mode = KVSNS_ATIME_STRICT;
+		return -EINVAL;
+	}
+
+	slots_per_shard = entries / KVSNS_ATIME_SHARDS;
+	if (slots_per_shard == 0)
+		slots_per_shard = 1;
+
+	for (i = 0; i < KVSNS_ATIME_SHARDS ; i++) {
+		pthread_mutex_init(&atime_shards[i].lock, NULL);
+		atime_shards[i].slots = calloc(slots_per_shard,
+					sizeof(struct kvsns_atime_slot));
+		if (!atime_shards[i].slots) {
+			kvsns_atime_fini();
+			return -ENOMEM;
+		}
+	}
+
+	flusher_stop = false;
+	if (pthread_create(&flusher, NULL, kvsns_atime_flusher, NULL) != 0) {
+		kvsns_atime_fini();
+		return -EAGAIN;
+	}
+	flusher_started = true;
+
+	LogInfo(KVSNS_COMPONENT_KVSNS,
+		"Writing access times every %llu ms",
+		(unsigned long long)flush_ms);
+
+	return 0;
+}
+
+/* Stops the thread, then writes what is left */
+int kvsns_atime_fini(void)
+{
+	int rc;
+	int i;
+
+	if (kvsns_atime_mode != KVSNS_ATIME_LAZY)
+		return 0;
+
+	if (flusher_started) {
+		pthread_mutex_lock(&flusher_lock);
+		flusher_stop = true;
+		pthread_cond_broadcast(&flusher_cond);
+		pthread_mutex_unlock(&flusher_lock);
+		pthread_join(flusher, NULL);
+		flusher_started = false;
+	}
+
+	rc = kvsns_atime_flush();
+
+	kvsns_atime_mode = KVSNS_ATIME_STRICT;
+	for (i = 0; i < KVSNS_ATIME_SHARDS ; i++) {
+		free(atime_shards[i].slots);
+		atime_shards[i].slots = NULL;
+		pthread_mutex_destroy(&atime_shards[i].lock);
+	}
+
+	return rc;
+}
@@ -0,0 +1,526 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) CEA, 2016
+ * Author: Philippe Deniel  philippe.deniel@cea.fr
+ *
+ * contributeur : Philippe DENIEL   philippe.deniel@cea.fr
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+/* kvsns_cache.c
+ * KVSNS: client side cache of dentries and attributes
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <ini_config.h>
+#include <kvsns/kvsal.h>
+#include <kvsns/kvsns.h>
+#include "kvsns_internal.h"
+
+/* A dentry entry may also be negative: the name is known not to exist in
+ * its parent. Such entries expire after their own TTL. They are replaced,
+ * as any dentry entry, when the name is created, linked or renamed into
+ * the parent.
+ * Each cache is split into shards, each one with its own lock. A shard is a
+ * direct-mapped table: a new entry replaces whatever was in its slot.
+ * Dentries are spread over the shards according to their parent, so that
+ * dropping a whole directory only scans one shard.
+ * Any invalidation bumps the shard's generation. A value read from the KVS
+ * is only cached if the generation did not change since the cache missed,
+ * otherwise it may be older than the invalidation. Entries are invalidated
+ * once their keys are written: those invalidated within a transaction are
+ * invalidated again once it ends, as a miss may have read the KVS before
+ * the commit. Up to KVSNS_CACHE_PENDING slots are kept for this, a larger
+ * transaction flushes the whole cache */
+#define KVSNS_CACHE_SHARDS 64
+#define KVSNS_CACHE_ENTRIES 65536
+#define KVSNS_CACHE_PENDING 256
+
+struct kvsns_dentry_slot {
+	bool valid;
+	bool negative;
+	uint64_t expire;
+	kvsns_ino_t parent;
+	kvsns_ino_t ino;
+	char name[NAME_MAX + 1];
+};
+
+struct kvsns_attr_slot {
+	bool valid;
+	uint64_t expire;
+	struct stat stat;
+};
+
+struct kvsns_cache_shard {
+	pthread_mutex_t lock;
+	unsigned long gen;
+	void *slots;
+};
+
+struct kvsns_cache_pending {
+	struct kvsns_cache_shard *s;
+	bool *valid;
+};
+
+static struct kvsns_cache_shard dentry_shards[KVSNS_CACHE_SHARDS];
+static struct kvsns_cache_shard attr_shards[KVSNS_CACHE_SHARDS];
+static size_t slots_per_shard;
+static bool cache_enabled;
+static uint64_t cache_ttl_ms; /* 0 means no positive entries */
+static uint64_t cache_negative_ttl_ms; /* 0 means no negative entries */
+
+/* The slots invalidated by the calling thread's transaction */
+static __thread bool in_transaction;
+static __thread bool pending_overflow;
+static __thread int nb_pending;
+static __thread struct kvsns_cache_pending pending[KVSNS_CACHE_PENDING];
+
+static uint64_t kvsns_cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* FNV-1a */
+static size_t kvsns_dentry_hash(kvsns_ino_t *parent, char *name)
+{
+	uint64_t h = 14695981039346656037ULL ^ *parent;
+
+	for (; *name != '\0' ; name++) {
+		h ^= (unsigned char)*name;
+		h *= 1099511628211ULL;
+	}
+
+	return h % slots_per_shard;
+}
+
+static struct kvsns_cache_shard *kvsns_dentry_shard(kvsns_ino_t *parent)
+{
+	return &dentry_shards[*parent % KVSNS_CACHE_SHARDS];
+}
+
+static struct kvsns_cache_shard *kvsns_attr_shard(kvsns_ino_t *ino)
+{
+	return &attr_shards[*ino % KVSNS_CACHE_SHARDS];
+}
+
+static struct kvsns_attr_slot *kvsns_attr_slot(struct kvsns_cache_shard *s,
+					       kvsns_ino_t *ino)
+{
+	struct kvsns_attr_slot *slots = s->slots;
+
+	return &slots[(*ino / KVSNS_CACHE_SHARDS) % slots_per_shard];
+}
+
+/* Keeps a slot just invalidated within a transaction, to be invalidated
+ * again by kvsns_cache_end */
+static void kvsns_cache_pend(struct kvsns_cache_shard *s, bool *valid)
+{
+	if (!in_transaction)
+		return;
+
+	if (nb_pending == KVSNS_CACHE_PENDING) {
+		pending_overflow = true;
+		return;
+	}
+
+	pending[nb_pending].s = s;
+	pending[nb_pending].valid = valid;
+	nb_pending++;
+}
+
+void kvsns_cache_begin(void)
+{
+	in_transaction = true;
+	pending_overflow = false;
+	nb_pending = 0;
+}
+
+void kvsns_cache_end(void)
+{
+	struct kvsns_cache_shard *s;
+	int i;
+
+	in_transaction = false;
+	if (!cache_enabled)
+		return;
+
+	if (pending_overflow) {
+		kvsns_cache_flush();
+		return;
+	}
+
+	/* The slot may hold another entry by now, which goes as well */
+	for (i = 0; i < nb_pending ; i++) {
+		s = pending[i].s;
+		pthread_mutex_lock(&s->lock);
+		*pending[i].valid = false;
+		s->gen++;
+		pthread_mutex_unlock(&s->lock);
+	}
+	nb_pending = 0;
+}
+
+/* Returns 0 if the dentry is cached, -ENOENT if it is known not to exist
+ * and -EAGAIN on a miss */
+int kvsns_cache_get_dentry(kvsns_ino_t *parent, char *name, kvsns_ino_t *ino,
+			   unsigned long *gen)
+{
+	struct kvsns_cache_shard *s;
+	struct kvsns_dentry_slot *slot;
+	int rc = -EAGAIN;
+
+	if (!cache_enabled)
+		return -EAGAIN;
+
+	s = kvsns_dentry_shard(parent);
+	slot = (struct kvsns_dentry_slot *)s->slots +
+		kvsns_dentry_hash(parent, name);
+
+	pthread_mutex_lock(&s->lock);
+	if (slot->valid && slot->parent == *parent &&
+	    !strcmp(slot->name, name) &&
+	    slot->expire > kvsns_cache_now()) {
+		if (slot->negative)
+			rc = -ENOENT;
+		else {
+			*ino = slot->ino;
+			rc = 0;
+		}
+	}
+	*gen = s->gen;
+	pthread_mutex_unlock(&s->lock);
+
+	return rc;
+}
+
+static void kvsns_cache_put_dentry(kvsns_ino_t *parent, char *name,
+				   kvsns_ino_t ino, uint64_t ttl,
+				   unsigned long gen)
+{
+	struct kvsns_cache_shard *s;
+	struct kvsns_dentry_slot *slot;
+
+	if (ttl == 0 || strlen(name) > NAME_MAX)
+		return;
+
+	s = kvsns_dentry_shard(parent);
+	slot = (struct kvsns_dentry_slot *)s->slots +
+		kvsns_dentry_hash(parent, name);
+
+	pthread_mutex_lock(&s->lock);
+	if (s->gen == gen) {
+		slot->valid = true;
+		slot->negative = (ino == 0LL);
+		slot->expire = kvsns_cache_now() + ttl;
+		slot->parent = *parent;
+		slot->ino = ino;
+		strcpy(slot->name, name);
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+void kvsns_cache_set_dentry(kvsns_ino_t *parent, char *name, kvsns_ino_t *ino,
+			    unsigned long gen)
+{
+	kvsns_cache_put_dentry(parent, name, *ino, cache_ttl_ms, gen);
+}
+
+void kvsns_cache_set_noent(kvsns_ino_t *parent, char *name,
+			   unsigned long gen)
+{
+	kvsns_cache_put_dentry(parent, name, 0LL, cache_negative_ttl_ms, gen);
+}
+
+void kvsns_cache_del_dentry(kvsns_ino_t *parent, char *name)
+{
+	struct kvsns_cache_shard *s;
+	struct kvsns_dentry_slot *slot;
+
+	if (!cache_enabled)
+		return;
+
+	s = kvsns_dentry_shard(parent);
+	slot = (struct kvsns_dentry_slot *)s->slots +
+		kvsns_dentry_hash(parent, name);
+
+	pthread_mutex_lock(&s->lock);
+	if (slot->valid && slot->parent == *parent &&
+	    !strcmp(slot->name, name))
+		slot->valid = false;
+	s->gen++;
+	pthread_mutex_unlock(&s->lock);
+
+	kvsns_cache_pend(s, &slot->valid);
+}
+
+void kvsns_cache_del_dir(kvsns_ino_t *parent)
+{
+	struct kvsns_cache_shard *s;
+	struct kvsns_dentry_slot *slots;
+	size_t i;
+
+	if (!cache_enabled)
+		return;
+
+	s = kvsns_dentry_shard(parent);
+	slots = s->slots;
+
+	pthread_mutex_lock(&s->lock);
+	for (i = 0; i < slots_per_shard ; i++)
+		if (slots[i].parent == *parent)
+			slots[i].valid = false;
+	s->gen++;
+	pthread_mutex_unlock(&s->lock);
+}
+
+int kvsns_cache_get_attr(kvsns_ino_t *ino, struct stat *bufstat,
+			 unsigned long *gen)
+{
+	struct kvsns_cache_shard *s;
+	struct kvsns_attr_slot *slot;
+	int rc = -ENOENT;
+
+	if (!cache_enabled)
+		return -ENOENT;
+
+	s = kvsns_attr_shard(ino);
+	slot = kvsns_attr_slot(s, ino);
+
+	pthread_mutex_lock(&s->lock);
+	if (slot->valid && slot->stat.st_ino == *ino &&
+	    slot->expire > kvsns_cache_now()) {
+		memcpy(bufstat, &slot->stat, sizeof(struct stat));
+		rc = 0;
+	}
+	*gen = s->gen;
+	pthread_mutex_unlock(&s->lock);
+
+	return rc;
+}
+
+void kvsns_cache_set_attr(kvsns_ino_t *ino, struct stat *bufstat,
+			  unsigned long gen)
+{
+	struct kvsns_cache_shard *s;
+	struct kvsns_attr_slot *slot;
+
+	if (cache_ttl_ms == 0)
+		return;
+
+	s = kvsns_attr_shard(ino);
+	slot = kvsns_attr_slot(s, ino);
+
+	pthread_mutex_lock(&s->lock);
+	if (s->gen == gen) {
+		slot->valid = true;
+		slot->expire = kvsns_cache_now() + cache_ttl_ms;
+		memcpy(&slot->stat, bufstat, sizeof(struct stat));
+		slot->stat.st_ino = *ino;
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+void kvsns_cache_del_attr(kvsns_ino_t *ino)
+{
+	struct kvsns_cache_shard *s;
+	struct kvsns_attr_slot *slot;
+
+	if (!cache_enabled)
+		return;
+
+	s = kvsns_attr_shard(ino);
+	slot = kvsns_attr_slot(s, ino);
+
+	pthread_mutex_lock(&s->lock);
+	if (slot->valid && slot->stat.st_ino == *ino)
+		slot->valid = false;
+	s->gen++;
+	pthread_mutex_unlock(&s->lock);
+
+	kvsns_cache_pend(s, &slot->valid);
+}
+
+static void kvsns_cache_flush_shard(struct kvsns_cache_shard *s, size_t size)
+{
+	pthread_mutex_lock(&s->lock);
+	memset(s->slots, 0, size * slots_per_shard);
+	s->gen++;
+	pthread_mutex_unlock(&s->lock);
+}
+
+void kvsns_cache_flush(void)
+{
+	int i;
+
+	if (!cache_enabled)
+		return;
+
+	for (i = 0; i < KVSNS_CACHE_SHARDS ; i++) {
+		kvsns_cache_flush_shard(&dentry_shards[i],
+					sizeof(struct kvsns_dentry_slot));
+		kvsns_cache_flush_shard(&attr_shards[i],
+					sizeof(struct kvsns_attr_slot));
+	}
+}
+
+/* Called by the KVSAL for every change, made by any client, to a key
+ * holding an inode or dentries */
+static void kvsns_cache_notify(char *k, void *arg)
+{
+	enum kvsns_key_type type;
+	kvsns_ino_t ino;
+	size_t name;
+
+	if (k == NULL) {
+		LogWarn(KVSNS_COMPONENT_KVSNS,
+			"Lost KVS notifications, cache entries now only expire");
+		kvsns_cache_flush();
+		return;
+	}
+
+	if (kvsns_parse_key(k, strlen(k), &ino, &type, &name) != 0)
+		return;
+
+	if (type == KVSNS_KEY_INODE)
+		kvsns_cache_del_attr(&ino);
+	else if (type == KVSNS_KEY_DENTRIES)
+		kvsns_cache_del_dir(&ino);
+	else if (type == KVSNS_KEY_DENTRY)
+		kvsns_cache_del_dentry(&ino, k + name);
+}
+
+int kvsns_cache_init(struct collection_item *cfg_items)
+{
+	struct collection_item *item = NULL;
+	char *patterns[] = { "*.inode", "*.dentries*" };
+	int nb_patterns = 2;
+	size_t entries = KVSNS_CACHE_ENTRIES;
+	bool invalidation = false;
+	int i;
+	int rc;
+
+	RC_WRAP(get_config_item, "kvsns", "cache_ttl_ms", cfg_items, &item);
+	if (item != NULL)
+		cache_ttl_ms = get_unsigned_config_value(item, 0, 0, NULL);
+
+	/* Negative entries live as long as the others, unless told otherwise */
+	cache_negative_ttl_ms = cache_ttl_ms;
+	item = NULL;
+	RC_WRAP(get_config_item, "kvsns", "cache_negative_ttl_ms", cfg_items,
+		&item);
+	if (item != NULL)
+		cache_negative_ttl_ms = get_unsigned_config_value(item, 0, 0,
+								  NULL);
+
+	item = NULL;
+	RC_WRAP(get_config_item, "kvsns", "cache_entries", cfg_items, &item);
+	if (item != NULL)
+		entries = get_unsigned_config_value(item, 0,
+						    KVSNS_CACHE_ENTRIES, NULL);
+
+	item = NULL;
+	RC_WRAP(get_config_item, "kvsns", "cache_invalidation", cfg_items,
+		&item);
+	if (item != NULL)
+		invalidation = get_bool_config_value(item, 0, NULL);
+
+	if (cache_ttl_ms == 0 && cache_negative_ttl_ms == 0)
+		return 0;
+
+	cache_enabled = true;
+	slots_per_shard = entries / KVSNS_CACHE_SHARDS;
+	if (slots_per_shard == 0)
+		slots_per_shard = 1;
+
+	for (i = 0; i < KVSNS_CACHE_SHARDS ; i++) {
+		pthread_mutex_init(&dentry_shards[i].lock, NULL);
+		dentry_shards[i].gen = 0;
+		dentry_shards[i].slots = calloc(slots_per_shard,
+					sizeof(struct kvsns_dentry_slot));
+
+		pthread_mutex_init(&attr_shards[i].lock, NULL);
+		attr_shards[i].gen = 0;
+		attr_shards[i].slots = calloc(slots_per_shard,
+					sizeof(struct kvsns_attr_slot));
+
+		if (!dentry_shards[i].slots || !attr_shards[i].slots) {
+			kvsns_cache_fini();
+			return -ENOMEM;
+		}
+	}
+
+	LogInfo(KVSNS_COMPONENT_KVSNS,
+		"Caching %zu entries for %llu ms (%llu ms if negative)",
+		slots_per_shard * KVSNS_CACHE_SHARDS,
+		(unsigned long long)cache_ttl_ms,
+		(unsigned long long)cache_negative_ttl_ms);
+
+	if (!invalidation)
+		return 0;
+
+	/* Encoded keys have their type after the inode number, the keys
+	 * notified are then sorted out by kvsns_cache_notify */
+	if (kvsns_key_encoding == KVSNS_KEYS_BINARY) {
+		patterns[0] = "*";
+		nb_patterns = 1;
+	}
+
+	rc = kvsal_watch(patterns, nb_patterns, kvsns_cache_notify, NULL);
+	if (rc != 0) {
+		LogCrit(KVSNS_COMPONENT_KVSNS,
+			"Can't get notified of KVS changes rc=%d", rc);
+		kvsns_cache_fini();
+		return rc;
+	}
+
+	return 0;
+}
+
+void kvsns_cache_fini(void)
+{
+	int i;
+
+	if (!cache_enabled)
+		return;
+
+	cache_enabled = false;
+	cache_ttl_ms = 0;
+	cache_negative_ttl_ms = 0;
+	for (i = 0; i < KVSNS_CACHE_SHARDS ; i++) {
+		free(dentry_shards[i].slots);
+		dentry_shards[i].slots = NULL;
+		pthread_mutex_destroy(&dentry_shards[i].lock);
+
+		free(attr_shards[i].slots);
+		attr_shards[i].slots = NULL;
+		pthread_mutex_destroy(&attr_shards[i].lock);
+	}
+}
@@ -106,6 +106,263 @@ int kvsns_creat(kvsns_cred_t *cred, kvsns_ino_t *parent, char *name,
 	return 0;
 }
 
+/* Orders items by name, the first one given coming first among equals */
+static int kvsns_create_cmp(const void *a, const void *b)
+{
+	const kvsns_create_item_t *ia = *(const kvsns_create_item_t **)a;
+	const kvsns_create_item_t *ib = *(const kvsns_create_item_t **)b;
+	int rc;
+
+	rc = strcmp(ia->name, ib->name);
+	if (rc != 0)
+		return rc;
+
+	return (ia < ib) ? -1 : (ia > ib);
+}
+
+/* Sets -EEXIST as the rc of the nb items whose names exist */
+static int kvsns_create_check(kvsns_ino_t *parent,
+			      kvsns_create_item_t **items, int nb)
+{
+	kvsal_op_t ops[KVSAL_ARRAY_SIZE];
+	size_t mark;
+	int rc = 0;
+	int i;
+
+	mark = kvsal_arena_mark();
+	for (i = 0; i < nb ; i++)
+		RC_WRAP_LABEL(rc, out, kvsns_prepare_dentry_op, &ops[i],
+			      KVSAL_OP_EXISTS, parent, items[i]->name, NULL,
+			      0);
+	RC_WRAP_LABEL(rc, out, kvsal_batch, ops, nb);
+
+	for (i = 0; i < nb ; i++) {
+		if (ops[i].rc == 0)
+			items[i]->rc = -EEXIST;
+		else if (ops[i].rc != -ENOENT) {
+			rc = ops[i].rc;
+			break;
+		}
+	}
+
+out:
+	kvsal_arena_release(mark);
+	return rc;
+}
+
+/* The inode record of item, inode holding what all items have in common */
+int kvsns_create_record(kvsns_inode_t *inode, kvsns_create_item_t *item,
+			char *record, size_t *size)
+{
+	inode->stat.st_ino = item->ino;
+	inode->stat.st_mode = S_IFREG|item->mode;
+#ifdef KVSNS_S3
+	strncpy(inode->name, item->name, NAME_MAX);
+#endif
+	return kvsns_encode_inode(inode, record, size);
+}
+
+/* Queues the dentries and inodes of nb items with the transaction, inode
+ * holding what they have in common */
+static int kvsns_create_queue(kvsns_ino_t *parent, kvsns_inode_t *inode,
+			      kvsns_create_item_t **items, int nb,
+			      char *records)
+{
+	char keys[KVSNS_CREATE_BATCH][KLEN];
+	char values[KVSNS_CREATE_BATCH][VLEN];
+	kvsal_op_t ops[KVSAL_ARRAY_SIZE];
+	char *record;
+	size_t size;
+	size_t mark;
+	int rc;
+	int i;
+
+	mark = kvsal_arena_mark();
+	for (i = 0; i < nb ; i++) {
+		record = &records[i*KVSNS_INODE_MAXLEN];
+		RC_WRAP_LABEL(rc, out, kvsns_create_record, inode, items[i],
+			      record, &size);
+
+		kvsns_ino2str(&items[i]->ino, values[i]);
+		RC_WRAP_LABEL(rc, out, kvsns_prepare_dentry_op, &ops[2*i],
+			      KVSAL_OP_SET, parent, items[i]->name, values[i],
+			      strlen(values[i]));
+		kvsns_key(keys[i], &items[i]->ino, KVSNS_KEY_INODE, NULL);
+		kvsns_prepare_op(&ops[2*i+1], KVSAL_OP_SET, keys[i], record,
+				 size);
+	}
+
+	rc = kvsal_batch(ops, 2 * nb);
+
+out:
+	kvsal_arena_release(mark);
+	return rc;
+}
+
+/* Writes nb items and their directory in a single transaction */
+static int kvsns_create_commit(kvsns_ino_t *parent,
+			       kvsns_inode_t *parent_inode,
+			       kvsns_inode_t *inode,
+			       kvsns_create_item_t **items, int nb,
+			       char *records)
+{
+	int rc;
+	int i;
+
+	RC_WRAP(kvsns_amend_stat, &parent_inode->stat,
+		STAT_CTIME_SET|STAT_MTIME_SET);
+
+	RC_WRAP(kvsns_begin_transaction);
+	for (i = 0; i < nb ; i += KVSNS_CREATE_BATCH)
+		RC_WRAP_LABEL(rc, aborted, kvsns_create_queue, parent, inode,
+			      &items[i], MIN(nb - i, KVSNS_CREATE_BATCH),
+			      records);
+	RC_WRAP_LABEL(rc, aborted, kvsns_set_inode, parent, parent_inode);
+	RC_WRAP_LABEL(rc, aborted, kvsns_add_entries, parent, parent_inode,
+		      nb);
+	RC_WRAP_LABEL(rc, aborted, kvsal_add_counter, KVSNS_INODES_COUNTER,
+		      nb);
+
+	rc = kvsns_end_transaction();
+	for (i = 0; i < nb ; i++)
+		kvsns_cache_del_dentry(parent, items[i]->name);
+
+	return rc;
+
+aborted:
+	kvsns_discard_transaction();
+	return rc;
+}
+
+int kvsns_create_many(kvsns_cred_t *cred, kvsns_ino_t *parent,
+		      kvsns_create_item_t *items, int nb_items)
+{
+	kvsns_create_item_t **sorted;
+	kvsns_inode_t inode;
+	kvsns_inode_t parent_inode;
+	kvsns_ino_t first;
+	char *records;
+	size_t mark;
+	int nb_names;
+	int nb = 0;
+	int done = 0;
+	int batch;
+	int i;
+	int rc;
+
+	if (!cred || !parent || !items || nb_items < 0)
+		return -EINVAL;
+
+	for (i = 0; i < nb_items ; i++) {
+		if (!items[i].name)
+			return -EINVAL;
+		items[i].rc = kvsns_check_name(items[i].name);
+	}
+
+	RC_WRAP(kvsns_access, cred, parent, KVSNS_ACCESS_WRITE);
+	if (nb_items == 0)
+		return 0;
+
+	mark = kvsal_arena_mark();
+	sorted = kvsal_arena_alloc(nb_items * sizeof(*sorted));
+	records = kvsal_arena_alloc(KVSNS_CREATE_BATCH * KVSNS_INODE_MAXLEN);
+	if (sorted == NULL || records == NULL) {
+		for (i = 0; i < nb_items ; i++)
+			items[i].rc = -ENOMEM;
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	/* A name given twice is created once */
+	for (i = 0, nb_names = 0; i < nb_items ; i++)
+		if (items[i].rc == 0)
+			sorted[nb_names++] = &items[i];
+	qsort(sorted, nb_names, sizeof(*sorted), kvsns_create_cmp);
+	for (i = 0; i < nb_names ; i++) {
+		if (nb > 0 && !strcmp(sorted[i]->name, sorted[nb-1]->name))
+			sorted[i]->rc = -EEXIST;
+		else
+			sorted[nb++] = sorted[i];
+	}
+
+	rc = 0;
+	if (nb == 0)
+		goto out;
+
+	RC_WRAP_LABEL(rc, out, kvsns_next_inodes, &first, nb);
+	for (i = 0; i < nb ; i++)
+		sorted[i]->ino = first + i;
+
+	memset(&inode, 0, sizeof(inode));
+	inode.nb_parents = 1;
+	inode.parents[0] = *parent;
+	inode.stat.st_uid = cred->uid;
+	inode.stat.st_gid = cred->gid;
+	inode.stat.st_nlink = 1;
+	inode.flags = KVSNS_INODE_DATA_ATTRS; /* no data yet */
+	RC_WRAP_LABEL(rc, out, kvsns_amend_stat, &inode.stat,
+		      STAT_ATIME_SET|STAT_MTIME_SET|STAT_CTIME_SET);
+
+	/* A script per batch, which checks each name as it creates it */
+	while (kvsns_use_scripts && done < nb) {
+		batch = MIN(nb - done, KVSNS_CREATE_BATCH);
+		rc = kvsns_script_create_many(parent, &inode, &sorted[done],
+					      batch, records);
+		if (rc < 0)
+			break;
+		done += batch;
+		rc = 0;
+	}
+	if (rc != 0 && rc != -ENOTSUP)
+		goto created;
+
+	/* Otherwise the names left are checked first, then created in a
+	 * transaction */
+	rc = 0;
+	for (i = done; i < nb ; i += KVSAL_ARRAY_SIZE)
+		RC_WRAP_LABEL(rc, created, kvsns_create_check, parent,
+			      &sorted[i], MIN(nb - i, KVSAL_ARRAY_SIZE));
+
+	for (i = done, nb_names = nb, nb = done; i < nb_names ; i++)
+		if (sorted[i]->rc == 0)
+			sorted[nb++] = sorted[i];
+
+	if (done == nb)
+		goto created;
+
+	RC_WRAP_LABEL(rc, created, kvsns_get_inode, parent, &parent_inode);
+
+	rc = kvsns_create_commit(parent, &parent_inode, &inode, &sorted[done],
+				 nb - done, records);
+
+	/* Too many REDIS Cluster slots for a transaction, one per batch */
+	if (rc == -E2BIG)
+		do {
+			batch = MIN(nb - done, KVSNS_CREATE_BATCH);
+			rc = kvsns_create_commit(parent, &parent_inode, &inode,
+						 &sorted[done], batch, records);
+			if (rc == 0)
+				done += batch;
+		} while (rc == 0 && done < nb);
+	else if (rc == 0)
+		done = nb;
+
+created:
+	/* The files committed get their data, even if a later batch failed */
+	for (i = 0; i < done ; i++)
+		if (sorted[i]->rc == 0)
+			sorted[i]->rc = extstore_create(sorted[i]->ino);
+
+out:
+	/* Those not created yet never will */
+	for (i = done; rc != 0 && i < nb ; i++)
+		if (sorted[i]->rc == 0)
+			sorted[i]->rc = rc;
+
+	kvsal_arena_release(mark);
+	return rc;
+}
+
 int kvsns_open(kvsns_cred_t *cred, kvsns_ino_t *ino, 
 	       int flags, mode_t mode, kvsns_file_open_t *fd)
 {
@@ -124,7 +381,7 @@ int kvsns_open(kvsns_cred_t *cred, kvsns_ino_t *ino,
 	me.tid = syscall(SYS_gettid);
 
 	/* Manage the list of open owners */
-	snprintf(k, KLEN, "%llu.openowner", *ino);
+	kvsns_key(k, ino, KVSNS_KEY_OPENOWNER, NULL);
 	rc = kvsal_get_char(k, v);
 	if (rc == 0) {
 		RC_WRAP(kvsns_str2ownerlist, owners, &size, v);
@@ -164,22 +421,70 @@ int kvsns_openat(kvsns_cred_t *cred, kvsns_ino_t *parent, char *name,
 	if (!cred || !parent || !name || !fd)
 		return -EINVAL;
 
-	RC_WRAP(kvsns_lookup, cred, parent, name, &ino);
+	RC_WRAP(kvsns_check_name, name);
+
+	RC_WRAP(kvsns_do_lookup, cred, parent, name, &ino);
 
 	return kvsns_open(cred, &ino, flags, mode, fd);
 }
 
+/* Copies the attributes of ino's data into its record, inode */
+static int kvsns_get_data_attrs(kvsns_ino_t *ino, kvsns_inode_t *inode)
+{
+	struct stat data_stat;
+	int rc;
+
+	rc = extstore_getattr(ino, &data_stat);
+	if (rc == 0) {
+		inode->stat.st_size = data_stat.st_size;
+		inode->stat.st_blocks = data_stat.st_blocks;
+		inode->stat.st_atim = data_stat.st_atim;
+		inode->stat.st_mtim = data_stat.st_mtim;
+	} else if (rc != -ENOENT)
+		return rc;
+
+	inode->flags |= KVSNS_INODE_DATA_ATTRS;
+	return 0;
+}
+
+/* With known set, copies the attributes of the data into the inode record,
+ * otherwise marks them as not to be trusted any more */
+int kvsns_set_data_attrs(kvsns_ino_t *ino, bool known)
+{
+	kvsns_inode_t inode;
+	off_t size;
+
+	RC_WRAP(kvsns_get_inode, ino, &inode);
+	size = inode.stat.st_size;
+
+	if (known)
+		RC_WRAP(kvsns_get_data_attrs, ino, &inode);
+	else {
+		if (!(inode.flags & KVSNS_INODE_DATA_ATTRS))
+			return 0;
+
+		inode.flags &= ~KVSNS_INODE_DATA_ATTRS;
+	}
+
+	return kvsns_resize_inode(ino, &inode, size);
+}
+
 int kvsns_close(kvsns_file_open_t *fd)
 {
 	kvsns_open_owner_t owners[KVSAL_ARRAY_SIZE];
 	int size = KVSAL_ARRAY_SIZE;
 	char k[KLEN];
 	char v[VLEN];
+	char kdeleted[KLEN];
+	kvsal_op_t ops[2];
+	kvsns_inode_t inode;
+	off_t data_size = 0;
 	int i;
 	int rc;
 	bool found = false;
 	bool opened_and_deleted;
 	bool delete_object = false;
+	bool data_attrs = false;
 
 	LogDebug(KVSNS_COMPONENT_KVSNS, "ino=%llu", fd->ino);
 
@@ -189,8 +494,15 @@ int kvsns_close(kvsns_file_open_t *fd)
 	/* forward close to the store */
 	extstore_close(fd->ino);
 
-	snprintf(k, KLEN, "%llu.openowner", fd->ino);
-	rc = kvsal_get_char(k, v);
+	/* Get the open owners and check if the file was deleted as it was
+	 * opened, the last close should then perform actual data deletion */
+	kvsns_key(k, &fd->ino, KVSNS_KEY_OPENOWNER, NULL);
+	kvsns_key(kdeleted, &fd->ino, KVSNS_KEY_OPENED_AND_DELETED, NULL);
+	kvsns_prepare_op(&ops[0], KVSAL_OP_GET, k, v, VLEN);
+	kvsns_prepare_op(&ops[1], KVSAL_OP_EXISTS, kdeleted, NULL, 0);
+	RC_WRAP(kvsal_batch, ops, 2);
+
+	rc = ops[0].rc;
 	if (rc != 0) {
 		if (rc == -ENOENT)
 			return -EBADF; /* File not opened */
@@ -198,33 +510,52 @@ int kvsns_close(kvsns_file_open_t *fd)
 			return rc;
 	}
 
-	/* Was the file deleted as it was opened ? */
-	/* The last close should perform actual data deletion */
-	snprintf(k, KLEN, "%llu.opened_and_deleted", fd->ino);
-	rc = kvsal_exists(k);
+	rc = ops[1].rc;
 	if ((rc != 0) && (rc != -ENOENT))
 		return rc;
 	opened_and_deleted = (rc == -ENOENT) ? false : true;
 
 	RC_WRAP(kvsns_str2ownerlist, owners, &size, v);
 
-	RC_WRAP(kvsal_begin_transaction);
+	/* Best effort: the record's attributes are simply not used for the
+	 * data as long as they are not known */
+	if (size == 1 && !opened_and_deleted &&
+	    kvsns_get_inode(&fd->ino, &inode) == 0 &&
+	    !(inode.flags & KVSNS_INODE_DATA_ATTRS)) {
+		data_size = inode.stat.st_size;
+		data_attrs = (kvsns_get_data_attrs(&fd->ino, &inode) == 0);
+	}
+
+	RC_WRAP(kvsns_begin_transaction);
 
 	if (size == 1) {
 		if (fd->owner.pid == owners[0].pid &&
 		    fd->owner.tid == owners[0].tid) {
-			snprintf(k, KLEN, "%llu.openowner", fd->ino);
+			kvsns_key(k, &fd->ino, KVSNS_KEY_OPENOWNER, NULL);
 			RC_WRAP_LABEL(rc, aborted, kvsal_del, k);
 
+			/* No fd is left to write the data: its attributes
+			 * go into the record along with the last close */
+			if (data_attrs) {
+				RC_WRAP_LABEL(rc, aborted, kvsns_set_inode,
+					      &fd->ino, &inode);
+				if (inode.stat.st_size != data_size)
+					RC_WRAP_LABEL(rc, aborted,
+						      kvsal_add_counter,
+						      KVSNS_BYTES_COUNTER,
+						      inode.stat.st_size -
+						      data_size);
+			}
+
 			/* Was the file deleted as it was opened ? */
 			if (opened_and_deleted) {
 				delete_object = true;
-				snprintf(k, KLEN, "%llu.opened_and_deleted",
-					 fd->ino);
+				kvsns_key(k, &fd->ino,
+					  KVSNS_KEY_OPENED_AND_DELETED, NULL);
 				RC_WRAP_LABEL(rc, aborted,
 					      kvsal_del, k);
 			}
-			RC_WRAP(kvsal_end_transaction);
+			RC_WRAP(kvsns_end_transaction);
 
 			if (delete_object)
 				RC_WRAP(extstore_del, &fd->ino);
@@ -255,7 +586,7 @@ int kvsns_close(kvsns_file_open_t *fd)
 
 	RC_WRAP_LABEL(rc, aborted, kvsal_set_char, k, v);
 
-	RC_WRAP(kvsal_end_transaction);
+	RC_WRAP(kvsns_end_transaction);
 
 	/* To be done outside of the previous transaction */
 	if (delete_object)
@@ -264,7 +595,7 @@ int kvsns_close(kvsns_file_open_t *fd)
 	return 0;
 
 aborted:
-	kvsal_discard_transaction();
+	kvsns_discard_transaction();
 	return rc;
 }
 
@@ -277,6 +608,11 @@ ssize_t kvsns_write(kvsns_cred_t *cred, kvsns_file_open_t *fd,
 
 	memset(&wstat, 0, sizeof(wstat));
 
+	/* The data's attributes in the inode record are no longer valid. The
+	 * record may have got them back since this fd's last write, from a
+	 * truncate for instance */
+	RC_WRAP(kvsns_set_data_attrs, &fd->ino, false);
+
 	/** @todo use flags to check correct access */
 	write_amount = extstore_write(&fd->ino,
 				      offset,
@@ -315,7 +651,7 @@ int kvsns_attach(kvsns_cred_t *cred, kvsns_ino_t *parent, char *name,
 	RC_WRAP(kvsns_create_entry, cred, parent, name, NULL,
 				    stat->st_mode, newfile, KVSNS_FILE);
 	RC_WRAP(kvsns_setattr, cred, newfile, stat, statflags);
-	RC_WRAP(kvsns_getattr, cred, newfile, stat);
+	RC_WRAP(kvsns_do_getattr, cred, newfile, stat);
 	RC_WRAP(extstore_attach, newfile, objid, objid_len);
 
 	return 0;
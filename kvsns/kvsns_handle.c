@@ -42,20 +42,87 @@
 #include <kvsns/extstore.h>
 #include "kvsns_internal.h"
 
-int kvsns_fsstat(kvsns_fsstat_t *stat)
+/* Lists the inodes of the whole namespace */
+static int kvsns_scan_inodes(unsigned long *nb_inodes)
 {
 	char k[KLEN];
+	kvsal_slice_t items[KVSAL_ARRAY_SIZE];
+	enum kvsns_key_type type;
+	kvsns_ino_t ino;
+	size_t name;
+	int offset = 0;
+	int size;
+	int i;
+	kvsal_list_t list;
 	int rc;
 
+	kvsns_key_pattern(k, KVSNS_KEY_INODE);
+	if (kvsns_key_encoding == KVSNS_KEYS_TEXT) {
+		rc = kvsal_get_list_size(k);
+		if (rc < 0)
+			return rc;
+
+		*nb_inodes = rc;
+		return 0;
+	}
+
+	/* The pattern matches every key, count the inodes' ones */
+	*nb_inodes = 0;
+	RC_WRAP(kvsal_fetch_list, k, &list);
+
+	do {
+		size = KVSAL_ARRAY_SIZE;
+		RC_WRAP_LABEL(rc, errout, kvsal_get_list_slices, &list,
+			      offset, &size, items);
+
+		for (i = 0; i < size ; i++)
+			if (kvsns_parse_key(items[i].p, items[i].len, &ino,
+					    &type, &name) == 0 &&
+			    type == KVSNS_KEY_INODE)
+				*nb_inodes += 1;
+
+		offset += size;
+	} while (size > 0);
+
+	rc = 0;
+
+errout:
+	kvsal_dispose_list(&list);
+	return rc;
+}
+
+int kvsns_fsstat(kvsns_fsstat_t *stat)
+{
+	char inodes[VLEN];
+	char bytes[VLEN];
+	kvsal_op_t ops[2];
+	long long v;
+
 	if (!stat)
 		return -EINVAL;
 
-	snprintf(k, KLEN, "*.stat");
-	rc = kvsal_get_list_size(k);
-	if (rc < 0)
-		return rc;
+	kvsns_prepare_op(&ops[0], KVSAL_OP_GET, KVSNS_INODES_COUNTER,
+			 inodes, VLEN);
+	kvsns_prepare_op(&ops[1], KVSAL_OP_GET, KVSNS_BYTES_COUNTER,
+			 bytes, VLEN);
+	RC_WRAP(kvsal_mget, ops, 2);
+
+	stat->nb_bytes = 0;
+	if (ops[1].rc == 0) {
+		v = (long long)strtoull(bytes, NULL, 10);
+		stat->nb_bytes = MAX(v, 0);
+	} else if (ops[1].rc != -ENOENT)
+		return ops[1].rc;
+
+	/* Namespaces from before the counters, see kvsns_migrate_counters */
+	if (ops[0].rc == -ENOENT)
+		return kvsns_scan_inodes(&stat->nb_inodes);
+	if (ops[0].rc != 0)
+		return ops[0].rc;
+
+	v = (long long)strtoull(inodes, NULL, 10);
+	stat->nb_inodes = MAX(v, 0);
 
-	stat->nb_inodes = rc;
 	return 0;
 }
 
@@ -99,64 +166,82 @@ int kvsns_symlink(kvsns_cred_t *cred, kvsns_ino_t *parent, char *name,
 int kvsns_readlink(kvsns_cred_t *cred, kvsns_ino_t *lnk,
 		  char *content, size_t *size)
 {
-	char k[KLEN];
-	char v[KLEN];
+	kvsns_inode_t inode;
 
 	/* No access check, a symlink's content is always readable */
 	if (!cred || !lnk || !content || !size)
 		return -EINVAL;
 
-	snprintf(k, KLEN, "%llu.link", *lnk);
-	RC_WRAP(kvsal_get_char, k, v);
+	RC_WRAP(kvsns_get_inode, lnk, &inode);
 
-	strncpy(content, v, *size);
-	*size = strnlen(v, VLEN);
+	if (!S_ISLNK(inode.stat.st_mode))
+		return -EINVAL;
 
-	RC_WRAP(kvsns_update_stat, lnk, STAT_ATIME_SET);
+	strncpy(content, inode.link, *size);
+	*size = strnlen(inode.link, VLEN);
 
-	return 0;
+	return kvsns_update_atime(lnk, &inode);
 }
 
 int kvsns_rmdir(kvsns_cred_t *cred, kvsns_ino_t *parent, char *name)
 {
 	int rc;
-	char k[KLEN];
+	char kparent[KLEN];
+	char kino[KLEN];
+	char kentries[KLEN];
+	char bparent[KVSNS_INODE_MAXLEN];
+	char bino[KVSNS_INODE_MAXLEN];
+	char entries[VLEN];
+	kvsal_op_t ops[3];
 	kvsns_ino_t ino = 0LL;
-	struct stat parent_stat;
+	kvsns_inode_t parent_inode;
+	kvsns_inode_t ino_inode;
 
 	if (!cred || !parent || !name)
 		return -EINVAL;
 
-	memset(&parent_stat, 0, sizeof(parent_stat));
+	RC_WRAP(kvsns_check_name, name);
 
 	RC_WRAP(kvsns_access, cred, parent, KVSNS_ACCESS_WRITE);
 
-	RC_WRAP(kvsns_lookup, cred, parent, name, &ino);
+	RC_WRAP(kvsns_do_lookup, cred, parent, name, &ino);
 
-	RC_WRAP(kvsns_get_stat, parent, &parent_stat);
+	kvsns_prepare_inode_op(&ops[0], kparent, parent, bparent);
+	kvsns_prepare_inode_op(&ops[1], kino, &ino, bino);
+	kvsns_prepare_entries_op(&ops[2], kentries, &ino, entries);
+	RC_WRAP(kvsal_batch, ops, 3);
 
-	snprintf(k, KLEN, "%llu.dentries.*", ino);
-	rc = kvsal_get_list_size(k);
-	if (rc > 0)
-		return -ENOTEMPTY;
+	RC_WRAP(kvsns_inode_op_rc, &ops[0], &parent_inode);
+	RC_WRAP(kvsns_inode_op_rc, &ops[1], &ino_inode);
+	RC_WRAP(kvsns_entries_op_rc, &ops[2], &ino_inode);
 
-	RC_WRAP(kvsal_begin_transaction);
+	/* Directories from before their entries were counted are scanned */
+	if (ino_inode.flags & KVSNS_INODE_ENTRIES) {
+		if (ino_inode.stat.st_size != 0)
+			return -ENOTEMPTY;
+	} else {
+		rc = kvsns_count_dentries(&ino);
+		if (rc < 0)
+			return rc;
+		if (rc > 0)
+			return -ENOTEMPTY;
+	}
 
-	snprintf(k, KLEN, "%llu.dentries.%s",
-		 *parent, name);
-	RC_WRAP_LABEL(rc, aborted, kvsal_del, k);
+	RC_WRAP(kvsns_begin_transaction);
 
-	snprintf(k, KLEN, "%llu.parentdir", ino);
-	RC_WRAP_LABEL(rc, aborted, kvsal_del, k);
+	RC_WRAP_LABEL(rc, aborted, kvsns_del_dentry, parent, name);
 
-	snprintf(k, KLEN, "%llu.stat", ino);
-	RC_WRAP_LABEL(rc, aborted, kvsal_del, k);
+	RC_WRAP_LABEL(rc, aborted, kvsns_del_inode, &ino);
+	RC_WRAP_LABEL(rc, aborted, kvsns_del_entries, &ino, &ino_inode);
+	RC_WRAP_LABEL(rc, aborted, kvsns_count_deletion, 0);
 
-	RC_WRAP_LABEL(rc, aborted, kvsns_amend_stat, &parent_stat,
+	RC_WRAP_LABEL(rc, aborted, kvsns_amend_stat, &parent_inode.stat,
 		      STAT_CTIME_SET|STAT_MTIME_SET);
-	RC_WRAP_LABEL(rc, aborted, kvsns_set_stat, parent, &parent_stat);
+	RC_WRAP_LABEL(rc, aborted, kvsns_set_inode, parent, &parent_inode);
+	RC_WRAP_LABEL(rc, aborted, kvsns_add_entries, parent, &parent_inode,
+		      -1);
 
-	RC_WRAP(kvsal_end_transaction);
+	RC_WRAP(kvsns_end_transaction);
 
 	/* Remove all associated xattr */
 	RC_WRAP(kvsns_remove_all_xattr, cred, &ino);
@@ -164,20 +249,25 @@ int kvsns_rmdir(kvsns_cred_t *cred, kvsns_ino_t *parent, char *name)
 	return 0;
 
 aborted:
-	kvsal_discard_transaction();
+	kvsns_discard_transaction();
 	return rc;
 }
 
 int kvsns_opendir(kvsns_cred_t *cred, kvsns_ino_t *dir, kvsns_dir_t *ddir)
 {
-	char pattern[KLEN];
+	bool replica;
+	int rc;
+
 	if (!cred || ! dir || !ddir)
 		return -EINVAL;
-	
-	snprintf(pattern, KLEN, "%llu.dentries.*", *dir);
 
+	/* The listing is read from where it starts */
 	ddir->ino = *dir;
-	return kvsal_fetch_list(pattern , &ddir->list);
+	replica = kvsns_replica_begin(KVSNS_READS_READDIR);
+	rc = kvsns_fetch_dentries(dir, &ddir->list);
+	kvsns_replica_end(KVSNS_READS_READDIR, replica);
+
+	return rc;
 }
 
 int kvsns_closedir(kvsns_dir_t *dir)
@@ -185,112 +275,194 @@ int kvsns_closedir(kvsns_dir_t *dir)
 	if (!dir)
 		return -EINVAL;
 
-	return kvsal_dispose_list(&dir->list);
+	RC_WRAP(kvsal_dispose_list, &dir->list);
+
+	/* The directory was read, its access time is written now */
+	return kvsns_atime_flush_ino(&dir->ino);
 }
 
 int kvsns_readdir(kvsns_cred_t *cred, kvsns_dir_t *dir, off_t offset,
 		  kvsns_dentry_t *dirent, int *size)
 {
-	char pattern[KLEN];
-	char v[VLEN];
-	kvsal_item_t *items;
+	char *values;
+	char *records;
+	char *keys;
+	char *name;
+	kvsal_slice_t *items;
+	kvsal_op_t *ops;
+	kvsns_inode_t inode;
+	struct stat data_stat;
+	bool replica;
+	size_t mark;
+	size_t len;
 	int i;
-	kvsns_ino_t ino = 0LL;
 	int rc;
-	unsigned long long lino;
 
 	if (!cred || !dir || !dirent || !size)
 		return -EINVAL;
 
 	RC_WRAP(kvsns_access, cred, &dir->ino, KVSNS_ACCESS_READ);
 
-	items = (kvsal_item_t *)malloc(*size*sizeof(kvsal_item_t));
-	if (items == NULL)
-		return -ENOMEM;
-	memset(items, 0, *size*sizeof(kvsal_item_t));
+	/* The page's buffers are scratch memory, gone once it is read */
+	mark = kvsal_arena_mark();
+	items = kvsal_arena_alloc(*size*sizeof(kvsal_slice_t));
+	ops = kvsal_arena_alloc(2*(*size)*sizeof(kvsal_op_t));
+	values = kvsal_arena_alloc(*size*VLEN);
+	records = kvsal_arena_alloc(*size*KVSNS_INODE_MAXLEN);
+	keys = kvsal_arena_alloc(2*(*size)*KLEN);
+	if (items == NULL || ops == NULL || values == NULL ||
+	    records == NULL || keys == NULL) {
+		rc = -ENOMEM;
+		goto errout;
+	}
+
+	/* The atime is then updated from the servers' own view */
+	replica = kvsns_replica_begin(KVSNS_READS_READDIR);
 
-	memcpy(&lino, dir, sizeof(lino)); /* violent cast */
-	snprintf(pattern, KLEN, "%llu.dentries.*", lino);
-	rc = kvsal_get_list(&dir->list, (int)offset, size, items);
-	RC_WRAP_LABEL(rc, errout,
-		      kvsal_get_list, &dir->list, (int)offset, size, items);
+	RC_WRAP_LABEL(rc, unread, kvsal_get_list_slices, &dir->list,
+		      (int)offset, size, items);
 
+	/* Resolve every dentry of the page in a single request */
 	for (i = 0; i < *size ; i++) {
-		sscanf(items[i].str, "%llu.dentries.%s\n",
-		       &ino, dirent[i].name);
+		/* A truncated name would be another one's */
+		name = kvsns_dentry_name(&items[i], &len);
+		if (len > NAME_MAX) {
+			rc = -ENAMETOOLONG;
+			goto unread;
+		}
+		memcpy(dirent[i].name, name, len);
+		dirent[i].name[len] = '\0';
+		RC_WRAP_LABEL(rc, unread, kvsns_prepare_dentry_op, &ops[i],
+			      KVSAL_OP_GET, &dir->ino, dirent[i].name,
+			      &values[i*VLEN], VLEN);
+	}
+	RC_WRAP_LABEL(rc, unread, kvsal_batch, ops, *size);
 
-		RC_WRAP_LABEL(rc, errout, kvsal_get_char, items[i].str, v);
+	for (i = 0; i < *size ; i++) {
 
-		sscanf(v, "%llu", &dirent[i].inode);
+		rc = ops[i].rc;
+		if (rc != 0)
+			goto unread;
 
-		RC_WRAP_LABEL(rc, errout, kvsns_getattr, cred, &dirent[i].inode,
-			 &dirent[i].stats);
+		RC_WRAP_LABEL(rc, unread, kvsns_str2ino, &values[i*VLEN],
+			      &dirent[i].inode);
 	}
 
-	RC_WRAP_LABEL(rc, errout, kvsns_update_stat, &dir->ino, STAT_ATIME_SET);
+	/* Then all their inode records in another one, with the number of
+	 * entries of those which are directories */
+	for (i = 0; i < *size ; i++) {
+		kvsns_prepare_inode_op(&ops[2*i], &keys[2*i*KLEN],
+				       &dirent[i].inode,
+				       &records[i*KVSNS_INODE_MAXLEN]);
+		kvsns_prepare_entries_op(&ops[2*i+1], &keys[(2*i+1)*KLEN],
+					 &dirent[i].inode, &values[i*VLEN]);
+	}
+	RC_WRAP_LABEL(rc, unread, kvsal_batch, ops, 2*(*size));
 
-	free(items);
-	return 0;
+	for (i = 0; i < *size ; i++) {
+		RC_WRAP_LABEL(rc, unread, kvsns_inode_op_rc, &ops[2*i], &inode);
+		RC_WRAP_LABEL(rc, unread, kvsns_entries_op_rc, &ops[2*i+1],
+			      &inode);
+		memcpy(&dirent[i].stats, &inode.stat, sizeof(struct stat));
+		kvsns_atime_amend(&dirent[i].inode, &dirent[i].stats);
+
+		/* Same as kvsns_do_getattr, unless the record is up to date */
+		if (!S_ISREG(inode.stat.st_mode) ||
+		    (inode.flags & KVSNS_INODE_DATA_ATTRS))
+			continue;
+
+		rc = extstore_getattr(&dirent[i].inode, &data_stat);
+		if (rc == -ENOENT)
+			continue;
+		if (rc != 0)
+			goto unread;
+
+		dirent[i].stats.st_size = data_stat.st_size;
+		dirent[i].stats.st_mtime = data_stat.st_mtime;
+		dirent[i].stats.st_atime = data_stat.st_atime;
+	}
+	rc = 0;
+
+unread:
+	kvsns_replica_end(KVSNS_READS_READDIR, replica);
+	if (rc == 0)
+		rc = kvsns_update_atime(&dir->ino, NULL);
 
 errout:
-	if (items)
-		free(items);
+	kvsal_arena_release(mark);
 
 	return rc;
 }
 
-int kvsns_lookup(kvsns_cred_t *cred, kvsns_ino_t *parent, char *name,
-		kvsns_ino_t *ino)
+int kvsns_do_lookup(kvsns_cred_t *cred, kvsns_ino_t *parent, char *name,
+		    kvsns_ino_t *ino)
 {
-	char k[KLEN];
-	char v[VLEN];
+	unsigned long gen;
+	int rc;
 
 	if (!cred || !parent || !name || !ino)
 		return -EINVAL;
 
+	RC_WRAP(kvsns_check_name, name);
+
 	RC_WRAP(kvsns_access, cred, parent, KVSNS_ACCESS_READ);
 
-	snprintf(k, KLEN, "%llu.dentries.%s",
-		 *parent, name);
+	rc = kvsns_cache_get_dentry(parent, name, ino, &gen);
+	if (rc != -EAGAIN)
+		return rc;
 
-	RC_WRAP(kvsal_get_char, k, v);
+	rc = kvsns_get_dentry(parent, name, ino);
+	if (rc == 0)
+		kvsns_cache_set_dentry(parent, name, ino, gen);
+	else if (rc == -ENOENT)
+		kvsns_cache_set_noent(parent, name, gen);
 
-	sscanf(v, "%llu", ino);
+	return rc;
+}
 
-	return 0;
+int kvsns_lookup(kvsns_cred_t *cred, kvsns_ino_t *parent, char *name,
+		kvsns_ino_t *ino)
+{
+	bool replica;
+	int rc;
+
+	replica = kvsns_replica_begin(KVSNS_READS_LOOKUP);
+	rc = kvsns_do_lookup(cred, parent, name, ino);
+	kvsns_replica_end(KVSNS_READS_LOOKUP, replica);
+
+	return rc;
 }
 
 int kvsns_lookupp(kvsns_cred_t *cred, kvsns_ino_t *dir, kvsns_ino_t *parent)
 {
-	char k[KLEN];
-	char v[VLEN];
+	kvsns_inode_t inode;
 
 	if (!cred || !dir || !parent)
 		return -EINVAL;
 
 	RC_WRAP(kvsns_access, cred, dir, KVSNS_ACCESS_READ);
 
-	snprintf(k, KLEN, "%llu.parentdir",
-		 *dir);
+	RC_WRAP(kvsns_get_inode, dir, &inode);
 
-	RC_WRAP(kvsal_get_char, k, v);
+	if (inode.nb_parents == 0)
+		return -ENOENT;
 
-	sscanf(v, "%llu|", parent);
+	*parent = inode.parents[0];
 
 	return 0;
 }
 
-int kvsns_getattr(kvsns_cred_t *cred, kvsns_ino_t *ino, struct stat *bufstat)
+int kvsns_do_getattr(kvsns_cred_t *cred, kvsns_ino_t *ino,
+		     struct stat *bufstat)
 {
 	struct stat data_stat;
-	char k[KLEN];
 	int rc;
 
 	if (!cred || !ino || !bufstat)
 		return -EINVAL;
 
-	snprintf(k, KLEN, "%llu.stat", *ino);
-	RC_WRAP(kvsal_get_stat, k, bufstat);
+	RC_WRAP(kvsns_get_stat, ino, bufstat);
+	kvsns_atime_amend(ino, bufstat);
 
 	if (S_ISREG(bufstat->st_mode)) {
 		/* for file, information is to be retrieved form extstore */
@@ -311,13 +483,26 @@ int kvsns_getattr(kvsns_cred_t *cred, kvsns_ino_t *ino, struct stat *bufstat)
 	return 0;
 }
 
+int kvsns_getattr(kvsns_cred_t *cred, kvsns_ino_t *ino, struct stat *bufstat)
+{
+	bool replica;
+	int rc;
+
+	replica = kvsns_replica_begin(KVSNS_READS_GETATTR);
+	rc = kvsns_do_getattr(cred, ino, bufstat);
+	kvsns_replica_end(KVSNS_READS_GETATTR, replica);
+
+	return rc;
+}
+
 int kvsns_setattr(kvsns_cred_t *cred, kvsns_ino_t *ino,
 		  struct stat *setstat, int statflag)
 {
-	char k[KLEN];
+	kvsns_inode_t inode;
 	struct stat bufstat;
 	struct timeval t;
 	mode_t ifmt;
+	off_t size;
 
 	if (!cred || !ino || !setstat)
 		return -EINVAL;
@@ -330,8 +515,13 @@ int kvsns_setattr(kvsns_cred_t *cred, kvsns_ino_t *ino,
 
 	RC_WRAP(kvsns_access, cred, ino, KVSNS_ACCESS_WRITE);
 
-	snprintf(k, KLEN, "%llu.stat", *ino);
-	RC_WRAP(kvsal_get_stat, k, &bufstat);
+	RC_WRAP(kvsns_get_inode, ino, &inode);
+	memcpy(&bufstat, &inode.stat, sizeof(struct stat));
+
+	/* A directory's size is its number of entries */
+	if ((statflag & (STAT_SIZE_SET|STAT_SIZE_ATTACH)) &&
+	    S_ISDIR(bufstat.st_mode))
+		return -EISDIR;
 
 	/* ctime is to be updated if md are changed */
 	bufstat.st_ctim.tv_sec = t.tv_sec;
@@ -356,6 +546,9 @@ int kvsns_setattr(kvsns_cred_t *cred, kvsns_ino_t *ino,
 		RC_WRAP(extstore_truncate, ino, setstat->st_size, false,
 			&bufstat);
 
+	if (statflag & (STAT_SIZE_SET|STAT_SIZE_ATTACH))
+		inode.flags |= KVSNS_INODE_DATA_ATTRS;
+
 	if (statflag & STAT_ATIME_SET) {
 		bufstat.st_atim.tv_sec = setstat->st_atim.tv_sec;
 		bufstat.st_atim.tv_nsec = setstat->st_atim.tv_nsec;
@@ -371,62 +564,74 @@ int kvsns_setattr(kvsns_cred_t *cred, kvsns_ino_t *ino,
 		bufstat.st_ctim.tv_nsec = setstat->st_ctim.tv_nsec;
 	}
 
-	return kvsal_set_stat(k, &bufstat);
+	size = inode.stat.st_size;
+	memcpy(&inode.stat, &bufstat, sizeof(struct stat));
+	return kvsns_resize_inode(ino, &inode, size);
 }
 
 int kvsns_link(kvsns_cred_t *cred, kvsns_ino_t *ino,
 	       kvsns_ino_t *dino, char *dname)
 {
 	int rc;
-	char k[KLEN];
-	char v[VLEN];
-	kvsns_ino_t tmpino = 0LL;
-	struct stat dino_stat;
-	struct stat ino_stat;
+	char kdino[KLEN];
+	char kino[KLEN];
+	char bdino[KVSNS_INODE_MAXLEN];
+	char bino[KVSNS_INODE_MAXLEN];
+	kvsal_op_t ops[3];
+	size_t mark;
+	kvsns_inode_t dino_inode;
+	kvsns_inode_t ino_inode;
 
 	if (!cred || !ino || !dino || !dname)
 		return -EINVAL;
 
-	RC_WRAP(kvsns_access, cred, dino, KVSNS_ACCESS_WRITE);
-
-	rc = kvsns_lookup(cred, dino, dname, &tmpino);
-	if (rc == 0)
-		return -EEXIST;
-
-	RC_WRAP(kvsns_get_stat, dino, &dino_stat);
-	RC_WRAP(kvsns_get_stat, ino, &ino_stat);
+	RC_WRAP(kvsns_check_name, dname);
 
+	RC_WRAP(kvsns_access, cred, dino, KVSNS_ACCESS_WRITE);
 
-	snprintf(k, KLEN, "%llu.parentdir", *ino);
-	RC_WRAP_LABEL(rc, aborted, kvsal_get_char, k, v);
+	if (kvsns_use_scripts) {
+		rc = kvsns_script_link(ino, dino, dname);
+		if (rc != -ENOTSUP)
+			return rc;
+	}
 
-	snprintf(k, KLEN, "%llu|", *dino);
-	strcat(v, k);
+	/* Check the new name and fetch what is to be updated at once */
+	mark = kvsal_arena_mark();
+	rc = kvsns_prepare_dentry_op(&ops[0], KVSAL_OP_EXISTS, dino, dname,
+				     NULL, 0);
+	kvsns_prepare_inode_op(&ops[1], kdino, dino, bdino);
+	kvsns_prepare_inode_op(&ops[2], kino, ino, bino);
+	if (rc == 0)
+		rc = kvsal_batch(ops, 3);
+	kvsal_arena_release(mark);
+	if (rc != 0)
+		return rc;
 
-	RC_WRAP(kvsal_begin_transaction);
+	if (ops[0].rc == 0)
+		return -EEXIST;
 
-	snprintf(k, KLEN, "%llu.parentdir", *ino);
-	RC_WRAP_LABEL(rc, aborted, kvsal_set_char, k, v);
+	RC_WRAP(kvsns_inode_op_rc, &ops[1], &dino_inode);
+	RC_WRAP(kvsns_inode_op_rc, &ops[2], &ino_inode);
 
-	snprintf(k, KLEN, "%llu.dentries.%s",
-		 *dino, dname);
-	snprintf(v, VLEN, "%llu", *ino);
-	RC_WRAP_LABEL(rc, aborted, kvsal_set_char, k, v);
+	RC_WRAP(kvsns_add_parent, &ino_inode, dino);
+	RC_WRAP(kvsns_amend_stat, &ino_inode.stat,
+		STAT_CTIME_SET|STAT_INCR_LINK);
+	RC_WRAP(kvsns_amend_stat, &dino_inode.stat,
+		STAT_CTIME_SET|STAT_MTIME_SET);
 
-	RC_WRAP_LABEL(rc, aborted, kvsns_amend_stat, &ino_stat,
-		      STAT_CTIME_SET|STAT_INCR_LINK);
-	RC_WRAP_LABEL(rc, aborted, kvsns_set_stat, ino, &ino_stat);
+	RC_WRAP(kvsns_begin_transaction);
 
-	RC_WRAP_LABEL(rc, aborted, kvsns_amend_stat, &dino_stat,
-		      STAT_CTIME_SET|STAT_MTIME_SET);
-	RC_WRAP_LABEL(rc, aborted, kvsns_set_stat, dino, &dino_stat);
+	RC_WRAP_LABEL(rc, aborted, kvsns_set_dentry, dino, dname, ino);
+	RC_WRAP_LABEL(rc, aborted, kvsns_set_inode, ino, &ino_inode);
+	RC_WRAP_LABEL(rc, aborted, kvsns_set_inode, dino, &dino_inode);
+	RC_WRAP_LABEL(rc, aborted, kvsns_add_entries, dino, &dino_inode, 1);
 
-	RC_WRAP(kvsal_end_transaction);
+	RC_WRAP(kvsns_end_transaction);
 
 	return 0;
 
 aborted:
-	kvsal_discard_transaction();
+	kvsns_discard_transaction();
 	return rc;
 }
 
@@ -435,12 +640,16 @@ int kvsns_unlink(kvsns_cred_t *cred, kvsns_ino_t *dir, char *name)
 	int rc;
 	char k[KLEN];
 	char v[VLEN];
+	char kdir[KLEN];
+	char kino[KLEN];
+	char kopen[KLEN];
+	char bdir[KVSNS_INODE_MAXLEN];
+	char bino[KVSNS_INODE_MAXLEN];
+	kvsal_op_t ops[3];
 	kvsns_ino_t ino = 0LL;
-	kvsns_ino_t parent[KVSAL_ARRAY_SIZE];
-	struct stat ino_stat;
-	struct stat dir_stat;
-	int size;
-	int i;
+	kvsns_inode_t dir_inode;
+	kvsns_inode_t ino_inode;
+	off_t size = 0;
 	bool opened;
 	bool deleted;
 
@@ -450,49 +659,55 @@ int kvsns_unlink(kvsns_cred_t *cred, kvsns_ino_t *dir, char *name)
 	if (!cred || !dir || !name)
 		return -EINVAL;
 
-	memset(parent, 0, KVSAL_ARRAY_SIZE*sizeof(kvsns_ino_t));
-	memset(&ino_stat, 0, sizeof(ino_stat));
-	memset(&dir_stat, 0, sizeof(dir_stat));
+	RC_WRAP(kvsns_check_name, name);
 
 	RC_WRAP(kvsns_access, cred, dir, KVSNS_ACCESS_WRITE);
 
-	RC_WRAP(kvsns_lookup, cred, dir, name, &ino);
+	RC_WRAP(kvsns_do_lookup, cred, dir, name, &ino);
 
-	RC_WRAP(kvsns_get_stat, dir, &dir_stat);
-	RC_WRAP(kvsns_get_stat, &ino, &ino_stat);
+	if (kvsns_use_scripts) {
+		rc = kvsns_script_unlink(dir, name, &ino, &opened, &deleted,
+					 &size);
 
-	snprintf(k, KLEN, "%llu.parentdir", ino);
-	RC_WRAP(kvsal_get_char, k, v);
+		if (rc == 0)
+			goto data;
+		if (rc != -ENOTSUP)
+			return rc;
+	}
+
+	/* Get both inodes and the open state at once */
+	kvsns_key(kopen, &ino, KVSNS_KEY_OPENOWNER, NULL);
+	kvsns_prepare_inode_op(&ops[0], kdir, dir, bdir);
+	kvsns_prepare_inode_op(&ops[1], kino, &ino, bino);
+	kvsns_prepare_op(&ops[2], KVSAL_OP_EXISTS, kopen, NULL, 0);
+	RC_WRAP(kvsal_batch, ops, 3);
 
-	size = KVSAL_ARRAY_SIZE;
-	RC_WRAP(kvsns_str2parentlist, parent, &size, v);
+	RC_WRAP(kvsns_inode_op_rc, &ops[0], &dir_inode);
+	RC_WRAP(kvsns_inode_op_rc, &ops[1], &ino_inode);
 
 	/* Check if file is opened */
-	snprintf(k, KLEN, "%llu.openowner", ino);
-	rc = kvsal_exists(k);
+	rc = ops[2].rc;
 	if ((rc != 0) && (rc != -ENOENT))
 		return rc;
 
 	opened = (rc == -ENOENT) ? false : true;
 
-	RC_WRAP(kvsal_begin_transaction);
-
-	if (size == 1) {
-		/* Last link, try to perform deletion */
-		snprintf(k, KLEN, "%llu.parentdir", ino);
-		RC_WRAP_LABEL(rc, aborted, kvsal_del, k);
+	RC_WRAP(kvsns_amend_stat, &dir_inode.stat,
+		STAT_MTIME_SET|STAT_CTIME_SET);
 
-		snprintf(k, KLEN, "%llu.stat", ino);
-		RC_WRAP_LABEL(rc, aborted, kvsal_del, k);
+	RC_WRAP(kvsns_begin_transaction);
 
-#ifdef KVSNS_S3
-		snprintf(k, KLEN, "%llu.name", ino);
-		RC_WRAP_LABEL(rc, aborted, kvsal_del, k);
-#endif
+	if (ino_inode.nb_parents == 1) {
+		/* Last link, try to perform deletion */
+		RC_WRAP_LABEL(rc, aborted, kvsns_del_inode, &ino);
+		RC_WRAP_LABEL(rc, aborted, kvsns_del_entries, &ino, &ino_inode);
+		if (!S_ISDIR(ino_inode.stat.st_mode))
+			size = ino_inode.stat.st_size;
+		RC_WRAP_LABEL(rc, aborted, kvsns_count_deletion, size);
 
 		if (opened) {
 			/* File is opened, deleted it at last close */
-			snprintf(k, KLEN, "%llu.opened_and_deleted", ino);
+			kvsns_key(k, &ino, KVSNS_KEY_OPENED_AND_DELETED, NULL);
 			snprintf(v, VLEN, "1");
 			RC_WRAP_LABEL(rc, aborted, kvsal_set_char, k, v);
 		}
@@ -500,41 +715,22 @@ int kvsns_unlink(kvsns_cred_t *cred, kvsns_ino_t *dir, char *name)
 		/* Remove all associated xattr */
 		deleted = true;
 	} else {
-		for (i = 0; i < size ; i++)
-			if (parent[i] == *dir) {
-				/* In this list mgmt, setting value 0
-				 * will make it ignored as str is rebuilt */
-				parent[i] = 0;
-				break;
-			}
-		snprintf(k, KLEN, "%llu.parentdir", ino);
-		RC_WRAP_LABEL(rc, aborted, kvsns_parentlist2str,
-			      parent, size, v);
-		RC_WRAP_LABEL(rc, aborted, kvsal_set_char, k, v);
-
-		RC_WRAP_LABEL(rc, aborted, kvsns_amend_stat, &ino_stat,
+		RC_WRAP_LABEL(rc, aborted, kvsns_del_parent, &ino_inode, dir);
+		RC_WRAP_LABEL(rc, aborted, kvsns_amend_stat, &ino_inode.stat,
 			 STAT_CTIME_SET|STAT_DECR_LINK);
-		RC_WRAP_LABEL(rc, aborted, kvsns_set_stat, &ino, &ino_stat);
+		RC_WRAP_LABEL(rc, aborted, kvsns_set_inode, &ino, &ino_inode);
 	}
 
-	snprintf(k, KLEN, "%llu.dentries.%s",
-		 *dir, name);
-	RC_WRAP_LABEL(rc, aborted, kvsal_del, k);
-
-	/* if object is a link, delete the link content as well */
-	if ((ino_stat.st_mode & S_IFLNK) == S_IFLNK) {
-		snprintf(k, KLEN, "%llu.link", ino);
-		RC_WRAP_LABEL(rc, aborted, kvsal_del, k);
-	}
+	RC_WRAP_LABEL(rc, aborted, kvsns_del_dentry, dir, name);
 
-	RC_WRAP_LABEL(rc, aborted, kvsns_amend_stat, &dir_stat,
-		      STAT_MTIME_SET|STAT_CTIME_SET);
-	RC_WRAP_LABEL(rc, aborted, kvsns_set_stat, dir, &dir_stat);
+	RC_WRAP_LABEL(rc, aborted, kvsns_set_inode, dir, &dir_inode);
+	RC_WRAP_LABEL(rc, aborted, kvsns_add_entries, dir, &dir_inode, -1);
 
-	RC_WRAP(kvsal_end_transaction);
+	RC_WRAP(kvsns_end_transaction);
 
+data:
 	/* Call to object store : do not mix with metadata transaction */
-	if (!opened)
+	if (deleted && !opened)
 		RC_WRAP(extstore_del, &ino);
 
 	if (deleted)
@@ -542,7 +738,7 @@ int kvsns_unlink(kvsns_cred_t *cred, kvsns_ino_t *dir, char *name)
 	return 0;
 
 aborted:
-	kvsal_discard_transaction();
+	kvsns_discard_transaction();
 	return rc;
 }
 
@@ -550,80 +746,103 @@ int kvsns_rename(kvsns_cred_t *cred,  kvsns_ino_t *sino,
 		 char *sname, kvsns_ino_t *dino, char *dname)
 {
 	int rc = 0;
-	char k[KLEN];
-	char v[VLEN];
+	char ksino[KLEN];
+	char kdino[KLEN];
+	char kino[KLEN];
+	char bsino[KVSNS_INODE_MAXLEN];
+	char bdino[KVSNS_INODE_MAXLEN];
+	char bino[KVSNS_INODE_MAXLEN];
+	kvsal_op_t ops[4];
+	size_t mark;
+	int nb_ops;
 	kvsns_ino_t ino = 0LL;
-	kvsns_ino_t parent[KVSAL_ARRAY_SIZE];
-	struct stat sino_stat;
-	struct stat dino_stat;
-	int size = 0;
+	kvsns_inode_t sino_inode;
+	kvsns_inode_t dino_inode;
+	kvsns_inode_t ino_inode;
 	int i = 0;
 
 	if (!cred || !sino || !sname || !dino || !dname)
 		return -EINVAL;
 
-	memset(parent, 0, KVSAL_ARRAY_SIZE*sizeof(kvsns_ino_t));
-	memset(&sino_stat, 0, sizeof(sino_stat));
-	memset(&dino_stat, 0, sizeof(dino_stat));
+	RC_WRAP(kvsns_check_name, sname);
+	RC_WRAP(kvsns_check_name, dname);
 
 	RC_WRAP(kvsns_access, cred, sino, KVSNS_ACCESS_WRITE);
 
 	RC_WRAP(kvsns_access, cred, dino, KVSNS_ACCESS_WRITE);
 
-	rc = kvsns_lookup(cred, dino, dname, &ino);
+	RC_WRAP(kvsns_do_lookup, cred, sino, sname, &ino);
+
+	if (kvsns_use_scripts) {
+		rc = kvsns_script_rename(sino, sname, dino, dname, &ino);
+		if (rc != -ENOTSUP)
+			return rc;
+	}
+
+	/* Check the new name and fetch what is to be updated at once */
+	mark = kvsal_arena_mark();
+	rc = kvsns_prepare_dentry_op(&ops[0], KVSAL_OP_EXISTS, dino, dname,
+				     NULL, 0);
+	kvsns_prepare_inode_op(&ops[1], ksino, sino, bsino);
+	kvsns_prepare_inode_op(&ops[2], kino, &ino, bino);
+	nb_ops = 3;
+	if (*sino != *dino) {
+		kvsns_prepare_inode_op(&ops[3], kdino, dino, bdino);
+		nb_ops = 4;
+	}
 	if (rc == 0)
+		rc = kvsal_batch(ops, nb_ops);
+	kvsal_arena_release(mark);
+	if (rc != 0)
+		return rc;
+
+	if (ops[0].rc == 0)
 		return -EEXIST;
 
-	RC_WRAP(kvsns_get_stat, sino, &sino_stat);
+	RC_WRAP(kvsns_inode_op_rc, &ops[1], &sino_inode);
+	RC_WRAP(kvsns_inode_op_rc, &ops[2], &ino_inode);
 	if (*sino != *dino)
-		RC_WRAP(kvsns_get_stat, dino, &dino_stat);
-
-	RC_WRAP(kvsns_lookup, cred, sino, sname, &ino);
+		RC_WRAP(kvsns_inode_op_rc, &ops[3], &dino_inode);
 
-	snprintf(k, KLEN, "%llu.parentdir", ino);
-	RC_WRAP(kvsal_get_char, k, v);
-
-	size = KVSAL_ARRAY_SIZE;
-	RC_WRAP(kvsns_str2parentlist, parent, &size, v);
-	for (i = 0; i < size ; i++)
-		if (parent[i] == *sino) {
-			parent[i] = *dino;
+	for (i = 0; i < ino_inode.nb_parents ; i++)
+		if (ino_inode.parents[i] == *sino) {
+			ino_inode.parents[i] = *dino;
 			break;
 		}
 
-	RC_WRAP(kvsal_begin_transaction);
-	snprintf(k, KLEN, "%llu.dentries.%s",
-		 *sino, sname);
-	RC_WRAP_LABEL(rc, aborted, kvsal_del, k);
-
-	snprintf(k, KLEN, "%llu.dentries.%s",
-		 *dino, dname);
-	snprintf(v, VLEN, "%llu", ino);
-	RC_WRAP_LABEL(rc, aborted, kvsal_set_char, k, v);
-
 #ifdef KVSNS_S3
-	snprintf(k, KLEN, "%llu.name", ino);
-	snprintf(v, VLEN, "%s", dname);
-	RC_WRAP_LABEL(rc, aborted, kvsal_set_char, k, v);
+	strncpy(ino_inode.name, dname, NAME_MAX);
+	ino_inode.name[NAME_MAX] = '\0';
 #endif
 
-	snprintf(k, KLEN, "%llu.parentdir", ino);
-	RC_WRAP_LABEL(rc, aborted, kvsns_parentlist2str, parent, size, v);
-	RC_WRAP_LABEL(rc, aborted, kvsal_set_char, k, v);
+	RC_WRAP(kvsns_amend_stat, &sino_inode.stat,
+		STAT_CTIME_SET|STAT_MTIME_SET);
+	if (*sino != *dino) {
+		RC_WRAP(kvsns_amend_stat, &dino_inode.stat,
+			STAT_CTIME_SET|STAT_MTIME_SET);
+	}
+
+	RC_WRAP(kvsns_begin_transaction);
+	RC_WRAP_LABEL(rc, aborted, kvsns_del_dentry, sino, sname);
 
-	RC_WRAP_LABEL(rc, aborted, kvsns_amend_stat, &sino_stat,
-		      STAT_CTIME_SET|STAT_MTIME_SET);
-	RC_WRAP_LABEL(rc, aborted, kvsns_set_stat, sino, &sino_stat);
+	RC_WRAP_LABEL(rc, aborted, kvsns_set_dentry, dino, dname, &ino);
+
+	RC_WRAP_LABEL(rc, aborted, kvsns_set_inode, &ino, &ino_inode);
+
+	RC_WRAP_LABEL(rc, aborted, kvsns_set_inode, sino, &sino_inode);
 	if (*sino != *dino) {
-		RC_WRAP_LABEL(rc, aborted, kvsns_amend_stat, &dino_stat,
-			 STAT_CTIME_SET|STAT_MTIME_SET);
-		RC_WRAP_LABEL(rc, aborted, kvsns_set_stat, dino, &dino_stat);
+		RC_WRAP_LABEL(rc, aborted, kvsns_set_inode, dino, &dino_inode);
+		RC_WRAP_LABEL(rc, aborted, kvsns_add_entries, sino,
+			      &sino_inode, -1);
+		RC_WRAP_LABEL(rc, aborted, kvsns_add_entries, dino,
+			      &dino_inode, 1);
 	}
-	RC_WRAP(kvsal_end_transaction);
+
+	RC_WRAP(kvsns_end_transaction);
 	return 0;
 
 aborted:
-	kvsal_discard_transaction();
+	kvsns_discard_transaction();
 	return rc;
 }
 
@@ -632,9 +851,11 @@ int kvsns_mr_proper(void)
 {
 	int rc;
 	char pattern[KLEN];
-	kvsal_item_t items[KVSAL_ARRAY_SIZE];
+	char k[KLEN];
+	kvsal_slice_t items[KVSAL_ARRAY_SIZE];
 	int i;
 	int size;
+	int offset = 0;
 	kvsal_list_t list;
 
 	snprintf(pattern, KLEN, "*");
@@ -645,19 +866,464 @@ int kvsns_mr_proper(void)
 
 	do {
 		size = KVSAL_ARRAY_SIZE;
-		rc = kvsal_get_list(&list, 0, &size, items);
-		if (rc < 0)
-			return rc;
+		RC_WRAP_LABEL(rc, errout, kvsal_get_list_slices, &list,
+			      offset, &size, items);
+
+		/* A map goes with its fields. Keys too long for KLEN are
+		 * those of long names, never maps */
+		for (i = 0; i < size ; i++) {
+			if (items[i].len >= KLEN) {
+				RC_WRAP_LABEL(rc, errout, kvsal_del_slice,
+					      &items[i]);
+				continue;
+			}
 
-		for (i = 0; i < size ; i++)
-			RC_WRAP(kvsal_del, items[i].str);
+			memcpy(k, items[i].p, items[i].len);
+			k[items[i].len] = '\0';
+			RC_WRAP_LABEL(rc, errout, kvsal_del, k);
+		}
 
+		offset += size;
 	} while (size > 0);
 
-	rc = kvsal_fetch_list(pattern, &list);
-	if (rc < 0)
-		return rc;
+	rc = 0;
 
-	return 0;
+errout:
+	kvsns_cache_flush();
+	kvsns_reset_inode_block();
+	kvsal_dispose_list(&list);
+	return rc;
 }
 
+static int kvsns_dentries_keys2hash(void)
+{
+	int rc;
+	char k[KLEN];
+	char values[KVSAL_ARRAY_SIZE][VLEN];
+	kvsal_slice_t items[KVSAL_ARRAY_SIZE];
+	kvsal_slice_t keys[KVSAL_ARRAY_SIZE];
+	kvsal_op_t ops[KVSAL_ARRAY_SIZE];
+	kvsns_ino_t dirs[KVSAL_ARRAY_SIZE];
+	char *names[KVSAL_ARRAY_SIZE];
+	enum kvsns_key_type type;
+	size_t name;
+	size_t mark;
+	int i;
+	int nb;
+	int size;
+	int offset = 0;
+	kvsal_list_t list;
+
+	RC_WRAP(kvsal_fetch_list, kvsns_key_pattern(k, KVSNS_KEY_DENTRY),
+		&list);
+
+	do {
+		size = KVSAL_ARRAY_SIZE;
+		RC_WRAP_LABEL(rc, errout, kvsal_get_list_slices, &list,
+			      offset, &size, items);
+
+		/* The pattern may match other keys. Those of long names are
+		 * copied whole, zero-terminated, in the arena */
+		mark = kvsal_arena_mark();
+		for (i = 0, nb = 0; i < size ; i++) {
+			if (kvsns_parse_key(items[i].p, items[i].len,
+					    &dirs[nb], &type, &name) != 0 ||
+			    type != KVSNS_KEY_DENTRY)
+				continue;
+
+			keys[nb].p = kvsal_arena_alloc(items[i].len + 1);
+			if (keys[nb].p == NULL) {
+				rc = -ENOMEM;
+				goto released;
+			}
+			memcpy(keys[nb].p, items[i].p, items[i].len);
+			keys[nb].p[items[i].len] = '\0';
+			keys[nb].len = items[i].len;
+
+			names[nb] = keys[nb].p + name;
+			kvsns_prepare_op(&ops[nb], KVSAL_OP_GET, keys[nb].p,
+					 values[nb], VLEN);
+			nb++;
+		}
+		RC_WRAP_LABEL(rc, released, kvsal_mget, ops, nb);
+
+		RC_WRAP_LABEL(rc, released, kvsns_begin_transaction);
+		for (i = 0; i < nb ; i++) {
+			if (ops[i].rc == -ENOENT)
+				continue;
+
+			rc = ops[i].rc;
+			if (rc != 0)
+				goto aborted;
+
+			kvsns_key(k, &dirs[i], KVSNS_KEY_DENTRIES, NULL);
+			RC_WRAP_LABEL(rc, aborted, kvsal_set_field, k,
+				      names[i], values[i]);
+			RC_WRAP_LABEL(rc, aborted, kvsal_del_slice, &keys[i]);
+		}
+		RC_WRAP_LABEL(rc, released, kvsns_end_transaction);
+		kvsal_arena_release(mark);
+
+		offset += size;
+	} while (size > 0);
+
+	rc = 0;
+
+errout:
+	kvsal_dispose_list(&list);
+	return rc;
+
+aborted:
+	kvsns_discard_transaction();
+released:
+	kvsal_arena_release(mark);
+	kvsal_dispose_list(&list);
+	return rc;
+}
+
+static int kvsns_dentries_hash2keys(char *map, kvsns_ino_t *dir)
+{
+	int rc;
+	char values[KVSAL_ARRAY_SIZE][VLEN];
+	kvsal_item_t items[KVSAL_ARRAY_SIZE];
+	kvsal_op_t ops[KVSAL_ARRAY_SIZE];
+	kvsal_slice_t k;
+	kvsal_slice_t v;
+	size_t mark;
+	int i;
+	int size;
+	int offset = 0;
+	kvsal_list_t list;
+
+	RC_WRAP(kvsal_fetch_field_list, map, &list);
+
+	do {
+		size = KVSAL_ARRAY_SIZE;
+		RC_WRAP_LABEL(rc, errout, kvsal_get_list, &list, offset,
+			      &size, items);
+
+		for (i = 0; i < size ; i++) {
+			kvsns_prepare_op(&ops[i], KVSAL_OP_GET, map,
+					 values[i], VLEN);
+			ops[i].field = items[i].str;
+		}
+		RC_WRAP_LABEL(rc, errout, kvsal_batch, ops, size);
+
+		/* The keys, as long as the names make them, in the arena */
+		mark = kvsal_arena_mark();
+		RC_WRAP_LABEL(rc, released, kvsns_begin_transaction);
+		for (i = 0; i < size ; i++) {
+			if (ops[i].rc == -ENOENT)
+				continue;
+
+			rc = ops[i].rc;
+			if (rc != 0)
+				goto aborted;
+
+			RC_WRAP_LABEL(rc, aborted, kvsns_name_key, &k, dir,
+				      KVSNS_KEY_DENTRY, ops[i].field);
+			v.p = values[i];
+			v.len = strlen(values[i]);
+			RC_WRAP_LABEL(rc, aborted, kvsal_set_slice, &k, &v);
+			RC_WRAP_LABEL(rc, aborted, kvsal_del_field, map,
+				      ops[i].field);
+		}
+		RC_WRAP_LABEL(rc, released, kvsns_end_transaction);
+		kvsal_arena_release(mark);
+
+		offset += size;
+	} while (size > 0);
+
+	/* The map is removed along with its last field, make sure of it */
+	RC_WRAP_LABEL(rc, errout, kvsal_del, map);
+
+	rc = 0;
+
+errout:
+	kvsal_dispose_list(&list);
+	return rc;
+
+aborted:
+	kvsns_discard_transaction();
+released:
+	kvsal_arena_release(mark);
+	kvsal_dispose_list(&list);
+	return rc;
+}
+
+int kvsns_migrate_dentries(enum kvsns_dentry_layout layout)
+{
+	int rc;
+	char pattern[KLEN];
+	kvsal_item_t items[KVSAL_ARRAY_SIZE];
+	enum kvsns_key_type type;
+	kvsns_ino_t dir;
+	size_t name;
+	int i;
+	int size;
+	int offset = 0;
+	kvsal_list_t list;
+
+	if (layout == KVSNS_DENTRY_HASH)
+		return kvsns_dentries_keys2hash();
+
+	if (layout != KVSNS_DENTRY_KEYS)
+		return -EINVAL;
+
+	/* Every directory has its own map */
+	RC_WRAP(kvsal_fetch_list,
+		kvsns_key_pattern(pattern, KVSNS_KEY_DENTRIES), &list);
+
+	do {
+		size = KVSAL_ARRAY_SIZE;
+		RC_WRAP_LABEL(rc, errout, kvsal_get_list, &list, offset,
+			      &size, items);
+
+		for (i = 0; i < size ; i++) {
+			if (kvsns_parse_key(items[i].str, strlen(items[i].str),
+					    &dir, &type, &name) != 0 ||
+			    type != KVSNS_KEY_DENTRIES)
+				continue;
+
+			RC_WRAP_LABEL(rc, errout, kvsns_dentries_hash2keys,
+				      items[i].str, &dir);
+		}
+
+		offset += size;
+	} while (size > 0);
+
+	rc = 0;
+
+errout:
+	kvsal_dispose_list(&list);
+	return rc;
+}
+
+/* Each old-style inode is made of 4 keys, fetched in a single batch */
+#define KVSNS_OLD_INODE_KEYS 4
+#define KVSNS_MIGRATE_INODES (KVSAL_ARRAY_SIZE / KVSNS_OLD_INODE_KEYS)
+
+int kvsns_migrate_inodes(void)
+{
+	int rc;
+	char keys[KVSAL_ARRAY_SIZE][KLEN];
+	char values[KVSAL_ARRAY_SIZE][VLEN];
+	kvsal_item_t items[KVSNS_MIGRATE_INODES];
+	kvsal_op_t ops[KVSAL_ARRAY_SIZE];
+	kvsal_op_t *op;
+	kvsns_inode_t inode;
+	kvsns_ino_t ino;
+	int i;
+	int j;
+	int size;
+	int offset = 0;
+	kvsal_list_t list;
+	static const char * const suffixes[KVSNS_OLD_INODE_KEYS] = {
+		"stat", "parentdir", "link", "name" };
+
+	RC_WRAP(kvsal_fetch_list, "*.stat", &list);
+
+	do {
+		size = KVSNS_MIGRATE_INODES;
+		RC_WRAP_LABEL(rc, errout, kvsal_get_list, &list, offset,
+			      &size, items);
+
+		for (i = 0; i < size ; i++) {
+			if (sscanf(items[i].str, "%llu.stat", &ino) != 1) {
+				rc = -EINVAL;
+				goto errout;
+			}
+
+			for (j = 0; j < KVSNS_OLD_INODE_KEYS ; j++) {
+				op = &ops[i * KVSNS_OLD_INODE_KEYS + j];
+				snprintf(keys[op - ops], KLEN, "%llu.%s",
+					 ino, suffixes[j]);
+				kvsns_prepare_op(op, KVSAL_OP_GET,
+						 keys[op - ops],
+						 values[op - ops], VLEN);
+			}
+		}
+		RC_WRAP_LABEL(rc, errout, kvsal_mget, ops,
+			      size * KVSNS_OLD_INODE_KEYS);
+
+		RC_WRAP_LABEL(rc, errout, kvsns_begin_transaction);
+		for (i = 0; i < size ; i++) {
+			op = &ops[i * KVSNS_OLD_INODE_KEYS];
+
+			/* Removed since it was listed */
+			if (op[0].rc == -ENOENT)
+				continue;
+
+			rc = op[0].rc;
+			if (rc != 0)
+				goto aborted;
+
+			if (op[0].vlen != sizeof(struct stat)) {
+				rc = -EIO;
+				goto aborted;
+			}
+
+			memset(&inode, 0, sizeof(inode));
+			memcpy(&inode.stat, op[0].v, sizeof(struct stat));
+
+			if (op[1].rc == 0) {
+				inode.nb_parents = KVSAL_ARRAY_SIZE;
+				RC_WRAP_LABEL(rc, aborted, kvsns_str2parentlist,
+					      inode.parents, &inode.nb_parents,
+					      op[1].v);
+			}
+
+			if (op[2].rc == 0)
+				strncpy(inode.link, op[2].v, VLEN - 1);
+
+			if (op[3].rc == 0)
+				strncpy(inode.name, op[3].v, NAME_MAX);
+
+			if (sscanf(op[0].k, "%llu.stat", &ino) != 1) {
+				rc = -EINVAL;
+				goto aborted;
+			}
+
+			RC_WRAP_LABEL(rc, aborted, kvsns_set_inode, &ino,
+				      &inode);
+			for (j = 0; j < KVSNS_OLD_INODE_KEYS ; j++)
+				if (op[j].rc == 0)
+					RC_WRAP_LABEL(rc, aborted, kvsal_del,
+						      op[j].k);
+		}
+		RC_WRAP_LABEL(rc, errout, kvsns_end_transaction);
+
+		offset += size;
+	} while (size > 0);
+
+	rc = 0;
+
+errout:
+	kvsal_dispose_list(&list);
+	return rc;
+
+aborted:
+	kvsns_discard_transaction();
+	kvsal_dispose_list(&list);
+	return rc;
+}
+
+int kvsns_migrate_counters(void)
+{
+	int rc;
+	char pattern[KLEN];
+	char keys[KVSAL_ARRAY_SIZE][KLEN];
+	char k[KLEN];
+	char v[VLEN];
+	kvsal_slice_t items[KVSAL_ARRAY_SIZE];
+	kvsns_ino_t inos[KVSAL_ARRAY_SIZE];
+	kvsal_op_t ops[KVSAL_ARRAY_SIZE];
+	kvsns_inode_t inode;
+	struct stat data_stat;
+	enum kvsns_key_type type;
+	unsigned long long nb_inodes = 0;
+	unsigned long long nb_bytes = 0;
+	char *records;
+	size_t mark;
+	size_t name;
+	int i;
+	int nb;
+	int size;
+	int offset = 0;
+	kvsal_list_t list;
+
+	RC_WRAP(kvsal_fetch_list,
+		kvsns_key_pattern(pattern, KVSNS_KEY_INODE), &list);
+
+	mark = kvsal_arena_mark();
+	records = kvsal_arena_alloc(KVSAL_ARRAY_SIZE * KVSNS_INODE_MAXLEN);
+	if (records == NULL) {
+		rc = -ENOMEM;
+		goto errout;
+	}
+
+	do {
+		size = KVSAL_ARRAY_SIZE;
+		RC_WRAP_LABEL(rc, errout, kvsal_get_list_slices, &list,
+			      offset, &size, items);
+
+		/* The page's inode records, in a single batch */
+		nb = 0;
+		for (i = 0; i < size ; i++) {
+			if (kvsns_parse_key(items[i].p, items[i].len, &inos[nb],
+					    &type, &name) != 0 ||
+			    type != KVSNS_KEY_INODE)
+				continue;
+
+			kvsns_prepare_inode_op(&ops[nb], keys[nb], &inos[nb],
+					       &records[nb*KVSNS_INODE_MAXLEN]);
+			nb += 1;
+		}
+		if (nb > 0)
+			RC_WRAP_LABEL(rc, errout, kvsal_mget, ops, nb);
+
+		for (i = 0; i < nb ; i++) {
+			rc = kvsns_inode_op_rc(&ops[i], &inode);
+
+			/* Removed since it was listed */
+			if (rc == -ENOENT)
+				continue;
+			if (rc != 0)
+				goto errout;
+
+			nb_inodes += 1;
+
+			/* A file's record gets its data's attributes */
+			if (S_ISREG(inode.stat.st_mode) &&
+			    !(inode.flags & KVSNS_INODE_DATA_ATTRS)) {
+				rc = extstore_getattr(&inos[i], &data_stat);
+				if (rc == 0) {
+					inode.stat.st_size = data_stat.st_size;
+					inode.stat.st_blocks =
+						data_stat.st_blocks;
+					inode.stat.st_atim = data_stat.st_atim;
+					inode.stat.st_mtim = data_stat.st_mtim;
+				} else if (rc != -ENOENT)
+					goto errout;
+
+				inode.flags |= KVSNS_INODE_DATA_ATTRS;
+				RC_WRAP_LABEL(rc, errout, kvsns_set_inode,
+					      &inos[i], &inode);
+			}
+
+			if (!S_ISDIR(inode.stat.st_mode)) {
+				nb_bytes += inode.stat.st_size;
+				continue;
+			}
+
+			/* A directory's entries get counted */
+			if (inode.flags & KVSNS_INODE_ENTRIES)
+				continue;
+
+			rc = kvsns_count_dentries(&inos[i]);
+			if (rc < 0)
+				goto errout;
+
+			inode.flags |= KVSNS_INODE_ENTRIES;
+			snprintf(v, VLEN, "%d", rc);
+			kvsns_key(k, &inos[i], KVSNS_KEY_ENTRIES, NULL);
+			RC_WRAP_LABEL(rc, errout, kvsal_set_char, k, v);
+			RC_WRAP_LABEL(rc, errout, kvsns_set_inode, &inos[i],
+				      &inode);
+		}
+
+		offset += size;
+	} while (size > 0);
+
+	snprintf(v, VLEN, "%llu", nb_inodes);
+	RC_WRAP_LABEL(rc, errout, kvsal_set_char, KVSNS_INODES_COUNTER, v);
+	snprintf(v, VLEN, "%llu", nb_bytes);
+	RC_WRAP_LABEL(rc, errout, kvsal_set_char, KVSNS_BYTES_COUNTER, v);
+
+	rc = 0;
+
+errout:
+	kvsal_arena_release(mark);
+	kvsal_dispose_list(&list);
+	return rc;
+}
@@ -45,9 +45,42 @@
 
 static struct collection_item *cfg_items;
 
+/* "replica_reads" lists the classes of calls that may read from replicas,
+ * separated by commas */
+static int kvsns_replica_config(const char *classes)
+{
+	char buf[VLEN];
+	char *class;
+	char *save;
+
+	strncpy(buf, classes, VLEN);
+	buf[VLEN - 1] = '\0';
+
+	kvsns_replica_reads = 0;
+	for (class = strtok_r(buf, ", \t", &save); class;
+	     class = strtok_r(NULL, ", \t", &save)) {
+		if (!strcmp(class, "getattr"))
+			kvsns_replica_reads |= KVSNS_READS_GETATTR;
+		else if (!strcmp(class, "lookup"))
+			kvsns_replica_reads |= KVSNS_READS_LOOKUP;
+		else if (!strcmp(class, "readdir"))
+			kvsns_replica_reads |= KVSNS_READS_READDIR;
+		else {
+			LogCrit(KVSNS_COMPONENT_KVSNS,
+				"Unknown replica_reads class %s", class);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
 int kvsns_start(const char *configpath)
 {
 	struct collection_item *errors = NULL;
+	struct collection_item *item = NULL;
+	const char *layout;
+	const char *encoding;
 	int rc;
 
 	LogInfo(KVSNS_COMPONENT_KVSNS, "--- Starting kvsns ---");
@@ -60,12 +93,89 @@ int kvsns_start(const char *configpath)
 		return -rc;
 	}
 
+	RC_WRAP(get_config_item, "kvsns", "dentry_layout", cfg_items, &item);
+	if (item != NULL) {
+		layout = get_const_string_config_value(item, NULL);
+		if (!strcmp(layout, "keys"))
+			kvsns_dentry_layout = KVSNS_DENTRY_KEYS;
+		else if (!strcmp(layout, "hash"))
+			kvsns_dentry_layout = KVSNS_DENTRY_HASH;
+		else {
+			LogCrit(KVSNS_COMPONENT_KVSNS,
+				"Unknown dentry_layout %s", layout);
+			return -EINVAL;
+		}
+	}
+
+	item = NULL;
+	RC_WRAP(get_config_item, "kvsns", "key_encoding", cfg_items, &item);
+	if (item != NULL) {
+		encoding = get_const_string_config_value(item, NULL);
+		if (!strcmp(encoding, "text"))
+			kvsns_key_encoding = KVSNS_KEYS_TEXT;
+		else if (!strcmp(encoding, "binary"))
+			kvsns_key_encoding = KVSNS_KEYS_BINARY;
+		else {
+			LogCrit(KVSNS_COMPONENT_KVSNS,
+				"Unknown key_encoding %s", encoding);
+			return -EINVAL;
+		}
+	}
+
+	item = NULL;
+	RC_WRAP(get_config_item, "kvsns", "ino_block_size", cfg_items, &item);
+	if (item != NULL) {
+		kvsns_ino_block_size = get_unsigned_config_value(item, 0, 0,
+								 NULL);
+		if (kvsns_ino_block_size == 0) {
+			LogCrit(KVSNS_COMPONENT_KVSNS,
+				"ino_block_size must be at least 1");
+			return -EINVAL;
+		}
+	}
+
+	item = NULL;
+	RC_WRAP(get_config_item, "kvsns", "tree_workers", cfg_items, &item);
+	if (item != NULL) {
+		kvsns_tree_workers = get_unsigned_config_value(item, 0, 0,
+							       NULL);
+		if (kvsns_tree_workers == 0) {
+			LogCrit(KVSNS_COMPONENT_KVSNS,
+				"tree_workers must be at least 1");
+			return -EINVAL;
+		}
+	}
+
+	item = NULL;
+	RC_WRAP(get_config_item, "kvsns", "replica_reads", cfg_items, &item);
+	if (item != NULL)
+		RC_WRAP(kvsns_replica_config,
+			get_const_string_config_value(item, NULL));
+
 	rc = kvsal_init(cfg_items);
 	if (rc != 0) {
 		LogCrit(KVSNS_COMPONENT_KVSNS, "Can't init kvsal");
 		return rc;
 	}
 
+	rc = kvsns_script_init(cfg_items);
+	if (rc != 0) {
+		LogCrit(KVSNS_COMPONENT_KVSNS, "Can't load scripts");
+		return rc;
+	}
+
+	rc = kvsns_cache_init(cfg_items);
+	if (rc != 0) {
+		LogCrit(KVSNS_COMPONENT_KVSNS, "Can't init cache");
+		return rc;
+	}
+
+	rc = kvsns_atime_init(cfg_items);
+	if (rc != 0) {
+		LogCrit(KVSNS_COMPONENT_KVSNS, "Can't init access times");
+		return rc;
+	}
+
 	rc = extstore_init(cfg_items);
 	if (rc != 0) {
 		LogCrit(KVSNS_COMPONENT_KVSNS, "Can't init extstore");
@@ -78,7 +188,9 @@ int kvsns_start(const char *configpath)
 
 int kvsns_stop(void)
 {
+	RC_WRAP(kvsns_atime_fini);
 	RC_WRAP(kvsal_fini);
+	kvsns_cache_fini();
 	RC_WRAP(extstore_fini);
 	free_ini_config_errors(cfg_items);
 	return 0;
@@ -88,35 +200,43 @@ int kvsns_init_root(int openbar)
 {
 	char k[KLEN];
 	char v[KLEN];
-	struct stat bufstat;
+	kvsns_inode_t inode;
+	struct stat *bufstat = &inode.stat;
 	kvsns_ino_t ino;
 
 	ino = KVSNS_ROOT_INODE;
 
-	snprintf(k, KLEN, "%llu.parentdir", ino);
-	snprintf(v, VLEN, "%llu|", ino);
-	RC_WRAP(kvsal_set_char, k, v);
-
 	snprintf(k, KLEN, "ino_counter");
 	snprintf(v, VLEN, "3");
 	RC_WRAP(kvsal_set_char, k, v);
+	kvsns_reset_inode_block();
+
+	/* The root is the only inode */
+	RC_WRAP(kvsal_set_char, KVSNS_INODES_COUNTER, "1");
+	RC_WRAP(kvsal_set_char, KVSNS_BYTES_COUNTER, "0");
+	RC_WRAP(kvsal_set_char,
+		kvsns_key(k, &ino, KVSNS_KEY_ENTRIES, NULL), "0");
+
+	/* The root is its own parent */
+	memset(&inode, 0, sizeof(inode));
+	inode.nb_parents = 1;
+	inode.parents[0] = ino;
+	inode.flags = KVSNS_INODE_ENTRIES;
 
 	/* Set stat */
-	memset(&bufstat, 0, sizeof(struct stat));
 	if (openbar != 0)
-		bufstat.st_mode = S_IFDIR|0777;
+		bufstat->st_mode = S_IFDIR|0777;
 	else
-		bufstat.st_mode = S_IFDIR|0755;
-	bufstat.st_ino = KVSNS_ROOT_INODE;
-	bufstat.st_nlink = 2;
-	bufstat.st_uid = 0;
-	bufstat.st_gid = 0;
-	bufstat.st_atim.tv_sec = 0;
-	bufstat.st_mtim.tv_sec = 0;
-	bufstat.st_ctim.tv_sec = 0;
-
-	snprintf(k, KLEN, "%llu.stat", ino);
-	RC_WRAP(kvsal_set_stat, k, &bufstat);
+		bufstat->st_mode = S_IFDIR|0755;
+	bufstat->st_ino = KVSNS_ROOT_INODE;
+	bufstat->st_nlink = 2;
+	bufstat->st_uid = 0;
+	bufstat->st_gid = 0;
+	bufstat->st_atim.tv_sec = 0;
+	bufstat->st_mtim.tv_sec = 0;
+	bufstat->st_ctim.tv_sec = 0;
+
+	RC_WRAP(kvsns_set_inode, &ino, &inode);
 
 	return 0;
 }
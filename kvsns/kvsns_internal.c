@@ -34,6 +34,8 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <time.h>
 #include <sys/time.h>
 #include <string.h>
@@ -41,19 +43,112 @@
 #include <kvsns/kvsns.h>
 #include "kvsns_internal.h"
 
-int kvsns_next_inode(kvsns_ino_t *ino)
+/* Inode numbers are reserved from "ino_counter" by blocks of
+ * kvsns_ino_block_size, then handed out locally. Numbers left in a block
+ * when the client stops are never used */
+unsigned long long kvsns_ino_block_size = 1;
+
+unsigned int kvsns_replica_reads;
+
+/* Returns what kvsns_replica_end is to be given back */
+bool kvsns_replica_begin(unsigned int reads)
+{
+	if (!(kvsns_replica_reads & reads))
+		return false;
+
+	return kvsal_read_replica(true);
+}
+
+void kvsns_replica_end(unsigned int reads, bool prev)
+{
+	if (kvsns_replica_reads & reads)
+		kvsal_read_replica(prev);
+}
+
+int kvsns_begin_transaction(void)
+{
+	RC_WRAP(kvsal_begin_transaction);
+
+	kvsns_cache_begin();
+	return 0;
+}
+
+/* The cache entries invalidated within the transaction may have been read
+ * again before its commit */
+int kvsns_end_transaction(void)
 {
 	int rc;
+
+	rc = kvsal_end_transaction();
+
+	kvsns_cache_end();
+	return rc;
+}
+
+int kvsns_discard_transaction(void)
+{
+	int rc;
+
+	rc = kvsal_discard_transaction();
+
+	kvsns_cache_end();
+	return rc;
+}
+
+static pthread_mutex_t ino_block_lock = PTHREAD_MUTEX_INITIALIZER;
+static kvsns_ino_t ino_block_next = 0LL;
+static kvsns_ino_t ino_block_last = 0LL;
+
+int kvsns_next_inode(kvsns_ino_t *ino)
+{
+	kvsns_ino_t last;
+	int rc = 0;
+
 	if (!ino)
 		return -EINVAL;
 
-	rc = kvsal_incr_counter("ino_counter", ino);
-	if (rc != 0)
-		return rc;
+	pthread_mutex_lock(&ino_block_lock);
+	if (ino_block_next == 0LL || ino_block_next > ino_block_last) {
+		rc = kvsal_incr_counter_by("ino_counter", kvsns_ino_block_size,
+					   &last);
+		if (rc != 0)
+			goto out;
+
+		ino_block_next = last - kvsns_ino_block_size + 1;
+		ino_block_last = last;
+	}
+
+	*ino = ino_block_next++;
+
+out:
+	pthread_mutex_unlock(&ino_block_lock);
+	return rc;
+}
+
+/* n consecutive inode numbers from *first, reserved apart from the local
+ * block, in a single round trip */
+int kvsns_next_inodes(kvsns_ino_t *first, unsigned long long n)
+{
+	kvsns_ino_t last;
+
+	if (!first || n == 0)
+		return -EINVAL;
+
+	RC_WRAP(kvsal_incr_counter_by, "ino_counter", n, &last);
+	*first = last - n + 1;
 
 	return 0;
 }
 
+/* Drops the current block, needed once "ino_counter" was reset */
+void kvsns_reset_inode_block(void)
+{
+	pthread_mutex_lock(&ino_block_lock);
+	ino_block_next = 0LL;
+	ino_block_last = 0LL;
+	pthread_mutex_unlock(&ino_block_lock);
+}
+
 int kvsns_str2parentlist(kvsns_ino_t *inolist, int *size, char *str)
 {
 	char *token;
@@ -99,20 +194,105 @@ int kvsns_parentlist2str(kvsns_ino_t *inolist, int size, char *str)
 
 int kvsns_update_stat(kvsns_ino_t *ino, int flags)
 {
-	char k[KLEN];
-	struct stat stat;
+	kvsns_inode_t inode;
 
 	if (!ino)
 		return -EINVAL;
 
-	snprintf(k, KLEN, "%llu.stat", *ino);
-	RC_WRAP(kvsal_get_stat, k, &stat);
-	RC_WRAP(kvsns_amend_stat, &stat, flags);
-	RC_WRAP(kvsal_set_stat, k, &stat);
+	RC_WRAP(kvsns_get_inode, ino, &inode);
+	RC_WRAP(kvsns_amend_stat, &inode.stat, flags);
+	RC_WRAP(kvsns_set_inode, ino, &inode);
 
 	return 0;
 }
 
+int kvsns_add_entries(kvsns_ino_t *dir, kvsns_inode_t *inode, int n)
+{
+	char k[KLEN];
+
+	if (!(inode->flags & KVSNS_INODE_ENTRIES) || n == 0)
+		return 0;
+
+	kvsns_key(k, dir, KVSNS_KEY_ENTRIES, NULL);
+	return kvsal_add_counter(k, n);
+}
+
+int kvsns_del_entries(kvsns_ino_t *dir, kvsns_inode_t *inode)
+{
+	char k[KLEN];
+
+	if (!(inode->flags & KVSNS_INODE_ENTRIES))
+		return 0;
+
+	kvsns_key(k, dir, KVSNS_KEY_ENTRIES, NULL);
+	return kvsal_del(k);
+}
+
+/* Batched GET of a directory's number of entries. k is a KLEN buffer and
+ * buf a VLEN one, both to be kept as long as the op */
+void kvsns_prepare_entries_op(kvsal_op_t *op, char *k, kvsns_ino_t *dir,
+			      char *buf)
+{
+	kvsns_key(k, dir, KVSNS_KEY_ENTRIES, NULL);
+	kvsns_prepare_op(op, KVSAL_OP_GET, k, buf, VLEN);
+}
+
+/* Sets the number of entries read by op as the size of inode, if it is
+ * counted. The counter is missing as long as it is 0 */
+int kvsns_entries_op_rc(kvsal_op_t *op, kvsns_inode_t *inode)
+{
+	if (!(inode->flags & KVSNS_INODE_ENTRIES))
+		return 0;
+
+	if (op->rc == -ENOENT) {
+		inode->stat.st_size = 0;
+		return 0;
+	}
+
+	if (op->rc != 0)
+		return op->rc;
+
+	inode->stat.st_size = (long long)strtoull(op->v, NULL, 10);
+	return 0;
+}
+
+int kvsns_count_deletion(off_t size)
+{
+	RC_WRAP(kvsal_add_counter, KVSNS_INODES_COUNTER, -1);
+	if (size != 0)
+		RC_WRAP(kvsal_add_counter, KVSNS_BYTES_COUNTER, -size);
+
+	return 0;
+}
+
+static int kvsns_count_script_rc(bool deleted, off_t size)
+{
+	int rc;
+
+	if (!deleted)
+		return kvsal_add_counter(KVSNS_INODES_COUNTER, 1);
+
+	RC_WRAP(kvsns_begin_transaction);
+	RC_WRAP_LABEL(rc, aborted, kvsns_count_deletion, size);
+	return kvsns_end_transaction();
+
+aborted:
+	kvsns_discard_transaction();
+	return rc;
+}
+
+void kvsns_count_script(kvsns_ino_t *ino, bool deleted, off_t size)
+{
+	int rc;
+
+	/* The operation is done, only the counters are off if this fails */
+	rc = kvsns_count_script_rc(deleted, size);
+	if (rc != 0)
+		LogWarn(KVSNS_COMPONENT_KVSNS,
+			"Can't count inode %llu %s rc=%d", *ino,
+			deleted ? "out" : "in", rc);
+}
+
 int kvsns_amend_stat(struct stat *stat, int flags)
 {
 	struct timeval t;
@@ -155,99 +335,103 @@ int kvsns_create_entry(kvsns_cred_t *cred, kvsns_ino_t *parent,
 		       kvsns_ino_t *new_entry, enum kvsns_type type)
 {
 	int rc;
-	char k[KLEN];
-	char v[KLEN];
-	struct stat bufstat;
-	struct stat parent_stat;
+	kvsns_inode_t inode;
+	kvsns_inode_t parent_inode;
+	struct stat *bufstat = &inode.stat;
 	struct timeval t;
 
 	if (!cred || !parent || !name || !new_entry)
 		return -EINVAL;
 
+	RC_WRAP(kvsns_check_name, name);
+
 	if ((type == KVSNS_SYMLINK) && (lnk == NULL))
 		return -EINVAL;
 
-	rc = kvsns_lookup(cred, parent, name, new_entry);
-	if (rc == 0)
-		return -EEXIST;
+	/* The script checks the name by itself */
+	if (!kvsns_use_scripts) {
+		rc = kvsns_do_lookup(cred, parent, name, new_entry);
+		if (rc == 0)
+			return -EEXIST;
+	}
 
 	RC_WRAP(kvsns_next_inode, new_entry);
-	RC_WRAP(kvsns_get_stat, parent, &parent_stat);
 
-	RC_WRAP(kvsal_begin_transaction);
+	memset(&inode, 0, sizeof(inode));
+	inode.nb_parents = 1;
+	inode.parents[0] = *parent;
 
 #ifdef KVSNS_S3
-	snprintf(k, KLEN, "%llu.name", *new_entry);
-	snprintf(v, VLEN, "%s", name);
-
-	RC_WRAP_LABEL(rc, aborted, kvsal_set_char, k, v);
+	strncpy(inode.name, name, NAME_MAX);
 #endif
 
-	snprintf(k, KLEN, "%llu.dentries.%s",
-		 *parent, name);
-	snprintf(v, VLEN, "%llu", *new_entry);
-
-	RC_WRAP_LABEL(rc, aborted, kvsal_set_char, k, v);
-
-	snprintf(k, KLEN, "%llu.parentdir", *new_entry);
-	snprintf(v, VLEN, "%llu|", *parent);
-
-	RC_WRAP_LABEL(rc, aborted, kvsal_set_char, k, v);
-
 	/* Set stat */
-	memset(&bufstat, 0, sizeof(struct stat));
-	bufstat.st_uid = cred->uid; 
-	bufstat.st_gid = cred->gid;
-	bufstat.st_ino = *new_entry;
+	bufstat->st_uid = cred->uid;
+	bufstat->st_gid = cred->gid;
+	bufstat->st_ino = *new_entry;
 
 	if (gettimeofday(&t, NULL) != 0)
 		return -1;
 
-	bufstat.st_atim.tv_sec = t.tv_sec;
-	bufstat.st_atim.tv_nsec = 1000 * t.tv_usec;
+	bufstat->st_atim.tv_sec = t.tv_sec;
+	bufstat->st_atim.tv_nsec = 1000 * t.tv_usec;
 
-	bufstat.st_mtim.tv_sec = bufstat.st_atim.tv_sec;
-	bufstat.st_mtim.tv_nsec = bufstat.st_atim.tv_nsec;
+	bufstat->st_mtim.tv_sec = bufstat->st_atim.tv_sec;
+	bufstat->st_mtim.tv_nsec = bufstat->st_atim.tv_nsec;
 
-	bufstat.st_ctim.tv_sec = bufstat.st_atim.tv_sec;
-	bufstat.st_ctim.tv_nsec = bufstat.st_atim.tv_nsec;
+	bufstat->st_ctim.tv_sec = bufstat->st_atim.tv_sec;
+	bufstat->st_ctim.tv_nsec = bufstat->st_atim.tv_nsec;
 
 	switch (type) {
 	case KVSNS_DIR:
-		bufstat.st_mode = S_IFDIR|mode;
-		bufstat.st_nlink = 2;
+		bufstat->st_mode = S_IFDIR|mode;
+		bufstat->st_nlink = 2;
+		inode.flags = KVSNS_INODE_ENTRIES;
 		break;
 
 	case KVSNS_FILE:
-		bufstat.st_mode = S_IFREG|mode;
-		bufstat.st_nlink = 1;
+		bufstat->st_mode = S_IFREG|mode;
+		bufstat->st_nlink = 1;
+		inode.flags = KVSNS_INODE_DATA_ATTRS; /* no data yet */
 		break;
 
 	case KVSNS_SYMLINK:
-		bufstat.st_mode = S_IFLNK|mode;
-		bufstat.st_nlink = 1;
+		bufstat->st_mode = S_IFLNK|mode;
+		bufstat->st_nlink = 1;
+		strncpy(inode.link, lnk, VLEN - 1);
 		break;
 
 	default:
 		return -EINVAL;
 	}
-	snprintf(k, KLEN, "%llu.stat", *new_entry);
-	RC_WRAP_LABEL(rc, aborted, kvsal_set_stat, k, &bufstat);
 
-	if (type == KVSNS_SYMLINK) {
-		snprintf(k, KLEN, "%llu.link", *new_entry);
-		RC_WRAP_LABEL(rc, aborted, kvsal_set_char, k, lnk);
+	if (kvsns_use_scripts) {
+		rc = kvsns_script_create(parent, name, new_entry, &inode);
+		if (rc != -ENOTSUP)
+			return rc;
+
+		rc = kvsns_do_lookup(cred, parent, name, new_entry);
+		if (rc == 0)
+			return -EEXIST;
 	}
 
-	RC_WRAP_LABEL(rc, aborted, kvsns_amend_stat, &parent_stat,
-		      STAT_CTIME_SET|STAT_MTIME_SET);
-	RC_WRAP_LABEL(rc, aborted, kvsns_set_stat, parent, &parent_stat);
+	RC_WRAP(kvsns_get_inode, parent, &parent_inode);
+	RC_WRAP(kvsns_amend_stat, &parent_inode.stat,
+		STAT_CTIME_SET|STAT_MTIME_SET);
+
+	RC_WRAP(kvsns_begin_transaction);
+
+	RC_WRAP_LABEL(rc, aborted, kvsns_set_dentry, parent, name, new_entry);
+	RC_WRAP_LABEL(rc, aborted, kvsns_set_inode, new_entry, &inode);
+	RC_WRAP_LABEL(rc, aborted, kvsns_set_inode, parent, &parent_inode);
+	RC_WRAP_LABEL(rc, aborted, kvsns_add_entries, parent, &parent_inode, 1);
+	RC_WRAP_LABEL(rc, aborted, kvsal_add_counter, KVSNS_INODES_COUNTER, 1);
 
-	RC_WRAP(kvsal_end_transaction);
+	RC_WRAP(kvsns_end_transaction);
 	return 0;
 
 aborted:
-	kvsal_discard_transaction();
+	kvsns_discard_transaction();
 	return rc;
 }
 
@@ -309,7 +493,7 @@ int kvsns_access(kvsns_cred_t *cred, kvsns_ino_t *ino, int flags)
 	if (!cred || !ino)
 		return -EINVAL;
 
-	RC_WRAP(kvsns_getattr, cred, ino, &stat);
+	RC_WRAP(kvsns_do_getattr, cred, ino, &stat);
 
 	return kvsns_access_check(cred, &stat, flags);
 }
@@ -317,58 +501,828 @@ int kvsns_access(kvsns_cred_t *cred, kvsns_ino_t *ino, int flags)
 int kvsns_get_stat(kvsns_ino_t *ino, struct stat *bufstat)
 {
 	char k[KLEN];
+	char kentries[KLEN];
+	char buf[KVSNS_INODE_MAXLEN];
+	char entries[VLEN];
+	kvsal_op_t ops[2];
+	kvsns_inode_t inode;
+	unsigned long gen;
 
 	if (!ino || !bufstat)
 		return -EINVAL;
 
-	snprintf(k, KLEN, "%llu.stat", *ino);
-	return kvsal_get_stat(k, bufstat);
+	if (kvsns_cache_get_attr(ino, bufstat, &gen) == 0)
+		return 0;
+
+	/* The record, and the number of entries if it is a directory */
+	kvsns_prepare_inode_op(&ops[0], k, ino, buf);
+	kvsns_prepare_entries_op(&ops[1], kentries, ino, entries);
+	RC_WRAP(kvsal_batch, ops, 2);
+
+	RC_WRAP(kvsns_inode_op_rc, &ops[0], &inode);
+	RC_WRAP(kvsns_entries_op_rc, &ops[1], &inode);
+	memcpy(bufstat, &inode.stat, sizeof(struct stat));
+
+	kvsns_cache_set_attr(ino, bufstat, gen);
+
+	return 0;
+}
+
+/* Inode records are little endian, whatever the host is */
+static char *kvsns_put16(char *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	return p + 2;
+}
+
+static char *kvsns_put32(char *p, uint32_t v)
+{
+	kvsns_put16(p, v & 0xffff);
+	kvsns_put16(p + 2, v >> 16);
+	return p + 4;
+}
+
+static char *kvsns_put64(char *p, uint64_t v)
+{
+	kvsns_put32(p, v & 0xffffffff);
+	kvsns_put32(p + 4, v >> 32);
+	return p + 8;
+}
+
+static char *kvsns_get16(char *p, uint16_t *v)
+{
+	unsigned char *u = (unsigned char *)p;
+
+	*v = u[0] | (u[1] << 8);
+	return p + 2;
+}
+
+static char *kvsns_get32(char *p, uint32_t *v)
+{
+	uint16_t lo;
+	uint16_t hi;
+
+	kvsns_get16(p, &lo);
+	kvsns_get16(p + 2, &hi);
+	*v = lo | ((uint32_t)hi << 16);
+	return p + 4;
+}
+
+static char *kvsns_get64(char *p, uint64_t *v)
+{
+	uint32_t lo;
+	uint32_t hi;
+
+	kvsns_get32(p, &lo);
+	kvsns_get32(p + 4, &hi);
+	*v = lo | ((uint64_t)hi << 32);
+	return p + 8;
+}
+
+/* buf is KVSNS_INODE_MAXLEN bytes long, *size is set to the record's size */
+int kvsns_encode_inode(kvsns_inode_t *inode, char *buf, size_t *size)
+{
+	struct stat *st;
+	size_t namelen;
+	size_t linklen;
+	char *p = buf;
+	int i;
+
+	if (!inode || !buf || !size)
+		return -EINVAL;
+
+	if (inode->nb_parents < 0 || inode->nb_parents > KVSAL_ARRAY_SIZE)
+		return -EINVAL;
+
+	st = &inode->stat;
+	namelen = strnlen(inode->name, NAME_MAX);
+	linklen = strnlen(inode->link, VLEN - 1);
+
+	*p++ = KVSNS_INODE_VERSION;
+	*p++ = inode->flags;
+	p = kvsns_put16(p, inode->nb_parents);
+	p = kvsns_put32(p, st->st_mode);
+	p = kvsns_put32(p, st->st_nlink);
+	p = kvsns_put32(p, st->st_uid);
+	p = kvsns_put32(p, st->st_gid);
+	p = kvsns_put64(p, st->st_ino);
+	p = kvsns_put64(p, st->st_size);
+	p = kvsns_put64(p, st->st_blocks);
+	p = kvsns_put64(p, st->st_atim.tv_sec);
+	p = kvsns_put32(p, st->st_atim.tv_nsec);
+	p = kvsns_put64(p, st->st_mtim.tv_sec);
+	p = kvsns_put32(p, st->st_mtim.tv_nsec);
+	p = kvsns_put64(p, st->st_ctim.tv_sec);
+	p = kvsns_put32(p, st->st_ctim.tv_nsec);
+
+	for (i = 0; i < inode->nb_parents ; i++)
+		p = kvsns_put64(p, inode->parents[i]);
+
+	p = kvsns_put16(p, namelen);
+	memcpy(p, inode->name, namelen);
+	p += namelen;
+
+	p = kvsns_put16(p, linklen);
+	memcpy(p, inode->link, linklen);
+	p += linklen;
+
+	*size = p - buf;
+	return 0;
+}
+
+int kvsns_decode_inode(char *buf, size_t size, kvsns_inode_t *inode)
+{
+	struct stat *st;
+	char *p = buf;
+	char *end = buf + size;
+	uint16_t u16;
+	uint32_t u32;
+	uint64_t u64;
+	int i;
+
+	if (!buf || !inode)
+		return -EINVAL;
+
+	if (size < KVSNS_INODE_HDRLEN || buf[0] != KVSNS_INODE_VERSION)
+		return -EIO;
+
+	memset(inode, 0, sizeof(kvsns_inode_t));
+	st = &inode->stat;
+
+	inode->flags = (unsigned char)p[1];
+	p += 2;
+	p = kvsns_get16(p, &u16);
+	inode->nb_parents = u16;
+	p = kvsns_get32(p, &u32);
+	st->st_mode = u32;
+	p = kvsns_get32(p, &u32);
+	st->st_nlink = u32;
+	p = kvsns_get32(p, &u32);
+	st->st_uid = u32;
+	p = kvsns_get32(p, &u32);
+	st->st_gid = u32;
+	p = kvsns_get64(p, &u64);
+	st->st_ino = u64;
+	p = kvsns_get64(p, &u64);
+	st->st_size = u64;
+	p = kvsns_get64(p, &u64);
+	st->st_blocks = u64;
+	p = kvsns_get64(p, &u64);
+	st->st_atim.tv_sec = u64;
+	p = kvsns_get32(p, &u32);
+	st->st_atim.tv_nsec = u32;
+	p = kvsns_get64(p, &u64);
+	st->st_mtim.tv_sec = u64;
+	p = kvsns_get32(p, &u32);
+	st->st_mtim.tv_nsec = u32;
+	p = kvsns_get64(p, &u64);
+	st->st_ctim.tv_sec = u64;
+	p = kvsns_get32(p, &u32);
+	st->st_ctim.tv_nsec = u32;
+
+	if (inode->nb_parents > KVSAL_ARRAY_SIZE ||
+	    end - p < inode->nb_parents * 8 + 2)
+		return -EIO;
+
+	for (i = 0; i < inode->nb_parents ; i++) {
+		p = kvsns_get64(p, &u64);
+		inode->parents[i] = u64;
+	}
+
+	p = kvsns_get16(p, &u16);
+	if (u16 > NAME_MAX || end - p < u16 + 2)
+		return -EIO;
+	memcpy(inode->name, p, u16);
+	p += u16;
+
+	p = kvsns_get16(p, &u16);
+	if (u16 > VLEN - 1 || end - p < u16)
+		return -EIO;
+	memcpy(inode->link, p, u16);
+
+	return 0;
+}
+
+/* Same encodings as in the records, for the server side scripts. An inode
+ * number is 8 bytes long and a time 12 bytes long */
+void kvsns_encode_ino(kvsns_ino_t *ino, char *buf)
+{
+	kvsns_put64(buf, *ino);
+}
+
+void kvsns_encode_time(struct timespec *t, char *buf)
+{
+	buf = kvsns_put64(buf, t->tv_sec);
+	kvsns_put32(buf, t->tv_nsec);
+}
+
+int kvsns_encode_now(char *buf)
+{
+	struct timeval t;
+
+	if (gettimeofday(&t, NULL) != 0)
+		return -errno;
+
+	buf = kvsns_put64(buf, t.tv_sec);
+	kvsns_put32(buf, 1000 * t.tv_usec);
+
+	return 0;
+}
+
+enum kvsns_key_encoding kvsns_key_encoding = KVSNS_KEYS_TEXT;
+
+/* Each type of key, with its suffix in text and its tag once encoded */
+static const struct kvsns_key_format {
+	const char *suffix;
+	char tag;
+	bool named;
+} kvsns_key_formats[] = {
+	[KVSNS_KEY_INODE] = { ".inode", 'i', false },
+	[KVSNS_KEY_DENTRIES] = { ".dentries", 'D', false },
+	[KVSNS_KEY_DENTRY] = { ".dentries.", 'd', true },
+	[KVSNS_KEY_XATTR] = { ".xattr.", 'x', true },
+	[KVSNS_KEY_OPENOWNER] = { ".openowner", 'o', false },
+	[KVSNS_KEY_OPENED_AND_DELETED] = { ".opened_and_deleted", 'u', false },
+	[KVSNS_KEY_ENTRIES] = { ".entries", 'n', false }
+};
+
+#define KVSNS_KEY_TYPES \
+	(sizeof(kvsns_key_formats) / sizeof(kvsns_key_formats[0]))
+
+/* Length of the largest inode number, in decimal */
+#define KVSNS_INO_DIGITS 20
+
+/* The inode number encoded as in kvsal.h, in the KVSAL_INO_KEYLEN bytes at
+ * buf. Returns the encoding's length */
+static size_t kvsns_encode_key_ino(kvsns_ino_t ino, char *buf)
+{
+	size_t n = 1;
+	size_t i;
+
+	while (n < KVSAL_INO_GROUPS && (ino >> (7 * n)) != 0)
+		n++;
+
+	buf[0] = KVSAL_INO_KEY + n;
+	for (i = 0; i < n ; i++)
+		buf[n - i] = 0x80 | ((ino >> (7 * i)) & 0x7f);
+
+	return n + 1;
+}
+
+/* Length of the encoded inode number the klen bytes at k start with, 0 if
+ * they don't */
+static size_t kvsns_decode_key_ino(const char *k, size_t klen,
+				   kvsns_ino_t *ino)
+{
+	const unsigned char *u = (const unsigned char *)k;
+	size_t n;
+	size_t i;
+
+	if (klen == 0 || u[0] <= KVSAL_INO_KEY ||
+	    u[0] > KVSAL_INO_KEY + KVSAL_INO_GROUPS)
+		return 0;
+
+	n = u[0] - KVSAL_INO_KEY;
+	if (n >= klen)
+		return 0;
+
+	*ino = 0;
+	for (i = 1; i <= n ; i++) {
+		if (!(u[i] & 0x80))
+			return 0;
+		*ino = (*ino << 7) | (u[i] & 0x7f);
+	}
+
+	return n + 1;
+}
+
+/* Builds in k, a buffer of size bytes, the key of type about inode ino,
+ * which ends with name for dentries and xattrs. Returns its length */
+static size_t kvsns_build_key(char *k, size_t size, kvsns_ino_t *ino,
+			      enum kvsns_key_type type, const char *name)
+{
+	const struct kvsns_key_format *f = &kvsns_key_formats[type];
+	size_t n;
+	size_t len;
+
+	if (kvsns_key_encoding == KVSNS_KEYS_TEXT) {
+		len = snprintf(k, size, "%llu%s%s", *ino, f->suffix,
+			       f->named ? name : "");
+		return MIN(len, size - 1);
+	}
+
+	n = kvsns_encode_key_ino(*ino, k);
+	k[n++] = f->tag;
+
+	len = f->named ? strnlen(name, size - 1 - n) : 0;
+	memcpy(k + n, name, len);
+	k[n + len] = '\0';
+
+	return n + len;
+}
+
+/* Builds in k, a KLEN buffer, the key of type about inode ino. Dentries and
+ * xattrs are given a short name here, a pattern's "*" for instance, their
+ * own keys are built by kvsns_name_key. Returns k */
+char *kvsns_key(char *k, kvsns_ino_t *ino, enum kvsns_key_type type,
+		const char *name)
+{
+	kvsns_build_key(k, KLEN, ino, type, name);
+	return k;
+}
+
+/* The key of the dentry or xattr name of inode ino, as long as name makes
+ * it, in k->p allocated in the arena. It is zero-terminated as well */
+int kvsns_name_key(kvsal_slice_t *k, kvsns_ino_t *ino,
+		   enum kvsns_key_type type, const char *name)
+{
+	size_t size;
+
+	/* The encoded inode number is shorter than the decimal one */
+	size = KVSNS_INO_DIGITS + strlen(kvsns_key_formats[type].suffix) +
+	       strlen(name) + 1;
+	k->p = kvsal_arena_alloc(size);
+	if (k->p == NULL)
+		return -ENOMEM;
+
+	k->len = kvsns_build_key(k->p, size, ino, type, name);
+	return 0;
+}
+
+/* Keys are built as long as the name makes them: a name is only bound by
+ * NAME_MAX */
+int kvsns_check_name(const char *name)
+{
+	if (strnlen(name, NAME_MAX + 1) > NAME_MAX)
+		return -ENAMETOOLONG;
+
+	return 0;
+}
+
+/* A pattern matching the keys of type of every inode, in k, a KLEN buffer.
+ * Other keys may match it as well, the keys listed are to be checked with
+ * kvsns_parse_key. Returns k */
+char *kvsns_key_pattern(char *k, enum kvsns_key_type type)
+{
+	const struct kvsns_key_format *f = &kvsns_key_formats[type];
+
+	if (kvsns_key_encoding == KVSNS_KEYS_TEXT)
+		snprintf(k, KLEN, "*%s%s", f->suffix, f->named ? "*" : "");
+	else
+		strcpy(k, "*");
+
+	return k;
+}
+
+/* Tells what the klen bytes of key k, in either encoding, are about. For a
+ * dentry or an xattr, *name is set to the name's offset in k. Returns
+ * -EINVAL if k is not a key kvsns_key builds */
+int kvsns_parse_key(const char *k, size_t klen, kvsns_ino_t *ino,
+		    enum kvsns_key_type *type, size_t *name)
+{
+	const struct kvsns_key_format *f;
+	size_t n;
+	size_t len;
+	int t;
+
+	n = kvsns_decode_key_ino(k, klen, ino);
+	if (n > 0) {
+		for (t = 0; t < KVSNS_KEY_TYPES ; t++) {
+			f = &kvsns_key_formats[t];
+			if (k[n] != f->tag || (!f->named && n + 1 != klen))
+				continue;
+
+			*type = t;
+			*name = n + 1;
+			return 0;
+		}
+
+		return -EINVAL;
+	}
+
+	/* "<inum>.<suffix>" */
+	*ino = 0;
+	for (n = 0; n < klen && k[n] >= '0' && k[n] <= '9' ; n++)
+		*ino = *ino * 10 + (k[n] - '0');
+
+	if (n == 0)
+		return -EINVAL;
+
+	for (t = 0; t < KVSNS_KEY_TYPES ; t++) {
+		f = &kvsns_key_formats[t];
+		len = strlen(f->suffix);
+		if (klen - n < len || memcmp(k + n, f->suffix, len) ||
+		    (!f->named && klen - n != len))
+			continue;
+
+		*type = t;
+		*name = n + len;
+		return 0;
+	}
+
+	return -EINVAL;
 }
 
-int kvsns_set_stat(kvsns_ino_t *ino, struct stat *bufstat)
+/* The value of a dentry: the inode number it leads to, in v, a VLEN
+ * buffer */
+void kvsns_ino2str(kvsns_ino_t *ino, char *v)
+{
+	if (kvsns_key_encoding == KVSNS_KEYS_TEXT)
+		snprintf(v, VLEN, "%llu", *ino);
+	else
+		v[kvsns_encode_key_ino(*ino, v)] = '\0';
+}
+
+int kvsns_str2ino(const char *v, kvsns_ino_t *ino)
+{
+	size_t len = strlen(v);
+	size_t n;
+
+	if (len > 0 && kvsns_decode_key_ino(v, len, ino) == len)
+		return 0;
+
+	*ino = 0;
+	for (n = 0; n < len && v[n] >= '0' && v[n] <= '9' ; n++)
+		*ino = *ino * 10 + (v[n] - '0');
+
+	return (n > 0 && n == len) ? 0 : -EIO;
+}
+
+int kvsns_get_inode(kvsns_ino_t *ino, kvsns_inode_t *inode)
 {
 	char k[KLEN];
+	char buf[KVSNS_INODE_MAXLEN];
+	size_t size = KVSNS_INODE_MAXLEN;
 
-	if (!ino || !bufstat)
+	if (!ino || !inode)
+		return -EINVAL;
+
+	kvsns_key(k, ino, KVSNS_KEY_INODE, NULL);
+	RC_WRAP(kvsal_get_binary, k, buf, &size);
+
+	return kvsns_decode_inode(buf, size, inode);
+}
+
+int kvsns_set_inode(kvsns_ino_t *ino, kvsns_inode_t *inode)
+{
+	char k[KLEN];
+	char buf[KVSNS_INODE_MAXLEN];
+	size_t size;
+	int rc;
+
+	if (!ino || !inode)
+		return -EINVAL;
+
+	/* An access time kept by the client goes with the record */
+	kvsns_atime_merge(ino, &inode->stat);
+	RC_WRAP(kvsns_encode_inode, inode, buf, &size);
+
+	kvsns_key(k, ino, KVSNS_KEY_INODE, NULL);
+	rc = kvsal_set_binary(k, buf, size);
+
+	kvsns_cache_del_attr(ino);
+	return rc;
+}
+
+/* Same as kvsns_set_inode, for an inode whose size was size: the bytes
+ * of the namespace change along with it */
+int kvsns_resize_inode(kvsns_ino_t *ino, kvsns_inode_t *inode, off_t size)
+{
+	int rc;
+
+	if (S_ISDIR(inode->stat.st_mode) || inode->stat.st_size == size)
+		return kvsns_set_inode(ino, inode);
+
+	RC_WRAP(kvsns_begin_transaction);
+	RC_WRAP_LABEL(rc, aborted, kvsns_set_inode, ino, inode);
+	RC_WRAP_LABEL(rc, aborted, kvsal_add_counter, KVSNS_BYTES_COUNTER,
+		      inode->stat.st_size - size);
+	RC_WRAP(kvsns_end_transaction);
+
+	return 0;
+
+aborted:
+	kvsns_discard_transaction();
+	return rc;
+}
+
+int kvsns_del_inode(kvsns_ino_t *ino)
+{
+	char k[KLEN];
+	int rc;
+
+	if (!ino)
+		return -EINVAL;
+
+	kvsns_atime_forget(ino);
+
+	kvsns_key(k, ino, KVSNS_KEY_INODE, NULL);
+	rc = kvsal_del(k);
+
+	kvsns_cache_del_attr(ino);
+	return rc;
+}
+
+/* Batched GET of an inode record. k is a KLEN buffer and buf is
+ * KVSNS_INODE_MAXLEN bytes long, both to be kept as long as the op */
+void kvsns_prepare_inode_op(kvsal_op_t *op, char *k, kvsns_ino_t *ino,
+			    char *buf)
+{
+	kvsns_key(k, ino, KVSNS_KEY_INODE, NULL);
+	kvsns_prepare_op(op, KVSAL_OP_GET, k, buf, KVSNS_INODE_MAXLEN);
+}
+
+int kvsns_inode_op_rc(kvsal_op_t *op, kvsns_inode_t *inode)
+{
+	if (op->rc != 0)
+		return op->rc;
+
+	return kvsns_decode_inode(op->v, op->vlen, inode);
+}
+
+int kvsns_add_parent(kvsns_inode_t *inode, kvsns_ino_t *parent)
+{
+	if (!inode || !parent)
+		return -EINVAL;
+
+	if (inode->nb_parents == KVSAL_ARRAY_SIZE)
+		return -EMLINK;
+
+	inode->parents[inode->nb_parents++] = *parent;
+	return 0;
+}
+
+/* Removes one occurrence of parent in the inode's parents */
+int kvsns_del_parent(kvsns_inode_t *inode, kvsns_ino_t *parent)
+{
+	int i;
+
+	if (!inode || !parent)
+		return -EINVAL;
+
+	for (i = 0; i < inode->nb_parents ; i++)
+		if (inode->parents[i] == *parent) {
+			inode->nb_parents -= 1;
+			memmove(&inode->parents[i], &inode->parents[i + 1],
+				(inode->nb_parents - i) * sizeof(kvsns_ino_t));
+			return 0;
+		}
+
+	return -ENOENT;
+}
+
+void kvsns_prepare_op(kvsal_op_t *op, enum kvsal_op_type type, char *k,
+		      void *v, size_t vlen)
+{
+	op->type = type;
+	op->k = k;
+	op->v = (char *)v;
+	op->vlen = vlen;
+	op->field = NULL;
+	op->off = 0;
+	op->rc = 0;
+}
+
+enum kvsns_dentry_layout kvsns_dentry_layout = KVSNS_DENTRY_KEYS;
+
+/* The op's key is allocated in the arena, to be released once the op is
+ * done */
+int kvsns_prepare_dentry_op(kvsal_op_t *op, enum kvsal_op_type type,
+			    kvsns_ino_t *parent, char *name, void *v,
+			    size_t vlen)
+{
+	kvsal_slice_t k;
+
+	if (kvsns_dentry_layout == KVSNS_DENTRY_HASH) {
+		k.p = kvsal_arena_alloc(KLEN);
+		if (k.p == NULL)
+			return -ENOMEM;
+
+		kvsns_prepare_op(op, type, kvsns_key(k.p, parent,
+						      KVSNS_KEY_DENTRIES,
+						      NULL), v, vlen);
+		op->field = name;
+		return 0;
+	}
+
+	RC_WRAP(kvsns_name_key, &k, parent, KVSNS_KEY_DENTRY, name);
+	kvsns_prepare_op(op, type, k.p, v, vlen);
+
+	return 0;
+}
+
+int kvsns_get_dentry(kvsns_ino_t *parent, char *name, kvsns_ino_t *ino)
+{
+	char k[KLEN];
+	char v[VLEN];
+	kvsal_slice_t sk;
+	kvsal_slice_t sv = { v, VLEN - 1 };
+	size_t mark;
+	int rc;
+
+	if (!parent || !name || !ino)
 		return -EINVAL;
 
-	snprintf(k, KLEN, "%llu.stat", *ino);
-	return kvsal_set_stat(k, bufstat);
+	if (kvsns_dentry_layout == KVSNS_DENTRY_HASH) {
+		kvsns_key(k, parent, KVSNS_KEY_DENTRIES, NULL);
+		RC_WRAP(kvsal_get_field, k, name, v);
+		return kvsns_str2ino(v, ino);
+	}
+
+	mark = kvsal_arena_mark();
+	rc = kvsns_name_key(&sk, parent, KVSNS_KEY_DENTRY, name);
+	if (rc == 0)
+		rc = kvsal_get_slice(&sk, &sv);
+	kvsal_arena_release(mark);
+	if (rc != 0)
+		return rc;
+
+	v[sv.len] = '\0';
+	return kvsns_str2ino(v, ino);
+}
+
+int kvsns_set_dentry(kvsns_ino_t *parent, char *name, kvsns_ino_t *ino)
+{
+	char k[KLEN];
+	char v[VLEN];
+	kvsal_slice_t sk;
+	kvsal_slice_t sv;
+	size_t mark;
+	int rc;
+
+	if (!parent || !name || !ino)
+		return -EINVAL;
+
+	kvsns_ino2str(ino, v);
+
+	if (kvsns_dentry_layout == KVSNS_DENTRY_HASH) {
+		kvsns_key(k, parent, KVSNS_KEY_DENTRIES, NULL);
+		rc = kvsal_set_field(k, name, v);
+	} else {
+		mark = kvsal_arena_mark();
+		rc = kvsns_name_key(&sk, parent, KVSNS_KEY_DENTRY, name);
+		if (rc == 0) {
+			sv.p = v;
+			sv.len = strlen(v);
+			rc = kvsal_set_slice(&sk, &sv);
+		}
+		kvsal_arena_release(mark);
+	}
+
+	kvsns_cache_del_dentry(parent, name);
+	return rc;
+}
+
+int kvsns_del_dentry(kvsns_ino_t *parent, char *name)
+{
+	char k[KLEN];
+	kvsal_slice_t sk;
+	size_t mark;
+	int rc;
+
+	if (!parent || !name)
+		return -EINVAL;
+
+	if (kvsns_dentry_layout == KVSNS_DENTRY_HASH) {
+		kvsns_key(k, parent, KVSNS_KEY_DENTRIES, NULL);
+		rc = kvsal_del_field(k, name);
+	} else {
+		mark = kvsal_arena_mark();
+		rc = kvsns_name_key(&sk, parent, KVSNS_KEY_DENTRY, name);
+		if (rc == 0)
+			rc = kvsal_del_slice(&sk);
+		kvsal_arena_release(mark);
+	}
+
+	kvsns_cache_del_dentry(parent, name);
+	return rc;
+}
+
+/* Returns the number of entries in dir, or a negative "-errno" */
+int kvsns_count_dentries(kvsns_ino_t *dir)
+{
+	char k[KLEN];
+
+	if (!dir)
+		return -EINVAL;
+
+	if (kvsns_dentry_layout == KVSNS_DENTRY_HASH) {
+		kvsns_key(k, dir, KVSNS_KEY_DENTRIES, NULL);
+		return kvsal_get_fields_count(k);
+	}
+
+	kvsns_key(k, dir, KVSNS_KEY_DENTRY, "*");
+	return kvsal_get_list_size(k);
+}
+
+int kvsns_fetch_dentries(kvsns_ino_t *dir, kvsal_list_t *list)
+{
+	char k[KLEN];
+
+	if (!dir || !list)
+		return -EINVAL;
+
+	if (kvsns_dentry_layout == KVSNS_DENTRY_HASH) {
+		kvsns_key(k, dir, KVSNS_KEY_DENTRIES, NULL);
+		return kvsal_fetch_field_list(k, list);
+	}
+
+	kvsns_key(k, dir, KVSNS_KEY_DENTRY, "*");
+	return kvsal_fetch_list(k, list);
+}
+
+/* Name of an entry listed by kvsns_fetch_dentries */
+char *kvsns_dentry_name(kvsal_slice_t *item, size_t *len)
+{
+	enum kvsns_key_type type;
+	kvsns_ino_t dir;
+	size_t name;
+
+	*len = item->len;
+	if (kvsns_dentry_layout == KVSNS_DENTRY_HASH)
+		return item->p;
+
+	if (kvsns_parse_key(item->p, item->len, &dir, &type, &name) != 0 ||
+	    type != KVSNS_KEY_DENTRY)
+		return item->p;
+
+	*len = item->len - name;
+	return item->p + name;
+}
+
+/* Same as kvsns_script_walk, done by the client if the KVS can't */
+static int kvsns_walk(kvsns_cred_t *cred, kvsns_ino_t *dir, int nb,
+		      char **names, kvsns_ino_t *parent, kvsns_ino_t *ino,
+		      int *found)
+{
+	kvsns_ino_t next;
+	int rc;
+
+	if (kvsns_use_scripts) {
+		rc = kvsns_script_walk(cred, dir, nb, names, parent, ino,
+				       found);
+		if (rc != -ENOTSUP)
+			return rc;
+	}
+
+	*parent = *dir;
+	*ino = *dir;
+	for (*found = 0; *found < nb ; *found += 1) {
+		rc = kvsns_do_lookup(cred, ino, names[*found], &next);
+		if (rc == -ENOENT) {
+			*parent = *ino;
+			return 0;
+		}
+		if (rc != 0)
+			return rc;
+
+		*parent = *ino;
+		*ino = next;
+	}
+
+	return 0;
 }
 
 int kvsns_lookup_path(kvsns_cred_t *cred, kvsns_ino_t *parent, char *path,
 		       kvsns_ino_t *ino)
 {
+	char *names[KVSNS_WALK_NAMES];
 	char *saveptr;
 	char *str;
-	char *token;
-	kvsns_ino_t iter_ino = 0LL;
-	kvsns_ino_t *iter = NULL;
-	int j = 0;
-	int rc = 0;
+	kvsns_ino_t dir;
+	int found;
+	int nb;
 
-	memcpy(&iter_ino, parent, sizeof(kvsns_ino_t));
-	iter = &iter_ino;
-	for (j = 1, str = path; ; j++, str = NULL) {
-		memcpy(parent, ino, sizeof(kvsns_ino_t));
-		token = strtok_r(str, "/", &saveptr);
-		if (token == NULL)
-			break;
+	if (!cred || !parent || !path || !ino)
+		return -EINVAL;
 
-		rc = kvsns_lookup(cred, iter, token, ino);
-		if (rc != 0) {
-			if (rc == -ENOENT)
+	dir = *parent;
+	*ino = dir;
+	str = path;
+	do {
+		/* As many names as a single walk resolves */
+		for (nb = 0; nb < KVSNS_WALK_NAMES ; nb++, str = NULL) {
+			names[nb] = strtok_r(str, "/", &saveptr);
+			if (names[nb] == NULL)
 				break;
-			else
-				return rc;
+			RC_WRAP(kvsns_check_name, names[nb]);
 		}
+		if (nb == 0)
+			break;
 
-		iter = ino;
-	}
+		RC_WRAP(kvsns_walk, cred, &dir, nb, names, parent, ino,
+			&found);
+
+		if (found < nb) {
+			/* If non-existing file should be created */
+			memmove(path, names[found], strlen(names[found]) + 1);
+			return -ENOENT;
+		}
 
-	if (token != NULL) /* If non-existing file should be created */
-		strcpy(path, token);
+		dir = *ino;
+	} while (nb == KVSNS_WALK_NAMES);
 
-	return rc;
+	return 0;
 }
 
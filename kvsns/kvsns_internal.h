@@ -50,17 +50,215 @@
 	if (__rc != 0)        \
 		goto __label; })
 
+extern unsigned long long kvsns_ino_block_size;
+extern unsigned int kvsns_tree_workers;
+
+/* Classes of calls whose reads may be served by the KVS's replicas, as set
+ * by "replica_reads". A call of such a class is run between
+ * kvsns_replica_begin and kvsns_replica_end. The namespace's own operations
+ * use kvsns_do_lookup and kvsns_do_getattr, which only read from replicas
+ * when called within such a call */
+#define KVSNS_READS_GETATTR	0x1
+#define KVSNS_READS_LOOKUP	0x2
+#define KVSNS_READS_READDIR	0x4
+
+extern unsigned int kvsns_replica_reads;
+
+bool kvsns_replica_begin(unsigned int reads);
+void kvsns_replica_end(unsigned int reads, bool prev);
+int kvsns_do_lookup(kvsns_cred_t *cred, kvsns_ino_t *parent, char *name,
+		    kvsns_ino_t *ino);
+int kvsns_do_getattr(kvsns_cred_t *cred, kvsns_ino_t *ino,
+		     struct stat *bufstat);
+
+/* kvsal's transactions, along with the cache entries they invalidate */
+int kvsns_begin_transaction(void);
+int kvsns_end_transaction(void);
+int kvsns_discard_transaction(void);
+
 int kvsns_next_inode(kvsns_ino_t *ino);
+int kvsns_next_inodes(kvsns_ino_t *first, unsigned long long n);
+void kvsns_reset_inode_block(void);
 int kvsns_str2parentlist(kvsns_ino_t *inolist, int *size, char *str);
 int kvsns_parentlist2str(kvsns_ino_t *inolist, int size, char *str);
 int kvsns_create_entry(kvsns_cred_t *cred, kvsns_ino_t *parent,
 		       char *name, char *lnk, mode_t mode,
 		       kvsns_ino_t *newdir, enum kvsns_type type);
 int kvsns_get_stat(kvsns_ino_t *ino, struct stat *bufstat);
-int kvsns_set_stat(kvsns_ino_t *ino, struct stat *bufstat);
 int kvsns_update_stat(kvsns_ino_t *ino, int flags);
 int kvsns_amend_stat(struct stat *stat, int flags);
+
+/* Access time updates, see kvsns_atime.c. kvsns_update_atime sets the
+ * access time of ino to now, inode being its record if the caller has it.
+ * With "lazytime", the time is only kept by the client: kvsns_atime_amend
+ * puts it in stat, kvsns_atime_merge does too and drops it as the record
+ * is about to be written, kvsns_atime_flush_ino writes it at once */
+enum kvsns_atime_mode {
+	KVSNS_ATIME_STRICT = 0,	/* "strict": written at each access */
+	KVSNS_ATIME_RELATIME,	/* "relatime": if older than a change or a day */
+	KVSNS_ATIME_LAZY	/* "lazytime": kept, then written in batches */
+};
+
+extern enum kvsns_atime_mode kvsns_atime_mode;
+
+int kvsns_atime_init(struct collection_item *cfg_items);
+int kvsns_atime_fini(void);
+int kvsns_update_atime(kvsns_ino_t *ino, kvsns_inode_t *inode);
+void kvsns_atime_amend(kvsns_ino_t *ino, struct stat *stat);
+void kvsns_atime_merge(kvsns_ino_t *ino, struct stat *stat);
+void kvsns_atime_forget(kvsns_ino_t *ino);
+int kvsns_atime_flush_ino(kvsns_ino_t *ino);
+int kvsns_atime_flush(void);
+
+/* Namespace wide counters, see kvsns_fsstat. kvsns_count_deletion counts
+ * an inode out, with size bytes of data. kvsns_count_script counts ino in,
+ * or out if deleted, once a script created or deleted it without counting
+ * it, the counters being on another server than its keys */
+#define KVSNS_INODES_COUNTER "nb_inodes"
+#define KVSNS_BYTES_COUNTER "nb_bytes"
+
+int kvsns_count_deletion(off_t size);
+void kvsns_count_script(kvsns_ino_t *ino, bool deleted, off_t size);
+
+/* The number of entries of a directory whose record is flagged so is kept
+ * in a counter of its own, next to the record, and read as its size.
+ * kvsns_add_entries adds n to it and kvsns_del_entries removes it along
+ * with the directory, both within the caller's transaction */
+int kvsns_add_entries(kvsns_ino_t *dir, kvsns_inode_t *inode, int n);
+int kvsns_del_entries(kvsns_ino_t *dir, kvsns_inode_t *inode);
+void kvsns_prepare_entries_op(kvsal_op_t *op, char *k, kvsns_ino_t *dir,
+			      char *buf);
+int kvsns_entries_op_rc(kvsal_op_t *op, kvsns_inode_t *inode);
 int kvsns_delall_xattr(kvsns_cred_t *cred, kvsns_ino_t *ino);
+void kvsns_prepare_op(kvsal_op_t *op, enum kvsal_op_type type, char *k,
+		      void *v, size_t vlen);
+
+/* Packed inode records: version, stat fields, parents, name and link.
+ * KVSNS_INODE_MAXLEN is the size of the largest record, the access time
+ * is found at KVSNS_INODE_ATIME */
+#define KVSNS_INODE_VERSION 1
+#define KVSNS_INODE_HDRLEN 80
+#define KVSNS_INODE_ATIME 44
+#define KVSNS_TIME_LEN 12
+#define KVSNS_INODE_MAXLEN (KVSNS_INODE_HDRLEN + \
+			    KVSAL_ARRAY_SIZE * sizeof(kvsns_ino_t) + \
+			    2 + NAME_MAX + 2 + VLEN)
+
+int kvsns_encode_inode(kvsns_inode_t *inode, char *buf, size_t *size);
+int kvsns_decode_inode(char *buf, size_t size, kvsns_inode_t *inode);
+void kvsns_encode_ino(kvsns_ino_t *ino, char *buf);
+int kvsns_encode_now(char *buf);
+void kvsns_encode_time(struct timespec *t, char *buf);
+int kvsns_set_inode(kvsns_ino_t *ino, kvsns_inode_t *inode);
+int kvsns_resize_inode(kvsns_ino_t *ino, kvsns_inode_t *inode, off_t size);
+int kvsns_set_data_attrs(kvsns_ino_t *ino, bool known);
+int kvsns_create_record(kvsns_inode_t *inode, kvsns_create_item_t *item,
+			char *record, size_t *size);
+int kvsns_del_inode(kvsns_ino_t *ino);
+void kvsns_prepare_inode_op(kvsal_op_t *op, char *k, kvsns_ino_t *ino,
+			    char *buf);
+int kvsns_inode_op_rc(kvsal_op_t *op, kvsns_inode_t *inode);
+int kvsns_add_parent(kvsns_inode_t *inode, kvsns_ino_t *parent);
+int kvsns_del_parent(kvsns_inode_t *inode, kvsns_ino_t *parent);
+
+/* Keys about an inode, built according to the configured encoding. Dentry
+ * and xattr keys end with the name, "*" making a pattern of them */
+enum kvsns_key_type {
+	KVSNS_KEY_INODE,
+	KVSNS_KEY_DENTRIES,	/* a directory's map of dentries */
+	KVSNS_KEY_DENTRY,
+	KVSNS_KEY_XATTR,
+	KVSNS_KEY_OPENOWNER,
+	KVSNS_KEY_OPENED_AND_DELETED,
+	KVSNS_KEY_ENTRIES	/* a directory's number of entries */
+};
+
+extern enum kvsns_key_encoding kvsns_key_encoding;
+
+char *kvsns_key(char *k, kvsns_ino_t *ino, enum kvsns_key_type type,
+		const char *name);
+int kvsns_name_key(kvsal_slice_t *k, kvsns_ino_t *ino,
+		   enum kvsns_key_type type, const char *name);
+char *kvsns_key_pattern(char *k, enum kvsns_key_type type);
+
+/* Names longer than NAME_MAX are refused with -ENAMETOOLONG */
+int kvsns_check_name(const char *name);
+int kvsns_parse_key(const char *k, size_t klen, kvsns_ino_t *ino,
+		    enum kvsns_key_type *type, size_t *name);
+void kvsns_ino2str(kvsns_ino_t *ino, char *v);
+int kvsns_str2ino(const char *v, kvsns_ino_t *ino);
+
+/* Dentries, stored according to the configured layout */
+extern enum kvsns_dentry_layout kvsns_dentry_layout;
+
+int kvsns_prepare_dentry_op(kvsal_op_t *op, enum kvsal_op_type type,
+			    kvsns_ino_t *parent, char *name, void *v,
+			    size_t vlen);
+int kvsns_get_dentry(kvsns_ino_t *parent, char *name, kvsns_ino_t *ino);
+int kvsns_set_dentry(kvsns_ino_t *parent, char *name, kvsns_ino_t *ino);
+int kvsns_del_dentry(kvsns_ino_t *parent, char *name);
+int kvsns_count_dentries(kvsns_ino_t *dir);
+int kvsns_fetch_dentries(kvsns_ino_t *dir, kvsal_list_t *list);
+char *kvsns_dentry_name(kvsal_slice_t *item, size_t *len);
+
+/* Namespace operations run as server side scripts, see kvsns_script.c.
+ * They return -ENOTSUP if the KVS can't run scripts, kvsns_use_scripts is
+ * then cleared and the operations are done by the client */
+extern bool kvsns_use_scripts;
+
+int kvsns_script_init(struct collection_item *cfg_items);
+int kvsns_script_create(kvsns_ino_t *parent, char *name, kvsns_ino_t *ino,
+			kvsns_inode_t *inode);
+int kvsns_script_link(kvsns_ino_t *ino, kvsns_ino_t *dino, char *dname);
+int kvsns_script_unlink(kvsns_ino_t *dir, char *name, kvsns_ino_t *ino,
+			bool *opened, bool *deleted, off_t *size);
+int kvsns_script_rename(kvsns_ino_t *sino, char *sname, kvsns_ino_t *dino,
+			char *dname, kvsns_ino_t *ino);
+
+/* Creates at most KVSNS_CREATE_BATCH of the files of kvsns_create_many,
+ * inode holding what they have in common and records being as many
+ * KVSNS_INODE_MAXLEN buffers. The items whose name exists get -EEXIST as
+ * their rc, the others are created. Returns the number of those */
+#define KVSNS_CREATE_BATCH (KVSAL_ARRAY_SIZE / 2)
+
+int kvsns_script_create_many(kvsns_ino_t *parent, kvsns_inode_t *inode,
+			     kvsns_create_item_t **items, int nb,
+			     char *records);
+
+/* Looks up at most KVSNS_WALK_NAMES names in turn from dir, as many
+ * kvsns_do_lookup would, and sets *found to the number of them found. If
+ * they all are, ino is the last one and parent its directory, otherwise both
+ * are the directory where names[*found] does not exist. Returns -ENOTSUP as
+ * well if the KVS is made of several servers */
+#define KVSNS_WALK_NAMES (KVSAL_ARRAY_SIZE - 7)
+
+int kvsns_script_walk(kvsns_cred_t *cred, kvsns_ino_t *dir, int nb,
+		      char **names, kvsns_ino_t *parent, kvsns_ino_t *ino,
+		      int *found);
+
+/* Client side cache of dentries and attributes, see kvsns_cache.c.
+ * On a miss, the get calls return the generation to be given back to the
+ * set call once the value was read from the KVS. kvsns_cache_get_dentry
+ * returns -EAGAIN on a miss and -ENOENT for a name known not to exist,
+ * kvsns_cache_get_attr returns -ENOENT on a miss */
+int kvsns_cache_init(struct collection_item *cfg_items);
+void kvsns_cache_fini(void);
+int kvsns_cache_get_dentry(kvsns_ino_t *parent, char *name, kvsns_ino_t *ino,
+			   unsigned long *gen);
+void kvsns_cache_set_dentry(kvsns_ino_t *parent, char *name, kvsns_ino_t *ino,
+			    unsigned long gen);
+void kvsns_cache_set_noent(kvsns_ino_t *parent, char *name,
+			   unsigned long gen);
+void kvsns_cache_del_dentry(kvsns_ino_t *parent, char *name);
+void kvsns_cache_del_dir(kvsns_ino_t *parent);
+int kvsns_cache_get_attr(kvsns_ino_t *ino, struct stat *bufstat,
+			 unsigned long *gen);
+void kvsns_cache_set_attr(kvsns_ino_t *ino, struct stat *bufstat,
+			  unsigned long gen);
+void kvsns_cache_del_attr(kvsns_ino_t *ino);
+void kvsns_cache_flush(void);
+void kvsns_cache_begin(void);
+void kvsns_cache_end(void);
 
 
 #endif
@@ -0,0 +1,835 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) CEA, 2016
+ * Author: Philippe Deniel  philippe.deniel@cea.fr
+ *
+ * contributeur : Philippe DENIEL   philippe.deniel@cea.fr
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+/* kvsns_script.c
+ * KVSNS: namespace operations run as server side scripts
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ini_config.h>
+#include <kvsns/kvsal.h>
+#include <kvsns/kvsns.h>
+#include "kvsns_internal.h"
+
+/* Each script checks what the operation depends on, then does all of its
+ * updates, on the server and in a single round trip. They return 0 or a
+ * negative "-errno", without having changed anything in the latter case.
+ * Inode records are changed in place, see kvsns_encode_inode for their
+ * layout. Inode numbers and times are given already encoded.
+ * A directory's entries are counted in a key of its own, if its flags say
+ * so.
+ * The dentry field is empty with the "keys" layout.
+ * -ESTALE means the dentry no longer leads to the given inode, which came
+ * from an outdated cache entry */
+#define KVSNS_STR2(x) #x
+#define KVSNS_STR(x) KVSNS_STR2(x)
+
+bool kvsns_use_scripts = true;
+
+#define KVSNS_SCRIPT_PRELUDE \
+"local EEXIST = -" KVSNS_STR(EEXIST) "\n" \
+"local ENOENT = -" KVSNS_STR(ENOENT) "\n" \
+"local EINVAL = -" KVSNS_STR(EINVAL) "\n" \
+"local EIO = -" KVSNS_STR(EIO) "\n" \
+"local EMLINK = -" KVSNS_STR(EMLINK) "\n" \
+"local ESTALE = -" KVSNS_STR(ESTALE) "\n" \
+"local MAX_PARENTS = " KVSNS_STR(KVSAL_ARRAY_SIZE) "\n" \
+"local function dentry_get(k, f)\n" \
+"  if f == '' then return redis.call('GET', k) end\n" \
+"  return redis.call('HGET', k, f)\n" \
+"end\n" \
+"local function dentry_set(k, f, v)\n" \
+"  if f == '' then redis.call('SET', k, v)\n" \
+"  else redis.call('HSET', k, f, v) end\n" \
+"end\n" \
+"local function dentry_del(k, f)\n" \
+"  if f == '' then redis.call('DEL', k)\n" \
+"  else redis.call('HDEL', k, f) end\n" \
+"end\n" \
+"local function get_inode(k)\n" \
+"  local r = redis.call('GET', k)\n" \
+"  if not r then return nil, ENOENT end\n" \
+"  if #r < 80 or r:byte(1) ~= " KVSNS_STR(KVSNS_INODE_VERSION) " then\n" \
+"    return nil, EIO\n" \
+"  end\n" \
+"  return r\n" \
+"end\n" \
+"local function nb_parents(r)\n" \
+"  return (struct.unpack('<H', r, 3))\n" \
+"end\n" \
+"local function nlink(r)\n" \
+"  return (struct.unpack('<I4', r, 9))\n" \
+"end\n" \
+"local function set_nlink(r, n)\n" \
+"  return r:sub(1, 8) .. struct.pack('<I4', n) .. r:sub(13)\n" \
+"end\n" \
+"local function touch(r, now, mtime)\n" \
+"  if mtime then r = r:sub(1, 56) .. now .. r:sub(69) end\n" \
+"  return r:sub(1, 68) .. now .. r:sub(81)\n" \
+"end\n" \
+"local function add_entries(r, k, n)\n" \
+"  if bit.band(r:byte(2), " KVSNS_STR(KVSNS_INODE_ENTRIES) ") ~= 0 then\n" \
+"    redis.call('INCRBY', k, n)\n" \
+"  end\n" \
+"end\n" \
+"local function data_size(r)\n" \
+"  if math.floor(struct.unpack('<I4', r, 5) / 4096) == 4 then return 0 end\n" \
+"  return (struct.unpack('<i8', r, 29))\n" \
+"end\n" \
+"local function find_parent(r, p)\n" \
+"  for i = 0, nb_parents(r) - 1 do\n" \
+"    if r:sub(81 + 8 * i, 88 + 8 * i) == p then return 81 + 8 * i end\n" \
+"  end\n" \
+"  return nil\n" \
+"end\n" \
+"local function add_parent(r, p)\n" \
+"  local n = nb_parents(r)\n" \
+"  if n >= MAX_PARENTS then return nil end\n" \
+"  return r:sub(1, 2) .. struct.pack('<H', n + 1) ..\n" \
+"    r:sub(5, 80 + 8 * n) .. p .. r:sub(81 + 8 * n)\n" \
+"end\n" \
+"local function del_parent(r, p)\n" \
+"  local off = find_parent(r, p)\n" \
+"  if not off then return nil end\n" \
+"  return r:sub(1, 2) .. struct.pack('<H', nb_parents(r) - 1) ..\n" \
+"    r:sub(5, off - 1) .. r:sub(off + 8)\n" \
+"end\n"
+
+/* KEYS: dentry, parent, new inode, parent's entries, then the inodes'
+ * counter if on the same server
+ * ARGV: dentry field, new inode number, new inode record, time */
+static kvsal_script_t kvsns_create_script = {
+	.body = KVSNS_SCRIPT_PRELUDE
+"if dentry_get(KEYS[1], ARGV[1]) then return EEXIST end\n"
+"local p, err = get_inode(KEYS[2])\n"
+"if not p then return err end\n"
+"dentry_set(KEYS[1], ARGV[1], ARGV[2])\n"
+"redis.call('SET', KEYS[3], ARGV[3])\n"
+"redis.call('SET', KEYS[2], touch(p, ARGV[4], true))\n"
+"add_entries(p, KEYS[4], 1)\n"
+"if KEYS[5] then redis.call('INCRBY', KEYS[5], 1) end\n"
+"return 0\n"
+};
+
+/* KEYS: parent, parent's entries, then the dentry and the new inode of each
+ * item, then the inodes' counter if on the same server
+ * ARGV: time, then the dentry field, new inode number and new inode record
+ * of each item
+ * Items whose name exists are left out. Returns a mask of them, bit i for
+ * item i, which KVSNS_CREATE_BATCH items keep exact as a Lua number */
+static kvsal_script_t kvsns_create_many_script = {
+	.body = KVSNS_SCRIPT_PRELUDE
+"local p, err = get_inode(KEYS[1])\n"
+"if not p then return err end\n"
+"local exist = 0\n"
+"local n = 0\n"
+"local nb = (#ARGV - 1) / 3\n"
+"for i = 0, nb - 1 do\n"
+"  local k = KEYS[3 + 2 * i]\n"
+"  local f = ARGV[2 + 3 * i]\n"
+"  if dentry_get(k, f) then\n"
+"    exist = exist + 2 ^ i\n"
+"  else\n"
+"    dentry_set(k, f, ARGV[3 + 3 * i])\n"
+"    redis.call('SET', KEYS[4 + 2 * i], ARGV[4 + 3 * i])\n"
+"    n = n + 1\n"
+"  end\n"
+"end\n"
+"if n > 0 then\n"
+"  redis.call('SET', KEYS[1], touch(p, ARGV[1], true))\n"
+"  add_entries(p, KEYS[2], n)\n"
+"  if KEYS[3 + 2 * nb] then\n"
+"    redis.call('INCRBY', KEYS[3 + 2 * nb], n)\n"
+"  end\n"
+"end\n"
+"return exist\n"
+};
+
+/* KEYS: dentry, directory, inode, directory's entries
+ * ARGV: dentry field, inode number, encoded directory, time */
+static kvsal_script_t kvsns_link_script = {
+	.body = KVSNS_SCRIPT_PRELUDE
+"if dentry_get(KEYS[1], ARGV[1]) then return EEXIST end\n"
+"local d, err = get_inode(KEYS[2])\n"
+"if not d then return err end\n"
+"local i, err = get_inode(KEYS[3])\n"
+"if not i then return err end\n"
+"i = add_parent(i, ARGV[3])\n"
+"if not i then return EMLINK end\n"
+"i = touch(set_nlink(i, nlink(i) + 1), ARGV[4], false)\n"
+"dentry_set(KEYS[1], ARGV[1], ARGV[2])\n"
+"redis.call('SET', KEYS[3], i)\n"
+"redis.call('SET', KEYS[2], touch(d, ARGV[4], true))\n"
+"add_entries(d, KEYS[4], 1)\n"
+"return 0\n"
+};
+
+/* KEYS: dentry, directory, inode, open owners, opened_and_deleted flag,
+ * directory's entries, inode's entries, then the inodes' and bytes'
+ * counters if on the same server
+ * ARGV: dentry field, inode number, encoded directory, time
+ * Returns 1 if the inode was deleted, plus 2 if it is opened, plus 4 times
+ * the size of its data if it was deleted */
+static kvsal_script_t kvsns_unlink_script = {
+	.body = KVSNS_SCRIPT_PRELUDE
+"local v = dentry_get(KEYS[1], ARGV[1])\n"
+"if not v then return ENOENT end\n"
+"if v ~= ARGV[2] then return ESTALE end\n"
+"local d, err = get_inode(KEYS[2])\n"
+"if not d then return err end\n"
+"local i, err = get_inode(KEYS[3])\n"
+"if not i then return err end\n"
+"local ret = 0\n"
+"if redis.call('EXISTS', KEYS[4]) == 1 then ret = 2 end\n"
+"if nb_parents(i) == 1 then\n"
+"  redis.call('DEL', KEYS[3], KEYS[7])\n"
+"  if ret == 2 then redis.call('SET', KEYS[5], '1') end\n"
+"  ret = ret + 1 + 4 * data_size(i)\n"
+"  if KEYS[8] then\n"
+"    redis.call('INCRBY', KEYS[8], -1)\n"
+"    if data_size(i) ~= 0 then\n"
+"      redis.call('INCRBY', KEYS[9], -data_size(i))\n"
+"    end\n"
+"  end\n"
+"else\n"
+"  i = del_parent(i, ARGV[3])\n"
+"  if not i then return ENOENT end\n"
+"  if nlink(i) == 1 then return EINVAL end\n"
+"  i = touch(set_nlink(i, nlink(i) - 1), ARGV[4], false)\n"
+"  redis.call('SET', KEYS[3], i)\n"
+"end\n"
+"dentry_del(KEYS[1], ARGV[1])\n"
+"redis.call('SET', KEYS[2], touch(d, ARGV[4], true))\n"
+"add_entries(d, KEYS[6], -1)\n"
+"return ret\n"
+};
+
+/* KEYS: source dentry, destination dentry, source directory, destination
+ * directory, inode, source directory's entries, destination directory's
+ * entries
+ * ARGV: source dentry field, destination dentry field, inode number,
+ * encoded source directory, encoded destination directory, time, new name
+ * to be set in the inode (empty if not kept in the record) */
+static kvsal_script_t kvsns_rename_script = {
+	.body = KVSNS_SCRIPT_PRELUDE
+"if dentry_get(KEYS[2], ARGV[2]) then return EEXIST end\n"
+"local v = dentry_get(KEYS[1], ARGV[1])\n"
+"if not v then return ENOENT end\n"
+"if v ~= ARGV[3] then return ESTALE end\n"
+"local s, err = get_inode(KEYS[3])\n"
+"if not s then return err end\n"
+"local d = nil\n"
+"if KEYS[4] ~= KEYS[3] then\n"
+"  d, err = get_inode(KEYS[4])\n"
+"  if not d then return err end\n"
+"end\n"
+"local i, err = get_inode(KEYS[5])\n"
+"if not i then return err end\n"
+"local off = find_parent(i, ARGV[4])\n"
+"if off then i = i:sub(1, off - 1) .. ARGV[5] .. i:sub(off + 8) end\n"
+"if ARGV[7] ~= '' then\n"
+"  off = 81 + 8 * nb_parents(i)\n"
+"  local len = struct.unpack('<H', i, off)\n"
+"  i = i:sub(1, off - 1) .. struct.pack('<H', #ARGV[7]) .. ARGV[7] ..\n"
+"    i:sub(off + 2 + len)\n"
+"end\n"
+"dentry_del(KEYS[1], ARGV[1])\n"
+"dentry_set(KEYS[2], ARGV[2], ARGV[3])\n"
+"redis.call('SET', KEYS[5], i)\n"
+"if d then\n"
+"  redis.call('SET', KEYS[3], touch(s, ARGV[6], true))\n"
+"  redis.call('SET', KEYS[4], touch(d, ARGV[6], true))\n"
+"  add_entries(s, KEYS[6], -1)\n"
+"  add_entries(d, KEYS[7], 1)\n"
+"else\n"
+"  redis.call('SET', KEYS[3], touch(s, ARGV[6], true))\n"
+"end\n"
+"return 0\n"
+};
+
+/* KEYS: directory the walk starts from
+ * ARGV: its inode number, suffix of an inode key, suffix of a dentry key
+ * (of the dentries map with the "hash" layout), "1" with the "hash" layout,
+ * uid, gid, then the names to look up in turn
+ * Each directory must be readable, as for kvsns_access. The other keys are
+ * built as the script goes, from the dentries. Returns the number of names
+ * found, then the inode numbers of the last directory and of the last name
+ * found, or twice the directory where the next name does not exist */
+static kvsal_script_t kvsns_walk_script = {
+	.body = KVSNS_SCRIPT_PRELUDE
+"local EPERM = -" KVSNS_STR(EPERM) "\n"
+"local function may_read(r, uid, gid)\n"
+"  if uid == " KVSNS_STR(KVSNS_ROOT_UID) " then return true end\n"
+"  local mode = struct.unpack('<I4', r, 5)\n"
+"  if uid == struct.unpack('<I4', r, 13) then\n"
+"    return bit.band(mode, 256) ~= 0\n"	/* 0400 */
+"  elseif gid == struct.unpack('<I4', r, 17) then\n"
+"    return bit.band(mode, 32) ~= 0\n"	/* 0040 */
+"  end\n"
+"  return bit.band(mode, 4) ~= 0\n"
+"end\n"
+"local uid = tonumber(ARGV[5])\n"
+"local gid = tonumber(ARGV[6])\n"
+"local parent = ARGV[1]\n"
+"local dir = ARGV[1]\n"
+"local k = KEYS[1]\n"
+"for n = 7, #ARGV do\n"
+"  local r, err = get_inode(k)\n"
+"  if not r then return { err } end\n"
+"  if not may_read(r, uid, gid) then return { EPERM } end\n"
+"  local v\n"
+"  if ARGV[4] == '' then v = redis.call('GET', dir .. ARGV[3] .. ARGV[n])\n"
+"  else v = redis.call('HGET', dir .. ARGV[3], ARGV[n]) end\n"
+"  if not v then return { n - 7, dir, dir } end\n"
+"  parent = dir\n"
+"  dir = v\n"
+"  k = dir .. ARGV[2]\n"
+"end\n"
+"return { #ARGV - 6, parent, dir }\n"
+};
+
+/* Key and field of a dentry for the scripts, the key allocated in the
+ * arena */
+static int kvsns_script_dentry(kvsns_ino_t *parent, char *name, char **k,
+			       char **field)
+{
+	kvsal_slice_t sk;
+
+	if (kvsns_dentry_layout == KVSNS_DENTRY_HASH) {
+		*k = kvsal_arena_alloc(KLEN);
+		if (*k == NULL)
+			return -ENOMEM;
+
+		kvsns_key(*k, parent, KVSNS_KEY_DENTRIES, NULL);
+		*field = name;
+		return 0;
+	}
+
+	RC_WRAP(kvsns_name_key, &sk, parent, KVSNS_KEY_DENTRY, name);
+	*k = sk.p;
+	*field = "";
+
+	return 0;
+}
+
+static int kvsns_script_rc(int rc)
+{
+	if (rc == -ENOTSUP) {
+		LogWarn(KVSNS_COMPONENT_KVSNS,
+			"KVS does not run scripts, no longer using them");
+		kvsns_use_scripts = false;
+	}
+
+	/* The keys are on different servers, this one op is done without */
+	if (rc == -EXDEV)
+		rc = -ENOTSUP;
+
+	return rc;
+}
+
+static int kvsns_script_run(kvsal_script_t *script, int nb_keys,
+			    char **keys, int nb_args, char **args,
+			    size_t *argslen, long long *ret)
+{
+	return kvsns_script_rc(kvsal_run_script(script, nb_keys, keys,
+						nb_args, args, argslen, ret));
+}
+
+/* Runs a script with nb_counters counters' keys after its nb_keys keys, so
+ * that it updates them too. If they are on another server or slot, it runs
+ * without them and *counted is false: the caller then counts separately */
+static int kvsns_script_run_counted(kvsal_script_t *script, int nb_keys,
+				    int nb_counters, char **keys,
+				    int nb_args, char **args,
+				    size_t *argslen, long long *ret,
+				    bool *counted)
+{
+	int rc;
+
+	rc = kvsal_run_script(script, nb_keys + nb_counters, keys, nb_args,
+			      args, argslen, ret);
+	*counted = (rc == 0);
+	if (rc == -EXDEV)
+		rc = kvsal_run_script(script, nb_keys, keys, nb_args, args,
+				      argslen, ret);
+
+	return kvsns_script_rc(rc);
+}
+
+int kvsns_script_init(struct collection_item *cfg_items)
+{
+	struct collection_item *item = NULL;
+	kvsal_script_t *scripts[] = { &kvsns_create_script,
+				      &kvsns_create_many_script,
+				      &kvsns_link_script,
+				      &kvsns_unlink_script,
+				      &kvsns_rename_script,
+				      &kvsns_walk_script };
+	int rc;
+	int i;
+
+	RC_WRAP(get_config_item, "kvsns", "scripts", cfg_items, &item);
+	if (item != NULL)
+		kvsns_use_scripts = get_bool_config_value(item, 1, NULL);
+
+	if (!kvsns_use_scripts)
+		return 0;
+
+	/* Preload them all, so that each operation is a single EVALSHA */
+	for (i = 0; i < sizeof(scripts) / sizeof(scripts[0]) ; i++) {
+		rc = kvsal_load_script(scripts[i]);
+		if (rc == -ENOTSUP) {
+			LogWarn(KVSNS_COMPONENT_KVSNS,
+				"KVS does not run scripts, not using them");
+			kvsns_use_scripts = false;
+			return 0;
+		}
+
+		if (rc != 0)
+			return rc;
+	}
+
+	return 0;
+}
+
+int kvsns_script_create(kvsns_ino_t *parent, char *name, kvsns_ino_t *ino,
+			kvsns_inode_t *inode)
+{
+	char kparent[KLEN];
+	char kino[KLEN];
+	char kentries[KLEN];
+	char vino[VLEN];
+	char record[KVSNS_INODE_MAXLEN];
+	char now[12];
+	char *keys[5] = { NULL, kparent, kino, kentries,
+			  KVSNS_INODES_COUNTER };
+	char *args[4];
+	size_t argslen[4];
+	size_t size;
+	size_t mark;
+	long long ret;
+	bool counted;
+	int rc;
+
+	RC_WRAP(kvsns_encode_inode, inode, record, &size);
+	RC_WRAP(kvsns_encode_now, now);
+
+	mark = kvsal_arena_mark();
+	RC_WRAP_LABEL(rc, out, kvsns_script_dentry, parent, name, &keys[0],
+		      &args[0]);
+	kvsns_key(kparent, parent, KVSNS_KEY_INODE, NULL);
+	kvsns_key(kino, ino, KVSNS_KEY_INODE, NULL);
+	kvsns_key(kentries, parent, KVSNS_KEY_ENTRIES, NULL);
+	kvsns_ino2str(ino, vino);
+
+	argslen[0] = strlen(args[0]);
+	args[1] = vino;
+	argslen[1] = strlen(vino);
+	args[2] = record;
+	argslen[2] = size;
+	args[3] = now;
+	argslen[3] = sizeof(now);
+
+	rc = kvsns_script_run_counted(&kvsns_create_script, 4, 1, keys, 4,
+				      args, argslen, &ret, &counted);
+
+	kvsns_cache_del_dentry(parent, name);
+	kvsns_cache_del_attr(parent);
+
+	if (rc == 0 && ret == 0 && !counted)
+		kvsns_count_script(ino, false, 0);
+
+out:
+	kvsal_arena_release(mark);
+	return (rc != 0) ? rc : (int)ret;
+}
+
+int kvsns_script_create_many(kvsns_ino_t *parent, kvsns_inode_t *inode,
+			     kvsns_create_item_t **items, int nb,
+			     char *records)
+{
+	char keys[2 + KVSNS_CREATE_BATCH][KLEN];
+	char vinos[KVSNS_CREATE_BATCH][VLEN];
+	char now[12];
+	char *pkeys[3 + 2 * KVSNS_CREATE_BATCH];
+	char *args[1 + 3 * KVSNS_CREATE_BATCH];
+	size_t argslen[1 + 3 * KVSNS_CREATE_BATCH];
+	char *record;
+	size_t mark;
+	long long ret;
+	bool counted;
+	int created = 0;
+	int rc;
+	int i;
+
+	if (nb > KVSNS_CREATE_BATCH)
+		return -EINVAL;
+
+	RC_WRAP(kvsns_encode_now, now);
+
+	kvsns_key(keys[0], parent, KVSNS_KEY_INODE, NULL);
+	kvsns_key(keys[1], parent, KVSNS_KEY_ENTRIES, NULL);
+	pkeys[0] = keys[0];
+	pkeys[1] = keys[1];
+	args[0] = now;
+	argslen[0] = sizeof(now);
+
+	mark = kvsal_arena_mark();
+	for (i = 0; i < nb ; i++) {
+		record = &records[i*KVSNS_INODE_MAXLEN];
+		RC_WRAP_LABEL(rc, out, kvsns_create_record, inode, items[i],
+			      record, &argslen[3 + 3*i]);
+		args[3 + 3*i] = record;
+
+		RC_WRAP_LABEL(rc, out, kvsns_script_dentry, parent,
+			      items[i]->name, &pkeys[2 + 2*i], &args[1 + 3*i]);
+		argslen[1 + 3*i] = strlen(args[1 + 3*i]);
+		kvsns_key(keys[2 + i], &items[i]->ino, KVSNS_KEY_INODE, NULL);
+		pkeys[3 + 2*i] = keys[2 + i];
+		kvsns_ino2str(&items[i]->ino, vinos[i]);
+		args[2 + 3*i] = vinos[i];
+		argslen[2 + 3*i] = strlen(vinos[i]);
+	}
+
+	pkeys[2 + 2*nb] = KVSNS_INODES_COUNTER;
+
+	rc = kvsns_script_run_counted(&kvsns_create_many_script, 2 + 2*nb, 1,
+				      pkeys, 1 + 3*nb, args, argslen, &ret,
+				      &counted);
+
+	for (i = 0; i < nb ; i++)
+		kvsns_cache_del_dentry(parent, items[i]->name);
+	kvsns_cache_del_attr(parent);
+
+out:
+	kvsal_arena_release(mark);
+
+	if (rc != 0)
+		return rc;
+
+	if (ret < 0)
+		return (int)ret;
+
+	for (i = 0; i < nb ; i++) {
+		if (ret & (1LL << i))
+			items[i]->rc = -EEXIST;
+		else
+			created++;
+	}
+
+	/* As with kvsns_script_create, only the counter is off if this
+	 * fails */
+	if (created > 0 && !counted &&
+	    kvsal_add_counter(KVSNS_INODES_COUNTER, created) != 0)
+		LogWarn(KVSNS_COMPONENT_KVSNS,
+			"Can't count %d inodes in", created);
+
+	return created;
+}
+
+int kvsns_script_link(kvsns_ino_t *ino, kvsns_ino_t *dino, char *dname)
+{
+	char kdino[KLEN];
+	char kino[KLEN];
+	char kentries[KLEN];
+	char vino[VLEN];
+	char edino[8];
+	char now[12];
+	char *keys[4] = { NULL, kdino, kino, kentries };
+	char *args[4];
+	size_t argslen[4];
+	size_t mark;
+	long long ret;
+	int rc;
+
+	RC_WRAP(kvsns_encode_now, now);
+	kvsns_encode_ino(dino, edino);
+
+	mark = kvsal_arena_mark();
+	RC_WRAP_LABEL(rc, out, kvsns_script_dentry, dino, dname, &keys[0],
+		      &args[0]);
+	kvsns_key(kdino, dino, KVSNS_KEY_INODE, NULL);
+	kvsns_key(kino, ino, KVSNS_KEY_INODE, NULL);
+	kvsns_key(kentries, dino, KVSNS_KEY_ENTRIES, NULL);
+	kvsns_ino2str(ino, vino);
+
+	argslen[0] = strlen(args[0]);
+	args[1] = vino;
+	argslen[1] = strlen(vino);
+	args[2] = edino;
+	argslen[2] = sizeof(edino);
+	args[3] = now;
+	argslen[3] = sizeof(now);
+
+	rc = kvsns_script_run(&kvsns_link_script, 4, keys, 4, args, argslen,
+			      &ret);
+
+	kvsns_cache_del_dentry(dino, dname);
+	kvsns_cache_del_attr(dino);
+	kvsns_cache_del_attr(ino);
+
+out:
+	kvsal_arena_release(mark);
+	return (rc != 0) ? rc : (int)ret;
+}
+
+static int kvsns_script_unlink_ino(kvsns_ino_t *dir, char *name,
+				   kvsns_ino_t *ino, long long *ret,
+				   bool *counted)
+{
+	char kdir[KLEN];
+	char kino[KLEN];
+	char kopen[KLEN];
+	char kdeleted[KLEN];
+	char kdentries[KLEN];
+	char kientries[KLEN];
+	char vino[VLEN];
+	char edir[8];
+	char now[12];
+	char *keys[9] = { NULL, kdir, kino, kopen, kdeleted, kdentries,
+			  kientries, KVSNS_INODES_COUNTER,
+			  KVSNS_BYTES_COUNTER };
+	char *args[4];
+	size_t argslen[4];
+	size_t mark;
+	int rc;
+
+	RC_WRAP(kvsns_encode_now, now);
+	kvsns_encode_ino(dir, edir);
+
+	mark = kvsal_arena_mark();
+	RC_WRAP_LABEL(rc, out, kvsns_script_dentry, dir, name, &keys[0],
+		      &args[0]);
+	kvsns_key(kdir, dir, KVSNS_KEY_INODE, NULL);
+	kvsns_key(kino, ino, KVSNS_KEY_INODE, NULL);
+	kvsns_key(kopen, ino, KVSNS_KEY_OPENOWNER, NULL);
+	kvsns_key(kdeleted, ino, KVSNS_KEY_OPENED_AND_DELETED, NULL);
+	kvsns_key(kdentries, dir, KVSNS_KEY_ENTRIES, NULL);
+	kvsns_key(kientries, ino, KVSNS_KEY_ENTRIES, NULL);
+	kvsns_ino2str(ino, vino);
+
+	argslen[0] = strlen(args[0]);
+	args[1] = vino;
+	argslen[1] = strlen(vino);
+	args[2] = edir;
+	argslen[2] = sizeof(edir);
+	args[3] = now;
+	argslen[3] = sizeof(now);
+
+	rc = kvsns_script_run_counted(&kvsns_unlink_script, 7, 2, keys, 4,
+				      args, argslen, ret, counted);
+
+	kvsns_cache_del_dentry(dir, name);
+	kvsns_cache_del_attr(dir);
+	kvsns_cache_del_attr(ino);
+
+out:
+	kvsal_arena_release(mark);
+	return rc;
+}
+
+int kvsns_script_unlink(kvsns_ino_t *dir, char *name, kvsns_ino_t *ino,
+			bool *opened, bool *deleted, off_t *size)
+{
+	long long ret;
+	bool counted;
+
+	RC_WRAP(kvsns_script_unlink_ino, dir, name, ino, &ret, &counted);
+
+	/* ino came from an outdated cache entry, get the current one */
+	if (ret == -ESTALE) {
+		RC_WRAP(kvsns_get_dentry, dir, name, ino);
+		RC_WRAP(kvsns_script_unlink_ino, dir, name, ino, &ret,
+			&counted);
+	}
+
+	if (ret < 0)
+		return (int)ret;
+
+	*deleted = (ret & 1) ? true : false;
+	*opened = (ret & 2) ? true : false;
+	*size = ret >> 2;
+
+	if (*deleted && !counted)
+		kvsns_count_script(ino, true, *size);
+
+	return 0;
+}
+
+static int kvsns_script_rename_ino(kvsns_ino_t *sino, char *sname,
+				   kvsns_ino_t *dino, char *dname,
+				   kvsns_ino_t *ino, long long *ret)
+{
+	char ksino[KLEN];
+	char kdino[KLEN];
+	char kino[KLEN];
+	char ksentries[KLEN];
+	char kdentries[KLEN];
+	char vino[VLEN];
+	char esino[8];
+	char edino[8];
+	char now[12];
+	char *keys[7] = { NULL, NULL, ksino, kdino, kino, ksentries,
+			  kdentries };
+	char *args[7];
+	size_t argslen[7];
+	size_t mark;
+	int rc;
+
+	RC_WRAP(kvsns_encode_now, now);
+	kvsns_encode_ino(sino, esino);
+	kvsns_encode_ino(dino, edino);
+
+	mark = kvsal_arena_mark();
+	RC_WRAP_LABEL(rc, out, kvsns_script_dentry, sino, sname, &keys[0],
+		      &args[0]);
+	RC_WRAP_LABEL(rc, out, kvsns_script_dentry, dino, dname, &keys[1],
+		      &args[1]);
+	kvsns_key(ksino, sino, KVSNS_KEY_INODE, NULL);
+	kvsns_key(kdino, dino, KVSNS_KEY_INODE, NULL);
+	kvsns_key(kino, ino, KVSNS_KEY_INODE, NULL);
+	kvsns_key(ksentries, sino, KVSNS_KEY_ENTRIES, NULL);
+	kvsns_key(kdentries, dino, KVSNS_KEY_ENTRIES, NULL);
+	kvsns_ino2str(ino, vino);
+
+	argslen[0] = strlen(args[0]);
+	argslen[1] = strlen(args[1]);
+	args[2] = vino;
+	argslen[2] = strlen(vino);
+	args[3] = esino;
+	argslen[3] = sizeof(esino);
+	args[4] = edino;
+	argslen[4] = sizeof(edino);
+	args[5] = now;
+	argslen[5] = sizeof(now);
+#ifdef KVSNS_S3
+	args[6] = dname;
+#else
+	args[6] = "";
+#endif
+	argslen[6] = strlen(args[6]);
+
+	rc = kvsns_script_run(&kvsns_rename_script, 7, keys, 7, args, argslen,
+			      ret);
+
+	kvsns_cache_del_dentry(sino, sname);
+	kvsns_cache_del_dentry(dino, dname);
+	kvsns_cache_del_attr(sino);
+	kvsns_cache_del_attr(dino);
+	kvsns_cache_del_attr(ino);
+
+out:
+	kvsal_arena_release(mark);
+	return rc;
+}
+
+int kvsns_script_rename(kvsns_ino_t *sino, char *sname, kvsns_ino_t *dino,
+			char *dname, kvsns_ino_t *ino)
+{
+	long long ret;
+
+	RC_WRAP(kvsns_script_rename_ino, sino, sname, dino, dname, ino, &ret);
+
+	/* ino came from an outdated cache entry, get the current one */
+	if (ret == -ESTALE) {
+		RC_WRAP(kvsns_get_dentry, sino, sname, ino);
+		RC_WRAP(kvsns_script_rename_ino, sino, sname, dino, dname,
+			ino, &ret);
+	}
+
+	return (int)ret;
+}
+
+int kvsns_script_walk(kvsns_cred_t *cred, kvsns_ino_t *dir, int nb,
+		      char **names, kvsns_ino_t *parent, kvsns_ino_t *ino,
+		      int *found)
+{
+	char kdir[KLEN];
+	char kdentry[KLEN];
+	char vdir[VLEN];
+	char vparent[VLEN];
+	char vino[VLEN];
+	char uid[VLEN];
+	char gid[VLEN];
+	char *keys[1] = { kdir };
+	char *args[6 + KVSNS_WALK_NAMES];
+	size_t argslen[6 + KVSNS_WALK_NAMES];
+	kvsal_slice_t values[2] = { { vparent, VLEN - 1 },
+				    { vino, VLEN - 1 } };
+	int nb_values = 2;
+	long long ret;
+	size_t len;
+	int i;
+
+	if (nb > KVSNS_WALK_NAMES)
+		return -EINVAL;
+
+	/* The keys of another inode are its number followed by the same
+	 * suffixes as the directory's */
+	kvsns_ino2str(dir, vdir);
+	len = strlen(vdir);
+	kvsns_key(kdir, dir, KVSNS_KEY_INODE, NULL);
+	if (kvsns_dentry_layout == KVSNS_DENTRY_HASH)
+		kvsns_key(kdentry, dir, KVSNS_KEY_DENTRIES, NULL);
+	else
+		kvsns_key(kdentry, dir, KVSNS_KEY_DENTRY, "");
+	snprintf(uid, VLEN, "%u", cred->uid);
+	snprintf(gid, VLEN, "%u", cred->gid);
+
+	args[0] = vdir;
+	args[1] = kdir + len;
+	args[2] = kdentry + len;
+	args[3] = (kvsns_dentry_layout == KVSNS_DENTRY_HASH) ? "1" : "";
+	args[4] = uid;
+	args[5] = gid;
+	for (i = 0; i < nb ; i++)
+		args[6 + i] = names[i];
+	for (i = 0; i < 6 + nb ; i++)
+		argslen[i] = strlen(args[i]);
+
+	RC_WRAP(kvsns_script_rc,
+		kvsal_run_walk_script(&kvsns_walk_script, 1, keys, 6 + nb,
+				      args, argslen, &ret, values,
+				      &nb_values));
+	if (ret < 0)
+		return (int)ret;
+
+	if (nb_values != 2 || ret > nb)
+		return -EIO;
+
+	vparent[values[0].len] = '\0';
+	vino[values[1].len] = '\0';
+	RC_WRAP(kvsns_str2ino, vparent, parent);
+	RC_WRAP(kvsns_str2ino, vino, ino);
+	*found = (int)ret;
+
+	return 0;
+}
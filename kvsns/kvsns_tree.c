@@ -0,0 +1,897 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) CEA, 2016
+ * Author: Philippe Deniel  philippe.deniel@cea.fr
+ *
+ * contributeur : Philippe DENIEL   philippe.deniel@cea.fr
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+
+/* kvsns_tree.c
+ * KVSNS: removes and copies whole trees
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <kvsns/kvsal.h>
+#include <kvsns/kvsns.h>
+#include <kvsns/extstore.h>
+#include "kvsns_internal.h"
+
+/* Threads walking a tree, set by "tree_workers" in section [kvsns] */
+unsigned int kvsns_tree_workers = 4;
+
+/* Entries read per page of a directory. Each takes two ops of a batch, and
+ * the directory itself one more */
+#define KVSNS_TREE_BATCH ((KVSAL_ARRAY_SIZE - 1) / 2)
+
+/* Size of the buffer data is copied through */
+#define KVSNS_TREE_IOLEN (1024 * 1024)
+
+struct kvsns_tree;
+
+/* A job is a directory to walk, with its copy for kvsns_cptree, or a batch
+ * of inodes whose data is to be deleted or copied */
+struct kvsns_tree_job {
+	struct kvsns_tree_job *next;
+	int (*run)(struct kvsns_tree *tree, struct kvsns_tree_job *job);
+	int depth;
+	int nb;
+	int nb_data;	/* rmtree: src[0..nb_data-1] have data to delete */
+	size_t first;	/* rmtree: first of the directories to remove */
+	kvsns_ino_t src[KVSNS_TREE_BATCH];
+	kvsns_ino_t dst[KVSNS_TREE_BATCH];
+};
+
+/* A directory found by kvsns_rmtree, removed once all the ones below it are */
+struct kvsns_tree_dir {
+	kvsns_ino_t ino;
+	kvsns_ino_t parent;
+	int depth;
+	char name[NAME_MAX + 1];
+};
+
+/* The workers run the jobs as they are queued, the last queued first, until
+ * one fails: the jobs left are then dropped and rc tells why */
+struct kvsns_tree {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct kvsns_tree_job *jobs;
+	int pending;		/* jobs queued or running */
+	bool stop;
+	int rc;
+	kvsns_cred_t *cred;
+	pthread_t *workers;
+	unsigned int nb_workers;
+	struct kvsns_tree_dir *dirs;
+	size_t nb_dirs;
+	size_t max_dirs;
+};
+
+static void *kvsns_tree_worker(void *arg)
+{
+	struct kvsns_tree *tree = arg;
+	struct kvsns_tree_job *job;
+	bool failed;
+	int rc;
+
+	pthread_mutex_lock(&tree->lock);
+	for (;;) {
+		while (tree->jobs == NULL && !tree->stop)
+			pthread_cond_wait(&tree->cond, &tree->lock);
+		if (tree->jobs == NULL)
+			break;
+
+		job = tree->jobs;
+		tree->jobs = job->next;
+		failed = (tree->rc != 0);
+		pthread_mutex_unlock(&tree->lock);
+
+		rc = failed ? 0 : job->run(tree, job);
+		free(job);
+
+		pthread_mutex_lock(&tree->lock);
+		if (rc != 0 && tree->rc == 0)
+			tree->rc = rc;
+		if (--tree->pending == 0)
+			pthread_cond_broadcast(&tree->cond);
+	}
+	pthread_mutex_unlock(&tree->lock);
+
+	return NULL;
+}
+
+static void kvsns_tree_stop(struct kvsns_tree *tree)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&tree->lock);
+	tree->stop = true;
+	pthread_cond_broadcast(&tree->cond);
+	pthread_mutex_unlock(&tree->lock);
+
+	for (i = 0; i < tree->nb_workers ; i++)
+		pthread_join(tree->workers[i], NULL);
+
+	free(tree->workers);
+	free(tree->dirs);
+	pthread_cond_destroy(&tree->cond);
+	pthread_mutex_destroy(&tree->lock);
+}
+
+static int kvsns_tree_start(struct kvsns_tree *tree, kvsns_cred_t *cred)
+{
+	unsigned int i;
+
+	memset(tree, 0, sizeof(*tree));
+	tree->cred = cred;
+	pthread_mutex_init(&tree->lock, NULL);
+	pthread_cond_init(&tree->cond, NULL);
+
+	tree->workers = calloc(kvsns_tree_workers, sizeof(pthread_t));
+	if (tree->workers == NULL) {
+		kvsns_tree_stop(tree);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < kvsns_tree_workers ; i++) {
+		if (pthread_create(&tree->workers[i], NULL, kvsns_tree_worker,
+				   tree) != 0)
+			break;
+		tree->nb_workers++;
+	}
+
+	/* Fewer workers only make it slower */
+	if (tree->nb_workers == 0) {
+		kvsns_tree_stop(tree);
+		return -EAGAIN;
+	}
+
+	return 0;
+}
+
+/* Returns once every job queued is done, with the first error met */
+static int kvsns_tree_wait(struct kvsns_tree *tree)
+{
+	int rc;
+
+	pthread_mutex_lock(&tree->lock);
+	while (tree->pending > 0)
+		pthread_cond_wait(&tree->cond, &tree->lock);
+	rc = tree->rc;
+	pthread_mutex_unlock(&tree->lock);
+
+	return rc;
+}
+
+static struct kvsns_tree_job *kvsns_tree_job(
+	int (*run)(struct kvsns_tree *tree, struct kvsns_tree_job *job),
+	int depth)
+{
+	struct kvsns_tree_job *job;
+
+	job = calloc(1, sizeof(*job));
+	if (job == NULL)
+		return NULL;
+
+	job->run = run;
+	job->depth = depth;
+	return job;
+}
+
+static void kvsns_tree_push(struct kvsns_tree *tree,
+			    struct kvsns_tree_job *job)
+{
+	pthread_mutex_lock(&tree->lock);
+	job->next = tree->jobs;
+	tree->jobs = job;
+	tree->pending++;
+	pthread_cond_broadcast(&tree->cond);
+	pthread_mutex_unlock(&tree->lock);
+}
+
+/* Queues a job about a single directory */
+static int kvsns_tree_push_dir(struct kvsns_tree *tree,
+	int (*run)(struct kvsns_tree *tree, struct kvsns_tree_job *job),
+	int depth, kvsns_ino_t *src, kvsns_ino_t *dst)
+{
+	struct kvsns_tree_job *job;
+
+	job = kvsns_tree_job(run, depth);
+	if (job == NULL)
+		return -ENOMEM;
+
+	job->nb = 1;
+	job->src[0] = *src;
+	if (dst != NULL)
+		job->dst[0] = *dst;
+
+	kvsns_tree_push(tree, job);
+	return 0;
+}
+
+/* Copies the nb names listed in items into names, then reads their dentries
+ * in dir and the inode records they point to. An entry removed meanwhile
+ * gets -ENOENT as its rc */
+static int kvsns_tree_read_page(kvsns_ino_t *dir, kvsal_slice_t *items,
+				int nb, char (*names)[NAME_MAX + 1],
+				kvsns_ino_t *inos, kvsns_inode_t *inodes,
+				int *rcs, bool *opened)
+{
+	char keys[KVSAL_ARRAY_SIZE][KLEN];
+	char values[KVSNS_TREE_BATCH][VLEN];
+	kvsal_op_t ops[KVSAL_ARRAY_SIZE];
+	char *records;
+	char *name;
+	size_t mark;
+	size_t len;
+	int i;
+	int rc;
+
+	mark = kvsal_arena_mark();
+	records = kvsal_arena_alloc(nb * KVSNS_INODE_MAXLEN);
+	if (records == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < nb ; i++) {
+		name = kvsns_dentry_name(&items[i], &len);
+		if (len > NAME_MAX) {
+			rc = -ENAMETOOLONG;
+			goto out;
+		}
+		memcpy(names[i], name, len);
+		names[i][len] = '\0';
+		RC_WRAP_LABEL(rc, out, kvsns_prepare_dentry_op, &ops[i],
+			      KVSAL_OP_GET, dir, names[i], values[i], VLEN);
+	}
+	RC_WRAP_LABEL(rc, out, kvsal_batch, ops, nb);
+
+	for (i = 0; i < nb ; i++) {
+		rcs[i] = ops[i].rc;
+		if (rcs[i] == 0)
+			rcs[i] = kvsns_str2ino(values[i], &inos[i]);
+		else if (rcs[i] != -ENOENT) {
+			rc = rcs[i];
+			goto out;
+		}
+	}
+
+	/* Then the records, with whether the files are open if asked to */
+	for (i = 0; i < nb ; i++) {
+		kvsns_prepare_inode_op(&ops[2*i], keys[2*i], &inos[i],
+				       &records[i*KVSNS_INODE_MAXLEN]);
+		kvsns_key(keys[2*i+1], &inos[i], KVSNS_KEY_OPENOWNER, NULL);
+		kvsns_prepare_op(&ops[2*i+1], KVSAL_OP_EXISTS, keys[2*i+1],
+				 NULL, 0);
+	}
+	RC_WRAP_LABEL(rc, out, kvsal_batch, ops, 2 * nb);
+
+	for (i = 0; i < nb ; i++) {
+		if (rcs[i] != 0)
+			continue;
+
+		rcs[i] = kvsns_inode_op_rc(&ops[2*i], &inodes[i]);
+		if (rcs[i] != 0 && rcs[i] != -ENOENT) {
+			rc = rcs[i];
+			goto out;
+		}
+
+		if (ops[2*i+1].rc != 0 && ops[2*i+1].rc != -ENOENT) {
+			rc = ops[2*i+1].rc;
+			goto out;
+		}
+		if (opened != NULL)
+			opened[i] = (ops[2*i+1].rc == 0);
+	}
+	rc = 0;
+
+out:
+	kvsal_arena_release(mark);
+	return rc;
+}
+
+/* Walks the pages of directory src, run being called for each of them */
+static int kvsns_tree_walk(struct kvsns_tree *tree, kvsns_ino_t *src,
+	int (*run)(struct kvsns_tree *tree, struct kvsns_tree_job *job,
+		   kvsal_slice_t *items, int nb),
+	struct kvsns_tree_job *job)
+{
+	kvsal_slice_t items[KVSNS_TREE_BATCH];
+	kvsal_list_t list;
+	int offset = 0;
+	int size;
+	int rc;
+
+	RC_WRAP(kvsns_fetch_dentries, src, &list);
+
+	do {
+		size = KVSNS_TREE_BATCH;
+		RC_WRAP_LABEL(rc, out, kvsal_get_list_slices, &list, offset,
+			      &size, items);
+		if (size > 0)
+			RC_WRAP_LABEL(rc, out, run, tree, job, items, size);
+		offset += size;
+	} while (size > 0);
+	rc = 0;
+
+out:
+	kvsal_dispose_list(&list);
+	return rc;
+}
+
+static int kvsns_rmtree_add_dir(struct kvsns_tree *tree, kvsns_ino_t *ino,
+				kvsns_ino_t *parent, int depth, char *name)
+{
+	struct kvsns_tree_dir *dirs;
+	struct kvsns_tree_dir *dir;
+	size_t max;
+
+	pthread_mutex_lock(&tree->lock);
+	if (tree->nb_dirs == tree->max_dirs) {
+		max = MAX(2 * tree->max_dirs, KVSAL_ARRAY_SIZE);
+		dirs = realloc(tree->dirs, max * sizeof(*dirs));
+		if (dirs == NULL) {
+			pthread_mutex_unlock(&tree->lock);
+			return -ENOMEM;
+		}
+		tree->dirs = dirs;
+		tree->max_dirs = max;
+	}
+
+	dir = &tree->dirs[tree->nb_dirs++];
+	dir->ino = *ino;
+	dir->parent = *parent;
+	dir->depth = depth;
+	strncpy(dir->name, name, NAME_MAX);
+	dir->name[NAME_MAX] = '\0';
+	pthread_mutex_unlock(&tree->lock);
+
+	return 0;
+}
+
+/* Deletes the data and the xattrs of inodes already removed */
+static int kvsns_rmtree_data(struct kvsns_tree *tree,
+			     struct kvsns_tree_job *job)
+{
+	int i;
+
+	for (i = 0; i < job->nb ; i++) {
+		/* Open ones are deleted at last close */
+		if (i < job->nb_data)
+			RC_WRAP(extstore_del, &job->src[i]);
+		RC_WRAP(kvsns_remove_all_xattr, tree->cred, &job->src[i]);
+	}
+
+	return 0;
+}
+
+static int kvsns_rmtree_dir(struct kvsns_tree *tree,
+			    struct kvsns_tree_job *job);
+
+/* Removes a page of entries of directory job->src[0]. Its subdirectories
+ * get their own jobs, its other entries go in a single transaction, except
+ * for those with other links, which are unlinked one by one */
+static int kvsns_rmtree_page(struct kvsns_tree *tree,
+			     struct kvsns_tree_job *job,
+			     kvsal_slice_t *items, int nb)
+{
+	kvsns_ino_t *dir = &job->src[0];
+	char names[KVSNS_TREE_BATCH][NAME_MAX + 1];
+	kvsns_ino_t inos[KVSNS_TREE_BATCH];
+	int rcs[KVSNS_TREE_BATCH];
+	bool opened[KVSNS_TREE_BATCH];
+	bool removed[KVSNS_TREE_BATCH];
+	struct kvsns_tree_job *data = NULL;
+	kvsns_inode_t *inodes;
+	kvsns_inode_t dir_inode;
+	char k[KLEN];
+	long long bytes = 0;
+	size_t mark;
+	int nb_rm = 0;
+	int i;
+	int rc;
+
+	mark = kvsal_arena_mark();
+	inodes = kvsal_arena_alloc(nb * sizeof(kvsns_inode_t));
+	if (inodes == NULL)
+		return -ENOMEM;
+
+	RC_WRAP_LABEL(rc, out, kvsns_tree_read_page, dir, items, nb, names,
+		      inos, inodes, rcs, opened);
+
+	for (i = 0; i < nb ; i++) {
+		removed[i] = false;
+		if (rcs[i] != 0)
+			continue;
+
+		if (S_ISDIR(inodes[i].stat.st_mode)) {
+			RC_WRAP_LABEL(rc, out, kvsns_rmtree_add_dir, tree,
+				      &inos[i], dir, job->depth + 1, names[i]);
+			RC_WRAP_LABEL(rc, out, kvsns_tree_push_dir, tree,
+				      kvsns_rmtree_dir, job->depth + 1,
+				      &inos[i], NULL);
+		} else if (inodes[i].nb_parents == 1) {
+			removed[i] = true;
+			nb_rm++;
+		}
+	}
+
+	if (nb_rm == 0)
+		goto linked;
+
+	data = kvsns_tree_job(kvsns_rmtree_data, job->depth);
+	if (data == NULL) {
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	RC_WRAP_LABEL(rc, nojob, kvsns_get_inode, dir, &dir_inode);
+	RC_WRAP_LABEL(rc, nojob, kvsns_amend_stat, &dir_inode.stat,
+		      STAT_MTIME_SET|STAT_CTIME_SET);
+
+	RC_WRAP_LABEL(rc, nojob, kvsns_begin_transaction);
+
+	for (i = 0; i < nb ; i++) {
+		if (!removed[i])
+			continue;
+
+		RC_WRAP_LABEL(rc, aborted, kvsns_del_dentry, dir, names[i]);
+		RC_WRAP_LABEL(rc, aborted, kvsns_del_inode, &inos[i]);
+		bytes += inodes[i].stat.st_size;
+
+		if (opened[i]) {
+			/* Deleted at last close */
+			kvsns_key(k, &inos[i], KVSNS_KEY_OPENED_AND_DELETED,
+				  NULL);
+			RC_WRAP_LABEL(rc, aborted, kvsal_set_char, k, "1");
+		}
+	}
+
+	RC_WRAP_LABEL(rc, aborted, kvsns_set_inode, dir, &dir_inode);
+	RC_WRAP_LABEL(rc, aborted, kvsns_add_entries, dir, &dir_inode, -nb_rm);
+	RC_WRAP_LABEL(rc, aborted, kvsal_add_counter, KVSNS_INODES_COUNTER,
+		      -nb_rm);
+	if (bytes != 0)
+		RC_WRAP_LABEL(rc, aborted, kvsal_add_counter,
+			      KVSNS_BYTES_COUNTER, -bytes);
+
+	RC_WRAP_LABEL(rc, nojob, kvsns_end_transaction);
+
+	/* The data goes later, the ones to be deleted first */
+	for (i = 0; i < nb ; i++)
+		if (removed[i] && !opened[i])
+			data->src[data->nb++] = inos[i];
+	data->nb_data = data->nb;
+	for (i = 0; i < nb ; i++)
+		if (removed[i] && opened[i])
+			data->src[data->nb++] = inos[i];
+	kvsns_tree_push(tree, data);
+
+linked:
+	/* Links of the same file may be anywhere, kvsns_unlink handles them
+	 * as it would for any client */
+	for (i = 0; i < nb ; i++) {
+		if (rcs[i] != 0 || removed[i] ||
+		    S_ISDIR(inodes[i].stat.st_mode))
+			continue;
+
+		rc = kvsns_unlink(tree->cred, dir, names[i]);
+		if (rc != 0 && rc != -ENOENT)
+			goto out;
+	}
+	rc = 0;
+	goto out;
+
+aborted:
+	kvsns_discard_transaction();
+nojob:
+	free(data);
+out:
+	kvsal_arena_release(mark);
+	return rc;
+}
+
+static int kvsns_rmtree_dir(struct kvsns_tree *tree,
+			    struct kvsns_tree_job *job)
+{
+	RC_WRAP(kvsns_access, tree->cred, &job->src[0],
+		KVSNS_ACCESS_READ|KVSNS_ACCESS_WRITE);
+
+	return kvsns_tree_walk(tree, &job->src[0], kvsns_rmtree_page, job);
+}
+
+/* Removes job->nb directories, emptied by now, from their common parent in
+ * a single transaction. Other jobs may be removing other directories from
+ * the same parent meanwhile, its number of entries is only added to */
+static int kvsns_rmtree_rmdirs(struct kvsns_tree *tree,
+			       struct kvsns_tree_job *job)
+{
+	struct kvsns_tree_dir *dirs = &tree->dirs[job->first];
+	kvsns_ino_t *parent = &dirs[0].parent;
+	char keys[2 * KVSNS_TREE_BATCH + 1][KLEN];
+	char entries[KVSNS_TREE_BATCH][VLEN];
+	kvsal_op_t ops[2 * KVSNS_TREE_BATCH + 1];
+	kvsns_inode_t parent_inode;
+	kvsns_inode_t *inodes;
+	char *records;
+	size_t mark;
+	int i;
+	int rc;
+
+	mark = kvsal_arena_mark();
+	records = kvsal_arena_alloc((job->nb + 1) * KVSNS_INODE_MAXLEN);
+	inodes = kvsal_arena_alloc(job->nb * sizeof(kvsns_inode_t));
+	if (records == NULL || inodes == NULL) {
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	/* The directories with their number of entries, and the parent */
+	kvsns_prepare_inode_op(&ops[0], keys[0], parent, records);
+	for (i = 0; i < job->nb ; i++) {
+		kvsns_prepare_inode_op(&ops[2*i+1], keys[2*i+1], &dirs[i].ino,
+				       &records[(i+1)*KVSNS_INODE_MAXLEN]);
+		kvsns_prepare_entries_op(&ops[2*i+2], keys[2*i+2],
+					 &dirs[i].ino, entries[i]);
+	}
+	RC_WRAP_LABEL(rc, out, kvsal_batch, ops, 2 * job->nb + 1);
+
+	RC_WRAP_LABEL(rc, out, kvsns_inode_op_rc, &ops[0], &parent_inode);
+
+	/* Something may have been created in them meanwhile */
+	for (i = 0; i < job->nb ; i++) {
+		RC_WRAP_LABEL(rc, out, kvsns_inode_op_rc, &ops[2*i+1],
+			      &inodes[i]);
+		RC_WRAP_LABEL(rc, out, kvsns_entries_op_rc, &ops[2*i+2],
+			      &inodes[i]);
+		if (inodes[i].flags & KVSNS_INODE_ENTRIES)
+			rc = (inodes[i].stat.st_size != 0) ? -ENOTEMPTY : 0;
+		else
+			rc = kvsns_count_dentries(&dirs[i].ino);
+		if (rc > 0)
+			rc = -ENOTEMPTY;
+		if (rc != 0)
+			goto out;
+	}
+
+	RC_WRAP_LABEL(rc, out, kvsns_amend_stat, &parent_inode.stat,
+		      STAT_CTIME_SET|STAT_MTIME_SET);
+
+	RC_WRAP_LABEL(rc, out, kvsns_begin_transaction);
+
+	for (i = 0; i < job->nb ; i++) {
+		RC_WRAP_LABEL(rc, aborted, kvsns_del_dentry, parent,
+			      dirs[i].name);
+		RC_WRAP_LABEL(rc, aborted, kvsns_del_inode, &dirs[i].ino);
+		RC_WRAP_LABEL(rc, aborted, kvsns_del_entries, &dirs[i].ino,
+			      &inodes[i]);
+	}
+	RC_WRAP_LABEL(rc, aborted, kvsns_set_inode, parent, &parent_inode);
+	RC_WRAP_LABEL(rc, aborted, kvsns_add_entries, parent, &parent_inode,
+		      -job->nb);
+	RC_WRAP_LABEL(rc, aborted, kvsal_add_counter, KVSNS_INODES_COUNTER,
+		      -job->nb);
+
+	RC_WRAP_LABEL(rc, out, kvsns_end_transaction);
+
+	for (i = 0; i < job->nb ; i++)
+		RC_WRAP_LABEL(rc, out, kvsns_remove_all_xattr, tree->cred,
+			      &dirs[i].ino);
+	goto out;
+
+aborted:
+	kvsns_discard_transaction();
+out:
+	kvsal_arena_release(mark);
+	return rc;
+}
+
+/* Deepest first, then by parent */
+static int kvsns_rmtree_cmp(const void *a, const void *b)
+{
+	const struct kvsns_tree_dir *da = a;
+	const struct kvsns_tree_dir *db = b;
+
+	if (da->depth != db->depth)
+		return db->depth - da->depth;
+
+	return (da->parent < db->parent) ? -1 : (da->parent > db->parent);
+}
+
+/* Removes the directories found, a level of the tree after the other, those
+ * of a level with the same parent being removed together */
+static int kvsns_rmtree_dirs(struct kvsns_tree *tree)
+{
+	struct kvsns_tree_dir *dirs = tree->dirs;
+	struct kvsns_tree_job *job;
+	size_t i;
+	size_t n;
+
+	qsort(dirs, tree->nb_dirs, sizeof(*dirs), kvsns_rmtree_cmp);
+
+	for (i = 0; i < tree->nb_dirs ; i += n) {
+		/* The level below is gone */
+		if (i > 0 && dirs[i].depth != dirs[i-1].depth)
+			RC_WRAP(kvsns_tree_wait, tree);
+
+		for (n = 1; i + n < tree->nb_dirs && n < KVSNS_TREE_BATCH &&
+		     dirs[i+n].depth == dirs[i].depth &&
+		     dirs[i+n].parent == dirs[i].parent; n++)
+			;
+
+		job = kvsns_tree_job(kvsns_rmtree_rmdirs, dirs[i].depth);
+		if (job == NULL)
+			return -ENOMEM;
+
+		job->first = i;
+		job->nb = n;
+		kvsns_tree_push(tree, job);
+	}
+
+	return kvsns_tree_wait(tree);
+}
+
+int kvsns_rmtree(kvsns_cred_t *cred, kvsns_ino_t *parent, char *name)
+{
+	struct kvsns_tree tree;
+	struct stat stat;
+	kvsns_ino_t ino;
+	int rc;
+
+	if (!cred || !parent || !name)
+		return -EINVAL;
+
+	RC_WRAP(kvsns_check_name, name);
+
+	RC_WRAP(kvsns_access, cred, parent, KVSNS_ACCESS_WRITE);
+	RC_WRAP(kvsns_do_lookup, cred, parent, name, &ino);
+	RC_WRAP(kvsns_get_stat, &ino, &stat);
+
+	if (!S_ISDIR(stat.st_mode))
+		return kvsns_unlink(cred, parent, name);
+
+	RC_WRAP(kvsns_tree_start, &tree, cred);
+
+	/* First every entry but the directories, then those */
+	RC_WRAP_LABEL(rc, out, kvsns_rmtree_add_dir, &tree, &ino, parent, 0,
+		      name);
+	RC_WRAP_LABEL(rc, out, kvsns_tree_push_dir, &tree, kvsns_rmtree_dir, 0,
+		      &ino, NULL);
+	RC_WRAP_LABEL(rc, out, kvsns_tree_wait, &tree);
+	rc = kvsns_rmtree_dirs(&tree);
+
+out:
+	kvsns_tree_wait(&tree);
+	kvsns_tree_stop(&tree);
+	return rc;
+}
+
+/* Copies the data of file src into file dst, then its attributes into
+ * dst's inode record */
+static int kvsns_cptree_data(kvsns_ino_t *src, kvsns_ino_t *dst)
+{
+	struct stat stat;
+	ssize_t rsize;
+	ssize_t wsize;
+	off_t off = 0;
+	bool stable;
+	bool eof = false;
+	char *buf;
+	size_t mark;
+	int rc = 0;
+
+	mark = kvsal_arena_mark();
+	buf = kvsal_arena_alloc(KVSNS_TREE_IOLEN);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	while (!eof) {
+		rsize = extstore_read(src, off, KVSNS_TREE_IOLEN, buf, &eof,
+				      &stat);
+		if (rsize == -ENOENT || rsize == 0)
+			break;
+		if (rsize < 0) {
+			rc = rsize;
+			goto out;
+		}
+
+		wsize = extstore_write(dst, off, rsize, buf, &stable, &stat);
+		if (wsize < 0) {
+			rc = wsize;
+			goto out;
+		}
+
+		off += rsize;
+		if (rsize < KVSNS_TREE_IOLEN)
+			break;
+	}
+
+	rc = kvsns_set_data_attrs(dst, true);
+
+out:
+	kvsal_arena_release(mark);
+	return rc;
+}
+
+static int kvsns_cptree_files(struct kvsns_tree *tree,
+			      struct kvsns_tree_job *job)
+{
+	int i;
+
+	for (i = 0; i < job->nb ; i++)
+		RC_WRAP(kvsns_cptree_data, &job->src[i], &job->dst[i]);
+
+	return 0;
+}
+
+static int kvsns_cptree_dir(struct kvsns_tree *tree,
+			    struct kvsns_tree_job *job);
+
+/* Copies a page of entries of directory job->src[0] into job->dst[0]. The
+ * files are created together, their data then copied by another job */
+static int kvsns_cptree_page(struct kvsns_tree *tree,
+			     struct kvsns_tree_job *job,
+			     kvsal_slice_t *items, int nb)
+{
+	char names[KVSNS_TREE_BATCH][NAME_MAX + 1];
+	kvsns_ino_t inos[KVSNS_TREE_BATCH];
+	int rcs[KVSNS_TREE_BATCH];
+	kvsns_create_item_t files[KVSNS_TREE_BATCH];
+	kvsns_ino_t srcs[KVSNS_TREE_BATCH];
+	struct kvsns_tree_job *data;
+	kvsns_inode_t *inodes;
+	kvsns_ino_t ino;
+	size_t mark;
+	int nb_files = 0;
+	int i;
+	int rc;
+
+	mark = kvsal_arena_mark();
+	inodes = kvsal_arena_alloc(nb * sizeof(kvsns_inode_t));
+	if (inodes == NULL)
+		return -ENOMEM;
+
+	RC_WRAP_LABEL(rc, out, kvsns_tree_read_page, &job->src[0], items, nb,
+		      names, inos, inodes, rcs, NULL);
+
+	for (i = 0; i < nb ; i++) {
+		if (rcs[i] != 0)
+			continue;
+
+		if (S_ISDIR(inodes[i].stat.st_mode)) {
+			RC_WRAP_LABEL(rc, out, kvsns_mkdir, tree->cred,
+				      &job->dst[0], names[i],
+				      inodes[i].stat.st_mode & 07777, &ino);
+			RC_WRAP_LABEL(rc, out, kvsns_tree_push_dir, tree,
+				      kvsns_cptree_dir, job->depth + 1,
+				      &inos[i], &ino);
+		} else if (S_ISLNK(inodes[i].stat.st_mode)) {
+			RC_WRAP_LABEL(rc, out, kvsns_symlink, tree->cred,
+				      &job->dst[0], names[i], inodes[i].link,
+				      &ino);
+		} else {
+			files[nb_files].name = names[i];
+			files[nb_files].mode = inodes[i].stat.st_mode & 07777;
+			srcs[nb_files++] = inos[i];
+		}
+	}
+
+	if (nb_files == 0) {
+		rc = 0;
+		goto out;
+	}
+
+	RC_WRAP_LABEL(rc, out, kvsns_create_many, tree->cred, &job->dst[0],
+		      files, nb_files);
+
+	data = kvsns_tree_job(kvsns_cptree_files, job->depth);
+	if (data == NULL) {
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nb_files ; i++) {
+		if (files[i].rc != 0) {
+			rc = files[i].rc;
+			free(data);
+			goto out;
+		}
+		data->src[data->nb] = srcs[i];
+		data->dst[data->nb++] = files[i].ino;
+	}
+	kvsns_tree_push(tree, data);
+	rc = 0;
+
+out:
+	kvsal_arena_release(mark);
+	return rc;
+}
+
+static int kvsns_cptree_dir(struct kvsns_tree *tree,
+			    struct kvsns_tree_job *job)
+{
+	RC_WRAP(kvsns_access, tree->cred, &job->src[0], KVSNS_ACCESS_READ);
+
+	return kvsns_tree_walk(tree, &job->src[0], kvsns_cptree_page, job);
+}
+
+/* Returns -EINVAL if dir is ino or below it */
+static int kvsns_cptree_check(kvsns_ino_t *ino, kvsns_ino_t *dir)
+{
+	kvsns_inode_t inode;
+	kvsns_ino_t cur = *dir;
+
+	for (;;) {
+		if (cur == *ino)
+			return -EINVAL;
+		if (cur == KVSNS_ROOT_INODE)
+			return 0;
+
+		RC_WRAP(kvsns_get_inode, &cur, &inode);
+		cur = inode.parents[0];
+	}
+}
+
+int kvsns_cptree(kvsns_cred_t *cred, kvsns_ino_t *sparent, char *sname,
+		 kvsns_ino_t *dparent, char *dname)
+{
+	struct kvsns_tree tree;
+	kvsns_inode_t inode;
+	kvsns_ino_t ino;
+	kvsns_ino_t new;
+	mode_t mode;
+	int rc;
+
+	if (!cred || !sparent || !sname || !dparent || !dname)
+		return -EINVAL;
+
+	RC_WRAP(kvsns_check_name, sname);
+	RC_WRAP(kvsns_check_name, dname);
+
+	RC_WRAP(kvsns_do_lookup, cred, sparent, sname, &ino);
+	RC_WRAP(kvsns_get_inode, &ino, &inode);
+	mode = inode.stat.st_mode & 07777;
+
+	if (S_ISLNK(inode.stat.st_mode))
+		return kvsns_symlink(cred, dparent, dname, inode.link, &new);
+
+	if (!S_ISDIR(inode.stat.st_mode)) {
+		RC_WRAP(kvsns_creat, cred, dparent, dname, mode, &new);
+		return kvsns_cptree_data(&ino, &new);
+	}
+
+	RC_WRAP(kvsns_access, cred, &ino, KVSNS_ACCESS_READ);
+	RC_WRAP(kvsns_cptree_check, &ino, dparent);
+	RC_WRAP(kvsns_mkdir, cred, dparent, dname, mode, &new);
+
+	RC_WRAP(kvsns_tree_start, &tree, cred);
+	rc = kvsns_tree_push_dir(&tree, kvsns_cptree_dir, 0, &ino, &new);
+	if (rc == 0)
+		rc = kvsns_tree_wait(&tree);
+	kvsns_tree_stop(&tree);
+
+	return rc;
+}
@@ -43,33 +43,68 @@ int kvsns_setxattr(kvsns_cred_t *cred, kvsns_ino_t *ino,
 		   char *name, char *value, size_t size, int flags)
 {
 	int rc;
-	char k[KLEN];
+	char c;
+	kvsal_slice_t k;
+	kvsal_slice_t v;
+	size_t mark;
 
 	if (!cred || !ino || !name || !value)
 		return -EINVAL;
 
-	snprintf(k, KLEN, "%llu.xattr.%s", *ino, name);
+	RC_WRAP(kvsns_check_name, name);
+
+	mark = kvsal_arena_mark();
+	RC_WRAP_LABEL(rc, out, kvsns_name_key, &k, ino, KVSNS_KEY_XATTR,
+		      name);
+
+	/* Read into an empty buffer, only to know if it exists */
 	if (flags == XATTR_CREATE) {
-		rc = kvsal_get_char(k, value);
-		if (rc == 0)
-			return -EEXIST;
+		v.p = &c;
+		v.len = 0;
+		rc = kvsal_get_slice(&k, &v);
+		if (rc == 0 || rc == -ENOBUFS) {
+			rc = -EEXIST;
+			goto out;
+		}
+		if (rc != -ENOENT)
+			goto out;
 	}
 
-	return kvsal_set_binary(k, (char *)value, size);
+	v.p = value;
+	v.len = size;
+	rc = kvsal_set_slice(&k, &v);
+
+out:
+	kvsal_arena_release(mark);
+	return rc;
 }
 
 int kvsns_getxattr(kvsns_cred_t *cred, kvsns_ino_t *ino,
 		   char *name, char *value, size_t *size)
 {
-	char k[KLEN];
+	int rc;
+	kvsal_slice_t k;
+	kvsal_slice_t v;
+	size_t mark;
 
-	if (!cred || !ino || !name || !value)
+	if (!cred || !ino || !name || !value || !size)
 		return -EINVAL;
 
-	snprintf(k, KLEN, "%llu.xattr.%s", *ino, name);
-	RC_WRAP(kvsal_get_binary, k, value, size);
+	RC_WRAP(kvsns_check_name, name);
 
-	return 0;
+	mark = kvsal_arena_mark();
+	RC_WRAP_LABEL(rc, out, kvsns_name_key, &k, ino, KVSNS_KEY_XATTR,
+		      name);
+
+	v.p = value;
+	v.len = *size;
+	rc = kvsal_get_slice(&k, &v);
+	if (rc == 0)
+		*size = v.len;
+
+out:
+	kvsal_arena_release(mark);
+	return rc;
 }
 
 int kvsns_listxattr(kvsns_cred_t *cred, kvsns_ino_t *ino, int offset,
@@ -77,81 +112,105 @@ int kvsns_listxattr(kvsns_cred_t *cred, kvsns_ino_t *ino, int offset,
 {
 	int rc;
 	char pattern[KLEN];
-	kvsal_item_t *items;
+	kvsal_slice_t *items;
+	enum kvsns_key_type type;
+	kvsns_ino_t owner;
+	size_t name;
+	size_t mark;
+	size_t len;
 	int i;
 	kvsal_list_t l;
 
 	if (!cred || !ino || !list || !size)
 		return -EINVAL;
 
-	snprintf(pattern, KLEN, "%llu.xattr.*", *ino);
-	items = (kvsal_item_t *)malloc(*size*sizeof(kvsal_item_t));
+	kvsns_key(pattern, ino, KVSNS_KEY_XATTR, "*");
+	mark = kvsal_arena_mark();
+	items = kvsal_arena_alloc(*size*sizeof(kvsal_slice_t));
 	if (items == NULL)
 		return -ENOMEM;
 
-	rc = kvsal_fetch_list(pattern, &l);
 	RC_WRAP_LABEL(rc, errout, kvsal_fetch_list, pattern, &l);
 
-	RC_WRAP_LABEL(rc, errout,  kvsal_get_list, &l, offset, size, items);
-
-	RC_WRAP_LABEL(rc, errout, kvsal_dispose_list, &l);
+	/* The slices are only valid until the list is disposed */
+	rc = kvsal_get_list_slices(&l, offset, size, items);
+	for (i = 0; rc == 0 && i < *size ; i++) {
+		if (kvsns_parse_key(items[i].p, items[i].len, &owner, &type,
+				    &name) != 0 || type != KVSNS_KEY_XATTR)
+			name = 0;
 
-	for (i = 0; i < *size ; i++)
-		strncpy(list[i].name, items[i].str, MAXNAMLEN);
+		len = MIN(items[i].len - name, NAME_MAX);
+		memcpy(list[i].name, items[i].p + name, len);
+		list[i].name[len] = '\0';
+	}
+	kvsal_dispose_list(&l);
+	if (rc != 0)
+		goto errout;
 
-	free(items);
+	kvsal_arena_release(mark);
 
 	return 0;
 
 errout:
-	if (items)
-		free(items);
+	kvsal_arena_release(mark);
 
 	return rc;
 }
 
 int kvsns_removexattr(kvsns_cred_t *cred, kvsns_ino_t *ino, char *name)
 {
-	char k[KLEN];
+	int rc;
+	kvsal_slice_t k;
+	size_t mark;
 
-	snprintf(k, KLEN, "%llu.xattr.%s", *ino, name);
-	RC_WRAP(kvsal_del, k);
+	if (!cred || !ino || !name)
+		return -EINVAL;
 
-	return 0;
+	RC_WRAP(kvsns_check_name, name);
+
+	mark = kvsal_arena_mark();
+	rc = kvsns_name_key(&k, ino, KVSNS_KEY_XATTR, name);
+	if (rc == 0)
+		rc = kvsal_del_slice(&k);
+	kvsal_arena_release(mark);
+
+	return rc;
 }
 
 int kvsns_remove_all_xattr(kvsns_cred_t *cred, kvsns_ino_t *ino)
 {
 	int rc;
 	char pattern[KLEN];
-	kvsal_item_t items[KVSAL_ARRAY_SIZE];
+	kvsal_slice_t items[KVSAL_ARRAY_SIZE];
 	int i;
 	int size;
+	int offset = 0;
 	kvsal_list_t list;
 
 	if (!cred || !ino)
 		return -EINVAL;
 
-	snprintf(pattern, KLEN, "%llu.xattr.*", *ino);
+	kvsns_key(pattern, ino, KVSNS_KEY_XATTR, "*");
 
 	rc = kvsal_fetch_list(pattern, &list);
 	if (rc < 0)
 		return rc;
 
+	/* Keys as long as their names, whole in the slices */
 	do {
 		size = KVSAL_ARRAY_SIZE;
-		rc = kvsal_get_list(&list, 0, &size, items);
-		if (rc < 0)
-			return rc;
+		RC_WRAP_LABEL(rc, errout, kvsal_get_list_slices, &list,
+			      offset, &size, items);
 
 		for (i = 0; i < size ; i++)
-			RC_WRAP(kvsal_del, items[i].str);
+			RC_WRAP_LABEL(rc, errout, kvsal_del_slice, &items[i]);
 
+		offset += size;
 	} while (size > 0);
 
-	rc = kvsal_dispose_list(&list);
-	if (rc < 0)
-		return rc;
+	rc = 0;
 
-	return 0;
+errout:
+	kvsal_dispose_list(&list);
+	return rc;
 }
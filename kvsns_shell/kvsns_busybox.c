@@ -562,6 +562,50 @@ int main(int argc, char *argv[])
 		else
 			fprintf(stderr, "Can't unlink %llu/%s rc=%d\n",
 				current_inode, argv[1], rc);
+	} else if (!strcmp(exec_name, "ns_rmtree")) {
+		if (argc != 2) {
+			fprintf(stderr, "rmtree <name>\n");
+			exit(1);
+		}
+
+		rc = kvsns_rmtree(&cred, &current_inode, argv[1]);
+		if (rc == 0)
+			printf("Rmtree %llu/%s OK\n", current_inode, argv[1]);
+		else
+			fprintf(stderr, "Can't rmtree %llu/%s rc=%d\n",
+				current_inode, argv[1], rc);
+	} else if (!strcmp(exec_name, "ns_cptree")) {
+		kvsns_ino_t dino = 0LL;
+		char *dname;
+
+		if (argc != 3 && argc != 4) {
+			printf("ns_cptree srcname newname (same dir)\n");
+			printf("ns_cptree srcname dstdir newname\n");
+			exit(1);
+		}
+
+		if (argc == 3) {
+			dino = current_inode;
+			dname = argv[2];
+		} else {
+			rc = kvsns_lookup(&cred, &current_inode,
+					  argv[2], &dino);
+			if (rc != 0) {
+				fprintf(stderr, "%s/%s does not exist\n",
+					current_path, argv[2]);
+				exit(1);
+			}
+			dname = argv[3];
+		}
+
+		rc = kvsns_cptree(&cred, &current_inode, argv[1], &dino,
+				  dname);
+		if (rc == 0)
+			printf("Cptree %llu/%s --> %llu/%s OK\n",
+			       current_inode, argv[1], dino, dname);
+		else
+			fprintf(stderr, "Can't cptree %llu/%s rc=%d\n",
+				current_inode, argv[1], rc);
 	} else if (!strcmp(exec_name, "ns_rename")) {
 		kvsns_ino_t sino = 0LL;
 		kvsns_ino_t dino = 0LL;
@@ -0,0 +1,120 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) CEA, 2016
+ * Author: Philippe Deniel  philippe.deniel@cea.fr
+ *
+ * contributeur : Philippe DENIEL   philippe.deniel@cea.fr
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+/* kvsns_migrate.c
+ * KVSNS: converts the namespace's dentries to another layout, or the
+ * inodes from the former multi-key format to the single record one, or
+ * counts the entries, inodes and bytes of a namespace created without
+ * counters
+ */
+
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <kvsns/kvsal.h>
+#include <kvsns/kvsns.h>
+
+int main(int argc, char *argv[])
+{
+	enum kvsns_dentry_layout layout;
+	int rc;
+
+	if (argc != 2) {
+		fprintf(stderr, "%s keys|hash|inodes|counters\n", argv[0]);
+		exit(1);
+	}
+
+	if (!strcmp(argv[1], "inodes")) {
+		rc = kvsns_start(KVSNS_DEFAULT_CONFIG);
+		if (rc != 0) {
+			fprintf(stderr, "kvsns_start: err=%d\n", rc);
+			exit(1);
+		}
+
+		rc = kvsns_migrate_inodes();
+		if (rc != 0) {
+			fprintf(stderr, "kvsns_migrate_inodes: err=%d\n", rc);
+			exit(1);
+		}
+
+		printf("Inodes are now stored as single records\n");
+		return kvsns_stop() ? 1 : 0;
+	}
+
+	if (!strcmp(argv[1], "counters")) {
+		rc = kvsns_start(KVSNS_DEFAULT_CONFIG);
+		if (rc != 0) {
+			fprintf(stderr, "kvsns_start: err=%d\n", rc);
+			exit(1);
+		}
+
+		rc = kvsns_migrate_counters();
+		if (rc != 0) {
+			fprintf(stderr, "kvsns_migrate_counters: err=%d\n", rc);
+			exit(1);
+		}
+
+		printf("Directories and namespace are now counted\n");
+		return kvsns_stop() ? 1 : 0;
+	}
+
+	if (!strcmp(argv[1], "keys"))
+		layout = KVSNS_DENTRY_KEYS;
+	else if (!strcmp(argv[1], "hash"))
+		layout = KVSNS_DENTRY_HASH;
+	else {
+		fprintf(stderr, "%s keys|hash|inodes|counters\n", argv[0]);
+		exit(1);
+	}
+
+	rc = kvsns_start(KVSNS_DEFAULT_CONFIG);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_start: err=%d\n", rc);
+		exit(1);
+	}
+
+	rc = kvsns_migrate_dentries(layout);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_migrate_dentries: err=%d\n", rc);
+		exit(1);
+	}
+
+	printf("Dentries now use the \"%s\" layout. "
+	       "Set \"dentry_layout = %s\" in section [kvsns] of %s\n",
+	       argv[1], argv[1], KVSNS_DEFAULT_CONFIG);
+
+	rc = kvsns_stop();
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_stop: err=%d\n", rc);
+		exit(1);
+	}
+
+	return 0;
+}
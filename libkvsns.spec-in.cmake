@@ -29,6 +29,9 @@ Provides: %{name} = %{version}-%{release}
 @BCOND_KVS_REDIS@ kvs_redis
 %global use_kvs_redis %{on_off_switch kvs_redis}
 
+@BCOND_KVS_EMBEDDED@ kvs_embedded
+%global use_kvs_embedded %{on_off_switch kvs_embedded}
+
 @BCOND_POSIX_STORE@ posix_store
 %global use_posix_store %{on_off_switch posix_store}
 
@@ -72,6 +75,7 @@ This package contains the tools for libkvsns.
 
 %build
 cmake . -DUSE_KVS_REDIS=%{use_kvs_redis}     \
+	-DUSE_KVS_EMBEDDED=%{use_kvs_embedded} \
 	-DUSE_POSIX_STORE=%{use_posix_store} \
 	-DUSE_POSIX_OBJ=%{use_posix_obj}     \
 	-DUSE_RADOS=%{use_rados}	     \
@@ -94,6 +98,7 @@ install -m 644 kvsns/libkvsns.so %{buildroot}%{_libdir}
 install -m 644 libkvsns.pc  %{buildroot}%{_libdir}/pkgconfig
 install -m 755 kvsns_shell/kvsns_busybox %{buildroot}%{_bindir}
 install -m 755 kvsns_shell/kvsns_cp %{buildroot}%{_bindir}
+install -m 755 kvsns_shell/kvsns_migrate %{buildroot}%{_bindir}
 install -m 755 kvsns_attach/kvsns_attach %{buildroot}%{_bindir}
 install -m 644 kvsns.ini %{buildroot}%{_sysconfdir}/kvsns.d
 
@@ -118,6 +123,7 @@ rm -rf $RPM_BUILD_ROOT
 %defattr(-,root,root)
 %{_bindir}/kvsns_busybox
 %{_bindir}/kvsns_cp
+%{_bindir}/kvsns_migrate
 %{_bindir}/kvsns_attach
 
 %changelog
@@ -0,0 +1,195 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) CEA, 2016
+ * Author: Philippe Deniel  philippe.deniel@cea.fr
+ *
+ * contributeur : Philippe DENIEL   philippe.deniel@cea.fr
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+
+/* kvsns_file_test_writers.c
+ * KVSNS: size of a file written through two fds, as readdir reports it
+ */
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <kvsns/kvsal.h>
+#include <kvsns/kvsns.h>
+
+#define SIZE 1024
+
+static kvsns_cred_t cred;
+static kvsns_ino_t dir;
+
+static void write_fd(kvsns_file_open_t *fd, size_t count, off_t offset)
+{
+	char buff[SIZE];
+	ssize_t written;
+
+	memset(buff, 'a', count);
+	written = kvsns_write(&cred, fd, buff, count, offset);
+	if (written != count) {
+		fprintf(stderr, "kvsns_write: err=%lld\n",
+			(long long)written);
+		exit(1);
+	}
+}
+
+/* The size of the only file of dir, as readdir reports it */
+static void check_size(off_t expected, const char *when)
+{
+	kvsns_dir_t ddir;
+	kvsns_dentry_t dirent[2];
+	int size = 2;
+	int rc;
+
+	rc = kvsns_opendir(&cred, &dir, &ddir);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_opendir: err=%d\n", rc);
+		exit(1);
+	}
+
+	rc = kvsns_readdir(&cred, &ddir, 0, dirent, &size);
+	if (rc != 0 || size != 1) {
+		fprintf(stderr, "kvsns_readdir: rc=%d, %d entries\n", rc, size);
+		exit(1);
+	}
+
+	if (dirent[0].stats.st_size != expected) {
+		fprintf(stderr, "%s: size=%lld, %lld expected\n", when,
+			(long long)dirent[0].stats.st_size,
+			(long long)expected);
+		exit(1);
+	}
+
+	rc = kvsns_closedir(&ddir);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_closedir: err=%d\n", rc);
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int rc;
+	kvsns_ino_t parent;
+	kvsns_ino_t ino;
+	kvsns_file_open_t fd1;
+	kvsns_file_open_t fd2;
+	struct stat stat;
+
+	cred.uid = getuid();
+	cred.gid = getgid();
+
+	rc = kvsns_start(KVSNS_DEFAULT_CONFIG);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_init: err=%d\n", rc);
+		exit(1);
+	}
+
+	rc = kvsns_init_root(1);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_init_root: err=%d\n", rc);
+		exit(1);
+	}
+
+	parent = KVSNS_ROOT_INODE;
+	rc = kvsns_mkdir(&cred, &parent, "writers", 0755, &dir);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_mkdir: err=%d\n", rc);
+		exit(1);
+	}
+
+	rc = kvsns_creat(&cred, &dir, "f", 0644, &ino);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_creat: err=%d\n", rc);
+		exit(1);
+	}
+
+	rc = kvsns_open(&cred, &ino, 0, 0644, &fd1);
+	if (rc == 0)
+		rc = kvsns_open(&cred, &ino, 0, 0644, &fd2);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_open: err=%d\n", rc);
+		exit(1);
+	}
+
+	write_fd(&fd1, 10, 0);
+	write_fd(&fd2, 20, 10);
+	check_size(30, "both fds written");
+
+	/* The file is still open through fd2, which keeps writing */
+	rc = kvsns_close(&fd1);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_close: err=%d\n", rc);
+		exit(1);
+	}
+	check_size(30, "first close");
+
+	write_fd(&fd2, 30, 30);
+	check_size(60, "write after the first close");
+
+	/* The record gets the data's size back with the last close */
+	rc = kvsns_close(&fd2);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_close: err=%d\n", rc);
+		exit(1);
+	}
+	check_size(60, "last close");
+
+	/* A truncate sets it too, while fd1 is open and was written: its
+	 * next writes must still be seen */
+	rc = kvsns_open(&cred, &ino, 0, 0644, &fd1);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_open: err=%d\n", rc);
+		exit(1);
+	}
+	write_fd(&fd1, 10, 60);
+	check_size(70, "write after reopen");
+
+	stat.st_size = 50;
+	rc = kvsns_setattr(&cred, &ino, &stat, STAT_SIZE_SET);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_setattr: err=%d\n", rc);
+		exit(1);
+	}
+	check_size(50, "truncate");
+
+	write_fd(&fd1, 30, 50);
+	check_size(80, "write after the truncate");
+
+	rc = kvsns_close(&fd1);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_close: err=%d\n", rc);
+		exit(1);
+	}
+	check_size(80, "close");
+
+	printf("######## OK ########\n");
+	return 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) CEA, 2016
+ * Author: Philippe Deniel  philippe.deniel@cea.fr
+ *
+ * contributeur : Philippe DENIEL   philippe.deniel@cea.fr
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+/* kvsns_test_atime.c
+ * KVSNS: "lazytime" access times flushed along with concurrent changes
+ */
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <time.h>
+#include <kvsns/kvsal.h>
+#include <kvsns/kvsns.h>
+#include "kvsns_test_common.h"
+
+#define NB_LINKS 50
+/* Each round adds a hard link, an inode has at most KVSAL_ARRAY_SIZE */
+#define NB_ROUNDS 50
+#define TEST_CONFIG "/tmp/kvsns_test_atime.ini"
+
+static kvsns_cred_t cred;
+static kvsns_ino_t dir;
+static kvsns_ino_t links[NB_LINKS];
+
+/* The default configuration, with "lazytime" access times flushed every
+ * millisecond, and no client cache: the records are read from the KVS */
+static const char *config_prefixes[] = { "atime", "cache", NULL };
+#define TEST_SETTINGS "atime = lazytime\natime_flush_ms = 1\n"
+
+/* Reads the links, setting their access times, as long as they change */
+static int reader(void)
+{
+	char content[MAXPATHLEN];
+	size_t size;
+	int rc;
+	int i;
+
+	for (i = 0; i < NB_LINKS ; i++) {
+		size = MAXPATHLEN;
+		rc = kvsns_readlink(&cred, &links[i], content, &size);
+		if (rc != 0) {
+			fprintf(stderr, "kvsns_readlink: err=%d\n", rc);
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+static mode_t round_mode(int r)
+{
+	return S_IFLNK | 0400 | (r & 077);
+}
+
+/* Changes the links' mode and adds hard links to them while their access
+ * times are flushed: a lost record update then shows in their mode or in
+ * their number of links */
+static int writer(void)
+{
+	struct stat stat;
+	char name[MAXNAMLEN];
+	int rc;
+	int r;
+	int i;
+
+	for (r = 0; r < NB_ROUNDS ; r++)
+		for (i = 0; i < NB_LINKS ; i++) {
+			stat.st_mode = round_mode(r);
+			rc = kvsns_setattr(&cred, &links[i], &stat,
+					   STAT_MODE_SET);
+			if (rc != 0) {
+				fprintf(stderr, "kvsns_setattr: err=%d\n", rc);
+				return rc;
+			}
+
+			snprintf(name, MAXNAMLEN, "h%d.%d", i, r);
+			rc = kvsns_link(&cred, &links[i], &dir, name);
+			if (rc != 0) {
+				fprintf(stderr, "kvsns_link: err=%d\n", rc);
+				return rc;
+			}
+		}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int rc;
+	kvsns_ino_t parent;
+	struct stat stat;
+	char name[MAXNAMLEN];
+	time_t start;
+	int i;
+
+	cred.uid = getuid();
+	cred.gid = getgid();
+	start = time(NULL);
+
+	rc = kvsns_test_config(TEST_CONFIG, config_prefixes, TEST_SETTINGS);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_test_config: err=%d\n", rc);
+		exit(1);
+	}
+
+	rc = kvsns_start(TEST_CONFIG);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_init: err=%d\n", rc);
+		exit(1);
+	}
+
+	rc = kvsns_init_root(1);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_init_root: err=%d\n", rc);
+		exit(1);
+	}
+
+	parent = KVSNS_ROOT_INODE;
+	rc = kvsns_mkdir(&cred, &parent, "atime", 0755, &dir);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_mkdir: err=%d\n", rc);
+		exit(1);
+	}
+
+	for (i = 0; i < NB_LINKS ; i++) {
+		snprintf(name, MAXNAMLEN, "l%d", i);
+		rc = kvsns_symlink(&cred, &dir, name, "target", &links[i]);
+		if (rc != 0) {
+			fprintf(stderr, "kvsns_symlink: err=%d\n", rc);
+			exit(1);
+		}
+	}
+
+	rc = kvsns_test_race(reader, writer);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_test_race: err=%d\n", rc);
+		exit(1);
+	}
+
+	for (i = 0; i < NB_LINKS ; i++) {
+		rc = kvsns_getattr(&cred, &links[i], &stat);
+		if (rc != 0) {
+			fprintf(stderr, "kvsns_getattr: err=%d\n", rc);
+			exit(1);
+		}
+
+		if (stat.st_mode != round_mode(NB_ROUNDS - 1)) {
+			fprintf(stderr, "l%d: mode %o, %o expected\n", i,
+				stat.st_mode, round_mode(NB_ROUNDS - 1));
+			exit(1);
+		}
+
+		if (stat.st_nlink != NB_ROUNDS + 1) {
+			fprintf(stderr, "l%d: %lu links, %d expected\n", i,
+				(unsigned long)stat.st_nlink, NB_ROUNDS + 1);
+			exit(1);
+		}
+
+		if (stat.st_atime < start) {
+			fprintf(stderr, "l%d: access time not written\n", i);
+			exit(1);
+		}
+	}
+
+	printf("######## OK ########\n");
+
+	return 0;
+}
@@ -0,0 +1,220 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) CEA, 2016
+ * Author: Philippe Deniel  philippe.deniel@cea.fr
+ *
+ * contributeur : Philippe DENIEL   philippe.deniel@cea.fr
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+/* kvsns_test_cache.c
+ * KVSNS: client cache of dentries and attributes kept up to date by the
+ * client's own changes, even with concurrent lookups
+ */
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <kvsns/kvsal.h>
+#include <kvsns/kvsns.h>
+#include "kvsns_test_common.h"
+
+#define NB_ROUNDS 300
+#define TEST_CONFIG "/tmp/kvsns_test_cache.ini"
+
+static kvsns_cred_t cred;
+static kvsns_ino_t dir;
+static kvsns_ino_t current;
+
+/* The default configuration, with entries, negative ones included, cached
+ * far longer than the test lasts */
+static const char *config_prefixes[] = { "cache", NULL };
+#define TEST_SETTINGS "cache_ttl_ms = 600000\ncache_negative_ttl_ms = 600000\n"
+
+/* What a lookup and a getattr of "f" in dir should see */
+static int check(kvsns_ino_t *ino, mode_t mode, const char *when)
+{
+	struct stat stat;
+	kvsns_ino_t found = 0;
+	int rc;
+
+	rc = kvsns_lookup(&cred, &dir, "f", &found);
+	if (ino == NULL) {
+		if (rc == -ENOENT)
+			return 0;
+		fprintf(stderr, "%s: lookup rc=%d, -ENOENT expected\n",
+			when, rc);
+		return -1;
+	}
+
+	if (rc != 0 || found != *ino) {
+		fprintf(stderr, "%s: lookup rc=%d ino=%llu, %llu expected\n",
+			when, rc, found, *ino);
+		return -1;
+	}
+
+	rc = kvsns_getattr(&cred, ino, &stat);
+	if (rc != 0 || stat.st_mode != (S_IFREG|mode)) {
+		fprintf(stderr, "%s: getattr rc=%d mode=%o, %o expected\n",
+			when, rc, stat.st_mode, S_IFREG|mode);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Looks "f" and its attributes up, caching them, while they change */
+static int reader(void)
+{
+	struct stat stat;
+	kvsns_ino_t ino;
+
+	kvsns_lookup(&cred, &dir, "f", &ino);
+	ino = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+	if (ino != 0)
+		kvsns_getattr(&cred, &ino, &stat);
+
+	return 0;
+}
+
+/* Creates, changes and removes "f", checking each change is seen at once
+ * by the cache, that the reader fills meanwhile */
+static int writer(void)
+{
+	struct stat stat;
+	kvsns_ino_t ino;
+	int rc;
+	int r;
+
+	for (r = 0; r < NB_ROUNDS ; r++) {
+		rc = kvsns_creat(&cred, &dir, "f", 0600, &ino);
+		if (rc != 0) {
+			fprintf(stderr, "kvsns_creat: err=%d\n", rc);
+			return rc;
+		}
+		__atomic_store_n(&current, ino, __ATOMIC_RELEASE);
+
+		rc = check(&ino, 0600, "creat");
+		if (rc != 0)
+			return rc;
+
+		stat.st_mode = 0640;
+		rc = kvsns_setattr(&cred, &ino, &stat, STAT_MODE_SET);
+		if (rc != 0) {
+			fprintf(stderr, "kvsns_setattr: err=%d\n", rc);
+			return rc;
+		}
+
+		rc = check(&ino, 0640, "setattr");
+		if (rc != 0)
+			return rc;
+
+		rc = kvsns_unlink(&cred, &dir, "f");
+		if (rc != 0) {
+			fprintf(stderr, "kvsns_unlink: err=%d\n", rc);
+			return rc;
+		}
+
+		rc = check(NULL, 0, "unlink");
+		if (rc != 0)
+			return rc;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int rc;
+	kvsns_ino_t parent;
+	kvsns_ino_t ino;
+
+	cred.uid = getuid();
+	cred.gid = getgid();
+
+	rc = kvsns_test_config(TEST_CONFIG, config_prefixes, TEST_SETTINGS);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_test_config: err=%d\n", rc);
+		exit(1);
+	}
+
+	rc = kvsns_start(TEST_CONFIG);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_init: err=%d\n", rc);
+		exit(1);
+	}
+
+	rc = kvsns_init_root(1);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_init_root: err=%d\n", rc);
+		exit(1);
+	}
+
+	parent = KVSNS_ROOT_INODE;
+	rc = kvsns_mkdir(&cred, &parent, "cache", 0755, &dir);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_mkdir: err=%d\n", rc);
+		exit(1);
+	}
+
+	/* A negative entry goes with the creation */
+	if (check(NULL, 0, "start") != 0)
+		exit(1);
+
+	rc = kvsns_creat(&cred, &dir, "f", 0600, &ino);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_creat: err=%d\n", rc);
+		exit(1);
+	}
+
+	if (check(&ino, 0600, "first creat") != 0)
+		exit(1);
+
+	rc = kvsns_rename(&cred, &dir, "f", &dir, "g");
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_rename: err=%d\n", rc);
+		exit(1);
+	}
+
+	if (check(NULL, 0, "rename") != 0)
+		exit(1);
+
+	rc = kvsns_unlink(&cred, &dir, "g");
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_unlink: err=%d\n", rc);
+		exit(1);
+	}
+
+	rc = kvsns_test_race(reader, writer);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_test_race: err=%d\n", rc);
+		exit(1);
+	}
+
+	printf("######## OK ########\n");
+
+	return 0;
+}
@@ -0,0 +1,137 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) CEA, 2016
+ * Author: Philippe Deniel  philippe.deniel@cea.fr
+ *
+ * contributeur : Philippe DENIEL   philippe.deniel@cea.fr
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+/* kvsns_test_common.c
+ * KVSNS: helpers shared by the tests
+ */
+
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <kvsns/kvsns.h>
+#include "kvsns_test_common.h"
+
+struct kvsns_test_race {
+	int (*reader)(void);
+	int (*writer)(void);
+	int reader_rc;
+	int writer_rc;
+	int writer_done;
+};
+
+static int kvsns_test_skip(const char *line, const char **prefixes)
+{
+	for (; *prefixes != NULL ; prefixes++)
+		if (!strncmp(line, *prefixes, strlen(*prefixes)))
+			return 1;
+
+	return 0;
+}
+
+int kvsns_test_config(const char *path, const char **prefixes,
+		      const char *settings)
+{
+	char line[1024];
+	FILE *in;
+	FILE *out;
+	int found = 0;
+
+	in = fopen(KVSNS_DEFAULT_CONFIG, "r");
+	if (in == NULL)
+		return -errno;
+
+	out = fopen(path, "w");
+	if (out == NULL) {
+		fclose(in);
+		return -errno;
+	}
+
+	while (fgets(line, sizeof(line), in) != NULL) {
+		if (kvsns_test_skip(line, prefixes))
+			continue;
+		fputs(line, out);
+		if (!strncmp(line, "[kvsns]", 7)) {
+			fputs(settings, out);
+			found = 1;
+		}
+	}
+	if (!found)
+		fprintf(out, "\n[kvsns]\n%s", settings);
+
+	fclose(in);
+	fclose(out);
+
+	return 0;
+}
+
+static void *kvsns_test_reader(void *arg)
+{
+	struct kvsns_test_race *race = arg;
+
+	while (!__atomic_load_n(&race->writer_done, __ATOMIC_ACQUIRE)) {
+		race->reader_rc = race->reader();
+		if (race->reader_rc != 0)
+			break;
+	}
+
+	return NULL;
+}
+
+static void *kvsns_test_writer(void *arg)
+{
+	struct kvsns_test_race *race = arg;
+
+	race->writer_rc = race->writer();
+	__atomic_store_n(&race->writer_done, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+int kvsns_test_race(int (*reader)(void), int (*writer)(void))
+{
+	struct kvsns_test_race race = { reader, writer, 0, 0, 0 };
+	pthread_t threads[2];
+	int rc;
+
+	rc = pthread_create(&threads[0], NULL, kvsns_test_reader, &race);
+	if (rc != 0)
+		return -rc;
+
+	rc = pthread_create(&threads[1], NULL, kvsns_test_writer, &race);
+	if (rc != 0) {
+		__atomic_store_n(&race.writer_done, 1, __ATOMIC_RELEASE);
+		pthread_join(threads[0], NULL);
+		return -rc;
+	}
+
+	pthread_join(threads[0], NULL);
+	pthread_join(threads[1], NULL);
+
+	return (race.reader_rc != 0) ? race.reader_rc : race.writer_rc;
+}
@@ -0,0 +1,46 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) CEA, 2016
+ * Author: Philippe Deniel  philippe.deniel@cea.fr
+ *
+ * contributeur : Philippe DENIEL   philippe.deniel@cea.fr
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+/* kvsns_test_common.h
+ * KVSNS: helpers shared by the tests
+ */
+
+#ifndef _KVSNS_TEST_COMMON_H
+#define _KVSNS_TEST_COMMON_H
+
+/* Writes path, a copy of KVSNS_DEFAULT_CONFIG without its lines starting
+ * with one of the prefixes, a NULL terminated array, and with settings
+ * added to section [kvsns]. Returns 0 or -errno */
+int kvsns_test_config(const char *path, const char **prefixes,
+		      const char *settings);
+
+/* Runs writer once in a thread while reader is run over and over in
+ * another one, until the writer is done. Returns the reader's rc if it
+ * failed, the writer's otherwise */
+int kvsns_test_race(int (*reader)(void), int (*writer)(void));
+
+#endif
@@ -0,0 +1,197 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) CEA, 2016
+ * Author: Philippe Deniel  philippe.deniel@cea.fr
+ *
+ * contributeur : Philippe DENIEL   philippe.deniel@cea.fr
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+/* kvsns_test_create_many.c
+ * KVSNS: kvsns_create_many and the result of each of its items
+ */
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <kvsns/kvsal.h>
+#include <kvsns/kvsns.h>
+
+
+/* More files than a transaction holds on a REDIS Cluster, then a name
+ * given twice, an existing name and a name too long */
+#define NB_FILES 150
+#define DUP NB_FILES
+#define EXISTING (NB_FILES + 1)
+#define TOO_LONG (NB_FILES + 2)
+#define NB_ITEMS (NB_FILES + 3)
+
+/* A created file is found by its name, and its data can be read */
+static int check_file(kvsns_cred_t *cred, kvsns_ino_t *dir,
+		      kvsns_create_item_t *item)
+{
+	kvsns_file_open_t fd;
+	kvsns_ino_t ino;
+	struct stat stat;
+	char buf[16];
+	ssize_t len;
+	int rc;
+
+	rc = kvsns_lookup(cred, dir, item->name, &ino);
+	if (rc != 0 || ino != item->ino) {
+		fprintf(stderr, "kvsns_lookup %s: rc=%d\n", item->name, rc);
+		return -1;
+	}
+
+	rc = kvsns_getattr(cred, &ino, &stat);
+	if (rc != 0 || stat.st_mode != (S_IFREG|item->mode)) {
+		fprintf(stderr, "kvsns_getattr %s: rc=%d\n", item->name, rc);
+		return -1;
+	}
+
+	rc = kvsns_open(cred, &ino, O_RDONLY, 0, &fd);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_open %s: err=%d\n", item->name, rc);
+		return -1;
+	}
+
+	len = kvsns_read(cred, &fd, buf, sizeof(buf), 0);
+	if (len != 0) {
+		fprintf(stderr, "kvsns_read %s: %zd\n", item->name, len);
+		return -1;
+	}
+
+	return kvsns_close(&fd);
+}
+
+int main(int argc, char *argv[])
+{
+	int rc;
+	kvsns_ino_t parent;
+	kvsns_ino_t dir;
+	kvsns_ino_t ino;
+	kvsns_cred_t cred;
+	kvsns_create_item_t items[NB_ITEMS];
+	kvsns_create_item_t *kept;
+	char names[NB_FILES][MAXNAMLEN];
+	char too_long[NAME_MAX + 2];
+	struct stat stat;
+	int i;
+
+	cred.uid = getuid();
+	cred.gid = getgid();
+
+	rc = kvsns_start(KVSNS_DEFAULT_CONFIG);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_init: err=%d\n", rc);
+		exit(1);
+	}
+
+	rc = kvsns_init_root(1);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_init_root: err=%d\n", rc);
+		exit(1);
+	}
+
+	parent = KVSNS_ROOT_INODE;
+	rc = kvsns_mkdir(&cred, &parent, "many", 0755, &dir);
+	if (rc == 0)
+		rc = kvsns_creat(&cred, &dir, "existing", 0644, &ino);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_mkdir: err=%d\n", rc);
+		exit(1);
+	}
+
+	for (i = 0; i < NB_FILES ; i++) {
+		snprintf(names[i], MAXNAMLEN, "f%d", i);
+		items[i].name = names[i];
+		items[i].mode = 0600 + (i % 64);
+	}
+
+	items[DUP].name = names[7];
+	items[DUP].mode = 0644;
+	items[EXISTING].name = "existing";
+	items[EXISTING].mode = 0644;
+	memset(too_long, 'a', NAME_MAX + 1);
+	too_long[NAME_MAX + 1] = '\0';
+	items[TOO_LONG].name = too_long;
+	items[TOO_LONG].mode = 0644;
+
+	rc = kvsns_create_many(&cred, &dir, items, NB_ITEMS);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_create_many: err=%d\n", rc);
+		exit(1);
+	}
+
+	/* Of a name given twice, one item is created, the other one gets
+	 * -EEXIST */
+	if (items[7].rc == 0 && items[DUP].rc == -EEXIST)
+		kept = &items[7];
+	else if (items[7].rc == -EEXIST && items[DUP].rc == 0)
+		kept = &items[DUP];
+	else {
+		fprintf(stderr, "name given twice: rc=%d and %d\n",
+			items[7].rc, items[DUP].rc);
+		exit(1);
+	}
+	if (check_file(&cred, &dir, kept) != 0)
+		exit(1);
+
+	for (i = 0; i < NB_FILES ; i++) {
+		if (i == 7)
+			continue;
+		if (items[i].rc != 0) {
+			fprintf(stderr, "%s: err=%d\n", items[i].name,
+				items[i].rc);
+			exit(1);
+		}
+		if (check_file(&cred, &dir, &items[i]) != 0)
+			exit(1);
+	}
+
+	if (items[EXISTING].rc != -EEXIST) {
+		fprintf(stderr, "existing name: rc=%d\n", items[EXISTING].rc);
+		exit(1);
+	}
+
+	if (items[TOO_LONG].rc != -ENAMETOOLONG) {
+		fprintf(stderr, "name too long: rc=%d\n", items[TOO_LONG].rc);
+		exit(1);
+	}
+
+	/* The files, and the one which existed */
+	rc = kvsns_getattr(&cred, &dir, &stat);
+	if (rc != 0 || stat.st_size != NB_FILES + 1) {
+		fprintf(stderr, "many: rc=%d, %lld entries counted\n", rc,
+			(long long)stat.st_size);
+		exit(1);
+	}
+
+	printf("######## OK ########\n");
+
+	return 0;
+}
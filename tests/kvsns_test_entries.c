@@ -0,0 +1,177 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) CEA, 2016
+ * Author: Philippe Deniel  philippe.deniel@cea.fr
+ *
+ * contributeur : Philippe DENIEL   philippe.deniel@cea.fr
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+/* kvsns_test_entries.c
+ * KVSNS: directory entries counted by concurrent creations and deletions
+ */
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <kvsns/kvsal.h>
+#include <kvsns/kvsns.h>
+
+#define NB_THREADS 8
+#define NB_FILES 200
+
+static kvsns_cred_t cred;
+static kvsns_ino_t dir;
+
+/* Creates NB_FILES files, then unlinks every other one (pass 0) or the
+ * remaining ones (pass 1) */
+struct worker {
+	pthread_t thread;
+	int id;
+	int pass;
+	int rc;
+};
+
+static void *worker(void *arg)
+{
+	struct worker *w = arg;
+	kvsns_ino_t ino;
+	char name[MAXNAMLEN];
+	int i;
+
+	for (i = 0; w->pass == 0 && i < NB_FILES ; i++) {
+		snprintf(name, MAXNAMLEN, "f%d.%d", w->id, i);
+		w->rc = kvsns_creat(&cred, &dir, name, 0644, &ino);
+		if (w->rc != 0) {
+			fprintf(stderr, "creat %s: err=%d\n", name, w->rc);
+			return NULL;
+		}
+	}
+
+	for (i = w->pass; i < NB_FILES ; i += 2) {
+		snprintf(name, MAXNAMLEN, "f%d.%d", w->id, i);
+		w->rc = kvsns_unlink(&cred, &dir, name);
+		if (w->rc != 0) {
+			fprintf(stderr, "unlink %s: err=%d\n", name, w->rc);
+			return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+static int run_pass(int pass, off_t expected)
+{
+	struct worker workers[NB_THREADS];
+	struct stat stat;
+	int rc;
+	int i;
+
+	for (i = 0; i < NB_THREADS ; i++) {
+		workers[i].id = i;
+		workers[i].pass = pass;
+		workers[i].rc = 0;
+		if (pthread_create(&workers[i].thread, NULL, worker,
+				   &workers[i]) != 0) {
+			fprintf(stderr, "pthread_create: err=%d\n", errno);
+			return -1;
+		}
+	}
+
+	rc = 0;
+	for (i = 0; i < NB_THREADS ; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (workers[i].rc != 0)
+			rc = workers[i].rc;
+	}
+	if (rc != 0)
+		return rc;
+
+	rc = kvsns_getattr(&cred, &dir, &stat);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_getattr: err=%d\n", rc);
+		return rc;
+	}
+
+	if (stat.st_size != expected) {
+		fprintf(stderr, "pass %d: %lld entries counted, %lld expected\n",
+			pass, (long long)stat.st_size, (long long)expected);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int rc;
+	kvsns_ino_t parent;
+
+	cred.uid = getuid();
+	cred.gid = getgid();
+
+	rc = kvsns_start(KVSNS_DEFAULT_CONFIG);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_init: err=%d\n", rc);
+		exit(1);
+	}
+
+	rc = kvsns_init_root(1);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_init_root: err=%d\n", rc);
+		exit(1);
+	}
+
+	parent = KVSNS_ROOT_INODE;
+	rc = kvsns_mkdir(&cred, &parent, "entries", 0755, &dir);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_mkdir: err=%d\n", rc);
+		exit(1);
+	}
+
+	if (run_pass(0, NB_THREADS * NB_FILES / 2) != 0)
+		exit(1);
+
+	rc = kvsns_rmdir(&cred, &parent, "entries");
+	if (rc != -ENOTEMPTY) {
+		fprintf(stderr, "kvsns_rmdir of a non-empty directory: rc=%d\n",
+			rc);
+		exit(1);
+	}
+
+	if (run_pass(1, 0) != 0)
+		exit(1);
+
+	rc = kvsns_rmdir(&cred, &parent, "entries");
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_rmdir: err=%d\n", rc);
+		exit(1);
+	}
+
+	printf("######## OK ########\n");
+
+	return 0;
+}
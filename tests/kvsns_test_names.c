@@ -0,0 +1,251 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) CEA, 2016
+ * Author: Philippe Deniel  philippe.deniel@cea.fr
+ *
+ * contributeur : Philippe DENIEL   philippe.deniel@cea.fr
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+/* kvsns_test_names.c
+ * KVSNS: names of up to NAME_MAX characters are kept whole, whatever the
+ * keys' layout, longer ones are refused
+ */
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <kvsns/kvsal.h>
+#include <kvsns/kvsns.h>
+
+
+/* A name of len characters, all 'a' but the last one */
+static void long_name(char *name, int len, char last)
+{
+	memset(name, 'a', len - 1);
+	name[len - 1] = last;
+	name[len] = '\0';
+}
+
+int main(int argc, char *argv[])
+{
+	int rc;
+	kvsns_ino_t parent;
+	kvsns_ino_t dir;
+	kvsns_ino_t ino1;
+	kvsns_ino_t ino2;
+	kvsns_ino_t ino;
+	kvsns_cred_t cred;
+	kvsns_dir_t ddir;
+	kvsns_dentry_t dirent[4];
+	kvsns_xattr_t xattrs[2];
+	char name1[NAME_MAX + 2];
+	char name2[NAME_MAX + 2];
+	char value[] = "v";
+	char read[sizeof(value)];
+	size_t vsize;
+	int size;
+	int i;
+
+	cred.uid = getuid();
+	cred.gid = getgid();
+
+	rc = kvsns_start(KVSNS_DEFAULT_CONFIG);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_init: err=%d\n", rc);
+		exit(1);
+	}
+
+	rc = kvsns_init_root(1);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_init_root: err=%d\n", rc);
+		exit(1);
+	}
+
+	parent = KVSNS_ROOT_INODE;
+	rc = kvsns_mkdir(&cred, &parent, "names", 0755, &dir);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_mkdir: err=%d\n", rc);
+		exit(1);
+	}
+
+	/* Past NAME_MAX, names are refused */
+	long_name(name1, NAME_MAX + 1, '1');
+	rc = kvsns_creat(&cred, &dir, name1, 0644, &ino1);
+	if (rc != -ENAMETOOLONG) {
+		fprintf(stderr, "kvsns_creat past NAME_MAX: rc=%d\n", rc);
+		exit(1);
+	}
+
+	/* Two names of NAME_MAX characters, which only differ by their last
+	 * one, are two entries */
+	long_name(name1, NAME_MAX, '1');
+	rc = kvsns_creat(&cred, &dir, name1, 0644, &ino1);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_creat of NAME_MAX characters: err=%d\n",
+			rc);
+		exit(1);
+	}
+
+	long_name(name2, NAME_MAX, '2');
+	rc = kvsns_creat(&cred, &dir, name2, 0644, &ino2);
+	if (rc != 0 || ino2 == ino1) {
+		fprintf(stderr, "kvsns_creat %s: rc=%d\n", name2, rc);
+		exit(1);
+	}
+
+	rc = kvsns_lookup(&cred, &dir, name1, &ino);
+	if (rc != 0 || ino != ino1) {
+		fprintf(stderr, "kvsns_lookup %s: rc=%d\n", name1, rc);
+		exit(1);
+	}
+
+	rc = kvsns_lookup(&cred, &dir, name2, &ino);
+	if (rc != 0 || ino != ino2) {
+		fprintf(stderr, "kvsns_lookup %s: rc=%d\n", name2, rc);
+		exit(1);
+	}
+
+	/* readdir lists them whole, with their own inodes */
+	rc = kvsns_opendir(&cred, &dir, &ddir);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_opendir: err=%d\n", rc);
+		exit(1);
+	}
+
+	size = 4;
+	rc = kvsns_readdir(&cred, &ddir, 0, dirent, &size);
+	if (rc != 0 || size != 2) {
+		fprintf(stderr, "kvsns_readdir: rc=%d, %d entries\n", rc, size);
+		exit(1);
+	}
+
+	for (i = 0; i < size ; i++)
+		if (!(strcmp(dirent[i].name, name1) == 0 &&
+		      dirent[i].inode == ino1) &&
+		    !(strcmp(dirent[i].name, name2) == 0 &&
+		      dirent[i].inode == ino2)) {
+			fprintf(stderr, "kvsns_readdir: %s is not listed\n",
+				dirent[i].name);
+			exit(1);
+		}
+
+	rc = kvsns_closedir(&ddir);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_closedir: err=%d\n", rc);
+		exit(1);
+	}
+
+	/* So are xattrs of such names */
+	rc = kvsns_setxattr(&cred, &ino1, name1, value, sizeof(value),
+			    XATTR_CREATE);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_setxattr: err=%d\n", rc);
+		exit(1);
+	}
+
+	rc = kvsns_setxattr(&cred, &ino1, name1, value, sizeof(value),
+			    XATTR_CREATE);
+	if (rc != -EEXIST) {
+		fprintf(stderr, "kvsns_setxattr twice: rc=%d\n", rc);
+		exit(1);
+	}
+
+	vsize = sizeof(read);
+	rc = kvsns_getxattr(&cred, &ino1, name1, read, &vsize);
+	if (rc != 0 || vsize != sizeof(value) || memcmp(read, value, vsize)) {
+		fprintf(stderr, "kvsns_getxattr: rc=%d\n", rc);
+		exit(1);
+	}
+
+	size = 2;
+	rc = kvsns_listxattr(&cred, &ino1, 0, xattrs, &size);
+	if (rc != 0 || size != 1 || strcmp(xattrs[0].name, name1)) {
+		fprintf(stderr, "kvsns_listxattr: rc=%d, %d xattrs\n", rc,
+			size);
+		exit(1);
+	}
+
+	rc = kvsns_removexattr(&cred, &ino1, name1);
+	if (rc == 0)
+		rc = kvsns_getxattr(&cred, &ino1, name1, read, &vsize);
+	if (rc != -ENOENT) {
+		fprintf(stderr, "kvsns_removexattr: rc=%d\n", rc);
+		exit(1);
+	}
+
+	/* And renamed whole */
+	rc = kvsns_rename(&cred, &dir, name1, &dir, "short");
+	if (rc == 0)
+		rc = kvsns_rename(&cred, &dir, "short", &dir, name1);
+	if (rc == 0)
+		rc = kvsns_lookup(&cred, &dir, name1, &ino);
+	if (rc != 0 || ino != ino1) {
+		fprintf(stderr, "kvsns_rename %s: rc=%d\n", name1, rc);
+		exit(1);
+	}
+
+	/* A name one character longer is refused by every call */
+	long_name(name1, NAME_MAX + 1, '1');
+	rc = kvsns_lookup(&cred, &dir, name1, &ino);
+	if (rc != -ENAMETOOLONG) {
+		fprintf(stderr, "kvsns_lookup: rc=%d\n", rc);
+		exit(1);
+	}
+
+	rc = kvsns_mkdir(&cred, &dir, name1, 0755, &ino);
+	if (rc != -ENAMETOOLONG) {
+		fprintf(stderr, "kvsns_mkdir: rc=%d\n", rc);
+		exit(1);
+	}
+
+	rc = kvsns_rename(&cred, &dir, name2, &dir, name1);
+	if (rc != -ENAMETOOLONG) {
+		fprintf(stderr, "kvsns_rename: rc=%d\n", rc);
+		exit(1);
+	}
+
+	rc = kvsns_setxattr(&cred, &ino1, name1, value, sizeof(value), 0);
+	if (rc != -ENAMETOOLONG) {
+		fprintf(stderr, "kvsns_setxattr: rc=%d\n", rc);
+		exit(1);
+	}
+
+	long_name(name1, NAME_MAX, '1');
+	rc = kvsns_unlink(&cred, &dir, name1);
+	if (rc == 0)
+		rc = kvsns_unlink(&cred, &dir, name2);
+	if (rc == 0)
+		rc = kvsns_rmdir(&cred, &parent, "names");
+	if (rc != 0) {
+		fprintf(stderr, "cleanup: err=%d\n", rc);
+		exit(1);
+	}
+
+	printf("######## OK ########\n");
+
+	return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) CEA, 2016
+ * Author: Philippe Deniel  philippe.deniel@cea.fr
+ *
+ * contributeur : Philippe DENIEL   philippe.deniel@cea.fr
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+/* kvsns_test_rmtree.c
+ * KVSNS: rmtree of a directory with many subdirectories
+ */
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <kvsns/kvsal.h>
+#include <kvsns/kvsns.h>
+
+/* Many more subdirectories than rmtree removes in one transaction, the
+ * removals from the same parent then run in parallel */
+#define NB_DIRS 500
+#define NB_FILES 3
+
+int main(int argc, char *argv[])
+{
+	int rc;
+	kvsns_ino_t parent;
+	kvsns_ino_t tree;
+	kvsns_ino_t dir;
+	kvsns_ino_t sub;
+	kvsns_ino_t ino;
+	kvsns_cred_t cred;
+	kvsns_fsstat_t fsstat;
+	struct stat stat;
+	char name[MAXNAMLEN];
+	int i;
+	int j;
+
+	cred.uid = getuid();
+	cred.gid = getgid();
+
+	rc = kvsns_start(KVSNS_DEFAULT_CONFIG);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_init: err=%d\n", rc);
+		exit(1);
+	}
+
+	rc = kvsns_init_root(1);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_init_root: err=%d\n", rc);
+		exit(1);
+	}
+
+	parent = KVSNS_ROOT_INODE;
+	rc = kvsns_mkdir(&cred, &parent, "tree", 0755, &tree);
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_mkdir: err=%d\n", rc);
+		exit(1);
+	}
+
+	/* Each subdirectory holds a few files and a subdirectory of its own */
+	for (i = 0; i < NB_DIRS ; i++) {
+		snprintf(name, MAXNAMLEN, "d%d", i);
+		rc = kvsns_mkdir(&cred, &tree, name, 0755, &dir);
+		if (rc != 0) {
+			fprintf(stderr, "kvsns_mkdir %s: err=%d\n", name, rc);
+			exit(1);
+		}
+
+		for (j = 0; j < NB_FILES ; j++) {
+			snprintf(name, MAXNAMLEN, "f%d", j);
+			rc = kvsns_creat(&cred, &dir, name, 0644, &ino);
+			if (rc != 0) {
+				fprintf(stderr, "kvsns_creat: err=%d\n", rc);
+				exit(1);
+			}
+		}
+
+		rc = kvsns_mkdir(&cred, &dir, "sub", 0755, &sub);
+		if (rc == 0)
+			rc = kvsns_creat(&cred, &sub, "f", 0644, &ino);
+		if (rc != 0) {
+			fprintf(stderr, "kvsns_mkdir sub: err=%d\n", rc);
+			exit(1);
+		}
+	}
+
+	rc = kvsns_rmtree(&cred, &parent, "tree");
+	if (rc != 0) {
+		fprintf(stderr, "kvsns_rmtree: err=%d\n", rc);
+		exit(1);
+	}
+
+	rc = kvsns_lookup(&cred, &parent, "tree", &ino);
+	if (rc != -ENOENT) {
+		fprintf(stderr, "kvsns_lookup after rmtree: rc=%d\n", rc);
+		exit(1);
+	}
+
+	rc = kvsns_getattr(&cred, &parent, &stat);
+	if (rc != 0 || stat.st_size != 0) {
+		fprintf(stderr, "root: rc=%d, %lld entries counted\n", rc,
+			(long long)stat.st_size);
+		exit(1);
+	}
+
+	/* Only the root is left */
+	rc = kvsns_fsstat(&fsstat);
+	if (rc != 0 || fsstat.nb_inodes != 1) {
+		fprintf(stderr, "kvsns_fsstat: rc=%d, %lu inodes\n", rc,
+			fsstat.nb_inodes);
+		exit(1);
+	}
+
+	printf("######## OK ########\n");
+
+	return 0;
+}